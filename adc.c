@@ -0,0 +1,265 @@
+/*
+ * File:   adc.c
+ * Author: Matt
+ *
+ * On-chip ADC, used to read the DAC outputs back for calibration.
+ *
+ * Oversampled acquisitions run from the Timer2 interrupt: each tick
+ * stores the conversion started on the previous tick and starts the
+ * next one, so the caller is free (e.g. to put the next I2C write on
+ * the bus) until adc_wait().
+ */
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "adc.h"
+
+#ifdef _ADC_
+
+/* ANx inputs used here are RA0 to RA3 on every supported part */
+#define ADC_PINS    ((1 << ADC_CH_OFFSET) | (1 << ADC_CH_GAIN))
+
+#define ADC_ACQ_TAD 4
+
+/* Timer2 at Fosc / 4 with a 1:16 prescale */
+#define ADC_TMR_PERIOD ((uint8_t)((((uint32_t)ADC_SAMPLE_US * (_XTAL_FREQ / 64UL)) / 1000000UL) - 1))
+
+#if defined(__18F26K42)
+#define ADC_TMR_IF          PIR4bits.TMR2IF
+#define ADC_TMR_IE          PIE4bits.TMR2IE
+#define adc_go()            (ADCON0bits.ADGO = 1)
+#define adc_select(ch)      (ADPCH = (ch))
+#define adc_timer_on()      { T2TMR = 0; T2CONbits.ON = 1; }
+#define adc_timer_off()     (T2CONbits.ON = 0)
+#else
+#define ADC_TMR_IF          PIR1bits.TMR2IF
+#define ADC_TMR_IE          PIE1bits.TMR2IE
+#define adc_go()            (ADCON0bits.GO = 1)
+#define adc_select(ch)      (ADCON0 = (uint8_t)((ch) << 2) | 0x01)
+#define adc_timer_on()      { TMR2 = 0; T2CONbits.TMR2ON = 1; }
+#define adc_timer_off()     (T2CONbits.TMR2ON = 0)
+#endif
+
+#define adc_result_reg()    (((uint16_t)ADRESH << 8) | ADRESL)
+
+static volatile uint16_t _g_buf[ADC_OVERSAMPLE_MAX];
+static volatile uint16_t _g_count;
+static volatile uint32_t _g_sum;
+static volatile bool _g_busy;
+static volatile bool _g_primed;         /* A conversion is in flight */
+static volatile int8_t _g_decided;      /* Early exit verdict, 0 if none */
+static uint16_t _g_samples;
+static uint8_t _g_extra;
+
+/* Running bounds for the early exit: count * (threshold -/+ margin), against sum << extra */
+static bool _g_early;
+static uint16_t _g_threshold;
+static uint16_t _g_lo_step;
+static uint16_t _g_hi_step;
+static volatile uint32_t _g_lo;
+static volatile uint32_t _g_hi;
+
+void adc_init(void)
+{
+    TRISA |= ADC_PINS;
+    ANSELA |= ADC_PINS;
+
+#if defined(__18F26K42)
+    /* ADCC in basic mode. TAD = Fosc / 64, over 1us up to 64MHz */
+    ADCON0 = 0;
+    ADCON1 = 0;
+    ADCON2 = 0;
+    ADCON3 = 0;
+    ADREF = 0;                       /* Vdd / Vss */
+    ADCLK = 31;
+    ADACQ = ADC_ACQ_TAD;
+    ADCON0bits.ADFM = 1;             /* Right justified */
+    ADCON0bits.ADON = 1;
+
+    T2CON = 0x40;                    /* Off, 1:16 prescale, 1:1 postscale */
+    T2CLKCON = 0x01;                 /* Fosc / 4 */
+    T2HLT = 0x00;                    /* Free running period timer */
+    T2PR = ADC_TMR_PERIOD;
+#elif defined(__18F26K22)
+    ADCON1 = 0x00;                   /* Vdd / Vss */
+    ADCON2 = 0x96;                   /* Right justified, 4 TAD acquisition, Fosc / 64 */
+    ADCON0 = 0x01;                   /* On, AN0 */
+
+    T2CON = 0x02;                    /* Off, 1:16 prescale, 1:1 postscale */
+    PR2 = ADC_TMR_PERIOD;
+#else
+#error Unknown device
+#endif
+}
+
+/* Every 4x of oversampling buys one extra bit */
+static uint8_t adc_extra_bits(uint16_t samples)
+{
+    uint8_t extra = 0;
+
+    for (; samples >= 4; samples >>= 2)
+        extra++;
+
+    return extra;
+}
+
+/* mV in adc_result() units for an acquisition of samples conversions */
+uint16_t adc_scale_mv(uint16_t mv, uint16_t samples)
+{
+    uint32_t full = (uint32_t)ADC_FULL_SCALE << adc_extra_bits(samples);
+
+    return (uint16_t)(((uint32_t)mv * full + ADC_VREF_MV / 2) / ADC_VREF_MV);
+}
+
+/*
+ * Starts an acquisition of samples conversions (ADC_OVERSAMPLE_MIN to
+ * ADC_OVERSAMPLE_MAX). With a threshold, in adc_result() units, the run
+ * stops as soon as the running mean is more than margin above or below
+ * it, so a clear verdict costs ADC_EARLY_MIN conversions.
+ */
+bool adc_start(uint8_t channel, uint16_t samples, uint16_t threshold, uint8_t margin)
+{
+    if (samples < ADC_OVERSAMPLE_MIN || samples > ADC_OVERSAMPLE_MAX)
+        return false;
+
+    adc_wait();
+
+    _g_extra = adc_extra_bits(samples);
+    _g_samples = samples;
+    _g_threshold = threshold;
+    _g_early = (threshold != ADC_NO_THRESHOLD);
+    _g_lo_step = (threshold < margin) ? 0 : threshold - margin;
+    _g_hi_step = threshold + margin;
+    _g_lo = 0;
+    _g_hi = 0;
+    _g_sum = 0;
+    _g_count = 0;
+    _g_decided = 0;
+    _g_primed = false;
+    _g_busy = true;
+
+    adc_select(channel);
+
+    ADC_TMR_IF = 0;
+    ADC_TMR_IE = 1;
+    adc_timer_on();
+
+    return true;
+}
+
+void adc_isr(void)
+{
+    uint16_t sample;
+
+    if (!(ADC_TMR_IE && ADC_TMR_IF))
+        return;
+
+    ADC_TMR_IF = 0;
+
+    if (_g_primed)
+    {
+        sample = adc_result_reg();
+        _g_buf[_g_count++] = sample;
+        _g_sum += sample;
+
+        if (_g_early)
+        {
+            _g_lo += _g_lo_step;
+            _g_hi += _g_hi_step;
+
+            if (_g_count >= ADC_EARLY_MIN)
+            {
+                if ((_g_sum << _g_extra) > _g_hi)
+                    _g_decided = ADC_ABOVE;
+                else if ((_g_sum << _g_extra) < _g_lo)
+                    _g_decided = ADC_BELOW;
+            }
+        }
+
+        if (_g_decided || _g_count == _g_samples)
+        {
+            adc_timer_off();
+            ADC_TMR_IE = 0;
+            _g_primed = false;
+            _g_busy = false;
+            return;
+        }
+    }
+
+    adc_go();
+    _g_primed = true;
+}
+
+bool adc_busy(void)
+{
+    return _g_busy;
+}
+
+/* False if the acquisition had to be abandoned */
+bool adc_wait(void)
+{
+    uint16_t polls = (uint16_t)(((uint32_t)(_g_samples + 2) * ADC_SAMPLE_US) / 10) + 100;
+
+    while (_g_busy)
+    {
+        if (!--polls)
+        {
+            adc_timer_off();
+            ADC_TMR_IE = 0;
+            _g_busy = false;
+            return false;
+        }
+
+        CLRWDT();
+        __delay_us(10);
+    }
+
+    return true;
+}
+
+uint8_t adc_result_bits(void)
+{
+    return ADC_BITS + _g_extra;
+}
+
+/* Mean of the samples taken, decimated to adc_result_bits() */
+uint16_t adc_result(void)
+{
+    if (!_g_count)
+        return 0;
+
+    return (uint16_t)(((_g_sum << _g_extra) + (_g_count >> 1)) / _g_count);
+}
+
+/* A result from an acquisition like the last one, in mV */
+uint16_t adc_result_mv(uint16_t result)
+{
+    uint32_t full = (uint32_t)ADC_FULL_SCALE << _g_extra;
+
+    return (uint16_t)(((uint32_t)result * ADC_VREF_MV + full / 2) / full);
+}
+
+/* ADC_ABOVE or ADC_BELOW (at or below) the threshold given to adc_start() */
+int8_t adc_compare(void)
+{
+    if (_g_decided)
+        return _g_decided;
+
+    return (adc_result() > _g_threshold) ? ADC_ABOVE : ADC_BELOW;
+}
+
+uint16_t adc_samples(void)
+{
+    return _g_count;
+}
+
+/* Raw conversion i of the last acquisition, 0 to adc_samples() - 1 */
+uint16_t adc_sample(uint16_t i)
+{
+    return _g_buf[i];
+}
+
+#endif /* _ADC_ */
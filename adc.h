@@ -0,0 +1,52 @@
+/*
+ * File:   adc.h
+ * Author: Matt
+ *
+ * On-chip ADC, used to read the DAC outputs back for calibration.
+ * Results are right justified, Vdd/Vss referenced.
+ */
+
+#ifndef __ADC_H__
+#define __ADC_H__
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef _ADC_
+
+#ifdef __18F26K42
+#define ADC_BITS                12
+#else
+#define ADC_BITS                10
+#endif
+
+#define ADC_FULL_SCALE          ((1U << ADC_BITS) - 1)
+
+/* Oversampling engine, Timer2 paced */
+#define ADC_SAMPLE_US           32      /* One conversion per tick */
+#define ADC_OVERSAMPLE_MIN      4
+#define ADC_OVERSAMPLE_MAX      256     /* Also the sample buffer size */
+#define ADC_EARLY_MIN           4       /* Samples before an early exit */
+#define ADC_NO_THRESHOLD        0xFFFF
+
+#define ADC_BELOW               (-1)
+#define ADC_ABOVE               1
+
+void adc_init(void);
+uint16_t adc_scale_mv(uint16_t mv, uint16_t samples);
+bool adc_start(uint8_t channel, uint16_t samples, uint16_t threshold, uint8_t margin);
+void adc_isr(void);
+bool adc_busy(void);
+bool adc_wait(void);
+uint8_t adc_result_bits(void);
+uint16_t adc_result(void);
+uint16_t adc_result_mv(uint16_t result);
+int8_t adc_compare(void);
+uint16_t adc_samples(void);
+uint16_t adc_sample(uint16_t i);
+
+#endif /* _ADC_ */
+
+#endif /* __ADC_H__ */
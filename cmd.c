@@ -17,7 +17,13 @@
 #include "util.h"
 #include "usart.h"
 #include "i2c.h"
+#include "i2c_queue.h"
+#include "i2c_gang.h"
+#include "proto.h"
 #include "mcp47febxx.h"
+#include "tca9548.h"
+#include "adc.h"
+#include "wave.h"
 
 #define CMD_NONE              0x00
 #define CMD_READLINE          0x01
@@ -30,6 +36,8 @@
 #define CMD_DROP_NAV          0x08
 #define CMD_CANCEL            0x10
 
+#define CMD_RET_BINARY        (-2)
+
 #define CTL_CANCEL            0x03
 #define CTL_XOFF              0x13
 #define CTL_U                 0x15
@@ -48,19 +56,119 @@
 
 #define CMD_MAX_LINE          64
 #define CMD_MAX_HISTORY       4
+#define CMD_MAX_LIST          8   /* Commands per ';' separated line */
+#define CMD_NOT_RUN           2
+#define CMD_MAX_REPLY         128 /* Worst case is show on the 26K22 */
 
 #define PARAM_U16             0
 #define PARAM_U8              1
 #define PARAM_U8H             2
 #define PARAM_DESC            3
 
+#define DUMP_DAC0             0
+#define DUMP_DAC1             1
+#define DUMP_DAC0_NV          2
+#define DUMP_DAC1_NV          3
+#define DUMP_SLADDR           4
+#define DUMP_VREF             5
+#define DUMP_VREF_NV          6
+#define DUMP_PD               7
+#define DUMP_PD_NV            8
+#define DUMP_STATUS           9
+#define DUMP_BASIC_REGS       5
+#define DUMP_ALL_REGS         10
+
+#define NVBATCH_MAX           8
+
+#define NV_STATE_DAC0         0
+#define NV_STATE_DAC0_BUSY    1
+#define NV_STATE_DAC1_BUSY    2
+#define NV_STATE_DONE         3
+#define NV_STATE_FAILED       4
+
+#define MUX_UNKNOWN           0xFF
+
+#define INT_STEP_FINE         1
+#define INT_STEP_MID          16
+#define INT_STEP_COARSE       256
+#define INT_ACCEL_RUN         8     /* Repeats of a key per doubling */
+#define INT_ACCEL_MAX_SHIFT   3
+#define INT_ACCEL_GAP_POLLS   1500  /* 150ms without a key ends a run */
+
+#define AUTOCAL_SETTLE_US     200
+#define AUTOCAL_SAMPLES       64  /* 3 extra bits */
+#define AUTOCAL_MARGIN        16  /* 2 LSB at AUTOCAL_SAMPLES */
+#define AUTOCAL_DIST(a, b)    ((a) > (b) ? (a) - (b) : (b) - (a))
+
+#define SWEEP_SETTLE_US       50
+#define SWEEP_SAMPLES         16  /* 2 extra bits */
+#define SWEEP_EXTRA_BITS      2
+#define SWEEP_PER_LINE        32
+#define SWEEP_ESCAPE          0x80
+
+#define SHADOW_REGS           32 /* Register addresses 00h to 1Fh */
+#define shadow_index(reg)     ((reg) >> 3)
+
 
 static bool do_dac_write16(sys_config_t *config, uint8_t reg, uint16_t value);
+static bool do_dac_read16(sys_config_t *config, uint8_t reg, uint16_t *value);
+static bool do_dac_start_write16(sys_config_t *config, uint8_t reg, uint16_t value);
+static bool do_dac_wait_nv(sys_config_t *config);
+static bool do_dac_nv_busy(sys_config_t *config);
+static bool do_nvbatch(sys_config_t *config, char *arg);
+static bool do_dac_write_pair(sys_config_t *config, bool nv, uint16_t offset, uint16_t gain);
+static bool do_set(sys_config_t *config, bool nv, char *arg);
+static bool do_cache(sys_config_t *config, const char *arg);
+static void shadow_invalidate(void);
+static bool shadow_lookup(sys_config_t *config, uint8_t reg, uint16_t *value);
+static void shadow_store(sys_config_t *config, uint8_t reg, uint16_t value);
+#ifdef _I2C_QUEUE_
+static bool do_dac_queue_write16(sys_config_t *config, uint8_t reg, uint16_t value);
+#endif /* _I2C_QUEUE_ */
 static bool do_dac_set_slave_addr(sys_config_t *config, uint8_t addr);
-static bool do_dump(sys_config_t *config);
+#ifdef _I2C_GANG_
+static bool do_gang(sys_config_t *config, const char *arg);
+static bool do_gang_write16(sys_config_t *config, uint8_t reg, uint16_t value);
+static bool do_gang_set_slave_addr(sys_config_t *config, uint8_t addr);
+static bool do_gang_report(uint8_t ok);
+static bool do_gang_read16(sys_config_t *config, uint8_t reg, uint16_t *values);
+static uint8_t do_gang_write_delta(sys_config_t *config, uint8_t reg, const uint16_t *base, int16_t delta);
+static bool do_gang_write_pair(sys_config_t *config, bool nv, uint16_t offset, uint16_t gain);
+static bool do_gang_set(sys_config_t *config, char *arg);
+static bool do_gang_dump(sys_config_t *config, bool all);
+#endif /* _I2C_GANG_ */
+static bool do_dump(sys_config_t *config, const char *arg);
 static bool do_interactive(sys_config_t *config, const char *arg);
+#ifdef _ADC_
+static bool do_autocal(sys_config_t *config, char *arg);
+static bool do_sweep(sys_config_t *config, char *arg);
+#endif /* _ADC_ */
+#ifdef _WAVE_
+static void do_wave_stats(sys_config_t *config);
+static bool do_wave(sys_config_t *config, char *arg);
+static void do_wave_cancel(void);
+static bool do_wave_conflict(sys_config_t *config);
+#endif /* _WAVE_ */
+static bool do_speed(sys_config_t *config, char *arg);
+static bool do_baud(sys_config_t *config, char *arg);
+static bool do_mode(sys_config_t *config, const char *arg);
+#ifdef _BINARY_PROTO_
+static void do_binary(sys_config_t *config);
+static bool do_binary_frame(sys_config_t *config, uint8_t port);
+#endif /* _BINARY_PROTO_ */
+#ifdef _USART2_
+static bool do_data(sys_config_t *config, const char *arg);
+#endif /* _USART2_ */
+static uint8_t do_bus_get_speed(sys_config_t *config, uint8_t addr);
+static bool do_bus_select(sys_config_t *config);
+static bool do_mux_select(sys_config_t *config);
+static bool do_addr(sys_config_t *config, char *arg);
+static bool do_bus_check(sys_config_t *config, bool ok);
 
 static inline int8_t cmd_prompt_handler(char *message, sys_config_t *config);
+static uint8_t cmd_run_list(char *line, sys_config_t *config, int8_t *status, bool replies);
+static void do_batch(sys_config_t *config);
+static int get_string(char *str, int8_t max, uint8_t *ignore_lf);
 static int8_t get_line(char *str, int8_t max, uint8_t *ignore_lf);
 static uint8_t parse_param(void *param, uint8_t type, char *arg);
 static void save_configuration(sys_config_t *config);
@@ -70,11 +178,69 @@ static uint8_t _g_max_history;
 static uint8_t _g_show_history;
 static uint8_t _g_next_history;
 static char _g_cmd_history[CMD_MAX_HISTORY][CMD_MAX_LINE];
+static bool _g_echo_off;
+
+#ifdef _USART2_
+/* Set while the console waits at its prompt, see cmd_idle() */
+static sys_config_t *_g_idle_config;
+#endif /* _USART2_ */
+
+/* Machine mode reply data, printed after "OK" */
+static char _g_reply[CMD_MAX_REPLY];
+static uint8_t _g_reply_len;
+static bool _g_reply_overflow;
+static bool _g_replying;                /* The command runs muted, see cmd_run_list() */
+
+static const uint8_t _g_dump_regs[] = {
+    MCP47FEBXX_VOLATILE_DAC0 | MCP47FEBXX_CMD_READ,
+    MCP47FEBXX_VOLATILE_DAC1 | MCP47FEBXX_CMD_READ,
+    MCP47FEBXX_NONVOLATILE_DAC0 | MCP47FEBXX_CMD_READ,
+    MCP47FEBXX_NONVOLATILE_DAC1 | MCP47FEBXX_CMD_READ,
+    MCP47FEBXX_GAINCTRL_SLAVEADDR | MCP47FEBXX_CMD_READ,
+    /* 'dump all' only */
+    MCP47FEBXX_VOLATILE_VREF | MCP47FEBXX_CMD_READ,
+    MCP47FEBXX_NONVOLATILE_VREF | MCP47FEBXX_CMD_READ,
+    MCP47FEBXX_VOLATILE_POWERDOWN | MCP47FEBXX_CMD_READ,
+    MCP47FEBXX_NONVOLATILE_POWERDOWN | MCP47FEBXX_CMD_READ,
+    MCP47FEBXX_GAIN_STATUS | MCP47FEBXX_CMD_READ,
+};
+
+/* Write-through cache of the register map of one DAC */
+static uint8_t _g_shadow_addr;
+static uint32_t _g_shadow_valid;
+static volatile bool _g_shadow_stale;
+static uint16_t _g_shadow[SHADOW_REGS];
+static uint16_t _g_shadow_hits;
+static uint16_t _g_shadow_misses;
+
+static uint8_t _g_bus_speed;
+static uint8_t _g_bus_errors;
+
+/* Mux port the bus is routed through now. MUX_UNKNOWN forces a rewrite */
+static uint8_t _g_mux_addr;
+static uint8_t _g_mux_channel;
+
+#ifdef _WAVE_
+/* Mux port the running wave's target sits behind */
+static uint8_t _g_wave_mux_addr;
+static uint8_t _g_wave_mux_channel;
+
+static const char * const _g_wave_shapes[] = { "ramp", "triangle", "sine", "square" };
+#endif /* _WAVE_ */
+
+#ifdef _I2C_QUEUE_
+static i2c_job_t _g_dac_job;
+static uint8_t _g_dac_job_data[2];
+#endif /* _I2C_QUEUE_ */
 
 void cmd_prompt(sys_config_t *config)
 {
-    char cmdbuf[64];
+    char cmdbuf[CMD_MAX_LINE];
+    int8_t status[CMD_MAX_LIST];
     uint8_t ignore_lf = 0;
+    uint8_t count;
+    uint8_t i;
+    bool machine;
 
     printf("\r\n");
     
@@ -82,33 +248,325 @@ void cmd_prompt(sys_config_t *config)
     {
         int8_t ret;
 
-        printf("cmd>");
+        machine = (config->console_mode == CONSOLE_MACHINE);
+        _g_echo_off = machine;
+
+        if (!machine)
+            printf("cmd>");
+
+#ifdef _USART2_
+        _g_idle_config = config;
+#endif /* _USART2_ */
+
         ret = get_line(cmdbuf, sizeof(cmdbuf), &ignore_lf);
 
+#ifdef _USART2_
+        _g_idle_config = NULL;
+#endif /* _USART2_ */
+
         if (ret == 0 || ret == -1) {
+            if (!machine)
+                printf("\r\n");
+            continue;
+        }
+
+#ifdef _BINARY_PROTO_
+        if (ret == CMD_RET_BINARY) {
+            do_binary(config);
             printf("\r\n");
             continue;
         }
+#endif /* _BINARY_PROTO_ */
+
+        if (!stricmp(cmdbuf, "batch")) {
+            do_batch(config);
+            continue;
+        }
 
-        ret = cmd_prompt_handler(cmdbuf, config);
+        count = cmd_run_list(cmdbuf, config, status, machine);
 
-        if (ret > 0)
+        if (!machine && count == 1 && status[0] > 0)
             printf("Error: command failed\r\n");
 
-        if (ret == -1) {
-            return;
+        if (!machine && count > 1) {
+            printf("Status:");
+            for (i = 0; i < count; i++) {
+                if (status[i] == CMD_NOT_RUN)
+                    printf(" -");
+                else
+                    printf(" %d", status[i] > 0 ? 1 : 0);
+            }
+            printf("\r\n");
+        }
+
+        for (i = 0; i < count; i++) {
+            if (status[i] == -1)
+                return;
+        }
+    }
+}
+
+/*
+ * Called by wdt_getch() while the console waits for a key. Frames on the
+ * data channel are only served while the console is idle at its prompt,
+ * so they never interleave with a command in progress.
+ *
+ * The console is muted meanwhile: a warning from a data channel op
+ * (bus fallback, wave stopped) would otherwise land in the middle of a
+ * machine mode host's reply stream. The frame status reports failures.
+ */
+void cmd_idle(void)
+{
+#ifdef _USART2_
+    if (_g_idle_config && usart2_data_ready())
+    {
+        console_mute(true);
+        do_binary_frame(_g_idle_config, PROTO_PORT_DATA);
+        console_mute(false);
+    }
+#endif /* _USART2_ */
+}
+
+/*
+ * Appends " key=value" (or " value" with no key) to the machine mode
+ * reply. A reply that doesn't fit turns the command's OK into ERR, the
+ * host never sees a line with fields missing.
+ */
+static void cmd_reply(const char *key, const char *value)
+{
+    uint8_t need = strlen(value) + 1;
+
+    if (key)
+        need += strlen(key) + 1;
+
+    if (_g_reply_len + need >= CMD_MAX_REPLY)
+    {
+        _g_reply_overflow = true;
+        return;
+    }
+
+    if (key)
+        _g_reply_len += sprintf(&_g_reply[_g_reply_len], " %s=%s", key, value);
+    else
+        _g_reply_len += sprintf(&_g_reply[_g_reply_len], " %s", value);
+}
+
+static void cmd_reply_u32(const char *key, uint32_t value)
+{
+    char buf[11];
+
+    sprintf(buf, "%lu", value);
+    cmd_reply(key, buf);
+}
+
+static void cmd_reply_hex(const char *key, uint16_t value)
+{
+    char buf[5];
+
+    sprintf(buf, "%04x", value);
+    cmd_reply(key, buf);
+}
+
+/*
+ * Runs a ';' separated command list, stopping at the first failure.
+ * status[] receives each handler result, CMD_NOT_RUN for the commands
+ * skipped after a failure. Returns the number of commands on the line.
+ *
+ * With replies set (machine mode) the human output of each command is
+ * muted and replaced by one line: "OK [data]", "ERR" or "SKIP".
+ */
+static uint8_t cmd_run_list(char *line, sys_config_t *config, int8_t *status, bool replies)
+{
+    char *cmds[CMD_MAX_LIST];
+    uint8_t count = 1;
+    uint8_t i;
+    bool failed = false;
+    char *p = line;
+
+    cmds[0] = line;
+
+    while ((p = strchr(p, ';')))
+    {
+        if (count == CMD_MAX_LIST)
+        {
+            printf("Error: more than %u commands\r\n", CMD_MAX_LIST);
+            status[0] = 1;
+            return 1;
+        }
+
+        *p++ = 0;
+        cmds[count++] = p;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        p = cmds[i];
+
+        while (*p == ' ')
+            p++;
+
+        _g_reply_len = 0;
+        _g_reply[0] = 0;
+        _g_reply_overflow = false;
+
+        _g_replying = replies;
+
+        if (replies)
+            console_mute(true);
+
+        if (failed)
+            status[i] = CMD_NOT_RUN;
+        else if (!*p)
+            status[i] = 0;
+        else
+            status[i] = cmd_prompt_handler(p, config);
+
+        _g_replying = false;
+
+        if (replies)
+        {
+            console_mute(false);
+
+            if (status[i] == CMD_NOT_RUN)
+                printf("SKIP\r\n");
+            else if (status[i] > 0)
+                printf("ERR\r\n");
+            else if (_g_reply_overflow)
+            {
+                printf("ERR\r\n");
+                status[i] = 1;
+            }
+            else
+                printf("OK%s\r\n", _g_reply);
+        }
+
+        if (status[i] > 0)
+            failed = true;
+    }
+
+    return count;
+}
+
+/*
+ * Runs lines up to "end" with no echo, prompt or command output, then
+ * prints one summary. Lines after a failure are read but not run, so
+ * the rest of the stream never reaches the CLI.
+ */
+static void do_batch(sys_config_t *config)
+{
+    char line[CMD_MAX_LINE];
+    int8_t status[CMD_MAX_LIST];
+    uint8_t ignore_lf = 0;
+    uint16_t lines = 0;
+    uint16_t failed_line = 0;
+    uint8_t failed_cmd = 0;
+    uint8_t count;
+    uint8_t i;
+    bool echo_off = _g_echo_off;
+    int ret;
+
+    _g_echo_off = true;
+
+    for (;;)
+    {
+        ret = get_string(line, sizeof(line), &ignore_lf);
+
+        if (ret == -1)
+            break;
+
+        if (ret <= 0)
+            continue;
+
+        if (!stricmp(line, "end"))
+            break;
+
+        lines++;
+
+        if (failed_line)
+            continue;
+
+        console_mute(true);
+        count = cmd_run_list(line, config, status, false);
+        console_mute(false);
+
+        for (i = 0; i < count; i++)
+        {
+            if (status[i] > 0)
+            {
+                failed_line = lines;
+                failed_cmd = i + 1;
+                break;
+            }
         }
     }
+
+    _g_echo_off = echo_off;
+
+    if (config->console_mode == CONSOLE_MACHINE)
+    {
+        if (ret == -1)
+            printf("ERR\r\n");
+        else if (failed_line)
+            printf("ERR line=%u cmd=%u\r\n", failed_line, failed_cmd);
+        else
+            printf("OK lines=%u\r\n", lines);
+    }
+    else if (ret == -1)
+        printf("Batch: aborted after %u lines\r\n", lines);
+    else if (failed_line)
+        printf("Batch: failed at line %u, command %u\r\n", failed_line, failed_cmd);
+    else
+        printf("Batch: %u lines OK\r\n", lines);
 }
 
 static void do_show(sys_config_t *config)
 {
+    if (config->console_mode == CONSOLE_MACHINE)
+    {
+        if (config->desc[0])
+            cmd_reply("desc", config->desc);
+        cmd_reply_hex("addr", config->i2c_addr);
+        if (config->mux_addr)
+        {
+            cmd_reply_hex("mux", config->mux_addr);
+            cmd_reply_u32("channel", config->mux_channel);
+        }
+        cmd_reply_u32("speed", i2c_get_khz(do_bus_get_speed(config, config->i2c_addr) * 100));
+        cmd_reply_u32("baud", config->uart_baud);
+        cmd_reply_u32("autobaud", config->uart_autobaud);
+#ifdef _USART2_
+        cmd_reply_u32("data", config->data_baud);
+#endif /* _USART2_ */
+#ifdef _I2C_BRUTEFORCE_RESET_
+        cmd_reply_u32("recoveries", i2c_recoveries());
+#endif /* _I2C_BRUTEFORCE_RESET_ */
+        return;
+    }
+
     printf(
             "\r\nCurrent configuration:\r\n\r\n"
+            "\tdesc .............: %s\r\n"
             "\ti2c_addr .........: %xh\r\n"
+            "\ti2c_speed ........: %ukHz\r\n"
+            "\tuart_baud ........: %lu (%s)\r\n"
+          , config->desc
           , config->i2c_addr
+          , i2c_get_khz(do_bus_get_speed(config, config->i2c_addr) * 100)
+          , config->uart_baud
+          , config->uart_autobaud ? "auto" : "fixed"
         );
 
+    if (config->mux_addr)
+        printf("\ti2c_mux ..........: %xh channel %u\r\n", config->mux_addr, config->mux_channel);
+
+#ifdef _USART2_
+    printf("\tdata_baud ........: %lu\r\n", config->data_baud);
+#endif /* _USART2_ */
+
+#ifdef _I2C_BRUTEFORCE_RESET_
+    printf("\ti2c_recoveries ...: %u\r\n", i2c_recoveries());
+#endif /* _I2C_BRUTEFORCE_RESET_ */
+
     printf("\r\n");
 }
 
@@ -122,20 +580,64 @@ static void do_help(void)
         "\t\tLoad the default configuration\r\n\r\n"
         "\tsave\r\n"
         "\t\tSave current configuration\r\n\r\n"
-        "\tdump\r\n"
-        "\t\tDump current register values from DAC\r\n\r\n"
+        "\tdump [all]\r\n"
+        "\t\tDump current register values from DAC. all: entire register map\r\n\r\n"
         "\taddr [0 to 7f]\r\n"
-        "\t\tSets I2C slave addr used by this board. Factory default: 60h\r\n\r\n"
+        "\taddr [mux] [0 to 7] [0 to 7f]\r\n"
+        "\t\tSets I2C slave addr used by this board. Factory default: 60h\r\n"
+        "\t\tmux: TCA9548 addr and channel the board sits behind\r\n\r\n"
         "\tpgmaddr [0 to 7f]\r\n"
         "\t\tPrograms I2C slave addr used by the DAC\r\n\r\n"
+#ifdef _I2C_GANG_
+        "\tgang [lane mask|off]\r\n"
+        "\t\tRoute dump/set/offset/gain/int/pgmaddr to the gang programmer lanes\r\n"
+        "\t\tint moves every lane by the same step from its own code\r\n\r\n"
+        "\tgangset [offset|gain|nvoffset|nvgain] [code per lane]\r\n"
+        "\t\tWrites each gang lane its own code, lowest lane first\r\n\r\n"
+#endif
+        "\tbatch\r\n"
+        "\t\tRun lines up to 'end' without echo or output, then report once\r\n\r\n"
+        "\tcmd;cmd;...\r\n"
+        "\t\tRun up to 8 commands, stopping at the first failure\r\n\r\n"
+#ifdef _USART2_
+        "\tdata [on|baud|off]\r\n"
+        "\t\tBinary protocol on USART2 (RB6/RB7). Takes gang lanes 6 and 7\r\n\r\n"
+#endif
+        "\tmode [human|machine]\r\n"
+        "\t\tmachine: no echo or prompt, one 'OK [data]' or 'ERR' line per command\r\n\r\n"
+        "\tdesc [name]\r\n"
+        "\t\tSets the station name reported to host tools\r\n\r\n"
+        "\tbaud [rate|auto on|auto off]\r\n"
+        "\t\tSets console baud rate, or auto-baud ('U') at power up\r\n\r\n"
+        "\tspeed [100|400|1000]\r\n"
+        "\t\tSets I2C bus speed (kHz) for the current addr. No arg: show table\r\n"
+        "\t\tThe bus runs at the nearest clock at or below the step, shown as actual\r\n\r\n"
         "\toffset [0 to 4095]\r\n"
         "\tnvoffset [0 to 4095]\r\n"
         "\t\tSets DAC0 (non)volatile register\r\n\r\n"
         "\tgain [0 to 4095]\r\n"
         "\tnvgain [0 to 4095]\r\n"
         "\t\tSets DAC1 (non)volatile register\r\n\r\n"
+        "\tnvbatch [offset] [gain] [addr] ...\r\n"
+        "\t\tSets DAC0/DAC1 NV registers on up to 8 DACs, overlapping EEPROM writes\r\n\r\n"
+        "\tset [offset] [gain]\r\n"
+        "\tnvset [offset] [gain]\r\n"
+        "\t\tSets DAC0 and DAC1 (non)volatile registers together\r\n\r\n"
+        "\tcache [flush]\r\n"
+        "\t\tShow register cache hit/miss counters, or invalidate it\r\n\r\n"
         "\tinteractive|int [gain|offset]\r\n"
         "\t\tPerform interactive calibration\r\n\r\n"
+#ifdef _ADC_
+        "\tautocal [gain|offset] [mV]\r\n"
+        "\t\tTrim DAC1/DAC0 until AN1/AN0 reads mV, then save to NV\r\n\r\n"
+        "\tsweep [0|1] [start] [end] [step]\r\n"
+        "\t\tStep DAC0/DAC1 and stream ADC readings as hex deltas (80xxxx: absolute)\r\n\r\n"
+#endif
+#ifdef _WAVE_
+        "\twave [0|1] [ramp|triangle|sine|square] [rate] [amp] [offset]\r\n"
+        "\twave [stop]\r\n"
+        "\t\tDrive DAC0/DAC1 at rate updates/s, 256 per period. No arg: stats\r\n\r\n"
+#endif
         );
 }
 
@@ -148,12 +650,56 @@ static inline int8_t cmd_prompt_handler(char *text, sys_config_t *config)
     arg = strtok(NULL, "");
 
     if (!stricmp(command, "dump")) {
-        if (!do_dump(config))
+        if (!do_dump(config, arg))
             return 1;
         return 0;
     }    
     else if (!stricmp(command, "addr")) {
-        return parse_param(&config->i2c_addr, PARAM_U8H, arg);
+        if (do_addr(config, arg))
+            return 0;
+        return 1;
+    }
+    else if (!stricmp(command, "cache")) {
+        if (do_cache(config, arg))
+            return 0;
+        return 1;
+    }
+#ifdef _I2C_GANG_
+    else if (!stricmp(command, "gang")) {
+        if (do_gang(config, arg))
+            return 0;
+        return 1;
+    }
+    else if (!stricmp(command, "gangset")) {
+        if (do_gang_set(config, arg))
+            return 0;
+        return 1;
+    }
+#endif /* _I2C_GANG_ */
+#ifdef _USART2_
+    else if (!stricmp(command, "data")) {
+        if (do_data(config, arg))
+            return 0;
+        return 1;
+    }
+#endif /* _USART2_ */
+    else if (!stricmp(command, "mode")) {
+        if (do_mode(config, arg))
+            return 0;
+        return 1;
+    }
+    else if (!stricmp(command, "desc")) {
+        return parse_param(config->desc, PARAM_DESC, arg);
+    }
+    else if (!stricmp(command, "baud")) {
+        if (do_baud(config, arg))
+            return 0;
+        return 1;
+    }
+    else if (!stricmp(command, "speed")) {
+        if (do_speed(config, arg))
+            return 0;
+        return 1;
     }
     else if (!stricmp(command, "pgmaddr")) {
         uint8_t new_addr;
@@ -195,11 +741,45 @@ static inline int8_t cmd_prompt_handler(char *text, sys_config_t *config)
             return 0;
         return 1;
     }
+    else if (!stricmp(command, "nvbatch")) {
+        if (do_nvbatch(config, arg))
+            return 0;
+        return 1;
+    }
+    else if (!stricmp(command, "set")) {
+        if (do_set(config, false, arg))
+            return 0;
+        return 1;
+    }
+    else if (!stricmp(command, "nvset")) {
+        if (do_set(config, true, arg))
+            return 0;
+        return 1;
+    }
     else if (!stricmp(command, "interactive") || !stricmp(command, "int")) {
         if (do_interactive(config, arg))
             return 0;
         return 1;
     }
+#ifdef _ADC_
+    else if (!stricmp(command, "autocal")) {
+        if (do_autocal(config, arg))
+            return 0;
+        return 1;
+    }
+    else if (!stricmp(command, "sweep")) {
+        if (do_sweep(config, arg))
+            return 0;
+        return 1;
+    }
+#endif /* _ADC_ */
+#ifdef _WAVE_
+    else if (!stricmp(command, "wave")) {
+        if (do_wave(config, arg))
+            return 0;
+        return 1;
+    }
+#endif /* _WAVE_ */
     else if (!stricmp(command, "save")) {
         save_configuration(config);
         printf("\r\nConfiguration saved.\r\n\r\n");
@@ -230,11 +810,54 @@ static inline int8_t cmd_prompt_handler(char *text, sys_config_t *config)
     return 0;
 }
 
+/* Signed step for a calibration key, 0 for anything else */
+static int16_t do_interactive_step(char c)
+{
+    switch (c)
+    {
+        case '+': return INT_STEP_FINE;
+        case '-': return -INT_STEP_FINE;
+        case ']': return INT_STEP_MID;
+        case '[': return -INT_STEP_MID;
+        case '}': return INT_STEP_COARSE;
+        case '{': return -INT_STEP_COARSE;
+    }
+
+    return 0;
+}
+
+/* Moves value by step, clamped to the 12 bit code range */
+static uint16_t do_interactive_apply(uint16_t value, int16_t step)
+{
+    if (step > 0)
+        return (MCP47FEBXX_MAX_CODE - value < (uint16_t)step) ? MCP47FEBXX_MAX_CODE : value + step;
+
+    return (value < (uint16_t)-step) ? 0 : value + step;
+}
+
+/*
+ * Keys already waiting in the receive buffer are folded into a single
+ * bus write of the final value, so terminal auto-repeat never queues up
+ * writes. Holding a key accelerates it: every INT_ACCEL_RUN repeats
+ * double its step, up to 8x, until another key or a pause.
+ */
 static bool do_interactive(sys_config_t *config, const char *arg)
 {
     uint8_t reg = MCP47FEBXX_VOLATILE_DAC0;
     uint16_t value;
+    uint16_t written;
+    bool accepted;
+    uint16_t gap;
+    int16_t step;
+    int16_t last_step = 0;
+    uint8_t run = 0;
+    uint8_t shift;
     char c;
+#ifdef _I2C_GANG_
+    uint16_t base[I2C_GANG_LANES];
+    uint16_t first = 0;
+    uint8_t lane;
+#endif /* _I2C_GANG_ */
     
     if (!stricmp(arg, "gain"))
     {
@@ -245,43 +868,1352 @@ static bool do_interactive(sys_config_t *config, const char *arg)
         printf("Error: invalid argument\r\n");
         return false;
     }
-    
-    if (!i2c_read16(config->i2c_addr, reg | MCP47FEBXX_CMD_READ, &value))
+
+#ifdef _WAVE_
+    if (do_wave_conflict(config))
+        return false;
+#endif /* _WAVE_ */
+
+#ifdef _I2C_GANG_
+    /* Gang mode steers every lane from its own code, shown is the lowest lane */
+    if (i2c_gang_lanes())
+    {
+        if (!do_gang_read16(config, reg | MCP47FEBXX_CMD_READ, base))
+            return false;
+
+        for (lane = 0; !(i2c_gang_lanes() & (1 << lane)); lane++);
+
+        first = base[lane];
+        value = first;
+    }
+    else
+#endif /* _I2C_GANG_ */
+    if (!do_dac_read16(config, reg | MCP47FEBXX_CMD_READ, &value))
         return false;    
     
+    written = value;
+
     printf("Performing interactive calibration for %s\r\n", reg == MCP47FEBXX_VOLATILE_DAC1 ? "gain" : "offset");
-    printf("Current value is %d. Press +/- to increase/decrease. Esc to exit and save to NV\r\n", value);
+    printf("Current value is %d. Press +/- (1), [/] (16), {/} (256), hold to accelerate. Esc to exit and save to NV\r\n", value);
     
     do {
-        c = wdt_getch();
-        
-        if (c == '+')
-            value++;
-        if (c == '-')
-            value--;
-        
-        i2c_write16(config->i2c_addr, reg | MCP47FEBXX_CMD_WRITE, value);
+        gap = 0;
+        clear_usart_oerr();
+
+        while (!usart1_data_ready())
+        {
+            CLRWDT();
+
+            if (gap < INT_ACCEL_GAP_POLLS)
+                gap++;
+
+            __delay_us(100);
+        }
+
+        if (gap == INT_ACCEL_GAP_POLLS)
+            run = 0;
+
+        do {
+            c = usart1_get();
+            step = do_interactive_step(c);
+
+            if (step != last_step)
+            {
+                run = 0;
+                last_step = step;
+            }
+            else if (run < 0xFF)
+            {
+                run++;
+            }
+
+            shift = run / INT_ACCEL_RUN;
+
+            if (shift > INT_ACCEL_MAX_SHIFT)
+                shift = INT_ACCEL_MAX_SHIFT;
+
+            value = do_interactive_apply(value, step * (1 << shift));
+        } while (c != SEQ_ESCAPE_CHAR && usart1_data_ready());
+
+        if (value == written)
+            continue;
+
+#ifdef _I2C_GANG_
+        if (i2c_gang_lanes())
+            accepted = (do_gang_write_delta(config, reg | MCP47FEBXX_CMD_WRITE, base,
+                    (int16_t)(value - first)) == i2c_gang_lanes());
+        else
+#endif /* _I2C_GANG_ */
+#ifdef _I2C_QUEUE_
+        /* Carry on reading keys while the write goes out */
+        accepted = do_dac_queue_write16(config, reg | MCP47FEBXX_CMD_WRITE, value);
+#else
+        accepted = do_dac_write16(config, reg | MCP47FEBXX_CMD_WRITE, value);
+#endif /* _I2C_QUEUE_ */
+
+        /* Not taken: the next key tries the write again */
+        if (!accepted)
+            continue;
+
+        written = value;
+        printf("\r%4u", value);
         
     } while (c != SEQ_ESCAPE_CHAR);
     
+    printf("\r\n");
+
+#ifdef _I2C_GANG_
+    if (i2c_gang_lanes())
+    {
+        /* Same step again into NV, then one report for the lot */
+        return do_gang_report(do_gang_write_delta(config, (reg == MCP47FEBXX_VOLATILE_DAC0
+                ? MCP47FEBXX_NONVOLATILE_DAC0 : MCP47FEBXX_NONVOLATILE_DAC1) | MCP47FEBXX_CMD_WRITE,
+                base, (int16_t)(value - first)));
+    }
+#endif /* _I2C_GANG_ */
+
+    /* The last write wasn't taken: once more, waiting for it this time */
+    if (value != written && !do_dac_write16(config, reg | MCP47FEBXX_CMD_WRITE, value))
+        return false;
+
     if (reg == MCP47FEBXX_VOLATILE_DAC0)
-        i2c_write16(config->i2c_addr, MCP47FEBXX_NONVOLATILE_DAC0 | MCP47FEBXX_CMD_WRITE, value);
+        do_dac_write16(config, MCP47FEBXX_NONVOLATILE_DAC0 | MCP47FEBXX_CMD_WRITE, value);
+
+    if (reg == MCP47FEBXX_VOLATILE_DAC1)
+        do_dac_write16(config, MCP47FEBXX_NONVOLATILE_DAC1 | MCP47FEBXX_CMD_WRITE, value);
+    
+    return true;
+}
+
+#ifdef _ADC_
+
+/*
+ * Writes code to the volatile register and takes an oversampled reading
+ * of the output. Given a threshold, the reading stops at a clear verdict.
+ */
+static bool do_autocal_measure(sys_config_t *config, uint8_t reg, uint8_t channel, uint16_t code, uint16_t threshold)
+{
+    if (!do_dac_write16(config, reg | MCP47FEBXX_CMD_WRITE, code))
+        return false;
+
+    __delay_us(AUTOCAL_SETTLE_US);
+
+    return adc_start(channel, AUTOCAL_SAMPLES, threshold, AUTOCAL_MARGIN) && adc_wait();
+}
+
+/*
+ * Successive approximation over the 12 bit code space: from the MSB
+ * down, each bit is kept if the output still reads at or below the
+ * target. Those steps only need a verdict, so most stop after a few
+ * conversions; full readings are taken of the end points (the output
+ * has to rise with the code and the target must be in reach) and of
+ * the result and its neighbour, whichever lands closer wins.
+ */
+static bool do_autocal(sys_config_t *config, char *arg)
+{
+    char *which = strtok(arg, " ");
+    char *mv_arg = strtok(NULL, " ");
+    uint8_t reg = MCP47FEBXX_VOLATILE_DAC0;
+    uint8_t nv_reg = MCP47FEBXX_NONVOLATILE_DAC0;
+    uint8_t channel = ADC_CH_OFFSET;
+    uint16_t target_mv;
+    uint16_t target;
+    uint16_t low;
+    uint16_t high;
+    uint16_t best;
+    uint16_t code = 0;
+    uint16_t bit;
+    uint16_t conversions = 0;
+
+    if (which && !stricmp(which, "gain"))
+    {
+        reg = MCP47FEBXX_VOLATILE_DAC1;
+        nv_reg = MCP47FEBXX_NONVOLATILE_DAC1;
+        channel = ADC_CH_GAIN;
+    }
+    else if (!which || stricmp(which, "offset"))
+    {
+        printf("Error: invalid argument\r\n");
+        return false;
+    }
+
+    if (parse_param(&target_mv, PARAM_U16, mv_arg))
+        return false;
+
+#ifdef _I2C_GANG_
+    if (i2c_gang_lanes())
+    {
+        printf("Error: not available in gang mode\r\n");
+        return false;
+    }
+#endif /* _I2C_GANG_ */
+
+#ifdef _WAVE_
+    if (do_wave_conflict(config))
+        return false;
+#endif /* _WAVE_ */
+
+    if (target_mv > ADC_VREF_MV)
+    {
+        printf("Error: out of range\r\n");
+        return false;
+    }
+
+    target = adc_scale_mv(target_mv, AUTOCAL_SAMPLES);
+
+    if (!do_autocal_measure(config, reg, channel, 0, ADC_NO_THRESHOLD))
+        return false;
+
+    low = adc_result();
+
+    if (!do_autocal_measure(config, reg, channel, MCP47FEBXX_MAX_CODE, ADC_NO_THRESHOLD))
+        return false;
+
+    high = adc_result();
+    conversions = 2 * AUTOCAL_SAMPLES;
+
+    if (target < low || target > high)
+    {
+        printf("Error: %umV out of reach (%u to %umV)\r\n", target_mv, adc_result_mv(low), adc_result_mv(high));
+        return false;
+    }
+
+    for (bit = (MCP47FEBXX_MAX_CODE + 1) >> 1; bit; bit >>= 1)
+    {
+        if (!do_autocal_measure(config, reg, channel, code | bit, target))
+            return false;
+
+        conversions += adc_samples();
+
+        if (adc_compare() == ADC_BELOW)
+            code |= bit;
+    }
+
+    if (!do_autocal_measure(config, reg, channel, code, ADC_NO_THRESHOLD))
+        return false;
+
+    best = adc_result();
+
+    if (code < MCP47FEBXX_MAX_CODE)
+    {
+        if (!do_autocal_measure(config, reg, channel, code + 1, ADC_NO_THRESHOLD))
+            return false;
+
+        if (AUTOCAL_DIST(adc_result(), target) < AUTOCAL_DIST(best, target))
+            code++;
+    }
+
+    conversions += 2 * AUTOCAL_SAMPLES;
+
+    if (!do_dac_write16(config, reg | MCP47FEBXX_CMD_WRITE, code))
+        return false;
+
+    __delay_us(AUTOCAL_SETTLE_US);
+
+    /* Verification reading runs while the EEPROM programs */
+    if (!do_dac_start_write16(config, nv_reg | MCP47FEBXX_CMD_WRITE, code))
+        return false;
+
+    adc_start(channel, AUTOCAL_SAMPLES, ADC_NO_THRESHOLD, 0);
+
+    if (!do_dac_wait_nv(config) || !adc_wait())
+        return false;
+
+    conversions += AUTOCAL_SAMPLES;
+    best = adc_result();
+
+    if (config->console_mode == CONSOLE_MACHINE)
+    {
+        cmd_reply_u32("code", code);
+        cmd_reply_u32("mv", adc_result_mv(best));
+        cmd_reply_u32("conversions", conversions);
+        return true;
+    }
+
+    printf("Calibrated %s to %u (%umV, %u conversions), saved to NV\r\n",
+            reg == MCP47FEBXX_VOLATILE_DAC1 ? "gain" : "offset", code, adc_result_mv(best), conversions);
+    return true;
+}
+
+
+/* One reading: signed delta from the last as two hex digits, or 80 and all four when it won't fit */
+static void do_sweep_emit(uint16_t reading, uint16_t *last, uint16_t *count)
+{
+    int16_t delta = (int16_t)(reading - *last);
+
+    if (!*count || delta < -127 || delta > 127)
+        printf("%02X%04X", SWEEP_ESCAPE, reading);
+    else
+        printf("%02X", (uint8_t)delta);
+
+    *last = reading;
+
+    if (!(++*count % SWEEP_PER_LINE))
+        printf("\r\n");
+}
+
+/* Machine mode hears the records but not a failing write's error messages */
+static bool do_sweep_write(sys_config_t *config, uint8_t reg, uint16_t code)
+{
+    bool ok;
+
+    if (!_g_replying)
+        return do_dac_start_write16(config, reg, code);
+
+    console_mute(true);
+    ok = do_dac_start_write16(config, reg, code);
+    console_mute(false);
+
+    return ok;
+}
+
+/*
+ * Steps a DAC channel through [start, end] and reads the output back at
+ * every code. The previous reading is formatted into the UART ring while
+ * the ADC samples the current one, and the ring drains while the next
+ * code goes out on the bus, so the sweep runs at bus/ADC speed until
+ * the console can't keep up. Output:
+ *
+ *   SWEEP ch start end step bits points
+ *   <hex records, SWEEP_PER_LINE per line>
+ *   [ERR index]
+ *   END count
+ *
+ * On a bus or ADC failure every reading taken so far is still sent, then
+ * ERR gives the point that failed, so count is short of points. In
+ * machine mode the records go out ahead of the command's OK / ERR line.
+ */
+static bool do_sweep(sys_config_t *config, char *arg)
+{
+    uint8_t ch;
+    uint16_t start;
+    uint16_t end;
+    uint16_t step;
+    uint16_t points;
+    uint16_t code;
+    uint16_t saved;
+    uint16_t reading = 0;
+    uint16_t last = 0;
+    uint16_t count = 0;
+    uint16_t i;
+    uint8_t reg;
+    uint8_t channel;
+    bool ok = true;
+
+    if (parse_param(&ch, PARAM_U8, strtok(arg, " "))
+            || parse_param(&start, PARAM_U16, strtok(NULL, " "))
+            || parse_param(&end, PARAM_U16, strtok(NULL, " "))
+            || parse_param(&step, PARAM_U16, strtok(NULL, " ")))
+        return false;
+
+    if (ch > 1 || start > MCP47FEBXX_MAX_CODE || end > MCP47FEBXX_MAX_CODE || !step)
+    {
+        printf("Error: out of range\r\n");
+        return false;
+    }
+
+#ifdef _I2C_GANG_
+    if (i2c_gang_lanes())
+    {
+        printf("Error: not available in gang mode\r\n");
+        return false;
+    }
+#endif /* _I2C_GANG_ */
+
+#ifdef _WAVE_
+    if (do_wave_conflict(config))
+        return false;
+#endif /* _WAVE_ */
+
+    reg = ch ? MCP47FEBXX_VOLATILE_DAC1 : MCP47FEBXX_VOLATILE_DAC0;
+    channel = ch ? ADC_CH_GAIN : ADC_CH_OFFSET;
+    points = ((start > end) ? start - end : end - start) / step + 1;
+
+    if (!do_dac_read16(config, reg | MCP47FEBXX_CMD_READ, &saved))
+        return false;
+
+    /* The records are the reply, too many for the OK line */
+    if (_g_replying)
+        console_mute(false);
+
+    printf("SWEEP %u %u %u %u %u %u\r\n", ch, start, end, step,
+            ADC_BITS + SWEEP_EXTRA_BITS, points);
+
+    code = start;
+
+    for (i = 0; i < points; i++)
+    {
+        if (!do_sweep_write(config, reg | MCP47FEBXX_CMD_WRITE, code))
+        {
+            /* The previous point's reading hasn't gone out yet */
+            if (i)
+                do_sweep_emit(reading, &last, &count);
+            ok = false;
+            break;
+        }
+
+        __delay_us(SWEEP_SETTLE_US);
+        adc_start(channel, SWEEP_SAMPLES, ADC_NO_THRESHOLD, 0);
+
+        if (i)
+            do_sweep_emit(reading, &last, &count);
+
+        if (!adc_wait())
+        {
+            ok = false;
+            break;
+        }
+
+        reading = adc_result();
+        code = (start > end) ? code - step : code + step;
+    }
+
+    if (ok)
+        do_sweep_emit(reading, &last, &count);
+
+    if (count % SWEEP_PER_LINE)
+        printf("\r\n");
+
+    if (!ok)
+        printf("ERR %u\r\n", i);
+
+    printf("END %u\r\n", count);
+
+    if (_g_replying)
+        console_mute(true);
+
+    if (!do_dac_start_write16(config, reg | MCP47FEBXX_CMD_WRITE, saved))
+        return false;
+
+    return ok;
+}
+
+#endif /* _ADC_ */
+
+#ifdef _WAVE_
+
+static void do_wave_stats(sys_config_t *config)
+{
+    wave_stats_t stats;
+    uint32_t max_rate = 0;
+
+    wave_stats(&stats);
+
+    if (stats.xfer_max_us)
+        max_rate = 1000000UL / stats.xfer_max_us;
+
+    if (config->console_mode == CONSOLE_MACHINE)
+    {
+        cmd_reply_u32("run", wave_running());
+        cmd_reply_u32("rate", stats.rate);
+        cmd_reply_u32("upd", stats.updates);
+        cmd_reply_u32("miss", stats.missed);
+        cmd_reply_u32("fail", stats.failed);
+        cmd_reply_u32("jit", stats.late_max_us - stats.late_min_us);
+        cmd_reply_u32("xfer", stats.xfer_max_us);
+        return;
+    }
+
+    printf(
+            "\r\nWaveform: %s, %u updates/s\r\n\r\n"
+            "\tupdates ..........: %lu\r\n"
+            "\tmissed ...........: %u\r\n"
+            "\tfailed ...........: %u\r\n"
+            "\tlatency ..........: %u to %uus (jitter %uus)\r\n"
+            "\tlongest update ...: %uus (max rate ~%lu/s)\r\n\r\n"
+          , wave_running() ? "running" : "stopped"
+          , stats.rate
+          , stats.updates
+          , stats.missed
+          , stats.failed
+          , stats.late_min_us
+          , stats.late_max_us
+          , stats.late_max_us - stats.late_min_us
+          , stats.xfer_max_us
+          , max_rate
+        );
+}
+
+/* wave <ch> <shape> <rate> <amp> <offset>, wave stop, or stats */
+static bool do_wave(sys_config_t *config, char *arg)
+{
+    uint8_t ch;
+    uint8_t shape;
+    uint16_t rate;
+    uint16_t amp;
+    uint16_t offset;
+    char *name;
+
+    if (!arg || !*arg)
+    {
+        do_wave_stats(config);
+        return true;
+    }
+
+    if (!stricmp(arg, "stop"))
+    {
+        wave_stop();
+        do_wave_stats(config);
+        return true;
+    }
+
+    if (parse_param(&ch, PARAM_U8, strtok(arg, " ")))
+        return false;
+
+    name = strtok(NULL, " ");
+
+    for (shape = 0; name && shape <= WAVE_SQUARE; shape++)
+    {
+        if (!stricmp(name, _g_wave_shapes[shape]))
+            break;
+    }
+
+    if (!name || shape > WAVE_SQUARE)
+    {
+        printf("Error: unknown shape\r\n");
+        return false;
+    }
+
+    if (parse_param(&rate, PARAM_U16, strtok(NULL, " "))
+            || parse_param(&amp, PARAM_U16, strtok(NULL, " "))
+            || parse_param(&offset, PARAM_U16, strtok(NULL, " ")))
+        return false;
+
+    if (ch >= WAVE_CHANNELS || rate < WAVE_MIN_RATE || rate > WAVE_MAX_RATE
+            || (uint32_t)offset + amp > MCP47FEBXX_MAX_CODE)
+    {
+        printf("Error: out of range\r\n");
+        return false;
+    }
+
+#ifdef _I2C_GANG_
+    if (i2c_gang_lanes())
+    {
+        printf("Error: not available in gang mode\r\n");
+        return false;
+    }
+#endif /* _I2C_GANG_ */
+
+    if (!do_bus_select(config))
+        return false;
+
+    /* The outputs are about to move under the cache */
+    shadow_invalidate();
+
+    _g_wave_mux_addr = config->mux_addr;
+    _g_wave_mux_channel = config->mux_channel;
+
+    return wave_start(config->i2c_addr, ch, shape, rate, amp, offset);
+}
+
+/* The bus is about to be re-clocked or re-routed away from a running wave */
+static void do_wave_cancel(void)
+{
+    if (!wave_running())
+        return;
+
+    wave_stop();
+    printf("Warning: bus changed, wave stopped\r\n");
+}
+
+/* True, with an error, if a wave is driving the target's outputs */
+static bool do_wave_conflict(sys_config_t *config)
+{
+    if (!wave_running() || wave_addr() != config->i2c_addr
+            || _g_wave_mux_addr != config->mux_addr || _g_wave_mux_channel != config->mux_channel)
+        return false;
+
+    printf("Error: wave running on %xh, 'wave stop' first\r\n", config->i2c_addr);
+    return true;
+}
+
+#endif /* _WAVE_ */
+
+static bool do_dac_write16(sys_config_t *config, uint8_t reg, uint16_t value)
+{
+#ifdef _I2C_GANG_
+    if (i2c_gang_lanes())
+        return do_gang_write16(config, reg, value);
+#endif /* _I2C_GANG_ */
+
+    if (!do_dac_start_write16(config, reg, value))
+        return false;
+
+    if (MCP47FEBXX_IS_NONVOLATILE(reg))
+        return do_dac_wait_nv(config);
+
+    return true;
+}
+
+/* As do_dac_write16() but returns without waiting out an EEPROM cycle */
+static bool do_dac_start_write16(sys_config_t *config, uint8_t reg, uint16_t value)
+{
+    uint16_t cached;
+
+    if (shadow_lookup(config, reg, &cached) && cached == value)
+        return true;
+
+    if (!do_bus_select(config))
+        return false;
+
+    if (!do_bus_check(config, i2c_write16(config->i2c_addr, reg, value)))
+        return false;
+
+    shadow_store(config, reg, value);
+    return true;
+}
+
+/* Single EEWA poll. No answer counts as busy */
+static bool do_dac_nv_busy(sys_config_t *config)
+{
+    uint16_t status;
+
+    if (!do_bus_select(config))
+        return true;
+
+    if (!i2c_read16(config->i2c_addr, MCP47FEBXX_GAIN_STATUS | MCP47FEBXX_CMD_READ, &status))
+        return true;
+
+    return (status & MCP47FEBXX_STATUS_EEWA) ? true : false;
+}
+
+/*
+ * Programs the NV offset/gain of several DACs. Each device's EEPROM cycle
+ * runs while the others are being serviced, so the total is close to two
+ * EEPROM cycles plus the bus traffic rather than two cycles per device.
+ */
+static bool do_nvbatch(sys_config_t *config, char *arg)
+{
+    static const uint8_t nv_regs[] = {
+        MCP47FEBXX_NONVOLATILE_DAC0 | MCP47FEBXX_CMD_READ,
+        MCP47FEBXX_NONVOLATILE_DAC1 | MCP47FEBXX_CMD_READ,
+    };
+    uint8_t addrs[NVBATCH_MAX];
+    uint8_t state[NVBATCH_MAX];
+    i2c_deadline_t deadlines[NVBATCH_MAX];
+    uint16_t readback[2];
+    uint16_t offset;
+    uint16_t gain;
+    uint8_t saved_addr = config->i2c_addr;
+    uint8_t count = 0;
+    uint8_t pending;
+    uint8_t i;
+    bool ok = true;
+    char *tok;
+    char *end;
+    long value;
+
+    if (parse_param(&offset, PARAM_U16, strtok(arg, " ")))
+        return false;
+    if (parse_param(&gain, PARAM_U16, strtok(NULL, " ")))
+        return false;
+
+    while ((tok = strtok(NULL, " ")))
+    {
+        if (count == NVBATCH_MAX)
+        {
+            printf("Error: more than %u addresses\r\n", NVBATCH_MAX);
+            return false;
+        }
+
+        /* All of it hex, and a real 7 bit address: 00h is general call */
+        value = strtol(tok, &end, 16);
+        if (*end || value < 1 || value > 0x7F)
+        {
+            printf("Error: invalid address %s\r\n", tok);
+            return false;
+        }
+
+        addrs[count] = (uint8_t)value;
+        state[count] = NV_STATE_DAC0;
+        count++;
+    }
+
+    if (!count)
+    {
+        printf("Error: Missing parameter\r\n");
+        return false;
+    }
+
+    do {
+        pending = 0;
+
+        for (i = 0; i < count; i++)
+        {
+            config->i2c_addr = addrs[i];
+
+            switch (state[i])
+            {
+                case NV_STATE_DAC0:
+                    /* Start the EEPROM cycle and move on to the next device */
+                    if (do_dac_start_write16(config, MCP47FEBXX_NONVOLATILE_DAC0 | MCP47FEBXX_CMD_WRITE, offset))
+                        state[i] = NV_STATE_DAC0_BUSY;
+                    else
+                        state[i] = NV_STATE_FAILED;
+                    i2c_deadline_start(&deadlines[i], MCP47FEBXX_NV_TIMEOUT_MS);
+                    break;
+
+                case NV_STATE_DAC0_BUSY:
+                case NV_STATE_DAC1_BUSY:
+                    if (do_dac_nv_busy(config))
+                    {
+                        if (i2c_deadline_passed(&deadlines[i]))
+                            state[i] = NV_STATE_FAILED;
+                        break;
+                    }
+
+                    if (state[i] == NV_STATE_DAC1_BUSY)
+                        state[i] = NV_STATE_DONE;
+                    else if (do_dac_start_write16(config, MCP47FEBXX_NONVOLATILE_DAC1 | MCP47FEBXX_CMD_WRITE, gain))
+                        state[i] = NV_STATE_DAC1_BUSY;
+                    else
+                        state[i] = NV_STATE_FAILED;
+                    i2c_deadline_start(&deadlines[i], MCP47FEBXX_NV_TIMEOUT_MS);
+                    break;
+            }
+
+            if (state[i] < NV_STATE_DONE)
+                pending++;
+        }
+
+        if (pending)
+            __delay_us(100);
+
+        CLRWDT();
+    } while (pending);
+
+    printf("\r\n");
+
+    for (i = 0; i < count; i++)
+    {
+        config->i2c_addr = addrs[i];
+
+        if (state[i] == NV_STATE_DONE)
+        {
+            /* Verify straight from the device, not the shadow */
+            if (!do_bus_select(config)
+                    || !i2c_read16_many(config->i2c_addr, nv_regs, readback, sizeof(nv_regs))
+                    || readback[0] != offset || readback[1] != gain)
+                state[i] = NV_STATE_FAILED;
+        }
+
+        if (state[i] != NV_STATE_DONE)
+            ok = false;
+
+        printf("\t%xh ..............: %s\r\n", addrs[i], state[i] == NV_STATE_DONE ? "OK" : "FAILED");
+    }
+
+    printf("\r\n");
+
+    config->i2c_addr = saved_addr;
+    shadow_invalidate();
+
+    return ok;
+}
+
+/* Returns once the DAC has finished its EEPROM write cycle */
+static bool do_dac_wait_nv(sys_config_t *config)
+{
+    if (i2c_await_clear16(config->i2c_addr, MCP47FEBXX_GAIN_STATUS | MCP47FEBXX_CMD_READ,
+            MCP47FEBXX_STATUS_EEWA, MCP47FEBXX_NV_TIMEOUT_MS))
+        return true;
+
+    printf("Error: timeout waiting for NV write\r\n");
+    shadow_invalidate();
+    return false;
+}
+
+static bool do_dac_read16(sys_config_t *config, uint8_t reg, uint16_t *value)
+{
+    if (shadow_lookup(config, reg, value))
+        return true;
+
+    if (!do_bus_select(config))
+        return false;
+
+    if (!do_bus_check(config, i2c_read16(config->i2c_addr, reg, value)))
+        return false;
+
+    shadow_store(config, reg, *value);
+    return true;
+}
+
+static void shadow_invalidate(void)
+{
+    _g_shadow_valid = 0;
+    _g_shadow_stale = false;
+}
+
+static bool shadow_lookup(sys_config_t *config, uint8_t reg, uint16_t *value)
+{
+    uint8_t index = shadow_index(reg);
+
+    if (_g_shadow_stale || _g_shadow_addr != config->i2c_addr)
+        shadow_invalidate();
+
+    if (!(_g_shadow_valid & (1UL << index)))
+    {
+        _g_shadow_misses++;
+        return false;
+    }
+
+    _g_shadow_hits++;
+    *value = _g_shadow[index];
+    return true;
+}
+
+static void shadow_store(sys_config_t *config, uint8_t reg, uint16_t value)
+{
+    uint8_t index = shadow_index(reg);
+
+    /* Status bits change under our feet */
+    if (index == shadow_index(MCP47FEBXX_GAIN_STATUS))
+        return;
+
+#ifdef _WAVE_
+    /* So do the outputs while a wave drives them */
+    if (index <= shadow_index(MCP47FEBXX_VOLATILE_DAC1) && wave_running() && wave_addr() == config->i2c_addr)
+        return;
+#endif /* _WAVE_ */
+
+    if (_g_shadow_addr != config->i2c_addr)
+    {
+        shadow_invalidate();
+        _g_shadow_addr = config->i2c_addr;
+    }
+
+    _g_shadow[index] = value;
+    _g_shadow_valid |= (1UL << index);
+}
+
+static bool do_cache(sys_config_t *config, const char *arg)
+{
+    char valid[9];
+
+    if (arg && *arg)
+    {
+        if (stricmp(arg, "flush"))
+        {
+            printf("Error: invalid argument\r\n");
+            return false;
+        }
+
+        shadow_invalidate();
+        return true;
+    }
+
+    if (config->console_mode == CONSOLE_MACHINE)
+    {
+        sprintf(valid, "%08lx", _g_shadow_valid);
+        cmd_reply_hex("addr", _g_shadow_addr);
+        cmd_reply("valid", valid);
+        cmd_reply_u32("hits", _g_shadow_hits);
+        cmd_reply_u32("misses", _g_shadow_misses);
+        return true;
+    }
+
+    printf(
+            "\r\nRegister cache:\r\n\r\n"
+            "\taddr .............: %xh\r\n"
+            "\tvalid ............: %lxh\r\n"
+            "\thits .............: %u\r\n"
+            "\tmisses ...........: %u\r\n\r\n"
+          , _g_shadow_addr, _g_shadow_valid, _g_shadow_hits, _g_shadow_misses
+        );
+
+    return true;
+}
+
+/*
+ * Writes DAC0 and DAC1 in one continuous write frame:
+ *
+ * S addr+W cmd0 d0h d0l cmd1 d1h d1l P
+ *
+ * Not for the NV registers: the device ignores a write that arrives
+ * while EEWA is set, so those go one at a time, each waiting out its
+ * own EEPROM cycle.
+ */
+static bool do_dac_write_pair(sys_config_t *config, bool nv, uint16_t offset, uint16_t gain)
+{
+    uint8_t frame[5];
+
+#ifdef _I2C_GANG_
+    if (i2c_gang_lanes())
+        return do_gang_write_pair(config, nv, offset, gain);
+#endif /* _I2C_GANG_ */
+
+    if (nv)
+    {
+        if (!do_dac_start_write16(config, MCP47FEBXX_NONVOLATILE_DAC0 | MCP47FEBXX_CMD_WRITE, offset)
+                || !do_dac_wait_nv(config))
+            return false;
+
+        if (!do_dac_start_write16(config, MCP47FEBXX_NONVOLATILE_DAC1 | MCP47FEBXX_CMD_WRITE, gain))
+            return false;
+
+        return do_dac_wait_nv(config);
+    }
+
+    frame[0] = (uint8_t)(offset >> 8);
+    frame[1] = (uint8_t)offset;
+    frame[2] = MCP47FEBXX_VOLATILE_DAC1 | MCP47FEBXX_CMD_WRITE;
+    frame[3] = (uint8_t)(gain >> 8);
+    frame[4] = (uint8_t)gain;
+
+    if (!do_bus_select(config))
+        return false;
+
+    if (!do_bus_check(config, i2c_write_buf(config->i2c_addr,
+            MCP47FEBXX_VOLATILE_DAC0 | MCP47FEBXX_CMD_WRITE, frame, sizeof(frame))))
+        return false;
+
+    shadow_store(config, MCP47FEBXX_VOLATILE_DAC0, offset);
+    shadow_store(config, MCP47FEBXX_VOLATILE_DAC1, gain);
+
+    return true;
+}
+
+static bool do_set(sys_config_t *config, bool nv, char *arg)
+{
+    uint16_t offset;
+    uint16_t gain;
+    char *first;
+    char *second;
+
+    first = strtok(arg, " ");
+    second = strtok(NULL, " ");
+
+    if (parse_param(&offset, PARAM_U16, first))
+        return false;
+    if (parse_param(&gain, PARAM_U16, second))
+        return false;
+
+    return do_dac_write_pair(config, nv, offset, gain);
+}
+
+static uint8_t do_bus_get_speed(sys_config_t *config, uint8_t addr)
+{
+    uint8_t i;
+
+    for (i = 0; i < I2C_SPEED_ENTRIES; i++)
+    {
+        if (config->i2c_speed[i].addr == addr)
+            return config->i2c_speed[i].speed;
+    }
+
+    return I2C_SPEED_100K;
+}
+
+static bool do_bus_set_speed(sys_config_t *config, uint8_t addr, uint8_t speed)
+{
+    uint8_t i;
+    i2c_speed_t *entry = NULL;
+
+    for (i = 0; i < I2C_SPEED_ENTRIES; i++)
+    {
+        if (config->i2c_speed[i].addr == addr)
+        {
+            entry = &config->i2c_speed[i];
+            break;
+        }
+
+        if (!entry && !config->i2c_speed[i].addr)
+            entry = &config->i2c_speed[i];
+    }
+
+    if (!entry)
+    {
+        if (speed == I2C_SPEED_100K)
+            return true;
+
+        printf("Error: speed table full\r\n");
+        return false;
+    }
+
+    /* Standard mode is the default, don't hold an entry for it */
+    entry->addr = (speed == I2C_SPEED_100K) ? 0 : addr;
+    entry->speed = speed;
+    return true;
+}
+
+/*
+ * Routes the bus to the target's mux channel. The selection is cached, so
+ * back to back operations on one board cost no extra traffic. Leaving a
+ * mux closes all of its channels first, so same address boards behind
+ * two muxes are never on the bus together.
+ *
+ * False if a mux didn't take the new setting. Whatever channel was open
+ * may still be, and every board in this fixture answers at the same
+ * address, so the caller must not go on to talk to the target.
+ */
+static bool do_mux_select(sys_config_t *config)
+{
+    uint8_t mux;
+
+    if (config->mux_addr == _g_mux_addr && config->mux_channel == _g_mux_channel)
+        return true;
+
+#ifdef _WAVE_
+    if (config->mux_addr != _g_wave_mux_addr || config->mux_channel != _g_wave_mux_channel)
+        do_wave_cancel();
+#endif /* _WAVE_ */
+
+    mux = _g_mux_addr;
+
+    if (mux && mux != config->mux_addr)
+    {
+        if (!i2c_write_byte(mux, TCA9548_NONE))
+            goto fail;
+    }
+
+    _g_mux_addr = config->mux_addr;
+    mux = config->mux_addr;
+
+    if (mux && !i2c_write_byte(mux, TCA9548_CHANNEL(config->mux_channel)))
+        goto fail;
+
+    _g_mux_channel = config->mux_channel;
+    shadow_invalidate();
+    return true;
+
+fail:
+    _g_mux_channel = MUX_UNKNOWN;
+    printf("Error: no answer from mux %xh\r\n", mux);
+    return false;
+}
+
+/*
+ * Re-clock the MSSP if the current target wants a different rate, then
+ * route the mux. False if the target can't be reached safely.
+ */
+static bool do_bus_select(sys_config_t *config)
+{
+    uint8_t speed = do_bus_get_speed(config, config->i2c_addr);
+
+    if (speed == _g_bus_speed)
+        return do_mux_select(config);
+
+#ifdef _WAVE_
+    do_wave_cancel();
+#endif /* _WAVE_ */
+
+#ifdef _I2C_QUEUE_
+    i2c_queue_flush();
+#endif /* _I2C_QUEUE_ */
+
+    i2c_init(speed * 100);
+    _g_bus_speed = speed;
+    _g_bus_errors = 0;
+
+    return do_mux_select(config);
+}
+
+/* Drops the current target down a speed grade after repeated bus failures */
+static bool do_bus_check(sys_config_t *config, bool ok)
+{
+    uint8_t speed;
+
+    if (ok)
+    {
+        _g_bus_errors = 0;
+        return true;
+    }
+
+    shadow_invalidate();
+
+    /* The mux may have been reset along with whatever went wrong */
+    _g_mux_channel = MUX_UNKNOWN;
+
+    if (++_g_bus_errors < I2C_FALLBACK_ERRORS)
+        return false;
+
+    _g_bus_errors = 0;
+    speed = do_bus_get_speed(config, config->i2c_addr);
+
+    if (speed == I2C_SPEED_1M)
+        speed = I2C_SPEED_400K;
+    else if (speed == I2C_SPEED_400K)
+        speed = I2C_SPEED_100K;
+    else
+        return false;
+
+    printf("Warning: I2C errors at %xh, falling back to %ukHz\r\n", config->i2c_addr, i2c_get_khz(speed * 100));
+    do_bus_set_speed(config, config->i2c_addr, speed);
+    do_bus_select(config);
+
+    return false;
+}
+
+#ifdef _USART2_
+
+static bool do_data(sys_config_t *config, const char *arg)
+{
+    uint32_t baud;
+
+    if (!arg || !*arg)
+    {
+        if (config->console_mode == CONSOLE_MACHINE)
+            cmd_reply_u32(NULL, config->data_baud);
+        else
+            printf("\r\nData channel: %lu\r\n\r\n", config->data_baud);
+        return true;
+    }
+
+    if (!stricmp(arg, "off"))
+    {
+        usart2_close();
+        config->data_baud = 0;
+        return true;
+    }
+
+    if (!stricmp(arg, "on"))
+        baud = UART2_BAUD;
+    else
+        baud = (uint32_t)atol(arg);
+
+    if (!usart_baud_ok(baud))
+    {
+        printf("Error: %lu baud not reachable within %u%%\r\n", baud, USART_MAX_BAUD_ERROR);
+        return false;
+    }
+
+#ifdef _I2C_GANG_
+    if (i2c_gang_lanes() & UART2_GANG_LANES)
+    {
+        printf("Error: gang lanes 6/7 in use\r\n");
+        return false;
+    }
+#endif /* _I2C_GANG_ */
+
+    if (!usart2_open(baud))
+        return false;
+
+    config->data_baud = baud;
+    return true;
+}
+
+#endif /* _USART2_ */
+
+static bool do_mode(sys_config_t *config, const char *arg)
+{
+    if (!arg || !*arg)
+    {
+        if (config->console_mode == CONSOLE_MACHINE)
+            cmd_reply(NULL, "machine");
+        else
+            printf("\r\nConsole mode: human\r\n\r\n");
+        return true;
+    }
+
+    if (!stricmp(arg, "human"))
+        config->console_mode = CONSOLE_HUMAN;
+    else if (!stricmp(arg, "machine"))
+        config->console_mode = CONSOLE_MACHINE;
+    else
+    {
+        printf("Error: invalid argument\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool do_baud(sys_config_t *config, char *arg)
+{
+    uint32_t baud;
+    char *first;
+    char *second;
+
+    if (!arg || !*arg)
+    {
+        if (config->console_mode == CONSOLE_MACHINE)
+            cmd_reply_u32(NULL, usart1_get_baud());
+        else
+            printf("\r\nBaud rate: %lu\r\n\r\n", usart1_get_baud());
+        return true;
+    }
+
+    first = strtok(arg, " ");
+    second = strtok(NULL, " ");
+
+    if (!stricmp(first, "auto"))
+    {
+        if (second && !stricmp(second, "on"))
+        {
+#ifdef _USART_BRG16_
+            config->uart_autobaud = 1;
+            return true;
+#else
+            printf("Error: auto-baud not supported\r\n");
+            return false;
+#endif /* _USART_BRG16_ */
+        }
+
+        if (second && !stricmp(second, "off"))
+        {
+            config->uart_autobaud = 0;
+            return true;
+        }
+
+        printf("Error: invalid argument\r\n");
+        return false;
+    }
+
+    baud = (uint32_t)atol(first);
+
+    if (!usart_baud_ok(baud))
+    {
+        printf("Error: %lu baud not reachable within %u%%\r\n", baud, USART_MAX_BAUD_ERROR);
+        return false;
+    }
+
+    printf("Switching to %lu baud\r\n", baud);
+    usart1_set_baud(baud);
+    config->uart_baud = baud;
+
+    return true;
+}
+
+/* addr <dev>, or addr <mux> <channel> <dev> for a board behind a TCA9548 */
+static bool do_addr(sys_config_t *config, char *arg)
+{
+    char *first = strtok(arg, " ");
+    char *second = strtok(NULL, " ");
+    char *third = strtok(NULL, " ");
+    uint8_t mux = 0;
+    uint8_t channel = 0;
+    uint8_t dev;
+
+    if (third)
+    {
+        if (parse_param(&mux, PARAM_U8H, first) || parse_param(&channel, PARAM_U8, second))
+            return false;
+
+        first = third;
+    }
+    else if (second)
+    {
+        printf("Error: invalid argument\r\n");
+        return false;
+    }
+
+    if (parse_param(&dev, PARAM_U8H, first))
+        return false;
+
+    if (mux > 0x7F || channel >= TCA9548_CHANNELS || dev > 0x7F)
+    {
+        printf("Error: out of range\r\n");
+        return false;
+    }
+
+    shadow_invalidate();
+    config->mux_addr = mux;
+    config->mux_channel = channel;
+    config->i2c_addr = dev;
+    return true;
+}
+
+static bool do_speed(sys_config_t *config, char *arg)
+{
+    uint16_t khz;
+    uint8_t i;
+
+    if (!arg || !*arg)
+    {
+        /* Machine mode: just the rate for the current addr */
+        if (config->console_mode == CONSOLE_MACHINE)
+        {
+            cmd_reply_u32(NULL, i2c_get_khz(do_bus_get_speed(config, config->i2c_addr) * 100));
+            return true;
+        }
+
+        printf("\r\nI2C speeds:\r\n\r\n");
+
+        for (i = 0; i < I2C_SPEED_ENTRIES; i++)
+        {
+            if (config->i2c_speed[i].addr)
+                printf("\t%xh .............: %ukHz (actual %ukHz)\r\n", config->i2c_speed[i].addr,
+                        config->i2c_speed[i].speed * 100, i2c_get_khz(config->i2c_speed[i].speed * 100));
+        }
+
+        printf("\tdefault ..........: %ukHz (actual %ukHz)\r\n\r\n", I2C_SPEED_100K * 100, i2c_get_khz(I2C_SPEED_100K * 100));
+        return true;
+    }
+
+    if (parse_param(&khz, PARAM_U16, arg))
+        return false;
+
+    if (khz != 100 && khz != 400 && khz != 1000)
+    {
+        printf("Error: invalid speed\r\n");
+        return false;
+    }
 
-    if (reg == MCP47FEBXX_VOLATILE_DAC1)
-        i2c_write16(config->i2c_addr, MCP47FEBXX_NONVOLATILE_DAC1 | MCP47FEBXX_CMD_WRITE, value);
-    
-    return true;
+    if (!do_bus_set_speed(config, config->i2c_addr, (uint8_t)(khz / 100)))
+        return false;
+
+    return do_bus_select(config);
 }
 
-static bool do_dac_write16(sys_config_t *config, uint8_t reg, uint16_t value)
+#ifdef _I2C_QUEUE_
+
+static void do_dac_job_done(i2c_job_t *job)
+{
+    /* ISR context. Lookup picks this up on the next access */
+    if (job->status == I2C_JOB_FAILED)
+        _g_shadow_stale = true;
+}
+
+static bool do_dac_queue_write16(sys_config_t *config, uint8_t reg, uint16_t value)
 {
-    return i2c_write16(config->i2c_addr, reg, value);
+    uint16_t cached;
+
+    if (shadow_lookup(config, reg, &cached) && cached == value)
+        return true;
+
+    /* Single descriptor. Let the previous write finish before reusing it */
+    if (i2c_job_pending(&_g_dac_job) && !i2c_queue_wait(&_g_dac_job))
+        return false;
+
+    if (!do_bus_select(config))
+        return false;
+
+    _g_dac_job_data[0] = (uint8_t)(value >> 8);
+    _g_dac_job_data[1] = (uint8_t)value;
+
+    _g_dac_job.addr = config->i2c_addr;
+    _g_dac_job.reg = reg;
+    _g_dac_job.data = _g_dac_job_data;
+    _g_dac_job.len = sizeof(_g_dac_job_data);
+    _g_dac_job.flags = I2C_JOB_WRITE;
+    _g_dac_job.callback = do_dac_job_done;
+
+    if (!i2c_queue_submit(&_g_dac_job))
+        return false;
+
+    /* Only what's on its way. A job that already failed leaves the cache alone */
+    if (_g_dac_job.status != I2C_JOB_FAILED)
+        shadow_store(config, reg, value);
+
+    return true;
 }
 
+#endif /* _I2C_QUEUE_ */
+
 static bool do_dac_set_slave_addr(sys_config_t *config, uint8_t addr)
 {
     uint16_t new_reg_value = addr;
     
+#ifdef _I2C_GANG_
+    if (i2c_gang_lanes())
+        return do_gang_set_slave_addr(config, addr);
+#endif /* _I2C_GANG_ */
+
+    shadow_invalidate();
+
+    if (!do_bus_select(config))
+        return false;
+
     PORTAbits.RA3 = 1; // HV ON
     
     __delay_ms(1);
@@ -293,14 +2225,16 @@ static bool do_dac_set_slave_addr(sys_config_t *config, uint8_t addr)
     
     PORTAbits.RA3 = 0; // HV OFF
     
-    __delay_ms(100);
+    if (!do_dac_wait_nv(config))
+        return false;
 
     if (!i2c_write16(config->i2c_addr, MCP47FEBXX_GAINCTRL_SLAVEADDR | MCP47FEBXX_CMD_WRITE, new_reg_value))
         return false;    
     
     config->i2c_addr = addr;
     
-    __delay_ms(100);
+    if (!do_dac_wait_nv(config))
+        return false;
     
     PORTAbits.RA3 = 1; // HV ON
     
@@ -314,32 +2248,357 @@ static bool do_dac_set_slave_addr(sys_config_t *config, uint8_t addr)
     
     PORTAbits.RA3 = 0; // HV OFF
     
+    return do_dac_wait_nv(config);
+}
+
+#ifdef _I2C_GANG_
+
+static bool do_gang(sys_config_t *config, const char *arg)
+{
+    uint8_t lanes;
+
+    if (!arg || !*arg)
+    {
+        if (config->console_mode == CONSOLE_MACHINE)
+            cmd_reply_hex(NULL, i2c_gang_lanes());
+        else
+            printf("\r\nGang lanes: %02xh\r\n\r\n", i2c_gang_lanes());
+        return true;
+    }
+
+    if (!stricmp(arg, "off"))
+        lanes = 0;
+    else
+        lanes = (uint8_t)strtol(arg, NULL, 16);
+
+#ifdef _USART2_
+    if (usart2_is_open() && (lanes & UART2_GANG_LANES))
+    {
+        printf("Error: lanes 6/7 are the data channel\r\n");
+        return false;
+    }
+#endif /* _USART2_ */
+
+    i2c_gang_init(lanes);
+    shadow_invalidate();
     return true;
 }
 
-static bool do_dump(sys_config_t *config)
+static bool do_gang_report(uint8_t ok)
+{
+    uint8_t lanes = i2c_gang_lanes();
+
+    printf("Lanes OK: %02xh FAILED: %02xh\r\n", ok & lanes, ~ok & lanes);
+    return (ok & lanes) == lanes;
+}
+
+/* Waits for EEWA to clear on every lane in ok. Returns the lanes that finished */
+static uint8_t do_gang_wait_nv(sys_config_t *config, uint8_t ok)
+{
+    uint16_t status[I2C_GANG_LANES];
+    i2c_deadline_t deadline;
+    bool last;
+    uint8_t idle = 0;
+    uint8_t acked;
+    uint8_t lane;
+
+    i2c_deadline_start(&deadline, MCP47FEBXX_NV_TIMEOUT_MS);
+
+    do {
+        /* Sample once more after the deadline, it may pass during the delay */
+        last = i2c_deadline_passed(&deadline);
+        acked = i2c_gang_read16(config->i2c_addr, MCP47FEBXX_GAIN_STATUS | MCP47FEBXX_CMD_READ, status);
+
+        for (lane = 0; lane < I2C_GANG_LANES; lane++)
+        {
+            if ((acked & (1 << lane)) && !(status[lane] & MCP47FEBXX_STATUS_EEWA))
+                idle |= (1 << lane);
+        }
+
+        if ((idle & ok) == ok)
+            break;
+
+        __delay_us(100);
+    } while (!last);
+
+    return idle & ok;
+}
+
+static bool do_gang_write16(sys_config_t *config, uint8_t reg, uint16_t value)
+{
+    uint8_t ok = i2c_gang_write16(config->i2c_addr, reg, value);
+
+    if (MCP47FEBXX_IS_NONVOLATILE(reg))
+        ok = do_gang_wait_nv(config, ok);
+
+    return do_gang_report(ok);
+}
+
+/* Reads reg from every lane. False, with a report, unless all of them answered */
+static bool do_gang_read16(sys_config_t *config, uint8_t reg, uint16_t *values)
+{
+    uint8_t ok = i2c_gang_read16(config->i2c_addr, reg, values);
+
+    if ((ok & i2c_gang_lanes()) == i2c_gang_lanes())
+        return true;
+
+    return do_gang_report(ok);
+}
+
+/*
+ * Moves every lane by delta from its own base code, clamped per lane, in
+ * one transaction. Quiet, returns the lanes that took it.
+ */
+static uint8_t do_gang_write_delta(sys_config_t *config, uint8_t reg, const uint16_t *base, int16_t delta)
+{
+    uint16_t values[I2C_GANG_LANES];
+    uint8_t lane;
+    uint8_t ok;
+
+    for (lane = 0; lane < I2C_GANG_LANES; lane++)
+        values[lane] = do_interactive_apply(base[lane], delta);
+
+    ok = i2c_gang_write16_lanes(config->i2c_addr, reg, values);
+
+    if (MCP47FEBXX_IS_NONVOLATILE(reg))
+        ok = do_gang_wait_nv(config, ok);
+
+    return ok;
+}
+
+/* set/nvset on every lane. NV goes one register at a time, see do_dac_write_pair() */
+static bool do_gang_write_pair(sys_config_t *config, bool nv, uint16_t offset, uint16_t gain)
+{
+    uint8_t ok;
+
+    ok = i2c_gang_write16(config->i2c_addr, (nv ? MCP47FEBXX_NONVOLATILE_DAC0 : MCP47FEBXX_VOLATILE_DAC0)
+            | MCP47FEBXX_CMD_WRITE, offset);
+
+    if (nv)
+        ok = do_gang_wait_nv(config, ok);
+
+    ok &= i2c_gang_write16(config->i2c_addr, (nv ? MCP47FEBXX_NONVOLATILE_DAC1 : MCP47FEBXX_VOLATILE_DAC1)
+            | MCP47FEBXX_CMD_WRITE, gain);
+
+    if (nv)
+        ok = do_gang_wait_nv(config, ok);
+
+    return do_gang_report(ok);
+}
+
+/* One code per active lane, lowest lane first, all in one transaction */
+static bool do_gang_set(sys_config_t *config, char *arg)
 {
-    uint16_t dac0;
-    uint16_t dac1;
-    uint16_t dac0_nv;
-    uint16_t dac1_nv;
-    uint16_t sladdr;
+    uint16_t values[I2C_GANG_LANES];
+    uint8_t lanes = i2c_gang_lanes();
+    uint8_t reg;
+    uint8_t lane;
+    uint8_t ok;
+    char *which = strtok(arg, " ");
+
+    if (!lanes)
+    {
+        printf("Error: gang mode is off\r\n");
+        return false;
+    }
+
+    if (!which)
+        reg = 0xFF;
+    else if (!stricmp(which, "offset"))
+        reg = MCP47FEBXX_VOLATILE_DAC0;
+    else if (!stricmp(which, "gain"))
+        reg = MCP47FEBXX_VOLATILE_DAC1;
+    else if (!stricmp(which, "nvoffset"))
+        reg = MCP47FEBXX_NONVOLATILE_DAC0;
+    else if (!stricmp(which, "nvgain"))
+        reg = MCP47FEBXX_NONVOLATILE_DAC1;
+    else
+        reg = 0xFF;
 
-    if (!i2c_read16(config->i2c_addr, MCP47FEBXX_VOLATILE_DAC0 | MCP47FEBXX_CMD_READ, &dac0))
+    if (reg == 0xFF)
+    {
+        printf("Error: invalid argument\r\n");
         return false;
+    }
+
+    for (lane = 0; lane < I2C_GANG_LANES; lane++)
+    {
+        values[lane] = 0;
+
+        if (!(lanes & (1 << lane)))
+            continue;
 
-    if (!i2c_read16(config->i2c_addr, MCP47FEBXX_VOLATILE_DAC1 | MCP47FEBXX_CMD_READ, &dac1))
+        if (parse_param(&values[lane], PARAM_U16, strtok(NULL, " ")))
+            return false;
+
+        if (values[lane] > MCP47FEBXX_MAX_CODE)
+        {
+            printf("Error: out of range\r\n");
+            return false;
+        }
+    }
+
+    if (strtok(NULL, " "))
+    {
+        printf("Error: more codes than lanes\r\n");
         return false;
-    
-    if (!i2c_read16(config->i2c_addr, MCP47FEBXX_NONVOLATILE_DAC0 | MCP47FEBXX_CMD_READ, &dac0_nv))
+    }
+
+    ok = i2c_gang_write16_lanes(config->i2c_addr, reg | MCP47FEBXX_CMD_WRITE, values);
+
+    if (MCP47FEBXX_IS_NONVOLATILE(reg))
+        ok = do_gang_wait_nv(config, ok);
+
+    return do_gang_report(ok);
+}
+
+static bool do_gang_set_slave_addr(sys_config_t *config, uint8_t addr)
+{
+    uint8_t ok;
+
+    PORTAbits.RA3 = 1; // HV ON
+
+    __delay_ms(1);
+
+    ok = i2c_gang_write_byte(config->i2c_addr, MCP47FEBXX_GAINCTRL_SLAVEADDR | MCP47FEBXX_CMD_DISABLE_CFG_BIT);
+
+    __delay_ms(1);
+
+    PORTAbits.RA3 = 0; // HV OFF
+
+    ok = do_gang_wait_nv(config, ok);
+    ok &= i2c_gang_write16(config->i2c_addr, MCP47FEBXX_GAINCTRL_SLAVEADDR | MCP47FEBXX_CMD_WRITE, addr);
+
+    config->i2c_addr = addr;
+
+    ok = do_gang_wait_nv(config, ok);
+
+    PORTAbits.RA3 = 1; // HV ON
+
+    __delay_ms(1);
+
+    ok &= i2c_gang_write(config->i2c_addr, MCP47FEBXX_GAINCTRL_SLAVEADDR | MCP47FEBXX_CMD_ENABLE_CFG_BIT,
+            MCP47FEBXX_GAINCTRL_SLAVEADDR | MCP47FEBXX_CMD_ENABLE_CFG_BIT);
+
+    __delay_ms(1);
+
+    PORTAbits.RA3 = 0; // HV OFF
+
+    ok = do_gang_wait_nv(config, ok);
+
+    return do_gang_report(ok);
+}
+
+static bool do_gang_dump(sys_config_t *config, bool all)
+{
+    uint16_t regs[DUMP_ALL_REGS][I2C_GANG_LANES];
+    uint8_t lanes = i2c_gang_lanes();
+    uint8_t ok = lanes;
+    uint8_t lane;
+    uint8_t i;
+
+    for (i = 0; i < (all ? DUMP_ALL_REGS : DUMP_BASIC_REGS); i++)
+        ok &= i2c_gang_read16(config->i2c_addr, _g_dump_regs[i], regs[i]);
+
+    printf(
+            "\r\nCurrent registers:\r\n\r\n"
+            "\tLane  V DAC0  NV DAC0  V DAC1  NV DAC1  Gainctrl\r\n"
+        );
+
+    for (lane = 0; lane < I2C_GANG_LANES; lane++)
+    {
+        if (!(lanes & (1 << lane)))
+            continue;
+
+        if (ok & (1 << lane))
+            printf("\t%-4u  %-6u  %-7u  %-6u  %-7u  %x\r\n", lane,
+                    regs[DUMP_DAC0][lane], regs[DUMP_DAC0_NV][lane],
+                    regs[DUMP_DAC1][lane], regs[DUMP_DAC1_NV][lane],
+                    regs[DUMP_SLADDR][lane]);
+        else
+            printf("\t%-4u  --\r\n", lane);
+    }
+
+    if (all)
+    {
+        printf("\r\n\tLane  V VREF  NV VREF  V PD  NV PD  Status\r\n");
+
+        for (lane = 0; lane < I2C_GANG_LANES; lane++)
+        {
+            if ((lanes & ok) & (1 << lane))
+                printf("\t%-4u  %-6x  %-7x  %-4x  %-5x  %x\r\n", lane,
+                        regs[DUMP_VREF][lane], regs[DUMP_VREF_NV][lane],
+                        regs[DUMP_PD][lane], regs[DUMP_PD_NV][lane],
+                        regs[DUMP_STATUS][lane]);
+        }
+    }
+
+    printf("\r\n");
+
+    return do_gang_report(ok);
+}
+
+#endif /* _I2C_GANG_ */
+
+static bool do_dac_read_map(sys_config_t *config, const uint8_t *regs, uint16_t *values, uint8_t count)
+{
+    uint8_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!shadow_lookup(config, regs[i], &values[i]))
+            break;
+    }
+
+    if (i == count)
+        return true;
+
+    if (!do_bus_select(config))
         return false;
 
-    if (!i2c_read16(config->i2c_addr, MCP47FEBXX_NONVOLATILE_DAC1 | MCP47FEBXX_CMD_READ, &dac1_nv))
+    if (!do_bus_check(config, i2c_read16_many(config->i2c_addr, regs, values, count)))
         return false;
-    
-    if (!i2c_read16(config->i2c_addr, MCP47FEBXX_GAINCTRL_SLAVEADDR | MCP47FEBXX_CMD_READ, &sladdr))
+
+    for (i = 0; i < count; i++)
+        shadow_store(config, regs[i], values[i]);
+
+    return true;
+}
+
+static bool do_dump(sys_config_t *config, const char *arg)
+{
+    uint16_t regs[DUMP_ALL_REGS];
+    uint8_t i;
+    bool all = false;
+
+    if (arg && *arg)
+    {
+        if (stricmp(arg, "all"))
+        {
+            printf("Error: invalid argument\r\n");
+            return false;
+        }
+
+        all = true;
+    }
+
+#ifdef _I2C_GANG_
+    if (i2c_gang_lanes())
+        return do_gang_dump(config, all);
+#endif /* _I2C_GANG_ */
+
+    /* Whole map in one bus transaction */
+    if (!do_dac_read_map(config, _g_dump_regs, regs, all ? DUMP_ALL_REGS : DUMP_BASIC_REGS))
         return false;
 
+    /* Register values in _g_dump_regs order */
+    if (config->console_mode == CONSOLE_MACHINE)
+    {
+        for (i = 0; i < (all ? DUMP_ALL_REGS : DUMP_BASIC_REGS); i++)
+            cmd_reply_hex(NULL, regs[i]);
+        return true;
+    }
+
     printf(
             "\r\nCurrent registers:\r\n\r\n"
             "\tV  DAC0 (offset) ......: %d\r\n"
@@ -347,18 +2606,213 @@ static bool do_dump(sys_config_t *config)
             "\tV  DAC1 (gain) ........: %d\r\n"
             "\tNV DAC1 (gain) ........: %d\r\n"
             "\tGainctrl / Slave reg ..: %x\r\n"
-          , dac0, dac0_nv, dac1, dac1_nv, sladdr
+          , regs[DUMP_DAC0], regs[DUMP_DAC0_NV], regs[DUMP_DAC1], regs[DUMP_DAC1_NV], regs[DUMP_SLADDR]
         );
 
+    if (all)
+    {
+        printf(
+                "\tV  VREF ..............: %x\r\n"
+                "\tNV VREF ..............: %x\r\n"
+                "\tV  Power-down ........: %x\r\n"
+                "\tNV Power-down ........: %x\r\n"
+                "\tGain / Status ........: %x (POR: %d, EEWA: %d)\r\n"
+              , regs[DUMP_VREF], regs[DUMP_VREF_NV], regs[DUMP_PD], regs[DUMP_PD_NV]
+              , regs[DUMP_STATUS]
+              , (regs[DUMP_STATUS] & MCP47FEBXX_STATUS_POR) ? 1 : 0
+              , (regs[DUMP_STATUS] & MCP47FEBXX_STATUS_EEWA) ? 1 : 0
+            );
+    }
+
     printf("\r\n");
 
     return true;
 }
 
+#ifdef _BINARY_PROTO_
+
+/*
+ * Runs one request. Arguments are read from the payload before the
+ * reply data is written over it, starting at payload[1]. Sets len to
+ * the reply length including the status byte.
+ */
+static uint8_t do_binary_op(sys_config_t *config, proto_frame_t *frame, uint8_t port)
+{
+    uint8_t *p = frame->payload;
+    uint16_t regs[DUMP_ALL_REGS];
+    uint16_t value;
+    uint8_t count;
+    uint8_t i;
+
+    switch (frame->op)
+    {
+        case PROTO_OP_INFO:
+            if (frame->len)
+                return PROTO_ERR_LENGTH;
+            p[1] = PROTO_VERSION;
+            p[2] = proto_rx_size(port);
+            p[3] = PROTO_MAX_PAYLOAD;
+            frame->len = 4;
+            return PROTO_OK;
+
+        case PROTO_OP_READ:
+            if (frame->len != 1)
+                return PROTO_ERR_LENGTH;
+            if (p[0] > 0x1F)
+                return PROTO_ERR_RANGE;
+#ifdef _I2C_GANG_
+            /* One value per reply, ganged lanes have one each: dump in text instead */
+            if (i2c_gang_lanes())
+                return PROTO_ERR_FAILED;
+#endif /* _I2C_GANG_ */
+            if (!do_dac_read16(config, (p[0] << 3) | MCP47FEBXX_CMD_READ, &value))
+                return PROTO_ERR_FAILED;
+            p[1] = (uint8_t)(value >> 8);
+            p[2] = (uint8_t)value;
+            frame->len = 3;
+            return PROTO_OK;
+
+        case PROTO_OP_WRITE:
+            if (frame->len != 3)
+                return PROTO_ERR_LENGTH;
+            if (p[0] > 0x1F)
+                return PROTO_ERR_RANGE;
+            value = ((uint16_t)p[1] << 8) | p[2];
+            if (!do_dac_write16(config, (p[0] << 3) | MCP47FEBXX_CMD_WRITE, value))
+                return PROTO_ERR_FAILED;
+            break;
+
+        case PROTO_OP_SET:
+            if (frame->len != 5)
+                return PROTO_ERR_LENGTH;
+            if (!do_dac_write_pair(config, p[0] ? true : false,
+                    ((uint16_t)p[1] << 8) | p[2], ((uint16_t)p[3] << 8) | p[4]))
+                return PROTO_ERR_FAILED;
+            break;
+
+        case PROTO_OP_ADDR:
+            if (frame->len != 1 && frame->len != 3)
+                return PROTO_ERR_LENGTH;
+            if (frame->len == 1)
+            {
+                p[2] = p[0];
+                p[0] = 0;
+                p[1] = 0;
+            }
+            if (p[0] > 0x7F || p[1] >= TCA9548_CHANNELS || p[2] > 0x7F)
+                return PROTO_ERR_RANGE;
+            shadow_invalidate();
+            config->mux_addr = p[0];
+            config->mux_channel = p[1];
+            config->i2c_addr = p[2];
+            break;
+
+        case PROTO_OP_PGMADDR:
+            if (frame->len != 1)
+                return PROTO_ERR_LENGTH;
+            if (p[0] > 0x7F)
+                return PROTO_ERR_RANGE;
+            if (!do_dac_set_slave_addr(config, p[0]))
+                return PROTO_ERR_FAILED;
+            break;
+
+        case PROTO_OP_DUMP:
+            if (frame->len > 1)
+                return PROTO_ERR_LENGTH;
+            count = (frame->len && p[0]) ? DUMP_ALL_REGS : DUMP_BASIC_REGS;
+#ifdef _I2C_GANG_
+            if (i2c_gang_lanes())
+                return PROTO_ERR_FAILED;
+#endif /* _I2C_GANG_ */
+            if (!do_dac_read_map(config, _g_dump_regs, regs, count))
+                return PROTO_ERR_FAILED;
+            for (i = 0; i < count; i++)
+            {
+                p[1 + (i << 1)] = (uint8_t)(regs[i] >> 8);
+                p[2 + (i << 1)] = (uint8_t)regs[i];
+            }
+            frame->len = 1 + (count << 1);
+            return PROTO_OK;
+
+        case PROTO_OP_IDENT:
+            if (frame->len)
+                return PROTO_ERR_LENGTH;
+            memset(&p[1], 0, MAX_DESC);
+            strncpy((char *)&p[1], config->desc, MAX_DESC - 1);
+            frame->len = 1 + MAX_DESC;
+            return PROTO_OK;
+
+        case PROTO_OP_SAVE:
+            save_configuration(config);
+            break;
+
+        case PROTO_OP_DEFAULT:
+            default_configuration(config);
+            break;
+
+        case PROTO_OP_EXIT:
+            break;
+
+        default:
+            return PROTO_ERR_OPCODE;
+    }
+
+    frame->len = 1;
+    return PROTO_OK;
+}
+
+/* Receives and answers one frame. True once an exit has been answered */
+static bool do_binary_frame(sys_config_t *config, uint8_t port)
+{
+    proto_frame_t frame;
+    uint8_t status;
+
+    switch (proto_recv(port, &frame))
+    {
+        case PROTO_RX_DROP:
+            return false;
+
+        case PROTO_RX_CRC:
+            status = PROTO_ERR_CRC;
+            break;
+
+        default:
+            status = do_binary_op(config, &frame, port);
+            break;
+    }
+
+    if (status != PROTO_OK)
+        frame.len = 1;
+
+    frame.payload[0] = status;
+    proto_send(port, &frame);
+
+    return status == PROTO_OK && frame.op == PROTO_OP_EXIT;
+}
+
+static void do_binary(sys_config_t *config)
+{
+    console_mute(true);
+
+    while (!do_binary_frame(config, PROTO_PORT_CONSOLE));
+
+    console_mute(false);
+}
+
+#endif /* _BINARY_PROTO_ */
+
 static void default_configuration(sys_config_t *config)
 {
     config->magic = CONFIG_MAGIC;
     config->i2c_addr = MCP47FEBXX_A0_SLAVE_ADDR;
+    memset(config->i2c_speed, 0, sizeof(config->i2c_speed));
+    config->uart_baud = UART_BAUD;
+    config->uart_autobaud = 0;
+    memset(config->desc, 0, sizeof(config->desc));
+    config->console_mode = CONSOLE_HUMAN;
+    config->data_baud = 0;
+    config->mux_addr = 0;
+    config->mux_channel = 0;
 }
 
 static uint8_t parse_param(void *param, uint8_t type, char *arg)
@@ -399,8 +2853,17 @@ static uint8_t parse_param(void *param, uint8_t type, char *arg)
     return 0;
 }
 
+static void cmd_echo(char c)
+{
+    if (!_g_echo_off)
+        putch(c);
+}
+
 static void cmd_erase_line(uint8_t count)
 {
+    if (_g_echo_off)
+        return;
+
     printf("%c[%dD%c[K", SEQ_ESCAPE_CHAR, count, SEQ_ESCAPE_CHAR);
 }
 
@@ -452,6 +2915,9 @@ static int get_string(char *str, int8_t max, uint8_t *ignore_lf)
     unsigned char c;
     uint8_t state = CMD_READLINE;
     int8_t count;
+#ifdef _BINARY_PROTO_
+    uint8_t magic = 0;
+#endif /* _BINARY_PROTO_ */
 
     count = 0;
     do {
@@ -494,9 +2960,9 @@ static int get_string(char *str, int8_t max, uint8_t *ignore_lf)
         }
         else if (state == CMD_DEL) {
             if (c == SEQ_NAV_END && count) {
-                putch('\b');
-                putch(' ');
-                putch('\b');
+                cmd_echo('\b');
+                cmd_echo(' ');
+                cmd_echo('\b');
                 count--;
             }
 
@@ -514,6 +2980,17 @@ static int get_string(char *str, int8_t max, uint8_t *ignore_lf)
                 break;
             }
 
+#ifdef _BINARY_PROTO_
+            /* Host automation switching to framed mode */
+            if (c == PROTO_MAGIC && !count) {
+                if (++magic == PROTO_MAGIC_COUNT)
+                    return CMD_RET_BINARY;
+                continue;
+            }
+
+            magic = 0;
+#endif /* _BINARY_PROTO_ */
+
             if (c == 19) /* Swallow XOFF */
                 continue;
 
@@ -547,14 +3024,14 @@ static int get_string(char *str, int8_t max, uint8_t *ignore_lf)
                 if (!count)
                     continue;
 
-                putch('\b');
-                putch(' ');
-                putch('\b');
+                cmd_echo('\b');
+                cmd_echo(' ');
+                cmd_echo('\b');
                 count--;
                 continue;
             }
             if (c != '\n' && c != '\r') {
-                putch(c);
+                cmd_echo(c);
             }
             else {
                 if (c == '\r') {
@@ -585,6 +3062,10 @@ static int8_t get_line(char *str, int8_t max, uint8_t *ignore_lf)
     if (ret <= 0) {
         return ret;
     }
+
+    /* Machine mode: no history and no line end to follow the (absent) echo */
+    if (_g_echo_off)
+        return ret;
     
     if (_g_next_history >= CMD_MAX_HISTORY)
         _g_next_history = 0;
@@ -11,12 +11,33 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#define I2C_SPEED_100K      1
+#define I2C_SPEED_400K      4
+#define I2C_SPEED_1M        10
+
+#define CONSOLE_HUMAN       0
+#define CONSOLE_MACHINE     1   /* No echo or prompt, one OK/ERR line per command */
+
+typedef struct {
+    uint8_t addr;           /* 0 = unused entry */
+    uint8_t speed;          /* Bus rate in units of 100kHz */
+} i2c_speed_t;
+
 typedef struct {
     uint16_t magic;
     uint8_t i2c_addr;
+    i2c_speed_t i2c_speed[I2C_SPEED_ENTRIES];
+    uint32_t uart_baud;
+    uint8_t uart_autobaud;
+    char desc[MAX_DESC];    /* Station name, reported to the host */
+    uint8_t console_mode;
+    uint32_t data_baud;     /* USART2 data channel, 0 = off */
+    uint8_t mux_addr;       /* I2C switch in front of the target, 0 = none */
+    uint8_t mux_channel;
 } sys_config_t;
 
 void cmd_prompt(sys_config_t *config);
+void cmd_idle(void);
 void load_configuration(sys_config_t *config);
 
 #endif /* __CONFIG_H__ */
\ No newline at end of file
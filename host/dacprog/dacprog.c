@@ -0,0 +1,870 @@
+/*
+ * File:   dacprog.c
+ * Author: Matt
+ *
+ * One epoll loop over all the ports. Nothing blocks: writes go through
+ * a per port output buffer, replies are parsed as they trickle in and
+ * every request in flight carries its own deadline, the nearest of
+ * which bounds epoll_wait().
+ *
+ * Requests run in queue order. Text commands go one at a time (the CLI
+ * has no way to tag a reply); frames are sent back to back as long as
+ * everything in flight fits the firmware's receive buffer. So the
+ * requests in flight are always at the head of the queue.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dacprog.h"
+
+#define DACPROG_OUT_SIZE        1024
+#define DACPROG_MAX_EVENTS      64
+#define DACPROG_FRAME_OVERHEAD  6       /* SOF len seq op crc_hi crc_lo */
+
+#define CTL_U                   0x15
+
+typedef enum {
+    MODE_SYNC,                  /* Not known, resynchronise first */
+    MODE_SYNCING,               /* Waiting for "OK machine" */
+    MODE_TEXT,
+    MODE_FRAMED,
+} port_mode_t;
+
+typedef enum {
+    REQ_TEXT,
+    REQ_FRAME,
+} req_kind_t;
+
+typedef struct dacprog_req {
+    struct dacprog_req *next;
+    req_kind_t kind;
+    bool sent;
+    bool internal;              /* Our own EXIT, no callback */
+    uint8_t seq;
+    uint8_t op;
+    uint8_t payload[DACPROG_MAX_PAYLOAD];
+    uint8_t len;
+    uint8_t wire[DACPROG_MAX_LINE + 2];
+    size_t wire_len;
+    uint32_t timeout_ms;
+    uint64_t deadline;
+    dacprog_done_t done;
+    void *ctx;
+} dacprog_req_t;
+
+struct dacprog_port {
+    dacprog_t *prog;
+    dacprog_port_t *next;
+    char *path;
+    int fd;
+    bool dead;
+    bool want_out;
+
+    port_mode_t mode;
+    uint64_t sync_deadline;
+    uint8_t seq;
+    size_t in_flight;           /* Frame bytes the firmware may be holding */
+
+    dacprog_req_t *head;
+    dacprog_req_t *tail;
+
+    uint8_t out[DACPROG_OUT_SIZE];
+    size_t out_len;
+
+    char line[DACPROG_MAX_LINE];
+    size_t line_len;
+    bool line_long;
+
+    uint8_t rx[DACPROG_MAX_PAYLOAD + DACPROG_FRAME_OVERHEAD];
+    size_t rx_len;
+};
+
+struct dacprog {
+    int epfd;
+    dacprog_port_t *ports;
+    size_t pending;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* CRC-16/CCITT, poly 1021h, as the firmware */
+uint16_t dacprog_crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+    uint8_t i;
+
+    while (len--)
+    {
+        crc ^= (uint16_t)*data++ << 8;
+
+        for (i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
+
+const char *dacprog_status_name(dacprog_status_t status)
+{
+    switch (status)
+    {
+        case DACPROG_OK: return "OK";
+        case DACPROG_ERR: return "ERR";
+        case DACPROG_SKIP: return "SKIP";
+        case DACPROG_TIMEOUT: return "timeout";
+        case DACPROG_IO: return "I/O error";
+    }
+
+    return "?";
+}
+
+static size_t build_frame(uint8_t *wire, uint8_t seq, uint8_t op, const uint8_t *payload, uint8_t len)
+{
+    uint16_t crc;
+
+    wire[0] = DACPROG_SOF;
+    wire[1] = len;
+    wire[2] = seq;
+    wire[3] = op;
+
+    if (len)
+        memcpy(&wire[4], payload, len);
+
+    crc = dacprog_crc16(0xFFFF, &wire[1], len + 3);
+    wire[4 + len] = (uint8_t)(crc >> 8);
+    wire[5 + len] = (uint8_t)crc;
+
+    return len + DACPROG_FRAME_OVERHEAD;
+}
+
+/* Keys the CLI acts on: the EXIT frame sent on resync must be inert text */
+static bool benign(uint8_t c)
+{
+    return c != '\r' && c != '\n' && c != '\b' && c != 0x03 && c != 0x13
+            && c != CTL_U && c != 0x1B && c != DACPROG_MAGIC && c != 0x7F;
+}
+
+static size_t build_sync(uint8_t *wire)
+{
+    static const char tail[] = "mode machine\rmode\r";
+    size_t len = 0;
+    unsigned seq;
+    size_t i;
+
+    for (seq = 0; seq < 256; seq++)
+    {
+        len = build_frame(wire, (uint8_t)seq, DACPROG_OP_EXIT, NULL, 0);
+
+        for (i = 1; i < len && benign(wire[i]); i++);
+
+        if (i == len)
+            break;
+    }
+
+    wire[len++] = CTL_U;
+    memcpy(&wire[len], tail, sizeof(tail) - 1);
+
+    return len + sizeof(tail) - 1;
+}
+
+static void port_events(dacprog_port_t *port)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | (port->out_len ? EPOLLOUT : 0);
+    ev.data.ptr = port;
+
+    if (port->want_out != (port->out_len != 0))
+    {
+        port->want_out = (port->out_len != 0);
+        epoll_ctl(port->prog->epfd, EPOLL_CTL_MOD, port->fd, &ev);
+    }
+}
+
+/* Out of the loop for good: a hung up PTY would report HUP forever */
+static void port_kill(dacprog_port_t *port)
+{
+    if (port->dead)
+        return;
+
+    port->dead = true;
+    port->out_len = 0;
+    epoll_ctl(port->prog->epfd, EPOLL_CTL_DEL, port->fd, NULL);
+}
+
+static void port_flush(dacprog_port_t *port)
+{
+    ssize_t n;
+
+    while (port->out_len && !port->dead)
+    {
+        n = write(port->fd, port->out, port->out_len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                port_kill(port);
+            break;
+        }
+
+        memmove(port->out, port->out + n, port->out_len - n);
+        port->out_len -= n;
+    }
+
+    if (!port->dead)
+        port_events(port);
+}
+
+static bool port_write(dacprog_port_t *port, const uint8_t *data, size_t len)
+{
+    if (port->out_len + len > sizeof(port->out))
+        return false;
+
+    memcpy(port->out + port->out_len, data, len);
+    port->out_len += len;
+    return true;
+}
+
+static void req_unlink(dacprog_port_t *port, dacprog_req_t *req)
+{
+    dacprog_req_t **pp = &port->head;
+    dacprog_req_t *prev = NULL;
+
+    while (*pp != req)
+    {
+        prev = *pp;
+        pp = &(*pp)->next;
+    }
+
+    *pp = req->next;
+    if (port->tail == req)
+        port->tail = prev;
+
+    if (req->sent && req->kind == REQ_FRAME)
+        port->in_flight -= req->wire_len;
+
+    port->prog->pending--;
+}
+
+/* Unlinked before the callback, which may queue more on the same port */
+static void req_finish(dacprog_port_t *port, dacprog_req_t *req, dacprog_reply_t *reply)
+{
+    req_unlink(port, req);
+
+    if (req->done)
+        req->done(port, reply, req->ctx);
+
+    free(req);
+}
+
+static void req_fail(dacprog_port_t *port, dacprog_req_t *req, dacprog_status_t status)
+{
+    dacprog_reply_t reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.status = status;
+    req_finish(port, req, &reply);
+}
+
+/*
+ * Fails what's in flight, or everything, and forgets the port's state.
+ * Requests the callbacks queue meanwhile land behind and are kept.
+ */
+static void port_fail(dacprog_port_t *port, dacprog_status_t status, bool all)
+{
+    dacprog_req_t *req;
+    size_t count = 0;
+
+    port->mode = MODE_SYNC;
+    port->line_len = 0;
+    port->rx_len = 0;
+
+    for (req = port->head; req && (all || req->sent); req = req->next)
+        count++;
+
+    while (count--)
+        req_fail(port, port->head, status);
+}
+
+static dacprog_req_t *req_new(req_kind_t kind, uint32_t timeout_ms, dacprog_done_t done, void *ctx)
+{
+    dacprog_req_t *req = calloc(1, sizeof(*req));
+
+    if (!req)
+        return NULL;
+
+    req->kind = kind;
+    req->timeout_ms = timeout_ms ? timeout_ms : DACPROG_TIMEOUT_MS;
+    req->done = done;
+    req->ctx = ctx;
+
+    return req;
+}
+
+static void req_append(dacprog_port_t *port, dacprog_req_t *req)
+{
+    if (port->tail)
+        port->tail->next = req;
+    else
+        port->head = req;
+
+    port->tail = req;
+    port->prog->pending++;
+}
+
+static void req_insert_before(dacprog_port_t *port, dacprog_req_t *at, dacprog_req_t *req)
+{
+    dacprog_req_t **pp = &port->head;
+
+    while (*pp != at)
+        pp = &(*pp)->next;
+
+    req->next = at;
+    *pp = req;
+    port->prog->pending++;
+}
+
+static void port_sync(dacprog_port_t *port, uint64_t now)
+{
+    uint8_t wire[64];
+    size_t len = build_sync(wire);
+
+    port->out_len = 0;
+    port->line_len = 0;
+    port->rx_len = 0;
+
+    port_write(port, wire, len);
+    port->mode = MODE_SYNCING;
+    port->sync_deadline = now + port->head->timeout_ms;
+}
+
+static void send_frame(dacprog_port_t *port, dacprog_req_t *req, uint64_t now)
+{
+    req->seq = port->seq++;
+    req->wire_len = build_frame(req->wire, req->seq, req->op, req->payload, req->len);
+
+    port_write(port, req->wire, req->wire_len);
+    port->in_flight += req->wire_len;
+    req->sent = true;
+    req->deadline = now + req->timeout_ms;
+}
+
+/* Sends whatever the queue and the mode allow */
+static void port_pump(dacprog_port_t *port, uint64_t now)
+{
+    static const uint8_t magic[2] = { DACPROG_MAGIC, DACPROG_MAGIC };
+    dacprog_req_t *req;
+    dacprog_req_t *exit_req;
+
+    if (!port->dead && port->head && port->mode == MODE_SYNC)
+        port_sync(port, now);
+
+    if (port->dead || !port->head || port->mode == MODE_SYNCING)
+        goto flush;
+
+    for (req = port->head; req && req->sent; req = req->next);
+
+    while (req)
+    {
+        if (req->kind == REQ_TEXT)
+        {
+            if (req != port->head)
+                break;
+
+            if (port->mode == MODE_FRAMED)
+            {
+                exit_req = req_new(REQ_FRAME, req->timeout_ms, NULL, NULL);
+                if (!exit_req)
+                    break;
+
+                exit_req->internal = true;
+                exit_req->op = DACPROG_OP_EXIT;
+                req_insert_before(port, req, exit_req);
+                send_frame(port, exit_req, now);
+                break;
+            }
+
+            port_write(port, req->wire, req->wire_len);
+            req->sent = true;
+            req->deadline = now + req->timeout_ms;
+            break;
+        }
+
+        if (port->mode == MODE_TEXT)
+        {
+            if (req != port->head)
+                break;
+
+            port_write(port, magic, sizeof(magic));
+            port->mode = MODE_FRAMED;
+        }
+
+        if (port->in_flight + req->len + DACPROG_FRAME_OVERHEAD > DACPROG_RX_BUF_SIZE)
+            break;
+
+        send_frame(port, req, now);
+        req = req->next;
+    }
+
+flush:
+    port_flush(port);
+
+    if (port->dead)
+        port_fail(port, DACPROG_IO, true);
+}
+
+static void on_line(dacprog_port_t *port, const char *line)
+{
+    dacprog_reply_t reply;
+    dacprog_req_t *req = port->head;
+
+    if (port->mode == MODE_SYNCING)
+    {
+        if (!strcmp(line, "OK machine"))
+            port->mode = MODE_TEXT;
+        return;
+    }
+
+    /* Unsolicited, or the tail of an EXIT reply */
+    if (port->mode != MODE_TEXT || !req || !req->sent || req->kind != REQ_TEXT)
+        return;
+
+    memset(&reply, 0, sizeof(reply));
+
+    if (!strcmp(line, "OK") || !strncmp(line, "OK ", 3))
+    {
+        reply.status = DACPROG_OK;
+        if (line[2])
+            strcpy(reply.text, line + 3);
+    }
+    else if (!strcmp(line, "ERR"))
+        reply.status = DACPROG_ERR;
+    else if (!strcmp(line, "SKIP"))
+        reply.status = DACPROG_SKIP;
+    else
+        return;
+
+    req_finish(port, req, &reply);
+}
+
+static void on_text(dacprog_port_t *port, uint8_t c)
+{
+    if (c == '\r' || c == '\n')
+    {
+        port->line[port->line_len] = 0;
+
+        if (port->line_len && !port->line_long)
+            on_line(port, port->line);
+
+        port->line_len = 0;
+        port->line_long = false;
+        return;
+    }
+
+    if (port->line_len < sizeof(port->line) - 1)
+        port->line[port->line_len++] = (char)c;
+    else
+        port->line_long = true;
+}
+
+static void on_frame(dacprog_port_t *port)
+{
+    dacprog_reply_t reply;
+    dacprog_req_t *req;
+    uint8_t len = port->rx[1];
+
+    for (req = port->head; req && req->sent; req = req->next)
+    {
+        if (req->kind == REQ_FRAME && req->seq == port->rx[2] && req->op == port->rx[3])
+            break;
+    }
+
+    if (!req || !req->sent || !len)
+        return;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.proto_status = port->rx[4];
+    reply.status = reply.proto_status ? DACPROG_ERR : DACPROG_OK;
+    reply.len = len - 1;
+    memcpy(reply.data, &port->rx[5], reply.len);
+
+    if (req->internal && req->op == DACPROG_OP_EXIT)
+    {
+        if (reply.status == DACPROG_OK)
+            port->mode = MODE_TEXT;
+        else
+            port->mode = MODE_SYNC;
+    }
+
+    req_finish(port, req, &reply);
+}
+
+/* Bytes outside a frame are skipped, a bad CRC is left to time out */
+static void on_framed(dacprog_port_t *port, uint8_t c)
+{
+    uint16_t crc;
+    size_t need;
+
+    if (!port->rx_len && c != DACPROG_SOF)
+        return;
+
+    port->rx[port->rx_len++] = c;
+
+    if (port->rx_len >= 2 && port->rx[1] > DACPROG_MAX_PAYLOAD)
+    {
+        port->rx_len = 0;
+        return;
+    }
+
+    if (port->rx_len < 4)
+        return;
+
+    need = port->rx[1] + DACPROG_FRAME_OVERHEAD;
+    if (port->rx_len < need)
+        return;
+
+    port->rx_len = 0;
+    crc = dacprog_crc16(0xFFFF, &port->rx[1], port->rx[1] + 3);
+
+    if (crc == (((uint16_t)port->rx[need - 2] << 8) | port->rx[need - 1]))
+        on_frame(port);
+}
+
+static void port_read(dacprog_port_t *port)
+{
+    uint8_t buf[256];
+    ssize_t n;
+    ssize_t i;
+
+    for (;;)
+    {
+        n = read(port->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0)
+        {
+            port_kill(port);
+            return;
+        }
+
+        /* The mode can change part way through, after an EXIT reply */
+        for (i = 0; i < n && !port->dead; i++)
+        {
+            if (port->mode == MODE_FRAMED)
+                on_framed(port, buf[i]);
+            else
+                on_text(port, buf[i]);
+        }
+    }
+}
+
+static void port_timeouts(dacprog_port_t *port, uint64_t now)
+{
+    dacprog_req_t *req;
+
+    if (port->mode == MODE_SYNCING && now >= port->sync_deadline)
+    {
+        port_fail(port, DACPROG_TIMEOUT, true);
+        return;
+    }
+
+    for (req = port->head; req && req->sent; req = req->next)
+    {
+        if (now >= req->deadline)
+        {
+            port_fail(port, DACPROG_TIMEOUT, false);
+            return;
+        }
+    }
+}
+
+static uint64_t port_deadline(const dacprog_port_t *port)
+{
+    const dacprog_req_t *req;
+    uint64_t deadline = UINT64_MAX;
+
+    if (port->mode == MODE_SYNCING)
+        return port->sync_deadline;
+
+    for (req = port->head; req && req->sent; req = req->next)
+    {
+        if (req->deadline < deadline)
+            deadline = req->deadline;
+    }
+
+    return deadline;
+}
+
+static bool set_line(int fd, uint32_t baud)
+{
+    static const struct { uint32_t baud; speed_t speed; } rates[] = {
+        { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+        { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+        { 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 },
+    };
+    struct termios tio;
+    size_t i;
+
+    if (tcgetattr(fd, &tio))
+        return !baud;
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+
+    if (baud)
+    {
+        for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+        {
+            if (rates[i].baud == baud)
+                break;
+        }
+
+        if (i == sizeof(rates) / sizeof(rates[0]))
+            return false;
+
+        cfsetispeed(&tio, rates[i].speed);
+        cfsetospeed(&tio, rates[i].speed);
+    }
+
+    return !tcsetattr(fd, TCSANOW, &tio);
+}
+
+dacprog_t *dacprog_new(void)
+{
+    dacprog_t *prog = calloc(1, sizeof(*prog));
+
+    if (!prog)
+        return NULL;
+
+    prog->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (prog->epfd < 0)
+    {
+        free(prog);
+        return NULL;
+    }
+
+    return prog;
+}
+
+void dacprog_free(dacprog_t *prog)
+{
+    while (prog->ports)
+        dacprog_close(prog->ports);
+
+    close(prog->epfd);
+    free(prog);
+}
+
+dacprog_port_t *dacprog_open(dacprog_t *prog, const char *path, uint32_t baud)
+{
+    struct epoll_event ev;
+    dacprog_port_t *port = calloc(1, sizeof(*port));
+
+    if (!port)
+        return NULL;
+
+    port->prog = prog;
+    port->mode = MODE_SYNC;
+    port->path = strdup(path);
+    port->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+    if (!port->path || port->fd < 0 || !set_line(port->fd, baud))
+        goto fail;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = port;
+    if (epoll_ctl(prog->epfd, EPOLL_CTL_ADD, port->fd, &ev))
+        goto fail;
+
+    port->next = prog->ports;
+    prog->ports = port;
+    return port;
+
+fail:
+    if (port->fd >= 0)
+        close(port->fd);
+    free(port->path);
+    free(port);
+    return NULL;
+}
+
+/* Queued requests are dropped without their callbacks */
+void dacprog_close(dacprog_port_t *port)
+{
+    dacprog_port_t **pp = &port->prog->ports;
+    dacprog_req_t *req;
+
+    while (*pp != port)
+        pp = &(*pp)->next;
+    *pp = port->next;
+
+    while ((req = port->head))
+    {
+        port->head = req->next;
+        port->prog->pending--;
+        free(req);
+    }
+
+    if (!port->dead)
+        epoll_ctl(port->prog->epfd, EPOLL_CTL_DEL, port->fd, NULL);
+    close(port->fd);
+    free(port->path);
+    free(port);
+}
+
+const char *dacprog_path(const dacprog_port_t *port)
+{
+    return port->path;
+}
+
+/* One command per line: a ';' list would answer more than once */
+bool dacprog_command(dacprog_port_t *port, const char *line, uint32_t timeout_ms,
+        dacprog_done_t done, void *ctx)
+{
+    size_t len = strlen(line);
+    dacprog_req_t *req;
+
+    if (!len || len >= DACPROG_MAX_LINE || strpbrk(line, "\r\n;") || line[0] == DACPROG_MAGIC)
+        return false;
+
+    req = req_new(REQ_TEXT, timeout_ms, done, ctx);
+    if (!req)
+        return false;
+
+    memcpy(req->wire, line, len);
+    req->wire[len] = '\r';
+    req->wire_len = len + 1;
+
+    req_append(port, req);
+    return true;
+}
+
+bool dacprog_frame(dacprog_port_t *port, uint8_t op, const uint8_t *payload, uint8_t len,
+        uint32_t timeout_ms, dacprog_done_t done, void *ctx)
+{
+    dacprog_req_t *req;
+
+    if (len > DACPROG_MAX_PAYLOAD)
+        return false;
+
+    req = req_new(REQ_FRAME, timeout_ms, done, ctx);
+    if (!req)
+        return false;
+
+    req->op = op;
+    req->len = len;
+    if (len)
+        memcpy(req->payload, payload, len);
+
+    req_append(port, req);
+    return true;
+}
+
+size_t dacprog_pending(const dacprog_t *prog)
+{
+    return prog->pending;
+}
+
+bool dacprog_run(dacprog_t *prog, int timeout_ms)
+{
+    struct epoll_event events[DACPROG_MAX_EVENTS];
+    dacprog_port_t *port;
+    dacprog_port_t *next;
+    uint64_t end = timeout_ms < 0 ? UINT64_MAX : now_ms() + timeout_ms;
+    uint64_t deadline;
+    uint64_t now;
+    int wait;
+    int n;
+    int i;
+
+    for (;;)
+    {
+        now = now_ms();
+        deadline = end;
+
+        for (port = prog->ports; port; port = next)
+        {
+            next = port->next;
+            port_pump(port, now);
+
+            if (port_deadline(port) < deadline)
+                deadline = port_deadline(port);
+        }
+
+        if (!prog->pending)
+            return true;
+
+        if (now >= end)
+            return false;
+
+        wait = deadline == UINT64_MAX ? -1 : (int)(deadline > now ? deadline - now : 0);
+
+        n = epoll_wait(prog->epfd, events, DACPROG_MAX_EVENTS, wait);
+        if (n < 0 && errno != EINTR)
+            return false;
+
+        for (i = 0; i < n; i++)
+        {
+            port = events[i].data.ptr;
+
+            if (events[i].events & EPOLLOUT)
+                port_flush(port);
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                port_read(port);
+        }
+
+        now = now_ms();
+
+        for (port = prog->ports; port; port = port->next)
+            port_timeouts(port, now);
+    }
+}
+
+/* The five dump registers from a text or a frame reply */
+bool dacprog_parse_dump(const dacprog_reply_t *reply, uint16_t *regs)
+{
+    unsigned v[DACPROG_DUMP_REGS];
+    uint8_t i;
+
+    if (reply->status != DACPROG_OK)
+        return false;
+
+    if (reply->text[0])
+    {
+        if (sscanf(reply->text, "%x %x %x %x %x", &v[0], &v[1], &v[2], &v[3], &v[4]) != DACPROG_DUMP_REGS)
+            return false;
+
+        for (i = 0; i < DACPROG_DUMP_REGS; i++)
+            regs[i] = (uint16_t)v[i];
+
+        return true;
+    }
+
+    if (reply->len < DACPROG_DUMP_REGS * 2)
+        return false;
+
+    for (i = 0; i < DACPROG_DUMP_REGS; i++)
+        regs[i] = ((uint16_t)reply->data[i * 2] << 8) | reply->data[i * 2 + 1];
+
+    return true;
+}
@@ -0,0 +1,119 @@
+/*
+ * File:   dacprog.h
+ * Author: Matt
+ *
+ * Host side of the programmer's console, for driving many stations from
+ * one process. Every port is a serial device (USB adapter or PTY) on one
+ * epoll loop; requests are queued per port and finish through a
+ * callback, so a slow station never holds up the others.
+ *
+ * Two kinds of request share a port's queue, in order:
+ *
+ *  - text: one machine mode command line, "OK [data]" / "ERR" / "SKIP"
+ *  - frame: one binary protocol request (see proto.h), pipelined up to
+ *    the firmware's receive buffer and matched by seq
+ *
+ * The port switches between the CLI and framed mode as the queue needs.
+ * Opening a port (and any timeout) resynchronises it: a stray framed
+ * session is closed, the line is cleared and machine mode is set, so
+ * the station may have been left in any state.
+ *
+ * Plain C, like the firmware and the simulator it's tested against, so
+ * proto.h's frame layout and CRC carry over as they are. C++ callers
+ * include it as it is.
+ */
+
+#ifndef __DACPROG_H__
+#define __DACPROG_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The binary protocol, as in proto.h */
+#define DACPROG_SOF             0xA5
+#define DACPROG_MAGIC           0x16
+#define DACPROG_MAX_PAYLOAD     24
+#define DACPROG_RX_BUF_SIZE     64
+
+#define DACPROG_OP_INFO         0x00
+#define DACPROG_OP_READ         0x01
+#define DACPROG_OP_WRITE        0x02
+#define DACPROG_OP_SET          0x03
+#define DACPROG_OP_ADDR         0x04
+#define DACPROG_OP_PGMADDR      0x05
+#define DACPROG_OP_DUMP         0x06
+#define DACPROG_OP_SAVE         0x07
+#define DACPROG_OP_DEFAULT      0x08
+#define DACPROG_OP_IDENT        0x09
+#define DACPROG_OP_EXIT         0x0F
+
+/* dump order, both the text reply and the DUMP frame */
+#define DACPROG_DUMP_DAC0       0
+#define DACPROG_DUMP_DAC1       1
+#define DACPROG_DUMP_DAC0_NV    2
+#define DACPROG_DUMP_DAC1_NV    3
+#define DACPROG_DUMP_SLADDR     4
+#define DACPROG_DUMP_REGS       5
+
+#define DACPROG_MAX_LINE        128
+#define DACPROG_TIMEOUT_MS      2000
+
+typedef enum {
+    DACPROG_OK,
+    DACPROG_ERR,                /* ERR, or a frame status other than OK */
+    DACPROG_SKIP,
+    DACPROG_TIMEOUT,
+    DACPROG_IO,                 /* The port failed or was closed */
+} dacprog_status_t;
+
+typedef struct {
+    dacprog_status_t status;
+    char text[DACPROG_MAX_LINE];        /* Text: the data after "OK " */
+    uint8_t proto_status;               /* Frame: payload[0] */
+    uint8_t len;                        /* Frame: reply data after the status */
+    uint8_t data[DACPROG_MAX_PAYLOAD];
+} dacprog_reply_t;
+
+typedef struct dacprog dacprog_t;
+typedef struct dacprog_port dacprog_port_t;
+
+/* Called once per request (done may be NULL), also for timeouts and port failures */
+typedef void (*dacprog_done_t)(dacprog_port_t *port, const dacprog_reply_t *reply, void *ctx);
+
+dacprog_t *dacprog_new(void);
+void dacprog_free(dacprog_t *prog);
+
+/* baud 0 leaves the speed alone (PTYs). Not to be closed from a callback */
+dacprog_port_t *dacprog_open(dacprog_t *prog, const char *path, uint32_t baud);
+void dacprog_close(dacprog_port_t *port);
+const char *dacprog_path(const dacprog_port_t *port);
+
+bool dacprog_command(dacprog_port_t *port, const char *line, uint32_t timeout_ms,
+        dacprog_done_t done, void *ctx);
+bool dacprog_frame(dacprog_port_t *port, uint8_t op, const uint8_t *payload, uint8_t len,
+        uint32_t timeout_ms, dacprog_done_t done, void *ctx);
+
+/* Requests queued or in flight over all ports */
+size_t dacprog_pending(const dacprog_t *prog);
+
+/*
+ * Runs the loop until nothing is pending or timeout_ms passes (-1 for
+ * no limit). Callbacks may queue more requests. False on a timeout or
+ * if epoll itself fails.
+ */
+bool dacprog_run(dacprog_t *prog, int timeout_ms);
+
+const char *dacprog_status_name(dacprog_status_t status);
+uint16_t dacprog_crc16(uint16_t crc, const uint8_t *data, size_t len);
+bool dacprog_parse_dump(const dacprog_reply_t *reply, uint16_t *regs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DACPROG_H__ */
@@ -0,0 +1,422 @@
+/*
+ * File:   dacprov.c
+ * Author: Matt
+ *
+ * Batch provisioning from a CSV, all stations at once:
+ *
+ *   dacprov [-b baud] [-f addr] [-t] [-T ms] boards.csv
+ *
+ *   -b  line speed (9600)
+ *   -f  the address boards arrive with, hex (60)
+ *   -t  use the text CLI instead of binary frames
+ *   -T  timeout per request (2000)
+ *
+ * One board per row, "port,offset,gain,addr": the serial port of its
+ * station, the NV DAC0 / DAC1 codes and the address to program (hex).
+ * A header row, blank lines and '#' comments are skipped. Rows for the
+ * same port run in file order, one after the other; different ports run
+ * side by side.
+ *
+ * Each board is selected at the arrival address, gets its NV codes and
+ * is read back, then is moved to its address and read back again. One
+ * line per board is printed as it finishes. Exits non-zero if any
+ * board failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dacprog.h"
+
+#define DACPROV_MAX_LINE        256
+
+typedef enum {
+    STEP_ADDR,
+    STEP_SET,
+    STEP_CHECK,
+    STEP_PGMADDR,
+    STEP_VERIFY,
+    STEP_DONE,
+} step_t;
+
+static const char * const _g_step_names[] = { "addr", "nvset", "check", "pgmaddr", "verify" };
+
+typedef struct station station_t;
+
+typedef struct row {
+    struct row *next;           /* Same station, file order */
+    station_t *station;
+    unsigned line;
+    uint16_t offset;
+    uint16_t gain;
+    uint8_t addr;
+
+    step_t step;                /* Next reply expected */
+    uint8_t outstanding;
+    bool failed;
+    step_t failed_step;
+    const char *why;
+} row_t;
+
+struct station {
+    station_t *next;
+    char *path;
+    dacprog_port_t *port;
+    row_t *rows;
+    row_t *last;
+};
+
+static station_t *_g_stations;
+static const char *_g_csv;
+static uint8_t _g_from = 0x60;
+static bool _g_text;
+static uint32_t _g_timeout = DACPROG_TIMEOUT_MS;
+static unsigned _g_boards;
+static unsigned _g_failures;
+
+static void row_start(row_t *row);
+
+static void row_report(row_t *row)
+{
+    station_t *station = row->station;
+
+    if (row->failed)
+    {
+        printf("%s:%u: %s: FAILED at %s: %s\n", _g_csv, row->line, station->path,
+                _g_step_names[row->failed_step], row->why);
+        _g_failures++;
+    }
+    else
+    {
+        printf("%s:%u: %s: OK offset=%u gain=%u addr=%02x\n", _g_csv, row->line, station->path,
+                row->offset, row->gain, row->addr);
+    }
+
+    fflush(stdout);
+
+    station->rows = row->next;
+    free(row);
+
+    if (station->rows)
+        row_start(station->rows);
+}
+
+static void row_fail(row_t *row, const char *why)
+{
+    if (row->failed)
+        return;
+
+    row->failed = true;
+    row->failed_step = row->step;
+    row->why = why;
+}
+
+static bool row_send(row_t *row, step_t step);
+
+static void on_reply(dacprog_port_t *port, const dacprog_reply_t *reply, void *ctx)
+{
+    row_t *row = ctx;
+    uint16_t regs[DACPROG_DUMP_REGS];
+
+    (void)port;
+
+    if (reply->status != DACPROG_OK)
+        row_fail(row, dacprog_status_name(reply->status));
+    else if (row->step == STEP_CHECK)
+    {
+        if (!dacprog_parse_dump(reply, regs))
+            row_fail(row, "bad dump");
+        else if (regs[DACPROG_DUMP_DAC0_NV] != row->offset || regs[DACPROG_DUMP_DAC1_NV] != row->gain)
+            row_fail(row, "NV codes read back wrong");
+    }
+    else if (row->step == STEP_VERIFY)
+    {
+        if (!dacprog_parse_dump(reply, regs))
+            row_fail(row, "bad dump");
+        else if ((regs[DACPROG_DUMP_SLADDR] & 0x7F) != row->addr)
+            row_fail(row, "address read back wrong");
+    }
+
+    row->step++;
+
+    if (--row->outstanding)
+        return;
+
+    if (row->failed || row->step == STEP_DONE)
+    {
+        row_report(row);
+        return;
+    }
+
+    /* Checked at the arrival address, now move it */
+    if (row->addr == _g_from)
+    {
+        row->step = STEP_DONE;
+        row_report(row);
+        return;
+    }
+
+    if (!row_send(row, STEP_PGMADDR) || !row_send(row, STEP_VERIFY))
+    {
+        row_fail(row, "can't queue");
+        if (!row->outstanding)
+            row_report(row);
+    }
+}
+
+/* Queued back to back: the library pipelines frames and serialises text */
+static bool row_send(row_t *row, step_t step)
+{
+    dacprog_port_t *port = row->station->port;
+    uint8_t payload[5];
+    char line[64];
+    uint8_t op;
+    uint8_t len = 0;
+    bool ok;
+
+    switch (step)
+    {
+        case STEP_ADDR:
+            sprintf(line, "addr %02x", _g_from);
+            op = DACPROG_OP_ADDR;
+            payload[len++] = _g_from;
+            break;
+
+        case STEP_SET:
+            sprintf(line, "nvset %u %u", row->offset, row->gain);
+            op = DACPROG_OP_SET;
+            payload[len++] = 1;
+            payload[len++] = (uint8_t)(row->offset >> 8);
+            payload[len++] = (uint8_t)row->offset;
+            payload[len++] = (uint8_t)(row->gain >> 8);
+            payload[len++] = (uint8_t)row->gain;
+            break;
+
+        case STEP_PGMADDR:
+            sprintf(line, "pgmaddr %02x", row->addr);
+            op = DACPROG_OP_PGMADDR;
+            payload[len++] = row->addr;
+            break;
+
+        default:
+            strcpy(line, "dump");
+            op = DACPROG_OP_DUMP;
+            break;
+    }
+
+    if (_g_text)
+        ok = dacprog_command(port, line, _g_timeout, on_reply, row);
+    else
+        ok = dacprog_frame(port, op, payload, len, _g_timeout, on_reply, row);
+
+    if (ok)
+        row->outstanding++;
+
+    return ok;
+}
+
+static void row_start(row_t *row)
+{
+    _g_boards++;
+    row->step = STEP_ADDR;
+
+    if (!row->station->port)
+    {
+        row_fail(row, "can't open the port");
+        row_report(row);
+        return;
+    }
+
+    if (!row_send(row, STEP_ADDR) || !row_send(row, STEP_SET) || !row_send(row, STEP_CHECK))
+    {
+        row_fail(row, "can't queue");
+        if (!row->outstanding)
+            row_report(row);
+    }
+}
+
+static station_t *station_get(const char *path)
+{
+    station_t *station;
+
+    for (station = _g_stations; station; station = station->next)
+    {
+        if (!strcmp(station->path, path))
+            return station;
+    }
+
+    station = calloc(1, sizeof(*station));
+    if (!station || !(station->path = strdup(path)))
+    {
+        fprintf(stderr, "dacprov: out of memory\n");
+        exit(1);
+    }
+
+    station->next = _g_stations;
+    _g_stations = station;
+    return station;
+}
+
+static char *trim(char *s)
+{
+    char *end;
+
+    while (*s == ' ' || *s == '\t')
+        s++;
+
+    end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n'))
+        *--end = 0;
+
+    return s;
+}
+
+static bool parse_u16(const char *s, int base, unsigned max, unsigned *value)
+{
+    char *end;
+    unsigned long v;
+
+    if (!*s)
+        return false;
+
+    v = strtoul(s, &end, base);
+    if (*end || v > max)
+        return false;
+
+    *value = (unsigned)v;
+    return true;
+}
+
+static bool read_csv(FILE *f)
+{
+    char buf[DACPROV_MAX_LINE];
+    char *field[4];
+    unsigned values[3];
+    unsigned line = 0;
+    station_t *station;
+    row_t *row;
+    char *p;
+    uint8_t count;
+
+    while (fgets(buf, sizeof(buf), f))
+    {
+        line++;
+        p = trim(buf);
+
+        if (!*p || *p == '#')
+            continue;
+
+        for (count = 0; count < 4 && p; count++)
+        {
+            field[count] = p;
+            p = strchr(p, ',');
+            if (p)
+                *p++ = 0;
+            field[count] = trim(field[count]);
+        }
+
+        if (count != 4 || p)
+        {
+            fprintf(stderr, "%s:%u: want port,offset,gain,addr\n", _g_csv, line);
+            return false;
+        }
+
+        if (!parse_u16(field[1], 10, 0xFFFF, &values[0]) || !parse_u16(field[2], 10, 0xFFFF, &values[1])
+                || !parse_u16(field[3], 16, 0x7F, &values[2]))
+        {
+            /* A header */
+            if (!_g_stations && !strcmp(field[0], "port"))
+                continue;
+
+            fprintf(stderr, "%s:%u: bad offset, gain or addr\n", _g_csv, line);
+            return false;
+        }
+
+        row = calloc(1, sizeof(*row));
+        if (!row)
+            return false;
+
+        station = station_get(field[0]);
+        row->station = station;
+        row->line = line;
+        row->offset = (uint16_t)values[0];
+        row->gain = (uint16_t)values[1];
+        row->addr = (uint8_t)values[2];
+
+        if (station->last)
+            station->last->next = row;
+        else
+            station->rows = row;
+        station->last = row;
+    }
+
+    return true;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: dacprov [-b baud] [-f addr] [-t] [-T ms] boards.csv\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    dacprog_t *prog;
+    station_t *station;
+    uint32_t baud = 9600;
+    FILE *f;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:f:tT:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b': baud = strtoul(optarg, NULL, 10); break;
+            case 'f': _g_from = (uint8_t)strtoul(optarg, NULL, 16); break;
+            case 't': _g_text = true; break;
+            case 'T': _g_timeout = strtoul(optarg, NULL, 10); break;
+            default: usage();
+        }
+    }
+
+    if (optind != argc - 1)
+        usage();
+
+    _g_csv = argv[optind];
+    f = fopen(_g_csv, "r");
+    if (!f)
+    {
+        perror(_g_csv);
+        return 1;
+    }
+
+    if (!read_csv(f))
+        return 1;
+    fclose(f);
+
+    prog = dacprog_new();
+    if (!prog)
+    {
+        perror("dacprov");
+        return 1;
+    }
+
+    for (station = _g_stations; station; station = station->next)
+    {
+        station->port = dacprog_open(prog, station->path, baud);
+        if (!station->port)
+            perror(station->path);
+
+        if (station->rows)
+            row_start(station->rows);
+    }
+
+    dacprog_run(prog, -1);
+    dacprog_free(prog);
+
+    printf("%u of %u boards provisioned\n", _g_boards - _g_failures, _g_boards);
+
+    return _g_failures ? 1 : 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * File:   dacsim.c
+ * Author: Matt
+ *
+ * A programmer on a pseudo-terminal, for host tools to be tested
+ * against: the firmware itself runs on the simulator with one MCP47FEB
+ * on the bus, its outputs wired to AN0 / AN1, and the console UART
+ * bridged to the PTY. The slave's path is printed on stdout.
+ *
+ *   dacsim [-a addr] [-e eeprom.bin] [-l link] [-s state.txt]
+ *
+ *   -a  the DAC's address, hex (60)
+ *   -e  keep the PIC's EEPROM (the saved configuration) in this file
+ *   -l  also make a symlink to the slave here
+ *   -s  on exit, write the DAC's address and DAC0/DAC1 registers here
+ *
+ * Simulated time runs flat out while there's traffic and for a while
+ * after (a command may still be working), then creeps while idle so a
+ * station sitting at its prompt costs next to no CPU.
+ */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define DACSIM_SLICE_US         1000
+#define DACSIM_IDLE_AFTER_US    100000
+#define DACSIM_IDLE_POLL_MS     10
+#define DACSIM_OUT_MAX          4096
+
+int firmware_main(void);
+void isr_high(void);
+
+static int _g_master = -1;
+static sim_mcp47feb_t *_g_dac;
+static const char *_g_link;
+static const char *_g_state;
+static volatile sig_atomic_t _g_quit;
+
+static uint8_t _g_out[DACSIM_OUT_MAX];
+static size_t _g_out_len;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    _g_quit = 1;
+}
+
+static void on_output(uint8_t uart, uint8_t byte, void *ctx)
+{
+    (void)uart;
+    (void)ctx;
+
+    if (_g_out_len < sizeof(_g_out))
+        _g_out[_g_out_len++] = byte;
+}
+
+/* Nobody reading the slave: the bytes are lost, as on an unplugged cable */
+static void flush_output(void)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < _g_out_len)
+    {
+        n = write(_g_master, _g_out + done, _g_out_len - done);
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+    }
+
+    _g_out_len = 0;
+}
+
+static bool open_pty(void)
+{
+    struct termios tio;
+    const char *name;
+
+    _g_master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (_g_master < 0 || grantpt(_g_master) || unlockpt(_g_master))
+        return false;
+
+    name = ptsname(_g_master);
+    if (!name)
+        return false;
+
+    /* Held open so the master never sees a hangup between clients */
+    if (open(name, O_RDWR | O_NOCTTY) < 0)
+        return false;
+
+    if (!tcgetattr(_g_master, &tio))
+    {
+        cfmakeraw(&tio);
+        tcsetattr(_g_master, TCSANOW, &tio);
+    }
+
+    fcntl(_g_master, F_SETFL, fcntl(_g_master, F_GETFL) | O_NONBLOCK);
+
+    if (_g_link)
+    {
+        unlink(_g_link);
+        if (symlink(name, _g_link))
+            return false;
+    }
+
+    printf("%s\n", name);
+    fflush(stdout);
+    return true;
+}
+
+static void write_state(void)
+{
+    FILE *f;
+
+    if (!_g_state)
+        return;
+
+    f = fopen(_g_state, "w");
+    if (!f)
+        return;
+
+    fprintf(f, "addr %02x dac0 %u dac1 %u nvdac0 %u nvdac1 %u\n", sim_mcp47feb_addr(_g_dac),
+            sim_mcp47feb_get(_g_dac, 0x00), sim_mcp47feb_get(_g_dac, 0x01),
+            sim_mcp47feb_get(_g_dac, 0x10), sim_mcp47feb_get(_g_dac, 0x11));
+    fclose(f);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: dacsim [-a addr] [-e eeprom.bin] [-l link] [-s state.txt]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct pollfd pfd;
+    uint8_t buf[256];
+    uint64_t active = 0;
+    uint8_t addr = 0x60;
+    const char *eeprom = NULL;
+    ssize_t n;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:e:l:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': addr = (uint8_t)strtol(optarg, NULL, 16); break;
+            case 'e': eeprom = optarg; break;
+            case 'l': _g_link = optarg; break;
+            case 's': _g_state = optarg; break;
+            default: usage();
+        }
+    }
+
+    if (eeprom && !sim_eeprom_file(eeprom))
+    {
+        fprintf(stderr, "dacsim: can't read %s\n", eeprom);
+        return 1;
+    }
+
+    if (!open_pty())
+    {
+        fprintf(stderr, "dacsim: can't set up a PTY: %s\n", strerror(errno));
+        return 1;
+    }
+
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+    signal(SIGHUP, on_signal);
+
+    _g_dac = sim_mcp47feb_add(addr);
+    sim_adc_connect(0, _g_dac, 0);
+    sim_adc_connect(1, _g_dac, 1);
+
+    sim_fw_start(firmware_main, isr_high);
+    sim_usart_set_sink(SIM_UART1, on_output, NULL);
+
+    pfd.fd = _g_master;
+    pfd.events = POLLIN;
+
+    while (!_g_quit)
+    {
+        bool idle = sim_us() - active > DACSIM_IDLE_AFTER_US;
+
+        if (poll(&pfd, 1, idle ? DACSIM_IDLE_POLL_MS : 0) > 0 && (pfd.revents & POLLIN))
+        {
+            n = read(_g_master, buf, sizeof(buf));
+            if (n > 0)
+            {
+                sim_usart_send(SIM_UART1, buf, (size_t)n);
+                active = sim_us();
+            }
+        }
+
+        if (!sim_fw_run(DACSIM_SLICE_US))
+        {
+            fprintf(stderr, "dacsim: firmware stopped\n");
+            break;
+        }
+
+        if (_g_out_len)
+        {
+            flush_output();
+            active = sim_us();
+        }
+
+        if (sim_usart_unsent(SIM_UART1))
+            active = sim_us();
+    }
+
+    write_state();
+
+    if (_g_link)
+        unlink(_g_link);
+
+    return _g_quit ? 0 : 1;
+}
@@ -0,0 +1,389 @@
+/*
+ * File:   sim.c
+ * Author: Matt
+ *
+ * Simulator core: register file, clock, ports, Timer0/1/2, CCP5 and
+ * interrupt dispatch. Peripheral models hang off sim_reg() (accesses
+ * with side effects), the pending write (registers where writing is an
+ * action, like SSPBUF) and the per step call.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define SIM_NO_PENDING          0xFF
+
+/* Longest single step of a delay, so events stay a few us apart */
+#define SIM_MAX_STEP            256
+
+volatile uint8_t sim_regs[SIM_REGS];
+
+static uint64_t _g_cycles;
+static uint32_t _g_delay_frac;          /* Delay remainder, cycles * 1e6 */
+static uint8_t _g_pending = SIM_NO_PENDING;
+static sim_isr_t _g_isr;
+static bool _g_in_isr;
+static void (*_g_reset_handler)(void);
+
+static uint8_t _g_port_ext[3];
+static uint8_t _g_port_shadow[3];
+
+static uint64_t _g_t0_cycles;
+static uint16_t _g_t1;
+static uint32_t _g_t1_acc;
+static uint8_t _g_t2;
+static uint32_t _g_t2_acc;
+static uint8_t _g_t2_post;
+
+void sim_reset(void)
+{
+    memset((void *)sim_regs, 0, sizeof(sim_regs));
+
+    sim_regs[SIM_TRISA] = 0xFF;
+    sim_regs[SIM_TRISB] = 0xFF;
+    sim_regs[SIM_TRISC] = 0xFF;
+    sim_regs[SIM_ANSELA] = 0x2F;
+    sim_regs[SIM_ANSELB] = 0x3F;
+    sim_regs[SIM_ANSELC] = 0xFC;
+    sim_regs[SIM_TXSTA] = 0x02;         /* TRMT */
+    sim_regs[SIM_TXSTA2] = 0x02;
+    sim_regs[SIM_BAUDCON] = 0x40;       /* RCIDL */
+    sim_regs[SIM_BAUDCON2] = 0x40;
+    sim_regs[SIM_PR2] = 0xFF;
+    sim_regs[SIM_INTCON2] = 0xF5;
+
+    memset(_g_port_ext, 0xFF, sizeof(_g_port_ext));
+    memset(_g_port_shadow, 0, sizeof(_g_port_shadow));
+
+    _g_pending = SIM_NO_PENDING;
+    _g_in_isr = false;
+    _g_delay_frac = 0;
+    _g_t0_cycles = 0;
+    _g_t1 = 0;
+    _g_t1_acc = 0;
+    _g_t2 = 0;
+    _g_t2_acc = 0;
+    _g_t2_post = 0;
+
+    sim_i2c_reset();
+    sim_usart_reset();
+    sim_adc_reset();
+    sim_eeprom_reset();
+}
+
+void sim_set_isr(sim_isr_t isr)
+{
+    _g_isr = isr;
+}
+
+void sim_set_reset_handler(void (*handler)(void))
+{
+    _g_reset_handler = handler;
+}
+
+uint64_t sim_cycles(void)
+{
+    return _g_cycles;
+}
+
+uint64_t sim_us(void)
+{
+    return _g_cycles * 1000000UL / SIM_FOSC;
+}
+
+void sim_port_input(uint8_t port, uint8_t level)
+{
+    _g_port_ext[port] = level;
+}
+
+uint8_t sim_port_lat(uint8_t port)
+{
+    return sim_regs[SIM_LATA + port];
+}
+
+/* A write to PORTx lands in LATx. Found by comparing with what was last read */
+static void sim_port_writes(void)
+{
+    uint8_t port;
+    uint8_t diff;
+
+    for (port = 0; port < 3; port++)
+    {
+        diff = sim_regs[SIM_PORTA + port] ^ _g_port_shadow[port];
+
+        if (!diff)
+            continue;
+
+        sim_regs[SIM_LATA + port] = (sim_regs[SIM_LATA + port] & ~diff) | (sim_regs[SIM_PORTA + port] & diff);
+        _g_port_shadow[port] = sim_regs[SIM_PORTA + port];
+    }
+}
+
+static void sim_port_read(uint8_t port)
+{
+    uint8_t tris = sim_regs[SIM_TRISA + port];
+    uint8_t level = (sim_regs[SIM_LATA + port] & ~tris) | (_g_port_ext[port] & tris);
+
+    /* The bus is open drain on RC3/RC4: anyone on it can pull a line low */
+    if (port == SIM_PORTC - SIM_PORTA)
+        level &= sim_i2c_pins();
+
+    sim_regs[SIM_PORTA + port] = level;
+    _g_port_shadow[port] = level;
+}
+
+/* Timer0 only ever free runs here: Fosc / 4 through the prescaler */
+static void sim_timer0_read(void)
+{
+    uint8_t t0con = sim_regs[SIM_T0CON];
+    uint32_t div = 4;
+    uint16_t count;
+
+    if (!(t0con & 0x08))
+        div <<= (t0con & 0x07) + 1;
+
+    count = (uint16_t)(_g_t0_cycles / div);
+    if (t0con & 0x40)
+        count &= 0xFF;
+
+    sim_regs[SIM_TMR0L] = (uint8_t)count;
+    sim_regs[SIM_TMR0H] = (uint8_t)(count >> 8);
+}
+
+/* Timer1 with CCP5 in compare mode on it: a match anywhere in the step flags CCP5IF */
+static void sim_timer1_step(uint32_t cycles)
+{
+    uint8_t t1con = sim_regs[SIM_T1CON];
+    uint32_t div;
+    uint32_t ticks;
+    uint16_t match;
+
+    if (!(t1con & 0x01))
+        return;
+
+    div = ((t1con & 0xC0) == 0x40) ? 1 : 4;
+    div <<= (t1con >> 4) & 0x03;
+
+    _g_t1_acc += cycles;
+    ticks = _g_t1_acc / div;
+    _g_t1_acc %= div;
+
+    if (!ticks)
+        return;
+
+    if ((sim_regs[SIM_CCP5CON] & 0x0F) == 0x0A && !(sim_regs[SIM_CCPTMRS1] & 0x0C))
+    {
+        match = ((uint16_t)sim_regs[SIM_CCPR5H] << 8) | sim_regs[SIM_CCPR5L];
+
+        if ((uint16_t)(match - _g_t1 - 1) < ticks)
+            sim_regs[SIM_PIR4] |= SIM_PIR4_CCP5IF;
+    }
+
+    _g_t1 += (uint16_t)ticks;
+}
+
+static void sim_timer1_read(void)
+{
+    sim_regs[SIM_TMR1L] = (uint8_t)_g_t1;
+    sim_regs[SIM_TMR1H] = (uint8_t)(_g_t1 >> 8);
+}
+
+static void sim_timer2_step(uint32_t cycles)
+{
+    static const uint8_t prescale[4] = { 1, 4, 16, 16 };
+    uint8_t t2con = sim_regs[SIM_T2CON];
+    uint32_t div;
+
+    if (!(t2con & 0x04))
+        return;
+
+    div = 4 * prescale[t2con & 0x03];
+    _g_t2_acc += cycles;
+
+    while (_g_t2_acc >= div)
+    {
+        _g_t2_acc -= div;
+
+        if (_g_t2 != sim_regs[SIM_PR2])
+        {
+            _g_t2++;
+            continue;
+        }
+
+        _g_t2 = 0;
+
+        if (++_g_t2_post > ((t2con >> 3) & 0x0F))
+        {
+            _g_t2_post = 0;
+            sim_regs[SIM_PIR1] |= SIM_PIR1_TMR2IF;
+        }
+    }
+}
+
+static void sim_flush(void)
+{
+    uint8_t id = _g_pending;
+
+    sim_port_writes();
+
+    if (id == SIM_NO_PENDING)
+        return;
+
+    _g_pending = SIM_NO_PENDING;
+
+    switch (id)
+    {
+        case SIM_TMR2:
+            _g_t2 = sim_regs[SIM_TMR2];
+            _g_t2_acc = 0;
+            _g_t2_post = 0;
+            break;
+
+        default:
+            sim_i2c_write(id);
+            sim_usart_write(id);
+            sim_adc_write(id);
+            sim_eeprom_write(id);
+            break;
+    }
+}
+
+static bool sim_irq_pending(void)
+{
+    uint8_t intcon = sim_regs[SIM_INTCON];
+
+    if (sim_regs[SIM_RCON] & SIM_RCON_IPEN)
+    {
+        if (!(intcon & SIM_INTCON_GIEH))
+            return false;
+    }
+    else if ((intcon & (SIM_INTCON_GIEH | SIM_INTCON_GIEL)) != (SIM_INTCON_GIEH | SIM_INTCON_GIEL))
+        return false;
+
+    return (sim_regs[SIM_PIR1] & sim_regs[SIM_PIE1])
+        || (sim_regs[SIM_PIR3] & sim_regs[SIM_PIE3])
+        || (sim_regs[SIM_PIR4] & sim_regs[SIM_PIE4]);
+}
+
+/* Vectors like the part: GIEH cleared on entry, set again by the RETFIE */
+static void sim_dispatch(void)
+{
+    if (_g_in_isr || !_g_isr || !sim_irq_pending())
+        return;
+
+    _g_in_isr = true;
+    sim_regs[SIM_INTCON] &= ~SIM_INTCON_GIEH;
+
+    _g_isr();
+
+    sim_flush();
+    sim_regs[SIM_INTCON] |= SIM_INTCON_GIEH;
+    _g_in_isr = false;
+}
+
+static void sim_step(uint32_t cycles)
+{
+    sim_flush();
+
+    _g_cycles += cycles;
+
+    if (sim_regs[SIM_T0CON] & 0x80)
+        _g_t0_cycles += cycles;
+
+    sim_timer1_step(cycles);
+    sim_timer2_step(cycles);
+    sim_i2c_step(_g_cycles);
+    sim_usart_step(_g_cycles);
+    sim_adc_step(_g_cycles);
+    sim_eeprom_step(_g_cycles);
+
+    sim_dispatch();
+    sim_fw_step(_g_cycles);
+}
+
+void sim_sync(void)
+{
+    sim_step(SIM_ACCESS_CYCLES);
+}
+
+volatile uint8_t *sim_reg(uint8_t id)
+{
+    sim_sync();
+
+    switch (id)
+    {
+        case SIM_PORTA:
+        case SIM_PORTB:
+        case SIM_PORTC:
+            sim_port_read(id - SIM_PORTA);
+            break;
+
+        case SIM_TMR0L:
+            sim_timer0_read();
+            break;
+
+        case SIM_TMR1L:
+            sim_timer1_read();
+            break;
+
+        case SIM_TMR2:
+            _g_pending = id;
+            break;
+
+        default:
+            if (sim_i2c_access(id) || sim_usart_access(id)
+                    || sim_adc_access(id) || sim_eeprom_access(id))
+                _g_pending = id;
+            break;
+    }
+
+    return &sim_regs[id];
+}
+
+void sim_delay_us(uint32_t us)
+{
+    uint64_t total = (uint64_t)us * SIM_FOSC + _g_delay_frac;
+    uint64_t cycles = total / 1000000UL;
+    uint32_t step;
+
+    _g_delay_frac = (uint32_t)(total % 1000000UL);
+
+    while (cycles)
+    {
+        step = (cycles > SIM_MAX_STEP) ? SIM_MAX_STEP : (uint32_t)cycles;
+        sim_step(step);
+        cycles -= step;
+    }
+}
+
+void sim_asm(const char *text)
+{
+    if (strcmp(text, "reset"))
+        return;
+
+    if (_g_reset_handler)
+        _g_reset_handler();
+
+    fprintf(stderr, "sim: reset at %lluus\n", (unsigned long long)sim_us());
+    exit(3);
+}
+
+/* Instrumented firmware: every function entry is an instruction or two */
+void __cyg_profile_func_enter(void *fn, void *site) __attribute__((no_instrument_function));
+void __cyg_profile_func_exit(void *fn, void *site) __attribute__((no_instrument_function));
+
+void __cyg_profile_func_enter(void *fn, void *site)
+{
+    (void)fn;
+    (void)site;
+    sim_sync();
+}
+
+void __cyg_profile_func_exit(void *fn, void *site)
+{
+    (void)fn;
+    (void)site;
+}
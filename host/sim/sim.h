@@ -0,0 +1,173 @@
+/*
+ * File:   sim.h
+ * Author: Matt
+ *
+ * Host simulator for the PIC18F26K22 build. The firmware sources compile
+ * unchanged against sim/xc.h; their SFR accesses land here, where the
+ * clock, the peripheral models and the interrupt dispatch run.
+ *
+ * Time only moves when the firmware touches an SFR, enters a function
+ * (with -finstrument-functions), delays, or when a test calls
+ * sim_delay_us(). Every step runs the models and then, if a source is
+ * flagged and enabled, the registered interrupt handler.
+ */
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#define SIM_FOSC                49152000UL
+
+/* Fosc cycles per SFR access or function entry, about one instruction */
+#define SIM_ACCESS_CYCLES       4
+
+#define SIM_US_TO_CYCLES(us)    ((uint64_t)(us) * SIM_FOSC / 1000000UL)
+
+enum {
+    SIM_ADCON0, SIM_ADCON1, SIM_ADCON2, SIM_ADRESH, SIM_ADRESL,
+    SIM_ANSELA, SIM_ANSELB, SIM_ANSELC,
+    SIM_BAUDCON, SIM_BAUDCON2,
+    SIM_CCP5CON, SIM_CCPR5H, SIM_CCPR5L, SIM_CCPTMRS1,
+    SIM_EEADR, SIM_EECON1, SIM_EECON2, SIM_EEDATA,
+    SIM_INTCON, SIM_INTCON2, SIM_IOCB,
+    SIM_LATA, SIM_LATB, SIM_LATC,
+    SIM_PIE1, SIM_PIE3, SIM_PIE4, SIM_PIR1, SIM_PIR2, SIM_PIR3, SIM_PIR4,
+    SIM_PORTA, SIM_PORTB, SIM_PORTC,
+    SIM_PR2, SIM_RCON,
+    SIM_RCREG, SIM_RCREG2, SIM_RCSTA, SIM_RCSTA2,
+    SIM_SPBRG, SIM_SPBRG2, SIM_SPBRGH, SIM_SPBRGH2,
+    SIM_SSPADD, SIM_SSPBUF, SIM_SSPCON1, SIM_SSPCON2, SIM_SSPSTAT,
+    SIM_T0CON, SIM_T1CON, SIM_T2CON,
+    SIM_TMR0H, SIM_TMR0L, SIM_TMR1H, SIM_TMR1L, SIM_TMR2,
+    SIM_TRISA, SIM_TRISB, SIM_TRISC,
+    SIM_TXREG, SIM_TXREG2, SIM_TXSTA, SIM_TXSTA2,
+    SIM_REGS
+};
+
+/* Register bits the models use */
+#define SIM_INTCON_GIEH         0x80
+#define SIM_INTCON_GIEL         0x40
+#define SIM_RCON_IPEN           0x80
+#define SIM_PIR1_TMR2IF         0x02
+#define SIM_PIR1_SSPIF          0x08
+#define SIM_PIR1_TXIF           0x10
+#define SIM_PIR1_RCIF           0x20
+#define SIM_PIR1_ADIF           0x40
+#define SIM_PIR2_BCL1IF         0x08
+#define SIM_PIR3_TX2IF          0x10
+#define SIM_PIR3_RC2IF          0x20
+#define SIM_PIR4_CCP5IF         0x04
+
+typedef void (*sim_isr_t)(void);
+
+extern volatile uint8_t sim_regs[SIM_REGS];
+
+/* Core */
+void sim_reset(void);
+void sim_set_isr(sim_isr_t isr);
+volatile uint8_t *sim_reg(uint8_t id);
+void sim_sync(void);
+void sim_delay_us(uint32_t us);
+uint64_t sim_cycles(void);
+uint64_t sim_us(void);
+void sim_asm(const char *text);
+void sim_set_reset_handler(void (*handler)(void));
+
+/* Pins: inputs read back as the external level when TRIS is set */
+void sim_port_input(uint8_t port, uint8_t level);
+uint8_t sim_port_lat(uint8_t port);
+
+/* printf/sprintf for the firmware, XC8 length modifiers */
+int sim_printf(const char *fmt, ...);
+int sim_sprintf(char *buf, const char *fmt, ...);
+int sim_vformat(char *buf, int size, const char *fmt, va_list ap);
+
+/* I2C bus: MSSP master, MCP47FEB DACs and TCA9548 switches */
+typedef struct sim_mcp47feb sim_mcp47feb_t;
+typedef struct sim_tca9548 sim_tca9548_t;
+
+sim_mcp47feb_t *sim_mcp47feb_add(uint8_t addr);
+void sim_mcp47feb_behind(sim_mcp47feb_t *dac, sim_tca9548_t *mux, uint8_t channel);
+uint16_t sim_mcp47feb_get(sim_mcp47feb_t *dac, uint8_t reg);
+void sim_mcp47feb_set(sim_mcp47feb_t *dac, uint8_t reg, uint16_t value);
+uint8_t sim_mcp47feb_addr(sim_mcp47feb_t *dac);
+bool sim_mcp47feb_nv_busy(sim_mcp47feb_t *dac);
+uint16_t sim_mcp47feb_nv_writes(sim_mcp47feb_t *dac);
+void sim_mcp47feb_trim(sim_mcp47feb_t *dac, uint8_t ch, int16_t offset_mv, int32_t gain_ppm);
+uint32_t sim_mcp47feb_uv(sim_mcp47feb_t *dac, uint8_t ch);
+uint16_t sim_mcp47feb_mv(sim_mcp47feb_t *dac, uint8_t ch);
+
+sim_tca9548_t *sim_tca9548_add(uint8_t addr);
+uint8_t sim_tca9548_control(sim_tca9548_t *mux);
+
+const char *sim_i2c_trace(void);
+void sim_i2c_trace_clear(void);
+
+/* A slave holding SDA low until it has seen clocks SCL pulses, 0 lets go */
+void sim_i2c_stuck_sda(uint8_t clocks);
+
+/* EUSART1 (SIM_UART1) and EUSART2 (SIM_UART2), host side of the line */
+#define SIM_UART1               0
+#define SIM_UART2               1
+
+typedef void (*sim_usart_sink_t)(uint8_t uart, uint8_t byte, void *ctx);
+
+void sim_usart_send(uint8_t uart, const void *data, size_t len);
+size_t sim_usart_unsent(uint8_t uart);
+void sim_usart_host_baud(uint8_t uart, uint32_t baud);
+uint32_t sim_usart_baud(uint8_t uart);
+uint32_t sim_usart_overruns(uint8_t uart);
+const char *sim_usart_output(uint8_t uart);
+size_t sim_usart_output_len(uint8_t uart);
+void sim_usart_output_clear(uint8_t uart);
+void sim_usart_set_sink(uint8_t uart, sim_usart_sink_t sink, void *ctx);
+
+/* ADC inputs: a fixed level or a DAC output, noise in 1/100 LSB peak */
+void sim_adc_input(uint8_t channel, uint16_t mv);
+void sim_adc_connect(uint8_t channel, sim_mcp47feb_t *dac, uint8_t dac_channel);
+void sim_adc_noise(uint16_t centi_lsb);
+uint32_t sim_adc_conversions(void);
+
+/* Data EEPROM, kept over sim_reset(), optionally backed by a file */
+bool sim_eeprom_file(const char *path);
+uint8_t sim_eeprom_get(uint8_t addr);
+void sim_eeprom_set(uint8_t addr, uint8_t byte);
+uint32_t sim_eeprom_writes(void);
+
+/*
+ * The whole firmware, main.c built with -Dmain=firmware_main, on its own
+ * stack. It runs for slices of simulated time and is suspended between
+ * them, so the host side can feed the UARTs and look at the models.
+ * False once it has stopped (a reset).
+ */
+typedef bool (*sim_fw_done_t)(void *ctx);
+
+void sim_fw_start(int (*entry)(void), sim_isr_t isr);
+bool sim_fw_run(uint32_t us);
+bool sim_fw_run_until(sim_fw_done_t done, void *ctx, uint32_t timeout_us);
+
+/* Model entry points, called by the core */
+void sim_i2c_reset(void);
+bool sim_i2c_access(uint8_t id);
+void sim_i2c_write(uint8_t id);
+void sim_i2c_step(uint64_t now);
+uint8_t sim_i2c_pins(void);
+void sim_usart_reset(void);
+bool sim_usart_access(uint8_t id);
+void sim_usart_write(uint8_t id);
+void sim_usart_step(uint64_t now);
+void sim_adc_reset(void);
+bool sim_adc_access(uint8_t id);
+void sim_adc_write(uint8_t id);
+void sim_adc_step(uint64_t now);
+void sim_eeprom_reset(void);
+bool sim_eeprom_access(uint8_t id);
+void sim_eeprom_write(uint8_t id);
+void sim_eeprom_step(uint64_t now);
+void sim_fw_step(uint64_t now);
+
+#endif /* __SIM_H__ */
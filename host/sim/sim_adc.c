@@ -0,0 +1,171 @@
+/*
+ * File:   sim_adc.c
+ * Author: Matt
+ *
+ * The 10 bit ADC, Vdd (5V) referenced. Setting GO samples the selected
+ * channel and the result lands in ADRESH:ADRESL after the acquisition
+ * and conversion time ADCON2 asks for, GO clears and ADIF sets.
+ *
+ * A channel is either a fixed level or wired to a DAC output, read at
+ * the sample instant. An ideal transfer function plus optional noise,
+ * from a seeded generator so runs repeat exactly.
+ */
+
+#include "sim.h"
+
+#define SIM_ADC_CHANNELS        8
+#define SIM_ADC_VREF_UV         5000000UL
+#define SIM_ADC_FULL_SCALE      1023
+
+#define ADCON0_ADON             0x01
+#define ADCON0_GO               0x02
+#define ADCON2_ADFM             0x80
+
+/* Fosc cycles for the internal RC clock, about 2us */
+#define SIM_ADC_FRC_CYCLES      SIM_US_TO_CYCLES(2)
+
+typedef struct {
+    sim_mcp47feb_t *dac;
+    uint8_t dac_channel;
+    uint32_t uv;
+} sim_adc_input_t;
+
+static sim_adc_input_t _g_inputs[SIM_ADC_CHANNELS];
+static uint16_t _g_noise;               /* Peak, 1/100 LSB */
+static uint32_t _g_seed;
+static uint32_t _g_conversions;
+
+static bool _g_busy;
+static uint16_t _g_result;
+static uint64_t _g_end;
+static uint64_t _g_now;
+
+void sim_adc_reset(void)
+{
+    _g_busy = false;
+    _g_conversions = 0;
+    _g_seed = 1;
+}
+
+void sim_adc_input(uint8_t channel, uint16_t mv)
+{
+    _g_inputs[channel].dac = NULL;
+    _g_inputs[channel].uv = (uint32_t)mv * 1000;
+}
+
+void sim_adc_connect(uint8_t channel, sim_mcp47feb_t *dac, uint8_t dac_channel)
+{
+    _g_inputs[channel].dac = dac;
+    _g_inputs[channel].dac_channel = dac_channel;
+}
+
+void sim_adc_noise(uint16_t centi_lsb)
+{
+    _g_noise = centi_lsb;
+}
+
+uint32_t sim_adc_conversions(void)
+{
+    return _g_conversions;
+}
+
+/* Sum of two uniforms, -_g_noise to +_g_noise, triangular */
+static int32_t sim_adc_dither(void)
+{
+    int32_t sum = 0;
+    uint8_t i;
+
+    if (!_g_noise)
+        return 0;
+
+    for (i = 0; i < 2; i++)
+    {
+        _g_seed = _g_seed * 1103515245UL + 12345;
+        sum += (int32_t)((_g_seed >> 16) % (2U * _g_noise + 1)) - _g_noise;
+    }
+
+    return sum / 2;
+}
+
+static uint16_t sim_adc_sample(uint8_t channel)
+{
+    sim_adc_input_t *in = &_g_inputs[channel];
+    uint32_t uv = in->dac ? sim_mcp47feb_uv(in->dac, in->dac_channel) : in->uv;
+    int64_t centi;
+
+    /* In 1/100 LSB, rounded to the nearest code */
+    centi = (int64_t)uv * SIM_ADC_FULL_SCALE * 100 / SIM_ADC_VREF_UV + sim_adc_dither();
+    centi = (centi + 50) / 100;
+
+    if (centi < 0)
+        return 0;
+    if (centi > SIM_ADC_FULL_SCALE)
+        return SIM_ADC_FULL_SCALE;
+
+    return (uint16_t)centi;
+}
+
+/* ACQT and ADCS from ADCON2: acquisition plus 11 TAD of conversion */
+static uint32_t sim_adc_cycles(void)
+{
+    static const uint8_t acqt[8] = { 0, 2, 4, 6, 8, 12, 16, 20 };
+    static const uint8_t adcs[8] = { 2, 8, 32, 0, 4, 16, 64, 0 };
+    uint8_t adcon2 = sim_regs[SIM_ADCON2];
+    uint32_t tad = adcs[adcon2 & 0x07];
+
+    if (!tad)
+        tad = SIM_ADC_FRC_CYCLES;
+
+    return (acqt[(adcon2 >> 3) & 0x07] + 11) * tad;
+}
+
+static void sim_adc_done(void)
+{
+    _g_busy = false;
+    _g_conversions++;
+
+    if (sim_regs[SIM_ADCON2] & ADCON2_ADFM)
+    {
+        sim_regs[SIM_ADRESH] = (uint8_t)(_g_result >> 8);
+        sim_regs[SIM_ADRESL] = (uint8_t)_g_result;
+    }
+    else
+    {
+        sim_regs[SIM_ADRESH] = (uint8_t)(_g_result >> 2);
+        sim_regs[SIM_ADRESL] = (uint8_t)(_g_result << 6);
+    }
+
+    sim_regs[SIM_ADCON0] &= ~ADCON0_GO;
+    sim_regs[SIM_PIR1] |= SIM_PIR1_ADIF;
+}
+
+void sim_adc_step(uint64_t now)
+{
+    _g_now = now;
+
+    if (_g_busy && now >= _g_end)
+        sim_adc_done();
+}
+
+bool sim_adc_access(uint8_t id)
+{
+    return id == SIM_ADCON0;
+}
+
+void sim_adc_write(uint8_t id)
+{
+    uint8_t adcon0 = sim_regs[SIM_ADCON0];
+
+    if (id != SIM_ADCON0 || _g_busy)
+        return;
+
+    if ((adcon0 & (ADCON0_ADON | ADCON0_GO)) != (ADCON0_ADON | ADCON0_GO))
+    {
+        sim_regs[SIM_ADCON0] &= ~ADCON0_GO;
+        return;
+    }
+
+    _g_result = sim_adc_sample((adcon0 >> 2) & (SIM_ADC_CHANNELS - 1));
+    _g_end = _g_now + sim_adc_cycles();
+    _g_busy = true;
+}
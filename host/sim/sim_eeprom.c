@@ -0,0 +1,178 @@
+/*
+ * File:   sim_eeprom.c
+ * Author: Matt
+ *
+ * The 256 byte data EEPROM behind EEADR / EEDATA / EECON1. RD is
+ * immediate. WR only starts straight after the 55h / AAh sequence on
+ * EECON2 with WREN set, stays set for the write time, then the byte is
+ * in. Anything else that sets WR is ignored and flags WRERR.
+ *
+ * The contents survive sim_reset(), like the part's. Given a file they
+ * are loaded from it and every completed write goes back to it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define SIM_EEPROM_SIZE         256
+#define SIM_EEPROM_WRITE_US     4000
+
+#define EECON1_RD               0x01
+#define EECON1_WR               0x02
+#define EECON1_WREN             0x04
+#define EECON1_WRERR            0x08
+#define EECON1_CFGS             0x40
+#define EECON1_EEPGD            0x80
+
+static uint8_t _g_mem[SIM_EEPROM_SIZE];
+static bool _g_blank_init;
+static const char *_g_path;
+
+static uint8_t _g_unlock;               /* Bytes of the sequence seen */
+static bool _g_writing;
+static uint8_t _g_addr;
+static uint8_t _g_data;
+static uint64_t _g_end;
+static uint64_t _g_now;
+static uint32_t _g_writes;
+
+static void sim_eeprom_blank(void)
+{
+    if (_g_blank_init)
+        return;
+
+    memset(_g_mem, 0xFF, sizeof(_g_mem));
+    _g_blank_init = true;
+}
+
+void sim_eeprom_reset(void)
+{
+    sim_eeprom_blank();
+
+    _g_unlock = 0;
+    _g_writing = false;
+}
+
+/* False if the file exists and can't be read; a missing one starts blank */
+bool sim_eeprom_file(const char *path)
+{
+    FILE *f;
+    size_t len;
+
+    sim_eeprom_blank();
+    _g_path = path;
+
+    f = fopen(path, "rb");
+    if (!f)
+        return true;
+
+    len = fread(_g_mem, 1, sizeof(_g_mem), f);
+    fclose(f);
+
+    return len == sizeof(_g_mem);
+}
+
+static void sim_eeprom_save(void)
+{
+    FILE *f;
+
+    if (!_g_path)
+        return;
+
+    f = fopen(_g_path, "wb");
+    if (!f)
+        return;
+
+    fwrite(_g_mem, 1, sizeof(_g_mem), f);
+    fclose(f);
+}
+
+uint8_t sim_eeprom_get(uint8_t addr)
+{
+    sim_eeprom_blank();
+    return _g_mem[addr];
+}
+
+void sim_eeprom_set(uint8_t addr, uint8_t byte)
+{
+    sim_eeprom_blank();
+    _g_mem[addr] = byte;
+}
+
+uint32_t sim_eeprom_writes(void)
+{
+    return _g_writes;
+}
+
+void sim_eeprom_step(uint64_t now)
+{
+    _g_now = now;
+
+    if (!_g_writing || now < _g_end)
+        return;
+
+    _g_writing = false;
+    _g_mem[_g_addr] = _g_data;
+    _g_writes++;
+    sim_regs[SIM_EECON1] &= ~EECON1_WR;
+
+    sim_eeprom_save();
+}
+
+bool sim_eeprom_access(uint8_t id)
+{
+    return id == SIM_EECON1 || id == SIM_EECON2;
+}
+
+static void sim_eeprom_control(void)
+{
+    uint8_t eecon1 = sim_regs[SIM_EECON1];
+    bool unlocked = (_g_unlock == 2);
+
+    _g_unlock = 0;
+
+    /* Program memory and config space aren't modelled */
+    if (eecon1 & (EECON1_EEPGD | EECON1_CFGS))
+    {
+        sim_regs[SIM_EECON1] &= ~(EECON1_RD | (_g_writing ? 0 : EECON1_WR));
+        return;
+    }
+
+    if (eecon1 & EECON1_RD)
+    {
+        sim_regs[SIM_EEDATA] = _g_mem[sim_regs[SIM_EEADR]];
+        sim_regs[SIM_EECON1] &= ~EECON1_RD;
+    }
+
+    if (!(eecon1 & EECON1_WR) || _g_writing)
+        return;
+
+    if (!unlocked || !(eecon1 & EECON1_WREN))
+    {
+        sim_regs[SIM_EECON1] = (eecon1 & ~EECON1_WR) | EECON1_WRERR;
+        return;
+    }
+
+    _g_addr = sim_regs[SIM_EEADR];
+    _g_data = sim_regs[SIM_EEDATA];
+    _g_end = _g_now + SIM_US_TO_CYCLES(SIM_EEPROM_WRITE_US);
+    _g_writing = true;
+}
+
+void sim_eeprom_write(uint8_t id)
+{
+    if (id == SIM_EECON1)
+        sim_eeprom_control();
+
+    if (id != SIM_EECON2)
+        return;
+
+    if (sim_regs[SIM_EECON2] == 0x55)
+        _g_unlock = 1;
+    else if (sim_regs[SIM_EECON2] == 0xAA && _g_unlock == 1)
+        _g_unlock = 2;
+    else
+        _g_unlock = 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * File:   sim_fw.c
+ * Author: Matt
+ *
+ * Runs the whole firmware as a coroutine. firmware_main() never returns,
+ * so it gets its own stack and every simulator step checks the slice's
+ * deadline; past it, the firmware is switched out wherever it is (in a
+ * delay, polling a flag, inside the ISR) and picks up from there on the
+ * next slice.
+ *
+ * Starting again is a reset as far as the SFRs go, but the firmware's
+ * RAM is left as it was: there's no C startup code to clear it.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+#include "sim.h"
+
+#define SIM_FW_STACK            (1024 * 1024)
+#define SIM_FW_SLICE_US         100
+
+static ucontext_t _g_host;
+static ucontext_t _g_fw;
+static void *_g_stack;
+static int (*_g_entry)(void);
+
+static bool _g_inside;
+static bool _g_stopped;
+static uint64_t _g_deadline;
+
+static void sim_fw_trampoline(void)
+{
+    _g_entry();
+
+    _g_stopped = true;
+    _g_inside = false;
+}
+
+/* asm("reset"): the firmware is gone until sim_fw_start() */
+static void sim_fw_reset(void)
+{
+    if (!_g_inside)
+        return;
+
+    fprintf(stderr, "sim: firmware reset at %lluus\n", (unsigned long long)sim_us());
+
+    _g_stopped = true;
+    _g_inside = false;
+    setcontext(&_g_host);
+}
+
+void sim_fw_start(int (*entry)(void), sim_isr_t isr)
+{
+    if (!_g_stack)
+        _g_stack = malloc(SIM_FW_STACK);
+
+    sim_reset();
+    sim_set_isr(isr);
+    sim_set_reset_handler(sim_fw_reset);
+
+    getcontext(&_g_fw);
+    _g_fw.uc_stack.ss_sp = _g_stack;
+    _g_fw.uc_stack.ss_size = SIM_FW_STACK;
+    _g_fw.uc_link = &_g_host;
+    makecontext(&_g_fw, sim_fw_trampoline, 0);
+
+    _g_entry = entry;
+    _g_stopped = false;
+}
+
+bool sim_fw_run(uint32_t us)
+{
+    if (!_g_entry || _g_stopped || _g_inside)
+        return false;
+
+    _g_deadline = sim_cycles() + SIM_US_TO_CYCLES(us);
+    _g_inside = true;
+    swapcontext(&_g_host, &_g_fw);
+
+    return !_g_stopped;
+}
+
+bool sim_fw_run_until(sim_fw_done_t done, void *ctx, uint32_t timeout_us)
+{
+    uint64_t end = sim_us() + timeout_us;
+
+    while (!done(ctx))
+    {
+        if (sim_us() >= end || !sim_fw_run(SIM_FW_SLICE_US))
+            return false;
+    }
+
+    return true;
+}
+
+void sim_fw_step(uint64_t now)
+{
+    if (!_g_inside || now < _g_deadline)
+        return;
+
+    _g_inside = false;
+    swapcontext(&_g_fw, &_g_host);
+}
@@ -0,0 +1,703 @@
+/*
+ * File:   sim_i2c.c
+ * Author: Matt
+ *
+ * MSSP in I2C master mode and the bus behind it. SEN, RSEN, PEN, RCEN,
+ * ACKEN and SSPBUF writes each run for their bit times at the SSPADD
+ * rate, then clear, report and raise SSPIF the way the module does.
+ *
+ * Devices are MCP47FEB DACs and TCA9548 switches. A DAC behind a switch
+ * only sees the bus while its channel is enabled. The DAC model keeps
+ * the register map, runs EEPROM writes for SIM_MCP47FEB_EE_US from the
+ * STOP with EEWA set (write commands are NACKed meanwhile) and turns the
+ * volatile DAC codes into output voltages for the ADC model.
+ *
+ * A slave can be made to hold SDA low (sim_i2c_stuck_sda()). Until it
+ * has seen enough SCL pulses, bit-banged on RC3 with the module off, RC4
+ * reads low and a START, STOP or byte out loses arbitration: the bit
+ * clears without SSPIF and BCL1IF is set instead, as on the MSSP.
+ *
+ * Every bus event is appended to a trace, e.g. "S C0+ 08+ 01+ 23+ P":
+ * S / Sr / P, bytes out with the slave's ACK (+) or NACK (-), bytes in
+ * as rXX followed by the master's a (ACK) or n (NACK), BCL for a bus
+ * collision.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define SIM_I2C_DEVS            16
+#define SIM_TRACE_SIZE          16384
+
+#define SIM_MCP47FEB_EE_US      5000
+#define SIM_MCP47FEB_VDD_MV     5000
+
+#define SSPCON1_WCOL            0x80
+#define SSPCON1_SSPEN           0x20
+#define SSPCON2_SEN             0x01
+#define SSPCON2_RSEN            0x02
+#define SSPCON2_PEN             0x04
+#define SSPCON2_RCEN            0x08
+#define SSPCON2_ACKEN           0x10
+#define SSPCON2_ACKDT           0x20
+#define SSPCON2_ACKSTAT         0x40
+#define SSPSTAT_BF              0x01
+#define SSPSTAT_R_W             0x04
+#define PORTC_SCL               0x08
+#define PORTC_SDA               0x10
+
+#define MCP_REG_GAIN_STATUS     0x0A
+#define MCP_REG_NV_FIRST        0x10
+#define MCP_REG_SLAVEADDR       0x1A
+#define MCP_EEWA                0x0040
+#define MCP_POR                 0x0080
+#define MCP_GAIN_BITS           0x0300
+
+#define MCP_CMD_WRITE           0x00
+#define MCP_CMD_DISABLE_CFG     0x02
+#define MCP_CMD_ENABLE_CFG      0x04
+#define MCP_CMD_READ            0x06
+
+enum { OP_NONE, OP_START, OP_RSTART, OP_STOP, OP_TX, OP_RX, OP_ACK };
+
+enum { MCP_CMD, MCP_DATA_HI, MCP_DATA_LO, MCP_IGNORE };
+
+struct sim_tca9548 {
+    uint8_t addr;
+    uint8_t control;
+    bool selected;
+};
+
+struct sim_mcp47feb {
+    uint8_t addr;
+    sim_tca9548_t *mux;
+    uint8_t channel;
+    bool selected;
+
+    uint16_t regs[32];
+    uint8_t state;
+    uint8_t reg;                /* Register of the command in progress */
+    uint8_t read_reg;
+    uint8_t hi;
+    bool read_lo;               /* Next byte out is the low half */
+    bool unlocked;              /* Configuration bit disabled with HV on */
+
+    bool ee_armed;              /* EEPROM write starts at the STOP */
+    bool ee_busy;
+    uint64_t ee_done;
+    uint8_t ee_reg;
+    uint16_t ee_value;
+    uint16_t nv_writes;
+
+    int16_t offset_mv[2];
+    int32_t gain_ppm[2];
+};
+
+static struct sim_mcp47feb _g_dacs[SIM_I2C_DEVS];
+static uint8_t _g_dac_count;
+static struct sim_tca9548 _g_muxes[SIM_I2C_DEVS];
+static uint8_t _g_mux_count;
+
+static uint8_t _g_op;
+static uint8_t _g_last_op;
+static uint64_t _g_op_end;
+static uint64_t _g_now;
+static bool _g_enabled;
+static bool _g_owned;
+static bool _g_addr_phase;
+static bool _g_rx_full;                 /* BF is a received byte */
+static bool _g_read;
+static uint8_t _g_stuck;                /* SCL pulses until SDA is let go */
+static bool _g_scl;
+
+static char _g_trace[SIM_TRACE_SIZE];
+static size_t _g_trace_len;
+
+static void sim_trace(const char *fmt, unsigned value)
+{
+    int len;
+
+    if (_g_trace_len + 8 >= sizeof(_g_trace))
+        return;
+
+    if (_g_trace_len)
+        _g_trace[_g_trace_len++] = ' ';
+
+    len = snprintf(&_g_trace[_g_trace_len], sizeof(_g_trace) - _g_trace_len, fmt, value);
+    _g_trace_len += len;
+}
+
+const char *sim_i2c_trace(void)
+{
+    return _g_trace;
+}
+
+void sim_i2c_trace_clear(void)
+{
+    _g_trace_len = 0;
+    _g_trace[0] = 0;
+}
+
+/* Power on. The device lists are kept: they're the board, not the chip */
+void sim_i2c_reset(void)
+{
+    uint8_t i;
+
+    _g_op = OP_NONE;
+    _g_last_op = OP_NONE;
+    _g_enabled = false;
+    _g_owned = false;
+    _g_rx_full = false;
+    _g_stuck = 0;
+    _g_scl = true;
+
+    for (i = 0; i < _g_mux_count; i++)
+    {
+        _g_muxes[i].control = 0;
+        _g_muxes[i].selected = false;
+    }
+
+    for (i = 0; i < _g_dac_count; i++)
+    {
+        _g_dacs[i].selected = false;
+        _g_dacs[i].state = MCP_CMD;
+    }
+
+    sim_i2c_trace_clear();
+}
+
+void sim_i2c_stuck_sda(uint8_t clocks)
+{
+    _g_stuck = clocks;
+}
+
+uint8_t sim_i2c_pins(void)
+{
+    return _g_stuck ? (uint8_t)~PORTC_SDA : 0xFF;
+}
+
+sim_tca9548_t *sim_tca9548_add(uint8_t addr)
+{
+    sim_tca9548_t *mux = &_g_muxes[_g_mux_count++];
+
+    memset(mux, 0, sizeof(*mux));
+    mux->addr = addr;
+    return mux;
+}
+
+uint8_t sim_tca9548_control(sim_tca9548_t *mux)
+{
+    return mux->control;
+}
+
+/* Volatile registers come up from their NV copies */
+sim_mcp47feb_t *sim_mcp47feb_add(uint8_t addr)
+{
+    sim_mcp47feb_t *dac = &_g_dacs[_g_dac_count++];
+
+    memset(dac, 0, sizeof(*dac));
+    dac->addr = addr;
+    dac->regs[MCP_REG_SLAVEADDR] = addr;
+    dac->regs[MCP_REG_GAIN_STATUS] = MCP_POR;
+    return dac;
+}
+
+void sim_mcp47feb_behind(sim_mcp47feb_t *dac, sim_tca9548_t *mux, uint8_t channel)
+{
+    dac->mux = mux;
+    dac->channel = channel;
+}
+
+uint16_t sim_mcp47feb_get(sim_mcp47feb_t *dac, uint8_t reg)
+{
+    return dac->regs[reg & 0x1F];
+}
+
+void sim_mcp47feb_set(sim_mcp47feb_t *dac, uint8_t reg, uint16_t value)
+{
+    reg &= 0x1F;
+    dac->regs[reg] = value;
+
+    if (reg >= MCP_REG_NV_FIRST && reg < MCP_REG_SLAVEADDR)
+        dac->regs[reg - MCP_REG_NV_FIRST] = value;
+
+    if (reg == MCP_REG_SLAVEADDR)
+        dac->addr = value & 0x7F;
+}
+
+uint8_t sim_mcp47feb_addr(sim_mcp47feb_t *dac)
+{
+    return dac->addr;
+}
+
+bool sim_mcp47feb_nv_busy(sim_mcp47feb_t *dac)
+{
+    return dac->ee_busy;
+}
+
+uint16_t sim_mcp47feb_nv_writes(sim_mcp47feb_t *dac)
+{
+    return dac->nv_writes;
+}
+
+void sim_mcp47feb_trim(sim_mcp47feb_t *dac, uint8_t ch, int16_t offset_mv, int32_t gain_ppm)
+{
+    dac->offset_mv[ch] = offset_mv;
+    dac->gain_ppm[ch] = gain_ppm;
+}
+
+/* Vref = Vdd, gain 1x: code / 4096 of the rail, then the trim errors */
+uint32_t sim_mcp47feb_uv(sim_mcp47feb_t *dac, uint8_t ch)
+{
+    int64_t uv = (int64_t)(dac->regs[ch] & 0x0FFF) * SIM_MCP47FEB_VDD_MV * 1000 / 4096;
+
+    uv += uv * dac->gain_ppm[ch] / 1000000;
+    uv += (int64_t)dac->offset_mv[ch] * 1000;
+
+    if (uv < 0)
+        return 0;
+    if (uv > SIM_MCP47FEB_VDD_MV * 1000)
+        return SIM_MCP47FEB_VDD_MV * 1000;
+
+    return (uint32_t)uv;
+}
+
+uint16_t sim_mcp47feb_mv(sim_mcp47feb_t *dac, uint8_t ch)
+{
+    return (uint16_t)((sim_mcp47feb_uv(dac, ch) + 500) / 1000);
+}
+
+static bool sim_mcp47feb_visible(sim_mcp47feb_t *dac)
+{
+    return !dac->mux || (dac->mux->control & (1 << dac->channel));
+}
+
+static uint16_t sim_mcp47feb_read_reg(sim_mcp47feb_t *dac, uint8_t reg)
+{
+    if (reg == MCP_REG_GAIN_STATUS)
+        return (dac->regs[reg] & (MCP_GAIN_BITS | MCP_POR)) | (dac->ee_busy ? MCP_EEWA : 0);
+
+    return dac->regs[reg];
+}
+
+static void sim_mcp47feb_store(sim_mcp47feb_t *dac, uint16_t value)
+{
+    uint8_t reg = dac->reg;
+
+    if (reg < MCP_REG_NV_FIRST)
+    {
+        if (reg <= 0x01)
+            value &= 0x0FFF;
+
+        if (reg == MCP_REG_GAIN_STATUS)
+            value = (dac->regs[reg] & ~MCP_GAIN_BITS) | (value & MCP_GAIN_BITS);
+
+        dac->regs[reg] = value;
+        return;
+    }
+
+    /* The new address answers at once, the EEPROM copy follows */
+    if (reg == MCP_REG_SLAVEADDR)
+        dac->addr = value & 0x7F;
+
+    dac->ee_armed = true;
+    dac->ee_reg = reg;
+    dac->ee_value = value;
+    dac->nv_writes++;
+}
+
+/* High voltage on the HVC pin: the P-FET switched by RA3 */
+static bool sim_mcp47feb_hv(void)
+{
+    return (sim_port_lat(0) & 0x08) != 0;
+}
+
+static bool sim_mcp47feb_write(sim_mcp47feb_t *dac, uint8_t byte)
+{
+    uint8_t cmd;
+
+    switch (dac->state)
+    {
+        case MCP_CMD:
+            dac->reg = byte >> 3;
+            cmd = byte & 0x06;
+
+            if (cmd == MCP_CMD_READ)
+            {
+                dac->read_reg = dac->reg;
+                dac->read_lo = false;
+                return true;
+            }
+
+            if (dac->ee_busy)
+            {
+                dac->state = MCP_IGNORE;
+                return false;
+            }
+
+            /* One EEPROM write per transfer. The same config command again is harmless */
+            if (dac->ee_armed)
+            {
+                if (cmd != MCP_CMD_WRITE && !dac->ee_reg && sim_mcp47feb_hv())
+                    return true;
+
+                dac->state = MCP_IGNORE;
+                return false;
+            }
+
+            if (cmd != MCP_CMD_WRITE)
+            {
+                if (!sim_mcp47feb_hv())
+                {
+                    dac->state = MCP_IGNORE;
+                    return false;
+                }
+
+                dac->unlocked = (cmd == MCP_CMD_DISABLE_CFG);
+                dac->ee_armed = true;
+                dac->ee_reg = 0;
+                return true;
+            }
+
+            if (dac->reg == MCP_REG_SLAVEADDR && !dac->unlocked)
+            {
+                dac->state = MCP_IGNORE;
+                return false;
+            }
+
+            dac->state = MCP_DATA_HI;
+            return true;
+
+        case MCP_DATA_HI:
+            dac->hi = byte;
+            dac->state = MCP_DATA_LO;
+            return true;
+
+        case MCP_DATA_LO:
+            sim_mcp47feb_store(dac, ((uint16_t)dac->hi << 8) | byte);
+            dac->state = MCP_CMD;     /* Continuous write: next command follows */
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static uint8_t sim_mcp47feb_read(sim_mcp47feb_t *dac)
+{
+    uint16_t value = sim_mcp47feb_read_reg(dac, dac->read_reg);
+    bool lo = dac->read_lo;
+
+    dac->read_lo = !lo;
+    return lo ? (uint8_t)value : (uint8_t)(value >> 8);
+}
+
+static void sim_mcp47feb_step(sim_mcp47feb_t *dac)
+{
+    if (!dac->ee_busy || _g_now < dac->ee_done)
+        return;
+
+    dac->ee_busy = false;
+
+    if (dac->ee_reg >= MCP_REG_NV_FIRST)
+        dac->regs[dac->ee_reg] = dac->ee_value;
+}
+
+/* Address byte: everyone decides whether it's them */
+static bool sim_bus_address(uint8_t byte)
+{
+    uint8_t addr = byte >> 1;
+    bool ack = false;
+    uint8_t i;
+
+    _g_read = byte & 0x01;
+
+    for (i = 0; i < _g_mux_count; i++)
+    {
+        _g_muxes[i].selected = (_g_muxes[i].addr == addr);
+        ack |= _g_muxes[i].selected;
+    }
+
+    for (i = 0; i < _g_dac_count; i++)
+    {
+        _g_dacs[i].selected = (_g_dacs[i].addr == addr) && sim_mcp47feb_visible(&_g_dacs[i]);
+        _g_dacs[i].state = MCP_CMD;
+        _g_dacs[i].read_lo = false;
+        ack |= _g_dacs[i].selected;
+    }
+
+    return ack;
+}
+
+static bool sim_bus_write(uint8_t byte)
+{
+    bool ack = false;
+    uint8_t i;
+
+    if (_g_read)
+        return false;
+
+    for (i = 0; i < _g_mux_count; i++)
+    {
+        if (_g_muxes[i].selected)
+        {
+            _g_muxes[i].control = byte;
+            ack = true;
+        }
+    }
+
+    for (i = 0; i < _g_dac_count; i++)
+    {
+        if (_g_dacs[i].selected)
+            ack |= sim_mcp47feb_write(&_g_dacs[i], byte);
+    }
+
+    return ack;
+}
+
+/* Open drain: several talkers AND together */
+static uint8_t sim_bus_read(void)
+{
+    uint8_t byte = 0xFF;
+    uint8_t i;
+
+    if (!_g_read)
+        return byte;
+
+    for (i = 0; i < _g_mux_count; i++)
+    {
+        if (_g_muxes[i].selected)
+            byte &= _g_muxes[i].control;
+    }
+
+    for (i = 0; i < _g_dac_count; i++)
+    {
+        if (_g_dacs[i].selected)
+            byte &= sim_mcp47feb_read(&_g_dacs[i]);
+    }
+
+    return byte;
+}
+
+static void sim_bus_release(void)
+{
+    uint8_t i;
+
+    _g_owned = false;
+    _g_read = false;
+
+    for (i = 0; i < _g_mux_count; i++)
+        _g_muxes[i].selected = false;
+
+    for (i = 0; i < _g_dac_count; i++)
+    {
+        _g_dacs[i].selected = false;
+        _g_dacs[i].state = MCP_CMD;
+
+        if (_g_dacs[i].ee_armed)
+        {
+            _g_dacs[i].ee_armed = false;
+            _g_dacs[i].ee_busy = true;
+            _g_dacs[i].ee_done = _g_now + SIM_US_TO_CYCLES(SIM_MCP47FEB_EE_US);
+        }
+    }
+}
+
+/* Lost arbitration to the stuck slave. The module gives the bus up */
+static void sim_mssp_collision(void)
+{
+    sim_regs[SIM_SSPCON2] &= ~(SSPCON2_SEN | SSPCON2_RSEN | SSPCON2_PEN);
+    sim_regs[SIM_SSPSTAT] &= ~(SSPSTAT_BF | SSPSTAT_R_W);
+    sim_regs[SIM_PIR2] |= SIM_PIR2_BCL1IF;
+    sim_trace("BCL", 0);
+
+    _g_last_op = OP_NONE;
+    sim_bus_release();
+}
+
+/* Pulses on a bit-banged SCL, latch low and TRIS as the open drain switch */
+static void sim_bus_clock(void)
+{
+    bool scl = ((sim_regs[SIM_TRISC] | sim_regs[SIM_LATC]) & PORTC_SCL) != 0;
+
+    if (scl && !_g_scl && _g_stuck)
+        _g_stuck--;
+
+    _g_scl = scl;
+}
+
+static void sim_mssp_begin(uint8_t op, uint8_t bits)
+{
+    uint32_t bit = 4 * ((uint32_t)sim_regs[SIM_SSPADD] + 1);
+
+    _g_op = op;
+    _g_op_end = _g_now + (uint64_t)bit * bits;
+}
+
+static void sim_mssp_complete(void)
+{
+    uint8_t op = _g_op;
+    bool ack;
+    uint8_t byte;
+
+    _g_op = OP_NONE;
+    _g_last_op = op;
+
+    switch (op)
+    {
+        case OP_START:
+        case OP_RSTART:
+            sim_regs[SIM_SSPCON2] &= ~(SSPCON2_SEN | SSPCON2_RSEN);
+            sim_trace(op == OP_START ? "S" : "Sr", 0);
+            _g_owned = true;
+            _g_addr_phase = true;
+            break;
+
+        case OP_STOP:
+            sim_regs[SIM_SSPCON2] &= ~SSPCON2_PEN;
+            sim_trace("P", 0);
+            sim_bus_release();
+            break;
+
+        case OP_TX:
+            byte = sim_regs[SIM_SSPBUF];
+
+            if (_g_addr_phase)
+                ack = sim_bus_address(byte);
+            else
+                ack = sim_bus_write(byte);
+
+            _g_addr_phase = false;
+            sim_regs[SIM_SSPSTAT] &= ~(SSPSTAT_BF | SSPSTAT_R_W);
+
+            if (ack)
+                sim_regs[SIM_SSPCON2] &= ~SSPCON2_ACKSTAT;
+            else
+                sim_regs[SIM_SSPCON2] |= SSPCON2_ACKSTAT;
+
+            sim_trace(ack ? "%02X+" : "%02X-", byte);
+            break;
+
+        case OP_RX:
+            byte = sim_bus_read();
+            sim_regs[SIM_SSPBUF] = byte;
+            sim_regs[SIM_SSPSTAT] |= SSPSTAT_BF;
+            sim_regs[SIM_SSPCON2] &= ~SSPCON2_RCEN;
+            _g_rx_full = true;
+            sim_trace("r%02X", byte);
+            break;
+
+        case OP_ACK:
+            sim_regs[SIM_SSPCON2] &= ~SSPCON2_ACKEN;
+            sim_trace((sim_regs[SIM_SSPCON2] & SSPCON2_ACKDT) ? "n" : "a", 0);
+            break;
+
+        default:
+            return;
+    }
+
+    sim_regs[SIM_PIR1] |= SIM_PIR1_SSPIF;
+}
+
+void sim_i2c_step(uint64_t now)
+{
+    uint8_t con2;
+    uint8_t i;
+
+    _g_now = now;
+
+    for (i = 0; i < _g_dac_count; i++)
+        sim_mcp47feb_step(&_g_dacs[i]);
+
+    sim_bus_clock();
+
+    if (!(sim_regs[SIM_SSPCON1] & SSPCON1_SSPEN))
+    {
+        /* Module off: whatever was going on is abandoned */
+        if (_g_enabled)
+        {
+            _g_enabled = false;
+            _g_op = OP_NONE;
+            _g_last_op = OP_NONE;
+            _g_rx_full = false;
+            sim_regs[SIM_SSPSTAT] &= ~(SSPSTAT_BF | SSPSTAT_R_W);
+            sim_bus_release();
+        }
+        return;
+    }
+
+    _g_enabled = true;
+
+    if (_g_op != OP_NONE)
+    {
+        if (now < _g_op_end)
+            return;
+
+        sim_mssp_complete();
+    }
+
+    con2 = sim_regs[SIM_SSPCON2];
+
+    if (_g_stuck && (con2 & (SSPCON2_SEN | SSPCON2_RSEN | SSPCON2_PEN)))
+        sim_mssp_collision();
+    else if (con2 & SSPCON2_SEN)
+        sim_mssp_begin(_g_owned ? OP_RSTART : OP_START, 1);
+    else if (con2 & SSPCON2_RSEN)
+        sim_mssp_begin(OP_RSTART, 1);
+    else if (con2 & SSPCON2_PEN)
+        sim_mssp_begin(OP_STOP, 1);
+    else if (con2 & SSPCON2_RCEN)
+        sim_mssp_begin(OP_RX, 8);
+    else if (con2 & SSPCON2_ACKEN)
+        sim_mssp_begin(OP_ACK, 1);
+}
+
+/*
+ * SSPBUF is both the byte received and the byte to send. A received byte
+ * still in it is being read (that clears BF, even once the ACK is out);
+ * otherwise it's a write when the module could take one: bus owned,
+ * idle, after a START or a byte out.
+ */
+bool sim_i2c_access(uint8_t id)
+{
+    if (id != SIM_SSPBUF)
+        return false;
+
+    if (_g_rx_full)
+    {
+        _g_rx_full = false;
+        sim_regs[SIM_SSPSTAT] &= ~SSPSTAT_BF;
+        return false;
+    }
+
+    if (sim_regs[SIM_SSPSTAT] & SSPSTAT_BF)
+        return false;
+
+    if (!_g_enabled || !_g_owned || _g_op != OP_NONE)
+        return false;
+
+    return _g_last_op == OP_START || _g_last_op == OP_RSTART || _g_last_op == OP_TX;
+}
+
+void sim_i2c_write(uint8_t id)
+{
+    if (id != SIM_SSPBUF)
+        return;
+
+    if (_g_op != OP_NONE)
+    {
+        sim_regs[SIM_SSPCON1] |= SSPCON1_WCOL;
+        return;
+    }
+
+    if (_g_stuck)
+    {
+        sim_mssp_collision();
+        return;
+    }
+
+    sim_regs[SIM_SSPSTAT] |= SSPSTAT_BF | SSPSTAT_R_W;
+    sim_mssp_begin(OP_TX, 9);
+}
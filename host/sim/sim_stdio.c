@@ -0,0 +1,78 @@
+/*
+ * File:   sim_stdio.c
+ * Author: Matt
+ *
+ * printf() and sprintf() as the firmware sees them under XC8. Long is
+ * 32 bits there, so "%lu" takes a uint32_t: the length modifier is
+ * dropped before the host formats it. printf() output goes through the
+ * firmware's own putch(), console mute and all.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define SIM_FMT_MAX             256
+#define SIM_OUT_MAX             1024
+
+void putch(char byte);
+
+int sim_vformat(char *buf, int size, const char *fmt, va_list ap)
+{
+    char host[SIM_FMT_MAX];
+    char *q = host;
+    const char *p = fmt;
+
+    while (*p && q < host + sizeof(host) - 2)
+    {
+        *q++ = *p;
+
+        if (*p++ != '%')
+            continue;
+
+        while (*p && strchr("-+ #0123456789.*", *p) && q < host + sizeof(host) - 2)
+            *q++ = *p++;
+
+        if (*p == 'l')
+            p++;
+
+        if (*p)
+            *q++ = *p++;
+    }
+
+    *q = 0;
+    return vsnprintf(buf, size, host, ap);
+}
+
+int sim_printf(const char *fmt, ...)
+{
+    char out[SIM_OUT_MAX];
+    va_list ap;
+    int len;
+    int i;
+
+    va_start(ap, fmt);
+    len = sim_vformat(out, sizeof(out), fmt, ap);
+    va_end(ap);
+
+    if (len > (int)sizeof(out) - 1)
+        len = sizeof(out) - 1;
+
+    for (i = 0; i < len; i++)
+        putch(out[i]);
+
+    return len;
+}
+
+int sim_sprintf(char *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = sim_vformat(buf, SIM_OUT_MAX, fmt, ap);
+    va_end(ap);
+
+    return len;
+}
@@ -0,0 +1,345 @@
+/*
+ * File:   sim_usart.c
+ * Author: Matt
+ *
+ * EUSART1 and EUSART2, asynchronous 8N1. Each side of the line is timed
+ * from its baud rate: TXREG feeds the shift register, which delivers a
+ * byte to the host every ten bit times (TRMT clear meanwhile). Host
+ * bytes arrive the same way into the two deep receive FIFO; a third one
+ * with the FIFO full sets OERR and is lost, as is everything arriving
+ * until CREN is cycled. ABDEN measures the next byte's rate.
+ *
+ * The host's rate defaults to whatever the part is set to.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define SIM_UARTS               2
+#define SIM_CAPTURE_MAX         65536
+
+#define TXSTA_BRGH              0x04
+#define TXSTA_TRMT              0x02
+#define TXSTA_TXEN              0x20
+#define RCSTA_SPEN              0x80
+#define RCSTA_CREN              0x10
+#define RCSTA_OERR              0x02
+#define BAUDCON_ABDOVF          0x80
+#define BAUDCON_BRG16           0x08
+#define BAUDCON_ABDEN           0x01
+
+typedef struct {
+    uint8_t txreg, rcreg, txsta, rcsta, spbrg, spbrgh, baudcon, pir;
+    uint8_t txif, rcif;
+
+    bool txreg_full;
+    uint8_t txreg_byte;
+    bool tsr_busy;
+    uint8_t tsr_byte;
+    uint64_t tsr_end;
+
+    uint8_t fifo[2];
+    uint8_t fifo_count;
+    bool cren;
+
+    uint8_t *in;                /* Host to part, not yet on the line */
+    size_t in_len;
+    size_t in_size;
+    bool line_busy;
+    uint8_t line_byte;
+    uint64_t line_end;
+    uint32_t host_baud;
+    uint32_t overruns;
+
+    char *out;                  /* Part to host, captured */
+    size_t out_len;
+    sim_usart_sink_t sink;
+    void *sink_ctx;
+} sim_uart_t;
+
+static sim_uart_t _g_uarts[SIM_UARTS] = {
+    { SIM_TXREG, SIM_RCREG, SIM_TXSTA, SIM_RCSTA, SIM_SPBRG, SIM_SPBRGH, SIM_BAUDCON,
+      SIM_PIR1, SIM_PIR1_TXIF, SIM_PIR1_RCIF },
+    { SIM_TXREG2, SIM_RCREG2, SIM_TXSTA2, SIM_RCSTA2, SIM_SPBRG2, SIM_SPBRGH2, SIM_BAUDCON2,
+      SIM_PIR3, SIM_PIR3_TX2IF, SIM_PIR3_RC2IF },
+};
+
+static uint64_t _g_now;
+
+/* Fosc cycles per baud clock, from BRG16 / BRGH */
+static uint32_t sim_usart_mult(sim_uart_t *u)
+{
+    bool brgh = sim_regs[u->txsta] & TXSTA_BRGH;
+
+    if (sim_regs[u->baudcon] & BAUDCON_BRG16)
+        return brgh ? 4 : 16;
+
+    return brgh ? 16 : 64;
+}
+
+static uint32_t sim_usart_divisor(sim_uart_t *u)
+{
+    uint32_t n = sim_regs[u->spbrg];
+
+    if (sim_regs[u->baudcon] & BAUDCON_BRG16)
+        n |= (uint32_t)sim_regs[u->spbrgh] << 8;
+
+    return sim_usart_mult(u) * (n + 1);
+}
+
+uint32_t sim_usart_baud(uint8_t uart)
+{
+    return SIM_FOSC / sim_usart_divisor(&_g_uarts[uart]);
+}
+
+static uint64_t sim_usart_host_cycles(sim_uart_t *u)
+{
+    if (u->host_baud)
+        return 10ULL * SIM_FOSC / u->host_baud;
+
+    return 10ULL * sim_usart_divisor(u);
+}
+
+void sim_usart_reset(void)
+{
+    sim_uart_t *u;
+    uint8_t i;
+
+    for (i = 0; i < SIM_UARTS; i++)
+    {
+        u = &_g_uarts[i];
+        u->txreg_full = false;
+        u->tsr_busy = false;
+        u->fifo_count = 0;
+        u->cren = false;
+        u->line_busy = false;
+        u->in_len = 0;
+        u->overruns = 0;
+        u->host_baud = 0;
+        sim_usart_output_clear(i);
+    }
+}
+
+void sim_usart_send(uint8_t uart, const void *data, size_t len)
+{
+    sim_uart_t *u = &_g_uarts[uart];
+
+    if (u->in_len + len > u->in_size)
+    {
+        u->in_size = (u->in_len + len) * 2;
+        u->in = realloc(u->in, u->in_size);
+    }
+
+    memcpy(&u->in[u->in_len], data, len);
+    u->in_len += len;
+}
+
+size_t sim_usart_unsent(uint8_t uart)
+{
+    return _g_uarts[uart].in_len + (_g_uarts[uart].line_busy ? 1 : 0);
+}
+
+void sim_usart_host_baud(uint8_t uart, uint32_t baud)
+{
+    _g_uarts[uart].host_baud = baud;
+}
+
+uint32_t sim_usart_overruns(uint8_t uart)
+{
+    return _g_uarts[uart].overruns;
+}
+
+const char *sim_usart_output(uint8_t uart)
+{
+    sim_uart_t *u = &_g_uarts[uart];
+
+    if (!u->out)
+        u->out = calloc(1, SIM_CAPTURE_MAX + 1);
+
+    return u->out;
+}
+
+size_t sim_usart_output_len(uint8_t uart)
+{
+    return _g_uarts[uart].out_len;
+}
+
+void sim_usart_output_clear(uint8_t uart)
+{
+    sim_uart_t *u = &_g_uarts[uart];
+
+    u->out_len = 0;
+    if (u->out)
+        u->out[0] = 0;
+}
+
+void sim_usart_set_sink(uint8_t uart, sim_usart_sink_t sink, void *ctx)
+{
+    _g_uarts[uart].sink = sink;
+    _g_uarts[uart].sink_ctx = ctx;
+}
+
+static void sim_usart_deliver(sim_uart_t *u, uint8_t byte)
+{
+    uint8_t uart = (uint8_t)(u - _g_uarts);
+
+    if (u->sink)
+    {
+        u->sink(uart, byte, u->sink_ctx);
+        return;
+    }
+
+    sim_usart_output(uart);
+
+    if (u->out_len < SIM_CAPTURE_MAX)
+    {
+        u->out[u->out_len++] = (char)byte;
+        u->out[u->out_len] = 0;
+    }
+}
+
+/* A byte has finished arriving on RX */
+static void sim_usart_received(sim_uart_t *u, uint8_t byte)
+{
+    uint8_t rcsta = sim_regs[u->rcsta];
+    uint32_t n;
+
+    if (!(rcsta & RCSTA_SPEN))
+        return;
+
+    if (sim_regs[u->baudcon] & BAUDCON_ABDEN)
+    {
+        n = (uint32_t)((sim_usart_host_cycles(u) / 10 + sim_usart_mult(u) / 2) / sim_usart_mult(u));
+
+        if (n > 0x10000)
+            sim_regs[u->baudcon] |= BAUDCON_ABDOVF;
+        else
+        {
+            sim_regs[u->spbrg] = (uint8_t)(n - 1);
+            sim_regs[u->spbrgh] = (uint8_t)((n - 1) >> 8);
+        }
+
+        sim_regs[u->baudcon] &= ~BAUDCON_ABDEN;
+        byte = 0;                        /* The measuring character is junk */
+    }
+    else if (!(rcsta & RCSTA_CREN))
+        return;
+
+    if ((rcsta & RCSTA_OERR) || u->fifo_count == 2)
+    {
+        sim_regs[u->rcsta] |= RCSTA_OERR;
+        u->overruns++;
+        return;
+    }
+
+    u->fifo[u->fifo_count++] = byte;
+}
+
+static void sim_usart_step_one(sim_uart_t *u)
+{
+    bool cren = sim_regs[u->rcsta] & RCSTA_CREN;
+    bool txen = (sim_regs[u->txsta] & TXSTA_TXEN) && (sim_regs[u->rcsta] & RCSTA_SPEN);
+
+    /* Cycling CREN is the only way out of an overrun */
+    if (u->cren && !cren)
+        sim_regs[u->rcsta] &= ~RCSTA_OERR;
+    u->cren = cren;
+
+    if (u->tsr_busy && _g_now >= u->tsr_end)
+    {
+        u->tsr_busy = false;
+        sim_usart_deliver(u, u->tsr_byte);
+    }
+
+    if (!u->tsr_busy && u->txreg_full && txen)
+    {
+        u->tsr_busy = true;
+        u->tsr_byte = u->txreg_byte;
+        u->tsr_end = _g_now + 10ULL * sim_usart_divisor(u);
+        u->txreg_full = false;
+    }
+
+    if (u->line_busy && _g_now >= u->line_end)
+    {
+        u->line_busy = false;
+        sim_usart_received(u, u->line_byte);
+    }
+
+    if (!u->line_busy && u->in_len)
+    {
+        u->line_busy = true;
+        u->line_byte = u->in[0];
+        u->line_end = _g_now + sim_usart_host_cycles(u);
+        memmove(u->in, u->in + 1, --u->in_len);
+    }
+
+    if (u->tsr_busy)
+        sim_regs[u->txsta] &= ~TXSTA_TRMT;
+    else
+        sim_regs[u->txsta] |= TXSTA_TRMT;
+
+    if (txen && !u->txreg_full)
+        sim_regs[u->pir] |= u->txif;
+    else
+        sim_regs[u->pir] &= ~u->txif;
+
+    if (u->fifo_count)
+        sim_regs[u->pir] |= u->rcif;
+    else
+        sim_regs[u->pir] &= ~u->rcif;
+}
+
+void sim_usart_step(uint64_t now)
+{
+    uint8_t i;
+
+    _g_now = now;
+
+    for (i = 0; i < SIM_UARTS; i++)
+        sim_usart_step_one(&_g_uarts[i]);
+}
+
+/* Reading RCREG pops the FIFO. Any TXREG access is taken as a write */
+bool sim_usart_access(uint8_t id)
+{
+    sim_uart_t *u;
+    uint8_t i;
+
+    for (i = 0; i < SIM_UARTS; i++)
+    {
+        u = &_g_uarts[i];
+
+        if (id == u->txreg)
+            return true;
+
+        if (id == u->rcreg && u->fifo_count)
+        {
+            sim_regs[u->rcreg] = u->fifo[0];
+            u->fifo[0] = u->fifo[1];
+            if (!--u->fifo_count)
+                sim_regs[u->pir] &= ~u->rcif;
+        }
+    }
+
+    return false;
+}
+
+void sim_usart_write(uint8_t id)
+{
+    sim_uart_t *u;
+    uint8_t i;
+
+    for (i = 0; i < SIM_UARTS; i++)
+    {
+        u = &_g_uarts[i];
+
+        if (id != u->txreg)
+            continue;
+
+        u->txreg_byte = sim_regs[id];
+        u->txreg_full = true;
+        sim_regs[u->pir] &= ~u->txif;
+    }
+}
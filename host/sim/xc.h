@@ -0,0 +1,308 @@
+/*
+ * File:   xc.h
+ * Author: Matt
+ *
+ * Host stand-in for the XC8 device header, PIC18F26K22 only. Each SFR
+ * is a byte in the simulator's register file: every access goes through
+ * sim_reg(), which lets the peripheral models run and interrupts fire
+ * between firmware statements, much as they would between instructions.
+ */
+
+#ifndef __SIM_XC_H__
+#define __SIM_XC_H__
+
+#ifndef __18F26K22
+#error The host simulator only models the PIC18F26K22
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <strings.h>
+
+#include "sim.h"
+
+#if defined(_XTAL_FREQ) && _XTAL_FREQ != SIM_FOSC
+#error _XTAL_FREQ does not match the simulated clock
+#endif
+
+/* XC8 keywords and intrinsics */
+#define interrupt
+#define high_priority
+#define low_priority
+#define __uint24                uint32_t
+#define asm(text)               sim_asm(text)
+#define CLRWDT()                sim_sync()
+#define NOP()                   sim_sync()
+#define __delay_us(us)          sim_delay_us(us)
+#define __delay_ms(ms)          sim_delay_us((uint32_t)(ms) * 1000UL)
+
+#define stricmp                 strcasecmp
+#define strnicmp                strncasecmp
+
+/* XC8 long is 32 bits: the shims map %lu and friends onto uint32_t */
+#define printf                  sim_printf
+#define sprintf                 sim_sprintf
+
+/* The character output hook XC8's stdio.h declares */
+void putch(char c);
+
+#define SIM_SFR(id)             (*sim_reg(id))
+#define SIM_SFR_BITS(type, id)  (*(volatile type *)sim_reg(id))
+
+#define ADCON0      SIM_SFR(SIM_ADCON0)
+#define ADCON1      SIM_SFR(SIM_ADCON1)
+#define ADCON2      SIM_SFR(SIM_ADCON2)
+#define ADRESH      SIM_SFR(SIM_ADRESH)
+#define ADRESL      SIM_SFR(SIM_ADRESL)
+#define ANSELA      SIM_SFR(SIM_ANSELA)
+#define ANSELB      SIM_SFR(SIM_ANSELB)
+#define ANSELC      SIM_SFR(SIM_ANSELC)
+#define BAUDCON     SIM_SFR(SIM_BAUDCON)
+#define BAUDCON2    SIM_SFR(SIM_BAUDCON2)
+#define CCP5CON     SIM_SFR(SIM_CCP5CON)
+#define CCPR5H      SIM_SFR(SIM_CCPR5H)
+#define CCPR5L      SIM_SFR(SIM_CCPR5L)
+#define CCPTMRS1    SIM_SFR(SIM_CCPTMRS1)
+#define EEADR       SIM_SFR(SIM_EEADR)
+#define EECON1      SIM_SFR(SIM_EECON1)
+#define EECON2      SIM_SFR(SIM_EECON2)
+#define EEDATA      SIM_SFR(SIM_EEDATA)
+#define INTCON      SIM_SFR(SIM_INTCON)
+#define INTCON2     SIM_SFR(SIM_INTCON2)
+#define IOCB        SIM_SFR(SIM_IOCB)
+#define LATA        SIM_SFR(SIM_LATA)
+#define LATB        SIM_SFR(SIM_LATB)
+#define LATC        SIM_SFR(SIM_LATC)
+#define PIE1        SIM_SFR(SIM_PIE1)
+#define PIE3        SIM_SFR(SIM_PIE3)
+#define PIE4        SIM_SFR(SIM_PIE4)
+#define PIR1        SIM_SFR(SIM_PIR1)
+#define PIR2        SIM_SFR(SIM_PIR2)
+#define PIR3        SIM_SFR(SIM_PIR3)
+#define PIR4        SIM_SFR(SIM_PIR4)
+#define PORTA       SIM_SFR(SIM_PORTA)
+#define PORTB       SIM_SFR(SIM_PORTB)
+#define PORTC       SIM_SFR(SIM_PORTC)
+#define PR2         SIM_SFR(SIM_PR2)
+#define RCON        SIM_SFR(SIM_RCON)
+#define RCREG       SIM_SFR(SIM_RCREG)
+#define RCREG2      SIM_SFR(SIM_RCREG2)
+#define RCSTA       SIM_SFR(SIM_RCSTA)
+#define RCSTA2      SIM_SFR(SIM_RCSTA2)
+#define SPBRG       SIM_SFR(SIM_SPBRG)
+#define SPBRG2      SIM_SFR(SIM_SPBRG2)
+#define SPBRGH      SIM_SFR(SIM_SPBRGH)
+#define SPBRGH2     SIM_SFR(SIM_SPBRGH2)
+#define SSPADD      SIM_SFR(SIM_SSPADD)
+#define SSPBUF      SIM_SFR(SIM_SSPBUF)
+#define SSPCON1     SIM_SFR(SIM_SSPCON1)
+#define SSPCON2     SIM_SFR(SIM_SSPCON2)
+#define SSPSTAT     SIM_SFR(SIM_SSPSTAT)
+#define T0CON       SIM_SFR(SIM_T0CON)
+#define T1CON       SIM_SFR(SIM_T1CON)
+#define T2CON       SIM_SFR(SIM_T2CON)
+#define TMR0H       SIM_SFR(SIM_TMR0H)
+#define TMR0L       SIM_SFR(SIM_TMR0L)
+#define TMR1H       SIM_SFR(SIM_TMR1H)
+#define TMR1L       SIM_SFR(SIM_TMR1L)
+#define TMR2        SIM_SFR(SIM_TMR2)
+#define TRISA       SIM_SFR(SIM_TRISA)
+#define TRISB       SIM_SFR(SIM_TRISB)
+#define TRISC       SIM_SFR(SIM_TRISC)
+#define TXREG       SIM_SFR(SIM_TXREG)
+#define TXREG2      SIM_SFR(SIM_TXREG2)
+#define TXSTA       SIM_SFR(SIM_TXSTA)
+#define TXSTA2      SIM_SFR(SIM_TXSTA2)
+
+/* Bit views, LSB first */
+
+typedef union {
+    struct { uint8_t ADON:1; uint8_t GO:1; uint8_t CHS:5; uint8_t :1; };
+    struct { uint8_t :1; uint8_t GO_NOT_DONE:1; };
+    struct { uint8_t :1; uint8_t DONE:1; };
+} ADCON0bits_t;
+
+typedef union {
+    struct { uint8_t ABDEN:1; uint8_t WUE:1; uint8_t :1; uint8_t BRG16:1;
+             uint8_t CKTXP:1; uint8_t DTRXP:1; uint8_t RCIDL:1; uint8_t ABDOVF:1; };
+} BAUDCONbits_t;
+
+typedef union {
+    struct { uint8_t RD:1; uint8_t WR:1; uint8_t WREN:1; uint8_t WRERR:1;
+             uint8_t FREE:1; uint8_t :1; uint8_t CFGS:1; uint8_t EEPGD:1; };
+} EECON1bits_t;
+
+typedef union {
+    struct { uint8_t RBIF:1; uint8_t INT0IF:1; uint8_t TMR0IF:1; uint8_t RBIE:1;
+             uint8_t INT0IE:1; uint8_t TMR0IE:1; uint8_t PEIE:1; uint8_t GIE:1; };
+    struct { uint8_t :6; uint8_t GIEL:1; uint8_t GIEH:1; };
+    struct { uint8_t :6; uint8_t PEIE_GIEL:1; uint8_t GIE_GIEH:1; };
+} INTCONbits_t;
+
+typedef union {
+    struct { uint8_t RBIP:1; uint8_t :1; uint8_t TMR0IP:1; uint8_t :1;
+             uint8_t INTEDG2:1; uint8_t INTEDG1:1; uint8_t INTEDG0:1; uint8_t NOT_RBPU:1; };
+} INTCON2bits_t;
+
+typedef union {
+    struct { uint8_t :4; uint8_t IOCB4:1; uint8_t IOCB5:1; uint8_t IOCB6:1; uint8_t IOCB7:1; };
+} IOCBbits_t;
+
+typedef union {
+    struct { uint8_t TMR1IF:1; uint8_t TMR2IF:1; uint8_t CCP1IF:1; uint8_t SSPIF:1;
+             uint8_t TXIF:1; uint8_t RCIF:1; uint8_t ADIF:1; uint8_t :1; };
+    struct { uint8_t :3; uint8_t SSP1IF:1; uint8_t TX1IF:1; uint8_t RC1IF:1; };
+} PIR1bits_t;
+
+typedef union {
+    struct { uint8_t TMR1IE:1; uint8_t TMR2IE:1; uint8_t CCP1IE:1; uint8_t SSPIE:1;
+             uint8_t TXIE:1; uint8_t RCIE:1; uint8_t ADIE:1; uint8_t :1; };
+    struct { uint8_t :3; uint8_t SSP1IE:1; uint8_t TX1IE:1; uint8_t RC1IE:1; };
+} PIE1bits_t;
+
+typedef union {
+    struct { uint8_t CCP2IF:1; uint8_t TMR3IF:1; uint8_t HLVDIF:1; uint8_t BCL1IF:1;
+             uint8_t EEIF:1; uint8_t C2IF:1; uint8_t C1IF:1; uint8_t OSCFIF:1; };
+} PIR2bits_t;
+
+typedef union {
+    struct { uint8_t CCP2IF:1; uint8_t TMR1GIF:1; uint8_t TMR3GIF:1; uint8_t TMR5GIF:1;
+             uint8_t TX2IF:1; uint8_t RC2IF:1; uint8_t BCL2IF:1; uint8_t SSP2IF:1; };
+} PIR3bits_t;
+
+typedef union {
+    struct { uint8_t CCP2IE:1; uint8_t TMR1GIE:1; uint8_t TMR3GIE:1; uint8_t TMR5GIE:1;
+             uint8_t TX2IE:1; uint8_t RC2IE:1; uint8_t BCL2IE:1; uint8_t SSP2IE:1; };
+} PIE3bits_t;
+
+typedef union {
+    struct { uint8_t CCP3IF:1; uint8_t CCP4IF:1; uint8_t CCP5IF:1; uint8_t :5; };
+} PIR4bits_t;
+
+typedef union {
+    struct { uint8_t CCP3IE:1; uint8_t CCP4IE:1; uint8_t CCP5IE:1; uint8_t :5; };
+} PIE4bits_t;
+
+typedef union {
+    struct { uint8_t RA0:1; uint8_t RA1:1; uint8_t RA2:1; uint8_t RA3:1;
+             uint8_t RA4:1; uint8_t RA5:1; uint8_t RA6:1; uint8_t RA7:1; };
+} PORTAbits_t;
+
+typedef union {
+    struct { uint8_t RB0:1; uint8_t RB1:1; uint8_t RB2:1; uint8_t RB3:1;
+             uint8_t RB4:1; uint8_t RB5:1; uint8_t RB6:1; uint8_t RB7:1; };
+} PORTBbits_t;
+
+typedef union {
+    struct { uint8_t RC0:1; uint8_t RC1:1; uint8_t RC2:1; uint8_t RC3:1;
+             uint8_t RC4:1; uint8_t RC5:1; uint8_t RC6:1; uint8_t RC7:1; };
+} PORTCbits_t;
+
+typedef union {
+    struct { uint8_t LATA0:1; uint8_t LATA1:1; uint8_t LATA2:1; uint8_t LATA3:1;
+             uint8_t LATA4:1; uint8_t LATA5:1; uint8_t LATA6:1; uint8_t LATA7:1; };
+} LATAbits_t;
+
+typedef union {
+    struct { uint8_t LATB0:1; uint8_t LATB1:1; uint8_t LATB2:1; uint8_t LATB3:1;
+             uint8_t LATB4:1; uint8_t LATB5:1; uint8_t LATB6:1; uint8_t LATB7:1; };
+} LATBbits_t;
+
+typedef union {
+    struct { uint8_t LATC0:1; uint8_t LATC1:1; uint8_t LATC2:1; uint8_t LATC3:1;
+             uint8_t LATC4:1; uint8_t LATC5:1; uint8_t LATC6:1; uint8_t LATC7:1; };
+} LATCbits_t;
+
+typedef union {
+    struct { uint8_t TRISA0:1; uint8_t TRISA1:1; uint8_t TRISA2:1; uint8_t TRISA3:1;
+             uint8_t TRISA4:1; uint8_t TRISA5:1; uint8_t TRISA6:1; uint8_t TRISA7:1; };
+} TRISAbits_t;
+
+typedef union {
+    struct { uint8_t TRISB0:1; uint8_t TRISB1:1; uint8_t TRISB2:1; uint8_t TRISB3:1;
+             uint8_t TRISB4:1; uint8_t TRISB5:1; uint8_t TRISB6:1; uint8_t TRISB7:1; };
+} TRISBbits_t;
+
+typedef union {
+    struct { uint8_t TRISC0:1; uint8_t TRISC1:1; uint8_t TRISC2:1; uint8_t TRISC3:1;
+             uint8_t TRISC4:1; uint8_t TRISC5:1; uint8_t TRISC6:1; uint8_t TRISC7:1; };
+} TRISCbits_t;
+
+typedef union {
+    struct { uint8_t :7; uint8_t IPEN:1; };
+} RCONbits_t;
+
+typedef union {
+    struct { uint8_t RX9D:1; uint8_t OERR:1; uint8_t FERR:1; uint8_t ADDEN:1;
+             uint8_t CREN:1; uint8_t SREN:1; uint8_t RX9:1; uint8_t SPEN:1; };
+} RCSTAbits_t;
+
+typedef union {
+    struct { uint8_t SSPM:4; uint8_t CKP:1; uint8_t SSPEN:1; uint8_t SSPOV:1; uint8_t WCOL:1; };
+} SSPCON1bits_t;
+
+typedef union {
+    struct { uint8_t SEN:1; uint8_t RSEN:1; uint8_t PEN:1; uint8_t RCEN:1;
+             uint8_t ACKEN:1; uint8_t ACKDT:1; uint8_t ACKSTAT:1; uint8_t GCEN:1; };
+} SSPCON2bits_t;
+
+typedef union {
+    struct { uint8_t BF:1; uint8_t UA:1; uint8_t R_W:1; uint8_t S:1;
+             uint8_t P:1; uint8_t D_A:1; uint8_t CKE:1; uint8_t SMP:1; };
+} SSPSTATbits_t;
+
+typedef union {
+    struct { uint8_t T0PS:3; uint8_t PSA:1; uint8_t T0SE:1; uint8_t T0CS:1; uint8_t T08BIT:1; uint8_t TMR0ON:1; };
+} T0CONbits_t;
+
+typedef union {
+    struct { uint8_t TMR1ON:1; uint8_t T1RD16:1; uint8_t T1SYNC:1; uint8_t T1SOSCEN:1;
+             uint8_t T1CKPS:2; uint8_t TMR1CS:2; };
+} T1CONbits_t;
+
+typedef union {
+    struct { uint8_t T2CKPS:2; uint8_t TMR2ON:1; uint8_t T2OUTPS:4; uint8_t :1; };
+} T2CONbits_t;
+
+typedef union {
+    struct { uint8_t TX9D:1; uint8_t TRMT:1; uint8_t BRGH:1; uint8_t SENDB:1;
+             uint8_t SYNC:1; uint8_t TXEN:1; uint8_t TX9:1; uint8_t CSRC:1; };
+} TXSTAbits_t;
+
+#define ADCON0bits      SIM_SFR_BITS(ADCON0bits_t, SIM_ADCON0)
+#define BAUDCONbits     SIM_SFR_BITS(BAUDCONbits_t, SIM_BAUDCON)
+#define BAUDCON2bits    SIM_SFR_BITS(BAUDCONbits_t, SIM_BAUDCON2)
+#define EECON1bits      SIM_SFR_BITS(EECON1bits_t, SIM_EECON1)
+#define INTCONbits      SIM_SFR_BITS(INTCONbits_t, SIM_INTCON)
+#define INTCON2bits     SIM_SFR_BITS(INTCON2bits_t, SIM_INTCON2)
+#define IOCBbits        SIM_SFR_BITS(IOCBbits_t, SIM_IOCB)
+#define LATAbits        SIM_SFR_BITS(LATAbits_t, SIM_LATA)
+#define LATBbits        SIM_SFR_BITS(LATBbits_t, SIM_LATB)
+#define LATCbits        SIM_SFR_BITS(LATCbits_t, SIM_LATC)
+#define PIE1bits        SIM_SFR_BITS(PIE1bits_t, SIM_PIE1)
+#define PIE3bits        SIM_SFR_BITS(PIE3bits_t, SIM_PIE3)
+#define PIE4bits        SIM_SFR_BITS(PIE4bits_t, SIM_PIE4)
+#define PIR1bits        SIM_SFR_BITS(PIR1bits_t, SIM_PIR1)
+#define PIR2bits        SIM_SFR_BITS(PIR2bits_t, SIM_PIR2)
+#define PIR3bits        SIM_SFR_BITS(PIR3bits_t, SIM_PIR3)
+#define PIR4bits        SIM_SFR_BITS(PIR4bits_t, SIM_PIR4)
+#define PORTAbits       SIM_SFR_BITS(PORTAbits_t, SIM_PORTA)
+#define PORTBbits       SIM_SFR_BITS(PORTBbits_t, SIM_PORTB)
+#define PORTCbits       SIM_SFR_BITS(PORTCbits_t, SIM_PORTC)
+#define RCONbits        SIM_SFR_BITS(RCONbits_t, SIM_RCON)
+#define RCSTAbits       SIM_SFR_BITS(RCSTAbits_t, SIM_RCSTA)
+#define RCSTA2bits      SIM_SFR_BITS(RCSTAbits_t, SIM_RCSTA2)
+#define SSPCON1bits     SIM_SFR_BITS(SSPCON1bits_t, SIM_SSPCON1)
+#define SSPCON2bits     SIM_SFR_BITS(SSPCON2bits_t, SIM_SSPCON2)
+#define SSPSTATbits     SIM_SFR_BITS(SSPSTATbits_t, SIM_SSPSTAT)
+#define T0CONbits       SIM_SFR_BITS(T0CONbits_t, SIM_T0CON)
+#define T1CONbits       SIM_SFR_BITS(T1CONbits_t, SIM_T1CON)
+#define T2CONbits       SIM_SFR_BITS(T2CONbits_t, SIM_T2CON)
+#define TRISAbits       SIM_SFR_BITS(TRISAbits_t, SIM_TRISA)
+#define TRISBbits       SIM_SFR_BITS(TRISBbits_t, SIM_TRISB)
+#define TRISCbits       SIM_SFR_BITS(TRISCbits_t, SIM_TRISC)
+#define TXSTAbits       SIM_SFR_BITS(TXSTAbits_t, SIM_TXSTA)
+#define TXSTA2bits      SIM_SFR_BITS(TXSTAbits_t, SIM_TXSTA2)
+
+#endif /* __SIM_XC_H__ */
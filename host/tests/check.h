@@ -0,0 +1,31 @@
+/*
+ * File:   check.h
+ * Author: Matt
+ *
+ * Minimal checks for the host tests. A test program runs its cases in
+ * order and exits non-zero if any check failed.
+ */
+
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+#include <string.h>
+
+static int _g_check_failed;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        _g_check_failed++; } } while (0)
+
+#define CHECK_STR(got, want) \
+    do { const char *_got = (got); const char *_want = (want); \
+        if (strcmp(_got, _want)) { fprintf(stderr, "%s:%d: got \"%s\"\n%*swant \"%s\"\n", \
+            __FILE__, __LINE__, _got, (int)strlen(__FILE__) + 5, "", _want); _g_check_failed++; } } while (0)
+
+#define RUN(test) \
+    do { fprintf(stderr, "%s\n", #test); test(); } while (0)
+
+#define CHECK_RESULT() (_g_check_failed ? 1 : 0)
+
+#endif /* __CHECK_H__ */
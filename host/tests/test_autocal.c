@@ -0,0 +1,192 @@
+/*
+ * File:   test_autocal.c
+ * Author: Matt
+ *
+ * autocal on the whole firmware: the DAC's outputs, with offset and
+ * gain errors, are wired to AN0 / AN1 through a noisy ADC. The search
+ * has to land on the code that best hits the target, save it to NV and
+ * do it in far fewer conversions than a full reading at every step.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "check.h"
+
+#define DAC_ADDR        0x60
+#define DAC_VOLATILE(ch)        (ch)
+#define DAC_NONVOLATILE(ch)     (0x10 + (ch))
+
+#define AUTOCAL_SAMPLES 64
+#define SAR_STEPS       12
+
+/* Always full readings: the ends, the best pair and the verification */
+#define FULL_READINGS   5
+
+int firmware_main(void);
+void isr_high(void);
+
+static sim_mcp47feb_t *_g_dac;
+static size_t _g_seen;
+static char _g_reply[128];
+
+static bool output_has(void *text)
+{
+    return strstr(sim_usart_output(SIM_UART1) + _g_seen, text) != NULL;
+}
+
+static void send_line(const char *line)
+{
+    _g_seen = sim_usart_output_len(SIM_UART1);
+    sim_usart_send(SIM_UART1, line, strlen(line));
+    sim_usart_send(SIM_UART1, "\r", 1);
+}
+
+/* The machine mode reply to one command, "" on a timeout */
+static const char *command(const char *line)
+{
+    const char *start;
+    size_t len;
+
+    send_line(line);
+    _g_reply[0] = 0;
+
+    if (!sim_fw_run_until(output_has, "\r\n", 2000000))
+        return _g_reply;
+
+    start = sim_usart_output(SIM_UART1) + _g_seen;
+    len = strstr(start, "\r\n") - start;
+
+    if (len >= sizeof(_g_reply))
+        len = sizeof(_g_reply) - 1;
+
+    memcpy(_g_reply, start, len);
+    _g_reply[len] = 0;
+
+    return _g_reply;
+}
+
+static void boot(bool machine)
+{
+    sim_fw_start(firmware_main, isr_high);
+
+    _g_seen = 0;
+    CHECK(sim_fw_run_until(output_has, "cmd>", 2000000));
+
+    if (!machine)
+        return;
+
+    /* Switched by a human mode command, so no reply to that one */
+    send_line("mode machine");
+    CHECK(sim_fw_run_until(output_has, "mode machine\r\n", 100000));
+    CHECK_STR(command("mode"), "OK machine");
+}
+
+static void setup(int16_t offset_mv, int32_t gain_ppm)
+{
+    uint8_t ch;
+
+    for (ch = 0; ch < 2; ch++)
+    {
+        sim_mcp47feb_set(_g_dac, DAC_VOLATILE(ch), 0);
+        sim_mcp47feb_set(_g_dac, DAC_NONVOLATILE(ch), 0);
+        sim_mcp47feb_trim(_g_dac, ch, offset_mv, gain_ppm);
+    }
+}
+
+/* Code nearest target_mv for a DAC with these errors */
+static int32_t ideal_code(uint16_t target_mv, int16_t offset_mv, int32_t gain_ppm)
+{
+    double lsb = 5000.0 * (1.0 + gain_ppm / 1e6) / 4096.0;
+
+    return (int32_t)((target_mv - offset_mv) / lsb + 0.5);
+}
+
+static void check_autocal(const char *which, uint8_t ch, uint16_t target_mv, int16_t offset_mv, int32_t gain_ppm)
+{
+    char line[32];
+    unsigned code = 0;
+    unsigned mv = 0;
+    unsigned conversions = 0;
+    uint16_t nv_writes;
+    int32_t want;
+
+    setup(offset_mv, gain_ppm);
+    boot(true);
+
+    nv_writes = sim_mcp47feb_nv_writes(_g_dac);
+    want = ideal_code(target_mv, offset_mv, gain_ppm);
+
+    sprintf(line, "autocal %s %u", which, target_mv);
+    CHECK(sscanf(command(line), "OK code=%u mv=%u conversions=%u", &code, &mv, &conversions) == 3);
+
+    CHECK(abs((int32_t)code - want) <= 1);
+    CHECK(abs((int)mv - target_mv) <= 2);
+    CHECK(abs((int)sim_mcp47feb_mv(_g_dac, ch) - target_mv) <= 2);
+
+    /* Searched and saved on the channel asked for, the other untouched */
+    CHECK(sim_mcp47feb_get(_g_dac, DAC_VOLATILE(ch)) == code);
+    CHECK(sim_mcp47feb_get(_g_dac, DAC_NONVOLATILE(ch)) == code);
+    CHECK(sim_mcp47feb_get(_g_dac, DAC_VOLATILE(ch ^ 1)) == 0);
+    CHECK(sim_mcp47feb_nv_writes(_g_dac) == nv_writes + 1);
+
+    /* Early verdicts: the SAR steps take well under full readings */
+    CHECK(conversions > FULL_READINGS * AUTOCAL_SAMPLES);
+    CHECK(conversions - FULL_READINGS * AUTOCAL_SAMPLES < SAR_STEPS * AUTOCAL_SAMPLES * 2 / 3);
+}
+
+static void test_offset(void)
+{
+    check_autocal("offset", 0, 1250, 12, -4000);
+}
+
+static void test_gain(void)
+{
+    check_autocal("gain", 1, 4000, -8, 6000);
+}
+
+/* With a 40mV offset nothing reaches 20mV: refused, nothing saved */
+static void test_out_of_reach(void)
+{
+    uint16_t nv_writes;
+
+    setup(40, 0);
+    boot(true);
+    nv_writes = sim_mcp47feb_nv_writes(_g_dac);
+
+    CHECK_STR(command("autocal offset 20"), "ERR");
+    CHECK(sim_mcp47feb_nv_writes(_g_dac) == nv_writes);
+    CHECK(sim_mcp47feb_get(_g_dac, DAC_NONVOLATILE(0)) == 0);
+
+    CHECK_STR(command("autocal offset 5001"), "ERR");
+    CHECK_STR(command("autocal both 100"), "ERR");
+}
+
+static void test_human(void)
+{
+    setup(0, 0);
+    boot(false);
+
+    send_line("autocal offset 2500");
+    CHECK(sim_fw_run_until(output_has, "cmd>", 2000000));
+    CHECK(output_has("Calibrated offset to 2048 ("));
+    CHECK(output_has("saved to NV"));
+    CHECK(sim_mcp47feb_get(_g_dac, DAC_NONVOLATILE(0)) == 2048);
+}
+
+int main(void)
+{
+    _g_dac = sim_mcp47feb_add(DAC_ADDR);
+    sim_adc_connect(0, _g_dac, 0);
+    sim_adc_connect(1, _g_dac, 1);
+    sim_adc_noise(60);
+
+    RUN(test_offset);
+    RUN(test_gain);
+    RUN(test_out_of_reach);
+    RUN(test_human);
+
+    return CHECK_RESULT();
+}
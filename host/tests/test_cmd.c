@@ -0,0 +1,153 @@
+/*
+ * File:   test_cmd.c
+ * Author: Matt
+ *
+ * Console commands on the whole firmware, in machine mode: what a host
+ * gets back, and what reaches the DAC.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "check.h"
+
+#define DAC_ADDR        0x60
+
+int firmware_main(void);
+void isr_high(void);
+
+static sim_mcp47feb_t *_g_dac;
+static size_t _g_seen;
+static char _g_reply[256];
+
+static bool output_has(void *text)
+{
+    return strstr(sim_usart_output(SIM_UART1) + _g_seen, text) != NULL;
+}
+
+static void send_line(const char *line)
+{
+    _g_seen = sim_usart_output_len(SIM_UART1);
+    sim_usart_send(SIM_UART1, line, strlen(line));
+    sim_usart_send(SIM_UART1, "\r", 1);
+}
+
+/* The first line of the reply, "" on a timeout */
+static const char *command(const char *line)
+{
+    const char *start;
+    size_t len;
+
+    send_line(line);
+    _g_reply[0] = 0;
+
+    if (!sim_fw_run_until(output_has, "\r\n", 2000000))
+        return _g_reply;
+
+    start = sim_usart_output(SIM_UART1) + _g_seen;
+    len = strstr(start, "\r\n") - start;
+
+    if (len >= sizeof(_g_reply))
+        len = sizeof(_g_reply) - 1;
+
+    memcpy(_g_reply, start, len);
+    _g_reply[len] = 0;
+
+    return _g_reply;
+}
+
+static void boot(void)
+{
+    sim_fw_start(firmware_main, isr_high);
+
+    _g_seen = 0;
+    CHECK(sim_fw_run_until(output_has, "cmd>", 2000000));
+
+    /* Switched by a human mode command, so no reply to that one */
+    send_line("mode machine");
+    CHECK(sim_fw_run_until(output_has, "mode machine\r\n", 100000));
+    CHECK_STR(command("mode"), "OK machine");
+}
+
+/* Bad addresses fail the whole command before any EEPROM cycle */
+static void test_nvbatch_addresses(void)
+{
+    static const char * const bad[] = {
+        "nvbatch 1 2 zz", "nvbatch 1 2 6g", "nvbatch 1 2 0", "nvbatch 1 2 ff", "nvbatch 1 2 60 80",
+    };
+    uint16_t nv_writes;
+    uint8_t i;
+
+    boot();
+    nv_writes = sim_mcp47feb_nv_writes(_g_dac);
+
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    {
+        CHECK_STR(command(bad[i]), "ERR");
+        CHECK(sim_mcp47feb_nv_writes(_g_dac) == nv_writes);
+    }
+
+    CHECK_STR(command("nvbatch 100 200 60"), "OK");
+    CHECK(sim_mcp47feb_get(_g_dac, 0x10) == 100);
+    CHECK(sim_mcp47feb_get(_g_dac, 0x11) == 200);
+}
+
+/* Queries answer on the OK line, not as a human readable table */
+static void test_query_replies(void)
+{
+    unsigned hits[2];
+    unsigned misses[2];
+
+    boot();
+
+    /* The counters run on from earlier tests: look at the steps */
+    CHECK_STR(command("cache flush"), "OK");
+    CHECK(!strncmp(command("dump"), "OK ", 3));
+    CHECK(sscanf(command("cache"), "OK addr=0060 valid=04030003 hits=%u misses=%u", &hits[0], &misses[0]) == 2);
+
+    /* The whole basic map comes from the cache the second time */
+    CHECK(!strncmp(command("dump"), "OK ", 3));
+    CHECK(sscanf(command("cache"), "OK addr=0060 valid=04030003 hits=%u misses=%u", &hits[1], &misses[1]) == 2);
+    CHECK(hits[1] == hits[0] + 5 && misses[1] == misses[0]);
+
+    CHECK_STR(command("gang"), "OK 0000");
+    CHECK_STR(command("gang 03"), "OK");
+    CHECK_STR(command("gang"), "OK 0003");
+    CHECK_STR(command("gang off"), "OK");
+    CHECK_STR(command("gang"), "OK 0000");
+}
+
+/* A sweep's records are its reply: they come ahead of the OK */
+static void test_sweep_machine(void)
+{
+    const char *out;
+
+    boot();
+    send_line("sweep 0 0 64 8");
+    CHECK(sim_fw_run_until(output_has, "OK\r\n", 2000000));
+
+    out = sim_usart_output(SIM_UART1) + _g_seen;
+    CHECK_STR(out,
+            "SWEEP 0 0 64 8 12 9\r\n"
+            "8000000808080808080808\r\n"
+            "END 9\r\n"
+            "OK\r\n");
+
+    /* Refused before the header: the error text stays muted */
+    CHECK_STR(command("sweep 2 0 64 8"), "ERR");
+}
+
+int main(void)
+{
+    _g_dac = sim_mcp47feb_add(DAC_ADDR);
+    sim_adc_connect(0, _g_dac, 0);
+    sim_adc_connect(1, _g_dac, 1);
+
+    RUN(test_nvbatch_addresses);
+    RUN(test_query_replies);
+    RUN(test_sweep_machine);
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,527 @@
+/*
+ * File:   test_dacprog.c
+ * Author: Matt
+ *
+ * libdacprog and dacprov against dacsim stations: the real firmware on
+ * the simulator, behind a PTY each. Several stations run at once, as on
+ * the line, and their DACs are checked from the state files dacsim
+ * writes when it's stopped.
+ *
+ *   test_dacprog path/to/dacsim path/to/dacprov
+ */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "dacprog.h"
+#include "check.h"
+
+#define STATIONS        3
+#define RUN_MS          30000
+
+typedef struct {
+    pid_t pid;
+    char path[64];
+    char state[64];
+} station_t;
+
+typedef struct {
+    unsigned addr;
+    unsigned dac0;
+    unsigned dac1;
+    unsigned nvdac0;
+    unsigned nvdac1;
+} dac_state_t;
+
+typedef struct {
+    bool done;
+    dacprog_reply_t reply;
+} result_t;
+
+static const char *_g_dacsim;
+static const char *_g_dacprov;
+static char _g_dir[] = "/tmp/test_dacprogXXXXXX";
+static unsigned _g_spawned;
+
+static bool station_start(station_t *station, uint8_t addr)
+{
+    char addr_arg[8];
+    int fds[2];
+    FILE *f;
+
+    sprintf(addr_arg, "%02x", addr);
+    sprintf(station->state, "%s/state%u.txt", _g_dir, _g_spawned++);
+
+    if (pipe(fds))
+        return false;
+
+    station->pid = fork();
+    if (!station->pid)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl(_g_dacsim, _g_dacsim, "-a", addr_arg, "-s", station->state, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    f = fdopen(fds[0], "r");
+    station->path[0] = 0;
+
+    if (f)
+    {
+        if (fgets(station->path, sizeof(station->path), f))
+            station->path[strcspn(station->path, "\n")] = 0;
+        fclose(f);
+    }
+
+    return station->pid > 0 && station->path[0] == '/';
+}
+
+/* Stopped with SIGTERM, so the state file gets written */
+static bool station_stop(station_t *station, dac_state_t *dac)
+{
+    FILE *f;
+    int n = 0;
+
+    kill(station->pid, SIGTERM);
+    waitpid(station->pid, NULL, 0);
+
+    f = fopen(station->state, "r");
+    if (!f)
+        return false;
+
+    if (dac)
+        n = fscanf(f, "addr %x dac0 %u dac1 %u nvdac0 %u nvdac1 %u",
+                &dac->addr, &dac->dac0, &dac->dac1, &dac->nvdac0, &dac->nvdac1);
+
+    fclose(f);
+    unlink(station->state);
+
+    return !dac || n == 5;
+}
+
+static void on_done(dacprog_port_t *port, const dacprog_reply_t *reply, void *ctx)
+{
+    result_t *result = ctx;
+
+    (void)port;
+    result->done = true;
+    result->reply = *reply;
+}
+
+/* Text and frames queued on all stations at once, then run together */
+static void test_parallel(void)
+{
+    station_t stations[STATIONS];
+    dacprog_port_t *ports[STATIONS];
+    result_t set[STATIONS];
+    result_t dump[STATIONS];
+    result_t nvset[STATIONS];
+    result_t show[STATIONS];
+    uint8_t payload[5];
+    uint16_t regs[DACPROG_DUMP_REGS];
+    dac_state_t dac;
+    dacprog_t *prog;
+    unsigned i;
+
+    prog = dacprog_new();
+    CHECK(prog != NULL);
+
+    memset(set, 0, sizeof(set));
+    memset(dump, 0, sizeof(dump));
+    memset(nvset, 0, sizeof(nvset));
+    memset(show, 0, sizeof(show));
+
+    for (i = 0; i < STATIONS; i++)
+    {
+        CHECK(station_start(&stations[i], 0x60));
+        ports[i] = dacprog_open(prog, stations[i].path, 0);
+        CHECK(ports[i] != NULL);
+
+        /* Text, then frames (into framed mode), then text again (out) */
+        CHECK(dacprog_command(ports[i], "nvset 100 200", 0, on_done, &nvset[i]));
+
+        payload[0] = 0;
+        payload[1] = 0;
+        payload[2] = 10 + i;
+        payload[3] = 0;
+        payload[4] = 20 + i;
+        CHECK(dacprog_frame(ports[i], DACPROG_OP_SET, payload, 5, 0, on_done, &set[i]));
+        CHECK(dacprog_frame(ports[i], DACPROG_OP_DUMP, NULL, 0, 0, on_done, &dump[i]));
+        CHECK(dacprog_command(ports[i], "show", 0, on_done, &show[i]));
+    }
+
+    CHECK(dacprog_pending(prog) == STATIONS * 4);
+    CHECK(dacprog_run(prog, RUN_MS));
+    CHECK(dacprog_pending(prog) == 0);
+
+    for (i = 0; i < STATIONS; i++)
+    {
+        CHECK(nvset[i].done && nvset[i].reply.status == DACPROG_OK);
+        CHECK(set[i].done && set[i].reply.status == DACPROG_OK);
+        CHECK(dump[i].done && dacprog_parse_dump(&dump[i].reply, regs));
+        CHECK(regs[DACPROG_DUMP_DAC0] == 10 + i && regs[DACPROG_DUMP_DAC1] == 20 + i);
+        CHECK(regs[DACPROG_DUMP_DAC0_NV] == 100 && regs[DACPROG_DUMP_DAC1_NV] == 200);
+        CHECK(show[i].done && !strncmp(show[i].reply.text, "addr=0060 ", 10));
+    }
+
+    dacprog_free(prog);
+
+    for (i = 0; i < STATIONS; i++)
+    {
+        CHECK(station_stop(&stations[i], &dac));
+        CHECK(dac.dac0 == 10 + i && dac.nvdac0 == 100 && dac.nvdac1 == 200);
+    }
+}
+
+/* More frames than fit the firmware's buffer, answered in order */
+static void test_pipeline(void)
+{
+    station_t station;
+    dacprog_port_t *port;
+    result_t info;
+    result_t reads[16];
+    uint8_t payload[3];
+    dacprog_t *prog;
+    unsigned i;
+
+    memset(&info, 0, sizeof(info));
+    memset(reads, 0, sizeof(reads));
+
+    prog = dacprog_new();
+    CHECK(station_start(&station, 0x60));
+    port = dacprog_open(prog, station.path, 0);
+    CHECK(port != NULL);
+
+    CHECK(dacprog_frame(port, DACPROG_OP_INFO, NULL, 0, 0, on_done, &info));
+
+    for (i = 0; i < 16; i++)
+    {
+        payload[0] = 0x00;
+        payload[1] = 0;
+        payload[2] = (uint8_t)i;
+        CHECK(dacprog_frame(port, DACPROG_OP_WRITE, payload, 3, 0, NULL, NULL));
+
+        payload[0] = 0x00;
+        CHECK(dacprog_frame(port, DACPROG_OP_READ, payload, 1, 0, on_done, &reads[i]));
+    }
+
+    CHECK(dacprog_run(prog, RUN_MS));
+
+    CHECK(info.reply.status == DACPROG_OK && info.reply.len == 3);
+    CHECK(info.reply.data[0] == 1);
+    CHECK(info.reply.data[1] == DACPROG_RX_BUF_SIZE);
+    CHECK(info.reply.data[2] == DACPROG_MAX_PAYLOAD);
+
+    for (i = 0; i < 16; i++)
+    {
+        CHECK(reads[i].reply.status == DACPROG_OK && reads[i].reply.len == 2);
+        CHECK(reads[i].reply.data[0] == 0 && reads[i].reply.data[1] == i);
+    }
+
+    dacprog_free(prog);
+    CHECK(station_stop(&station, NULL));
+}
+
+/* No DAC at the selected address: ERR in text, FAILED in a frame */
+static void test_missing_dac(void)
+{
+    station_t station;
+    dacprog_port_t *port;
+    result_t text;
+    result_t frame;
+    result_t opcode;
+    uint8_t payload[5] = { 1, 0, 1, 0, 2 };
+    dacprog_t *prog;
+
+    memset(&text, 0, sizeof(text));
+    memset(&frame, 0, sizeof(frame));
+    memset(&opcode, 0, sizeof(opcode));
+
+    prog = dacprog_new();
+    CHECK(station_start(&station, 0x61));
+    port = dacprog_open(prog, station.path, 0);
+    CHECK(port != NULL);
+
+    CHECK(dacprog_command(port, "nvset 1 2", 0, on_done, &text));
+    CHECK(dacprog_frame(port, DACPROG_OP_SET, payload, 5, 0, on_done, &frame));
+    CHECK(dacprog_frame(port, 0x0E, NULL, 0, 0, on_done, &opcode));
+    CHECK(dacprog_run(prog, RUN_MS));
+
+    CHECK(text.reply.status == DACPROG_ERR);
+    CHECK(frame.reply.status == DACPROG_ERR && frame.reply.proto_status == 1);
+    CHECK(opcode.reply.status == DACPROG_ERR && opcode.reply.proto_status == 2);
+
+    /* Not taken by the library */
+    CHECK(!dacprog_command(port, "set 1 2; dump", 0, on_done, &text));
+    CHECK(!dacprog_frame(port, DACPROG_OP_WRITE, payload, DACPROG_MAX_PAYLOAD + 1, 0, on_done, &frame));
+
+    dacprog_free(prog);
+    CHECK(station_stop(&station, NULL));
+}
+
+/* Ganged lanes have a value each, which a READ or DUMP frame can't carry */
+static void test_gang_frames(void)
+{
+    station_t station;
+    dacprog_port_t *port;
+    result_t gang;
+    result_t read;
+    result_t dump;
+    result_t off;
+    result_t again;
+    uint8_t reg = 0x00;
+    dacprog_t *prog;
+
+    memset(&gang, 0, sizeof(gang));
+    memset(&read, 0, sizeof(read));
+    memset(&dump, 0, sizeof(dump));
+    memset(&off, 0, sizeof(off));
+    memset(&again, 0, sizeof(again));
+
+    prog = dacprog_new();
+    CHECK(station_start(&station, 0x60));
+    port = dacprog_open(prog, station.path, 0);
+    CHECK(port != NULL);
+
+    CHECK(dacprog_command(port, "gang 03", 0, on_done, &gang));
+    CHECK(dacprog_frame(port, DACPROG_OP_READ, &reg, 1, 0, on_done, &read));
+    CHECK(dacprog_frame(port, DACPROG_OP_DUMP, NULL, 0, 0, on_done, &dump));
+    CHECK(dacprog_command(port, "gang off", 0, on_done, &off));
+    CHECK(dacprog_frame(port, DACPROG_OP_READ, &reg, 1, 0, on_done, &again));
+    CHECK(dacprog_run(prog, RUN_MS));
+
+    CHECK(gang.reply.status == DACPROG_OK);
+    CHECK(read.reply.status == DACPROG_ERR && read.reply.proto_status == 1);
+    CHECK(dump.reply.status == DACPROG_ERR && dump.reply.proto_status == 1);
+    CHECK(off.reply.status == DACPROG_OK);
+    CHECK(again.reply.status == DACPROG_OK && again.reply.len == 2);
+
+    dacprog_free(prog);
+    CHECK(station_stop(&station, NULL));
+}
+
+/* A station left in framed mode by a client that went away */
+static void test_resync(void)
+{
+    station_t station;
+    dacprog_port_t *port;
+    result_t info;
+    result_t mode;
+    dacprog_t *prog;
+
+    memset(&info, 0, sizeof(info));
+    memset(&mode, 0, sizeof(mode));
+
+    prog = dacprog_new();
+    CHECK(station_start(&station, 0x60));
+
+    port = dacprog_open(prog, station.path, 0);
+    CHECK(dacprog_frame(port, DACPROG_OP_INFO, NULL, 0, 0, on_done, &info));
+    CHECK(dacprog_run(prog, RUN_MS));
+    CHECK(info.reply.status == DACPROG_OK);
+    dacprog_close(port);
+
+    port = dacprog_open(prog, station.path, 0);
+    CHECK(dacprog_command(port, "mode", 0, on_done, &mode));
+    CHECK(dacprog_run(prog, RUN_MS));
+    CHECK(mode.reply.status == DACPROG_OK);
+    CHECK_STR(mode.reply.text, "machine");
+
+    dacprog_free(prog);
+    CHECK(station_stop(&station, NULL));
+}
+
+/* Nobody behind the PTY: everything queued times out, nothing hangs */
+static void test_timeout(void)
+{
+    dacprog_port_t *port;
+    result_t first;
+    result_t second;
+    dacprog_t *prog;
+    int master;
+
+    memset(&first, 0, sizeof(first));
+    memset(&second, 0, sizeof(second));
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    CHECK(master >= 0 && !grantpt(master) && !unlockpt(master));
+
+    prog = dacprog_new();
+    port = dacprog_open(prog, ptsname(master), 0);
+    CHECK(port != NULL);
+
+    CHECK(dacprog_command(port, "show", 200, on_done, &first));
+    CHECK(dacprog_frame(port, DACPROG_OP_INFO, NULL, 0, 200, on_done, &second));
+    CHECK(dacprog_run(prog, 5000));
+
+    CHECK(first.done && first.reply.status == DACPROG_TIMEOUT);
+    CHECK(second.done && second.reply.status == DACPROG_TIMEOUT);
+
+    dacprog_free(prog);
+    close(master);
+}
+
+/* The station going away mid-command fails the port, not the loop */
+static void test_hangup(void)
+{
+    station_t station;
+    dacprog_port_t *port;
+    result_t result;
+    dacprog_t *prog;
+
+    memset(&result, 0, sizeof(result));
+
+    prog = dacprog_new();
+    CHECK(station_start(&station, 0x60));
+    port = dacprog_open(prog, station.path, 0);
+
+    kill(station.pid, SIGKILL);
+    waitpid(station.pid, NULL, 0);
+    unlink(station.state);
+
+    CHECK(dacprog_command(port, "show", 0, on_done, &result));
+    CHECK(dacprog_run(prog, 5000));
+    CHECK(result.done && result.reply.status == DACPROG_IO);
+
+    dacprog_free(prog);
+}
+
+static int run_dacprov(const char *options, const char *csv, char *output, size_t size)
+{
+    char csv_path[64];
+    char out_path[64];
+    char cmd[512];
+    FILE *f;
+    size_t len;
+    int status;
+
+    sprintf(csv_path, "%s/boards.csv", _g_dir);
+    sprintf(out_path, "%s/dacprov.out", _g_dir);
+
+    f = fopen(csv_path, "w");
+    fputs(csv, f);
+    fclose(f);
+
+    sprintf(cmd, "%s %s %s > %s", _g_dacprov, options, csv_path, out_path);
+    status = system(cmd);
+
+    f = fopen(out_path, "r");
+    len = f ? fread(output, 1, size - 1, f) : 0;
+    output[len] = 0;
+    if (f)
+        fclose(f);
+
+    unlink(csv_path);
+    unlink(out_path);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void check_dacprov(const char *options)
+{
+    static const uint8_t addrs[STATIONS] = { 0x61, 0x60, 0x6a };
+    station_t stations[STATIONS];
+    char csv[512];
+    char output[1024];
+    dac_state_t dac;
+    unsigned i;
+
+    strcpy(csv, "port,offset,gain,addr\n# one row per board\n");
+
+    for (i = 0; i < STATIONS; i++)
+    {
+        CHECK(station_start(&stations[i], 0x60));
+        sprintf(csv + strlen(csv), "%s, %u, %u, %02x\n", stations[i].path, 1000 + i, 3000 + i, addrs[i]);
+    }
+
+    CHECK(run_dacprov(options, csv, output, sizeof(output)) == 0);
+    CHECK(strstr(output, "3 of 3 boards provisioned") != NULL);
+
+    for (i = 0; i < STATIONS; i++)
+    {
+        CHECK(station_stop(&stations[i], &dac));
+        CHECK(dac.addr == addrs[i]);
+        CHECK(dac.nvdac0 == 1000 + i && dac.nvdac1 == 3000 + i);
+    }
+}
+
+static void test_dacprov_binary(void)
+{
+    check_dacprov("");
+}
+
+static void test_dacprov_text(void)
+{
+    check_dacprov("-t");
+}
+
+/* A bad station and a missing port don't stop the good one */
+static void test_dacprov_failures(void)
+{
+    station_t good;
+    station_t bad;
+    char csv[512];
+    char output[1024];
+    dac_state_t dac;
+
+    CHECK(station_start(&good, 0x60));
+    CHECK(station_start(&bad, 0x62));
+
+    sprintf(csv, "%s,1,2,61\n%s,3,4,61\n%s/nonexistent,5,6,61\n", good.path, bad.path, _g_dir);
+
+    CHECK(run_dacprov("-T 1000", csv, output, sizeof(output)) == 1);
+    CHECK(strstr(output, ":1: ") && strstr(output, "OK offset=1 gain=2 addr=61"));
+    CHECK(strstr(output, ":2: ") && strstr(output, "FAILED at nvset: ERR"));
+    CHECK(strstr(output, ":3: ") && strstr(output, "FAILED at addr: can't open the port"));
+    CHECK(strstr(output, "1 of 3 boards provisioned") != NULL);
+
+    CHECK(station_stop(&good, &dac));
+    CHECK(dac.addr == 0x61 && dac.nvdac0 == 1 && dac.nvdac1 == 2);
+
+    CHECK(station_stop(&bad, &dac));
+    CHECK(dac.addr == 0x62 && dac.nvdac0 == 0);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: test_dacprog dacsim dacprov\n");
+        return 2;
+    }
+
+    _g_dacsim = argv[1];
+    _g_dacprov = argv[2];
+
+    if (!mkdtemp(_g_dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    RUN(test_parallel);
+    RUN(test_pipeline);
+    RUN(test_missing_dac);
+    RUN(test_gang_frames);
+    RUN(test_resync);
+    RUN(test_timeout);
+    RUN(test_hangup);
+    RUN(test_dacprov_binary);
+    RUN(test_dacprov_text);
+    RUN(test_dacprov_failures);
+
+    rmdir(_g_dir);
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,309 @@
+/*
+ * File:   test_i2c_queue.c
+ * Author: Matt
+ *
+ * The SSPIF driven job engine against the MSSP model: jobs clock out in
+ * the background, in order, a NACK fails only its own job, and blocking
+ * transfers in i2c.c wait for the job on the bus instead of cutting in
+ * and get a stuck bus clocked free.
+ */
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "i2c.h"
+#include "i2c_queue.h"
+#include "mcp47febxx.h"
+
+#include "check.h"
+
+#define DAC_ADDR    MCP47FEBXX_A0_SLAVE_ADDR
+
+static sim_mcp47feb_t *_g_dac;
+static uint8_t _g_cb_status;
+static uint8_t _g_cb_gie;
+static uint8_t _g_cb_calls;
+
+static void isr(void)
+{
+    if (PIE1bits.SSPIE && PIR1bits.SSPIF)
+    {
+        PIR1bits.SSPIF = 0;
+        i2c_queue_isr();
+    }
+}
+
+static void job_done(i2c_job_t *job)
+{
+    _g_cb_status = job->status;
+    _g_cb_gie = INTCONbits.GIE;
+    _g_cb_calls++;
+}
+
+static void job_write(i2c_job_t *job, uint8_t addr, uint8_t reg, uint8_t *data)
+{
+    memset(job, 0, sizeof(*job));
+    job->addr = addr;
+    job->reg = reg | MCP47FEBXX_CMD_WRITE;
+    job->data = data;
+    job->len = 2;
+    job->flags = I2C_JOB_WRITE;
+}
+
+static void setup(void)
+{
+    sim_reset();
+    sim_mcp47feb_set(_g_dac, 0x00, 0);
+    sim_mcp47feb_set(_g_dac, 0x01, 0);
+
+    i2c_init(100);
+    i2c_queue_init();
+
+    INTCONbits.PEIE = 1;
+    INTCONbits.GIE = 1;
+    sim_i2c_trace_clear();
+}
+
+/* Submit returns at once, the bus work happens under interrupts */
+static void test_write_background(void)
+{
+    uint8_t data[2] = { 0x01, 0x23 };
+    i2c_job_t job;
+
+    setup();
+    job_write(&job, DAC_ADDR, MCP47FEBXX_VOLATILE_DAC0, data);
+    job.callback = job_done;
+    _g_cb_calls = 0;
+
+    CHECK(i2c_queue_submit(&job));
+    CHECK(i2c_job_pending(&job));
+    CHECK(i2c_queue_busy());
+    CHECK(sim_mcp47feb_get(_g_dac, 0x00) == 0);
+
+    /* 5 bytes at 100kHz is about 450us, nothing here polls */
+    sim_delay_us(1000);
+
+    CHECK(job.status == I2C_JOB_DONE);
+    CHECK(!i2c_queue_busy());
+    CHECK(sim_mcp47feb_get(_g_dac, 0x00) == 0x123);
+    CHECK_STR(sim_i2c_trace(), "S C0+ 00+ 01+ 23+ P");
+
+    CHECK(_g_cb_calls == 1);
+    CHECK(_g_cb_status == I2C_JOB_DONE);
+    CHECK(_g_cb_gie == 0);
+}
+
+static void test_read(void)
+{
+    uint8_t data[2] = { 0, 0 };
+    i2c_job_t job;
+
+    setup();
+    sim_mcp47feb_set(_g_dac, 0x01, 0x0ABC);
+
+    memset(&job, 0, sizeof(job));
+    job.addr = DAC_ADDR;
+    job.reg = MCP47FEBXX_VOLATILE_DAC1 | MCP47FEBXX_CMD_READ;
+    job.data = data;
+    job.len = 2;
+    job.flags = I2C_JOB_READ;
+
+    CHECK(i2c_queue_submit(&job));
+    CHECK(i2c_queue_wait(&job));
+    CHECK(data[0] == 0x0A && data[1] == 0xBC);
+    CHECK_STR(sim_i2c_trace(), "S C0+ 0E+ Sr C1+ r0A a rBC n P");
+
+    /* A read needs somewhere to put the data */
+    job.len = 0;
+    CHECK(!i2c_queue_submit(&job));
+}
+
+/* I2C_QUEUE_LEN slots, one always free to tell full from empty */
+static void test_order_and_full(void)
+{
+    uint8_t data[4][2] = { { 0, 1 }, { 0, 2 }, { 0, 3 }, { 0, 4 } };
+    i2c_job_t jobs[4];
+    const char *first;
+    const char *second;
+    const char *third;
+    uint8_t i;
+
+    setup();
+
+    for (i = 0; i < 4; i++)
+        job_write(&jobs[i], DAC_ADDR, MCP47FEBXX_VOLATILE_DAC0, data[i]);
+
+    i2c_queue_lock();
+
+    for (i = 0; i < I2C_QUEUE_LEN - 1; i++)
+        CHECK(i2c_queue_submit(&jobs[i]));
+
+    CHECK(!i2c_queue_submit(&jobs[3]));
+    CHECK(jobs[3].status == I2C_JOB_IDLE);
+
+    /* Locked: queued, not started */
+    sim_delay_us(2000);
+    CHECK(jobs[0].status == I2C_JOB_QUEUED);
+    CHECK_STR(sim_i2c_trace(), "");
+
+    i2c_queue_unlock();
+    CHECK(i2c_queue_flush());
+
+    for (i = 0; i < I2C_QUEUE_LEN - 1; i++)
+        CHECK(jobs[i].status == I2C_JOB_DONE);
+
+    CHECK(sim_mcp47feb_get(_g_dac, 0x00) == 3);
+
+    first = strstr(sim_i2c_trace(), "00+ 01+ P");
+    second = strstr(sim_i2c_trace(), "00+ 02+ P");
+    third = strstr(sim_i2c_trace(), "00+ 03+ P");
+    CHECK(first && second && third && first < second && second < third);
+}
+
+/* A missing device fails its job, the STOP frees the bus for the next */
+static void test_nack(void)
+{
+    uint8_t bad_data[2] = { 0x0F, 0xFF };
+    uint8_t good_data[2] = { 0x02, 0x00 };
+    i2c_job_t bad;
+    i2c_job_t good;
+
+    setup();
+    job_write(&bad, DAC_ADDR + 1, MCP47FEBXX_VOLATILE_DAC0, bad_data);
+    job_write(&good, DAC_ADDR, MCP47FEBXX_VOLATILE_DAC0, good_data);
+    bad.callback = job_done;
+    _g_cb_calls = 0;
+
+    CHECK(i2c_queue_submit(&bad));
+    CHECK(i2c_queue_submit(&good));
+
+    CHECK(!i2c_queue_wait(&bad));
+    CHECK(bad.status == I2C_JOB_FAILED);
+    CHECK(_g_cb_calls == 1 && _g_cb_status == I2C_JOB_FAILED);
+
+    CHECK(i2c_queue_wait(&good));
+    CHECK(sim_mcp47feb_get(_g_dac, 0x00) == 0x200);
+    CHECK_STR(sim_i2c_trace(), "S C2- P S C0+ 00+ 02+ 00+ P");
+}
+
+/* The DAC refuses writes during its EEPROM cycle: the job fails on the command byte */
+static void test_nack_during_eewa(void)
+{
+    uint8_t nv_data[2] = { 0x04, 0x00 };
+    uint8_t data[2] = { 0x01, 0x00 };
+    i2c_job_t nv;
+    i2c_job_t job;
+
+    setup();
+    job_write(&nv, DAC_ADDR, MCP47FEBXX_NONVOLATILE_DAC0, nv_data);
+    job_write(&job, DAC_ADDR, MCP47FEBXX_VOLATILE_DAC1, data);
+
+    CHECK(i2c_queue_submit(&nv));
+    CHECK(i2c_queue_submit(&job));
+    CHECK(i2c_queue_wait(&nv));
+    CHECK(!i2c_queue_wait(&job));
+    CHECK(sim_mcp47feb_nv_busy(_g_dac));
+
+    sim_delay_us(10000);
+    CHECK(!sim_mcp47feb_nv_busy(_g_dac));
+    CHECK(sim_mcp47feb_get(_g_dac, 0x10) == 0x400);
+    CHECK(sim_mcp47feb_get(_g_dac, 0x01) == 0);
+}
+
+/* A blocking transfer takes the lock: the job in flight finishes first */
+static void test_blocking_waits_for_job(void)
+{
+    uint8_t data[2] = { 0x07, 0x77 };
+    i2c_job_t job;
+    uint16_t value = 0;
+
+    setup();
+    job_write(&job, DAC_ADDR, MCP47FEBXX_VOLATILE_DAC0, data);
+
+    CHECK(i2c_queue_submit(&job));
+    sim_delay_us(50);
+    CHECK(job.status == I2C_JOB_BUSY);
+
+    CHECK(i2c_write16(DAC_ADDR, MCP47FEBXX_VOLATILE_DAC1 | MCP47FEBXX_CMD_WRITE, 0x0555));
+    CHECK(job.status == I2C_JOB_DONE);
+    CHECK(i2c_read16(DAC_ADDR, MCP47FEBXX_VOLATILE_DAC0 | MCP47FEBXX_CMD_READ, &value));
+    CHECK(value == 0x777);
+
+    CHECK_STR(sim_i2c_trace(),
+            "S C0+ 00+ 07+ 77+ P "
+            "S C0+ 08+ 05+ 55+ P "
+            "S C0+ 06+ Sr C1+ r07 a r77 n P");
+}
+
+/* Abort fails the job on the bus and everything behind it */
+static void test_abort(void)
+{
+    uint8_t data[2][2] = { { 0, 1 }, { 0, 2 } };
+    i2c_job_t jobs[2];
+
+    setup();
+    job_write(&jobs[0], DAC_ADDR, MCP47FEBXX_VOLATILE_DAC0, data[0]);
+    job_write(&jobs[1], DAC_ADDR, MCP47FEBXX_VOLATILE_DAC0, data[1]);
+
+    CHECK(i2c_queue_submit(&jobs[0]));
+    CHECK(i2c_queue_submit(&jobs[1]));
+    sim_delay_us(100);
+
+    i2c_queue_abort();
+    CHECK(jobs[0].status == I2C_JOB_FAILED);
+    CHECK(jobs[1].status == I2C_JOB_FAILED);
+    CHECK(!i2c_queue_busy());
+
+    sim_delay_us(1000);
+    CHECK(sim_mcp47feb_get(_g_dac, 0x00) == 0);
+}
+
+/* SDA held low: the START collides, the bus is clocked free and the write retried */
+static void test_stuck_sda(void)
+{
+    uint16_t recoveries;
+
+    setup();
+    recoveries = i2c_recoveries();
+    sim_i2c_stuck_sda(5);
+
+    CHECK(i2c_write16(DAC_ADDR, MCP47FEBXX_VOLATILE_DAC0 | MCP47FEBXX_CMD_WRITE, 0x0123));
+    CHECK(i2c_recoveries() == recoveries + 1);
+    CHECK(!PIR2bits.BCL1IF);
+    CHECK(sim_mcp47feb_get(_g_dac, 0x00) == 0x123);
+    CHECK_STR(sim_i2c_trace(), "BCL S C0+ 00+ 01+ 23+ P");
+
+    /* Longer than one reset can clock out: fails after the one retry */
+    sim_i2c_trace_clear();
+    sim_i2c_stuck_sda(50);
+
+    CHECK(!i2c_write16(DAC_ADDR, MCP47FEBXX_VOLATILE_DAC0 | MCP47FEBXX_CMD_WRITE, 0x0456));
+    CHECK(i2c_recoveries() == recoveries + 3);
+    CHECK_STR(sim_i2c_trace(), "BCL BCL");
+    CHECK(sim_mcp47feb_get(_g_dac, 0x00) == 0x123);
+
+    /* And works again once the slave lets go */
+    sim_i2c_stuck_sda(0);
+    CHECK(i2c_write16(DAC_ADDR, MCP47FEBXX_VOLATILE_DAC0 | MCP47FEBXX_CMD_WRITE, 0x0456));
+    CHECK(sim_mcp47feb_get(_g_dac, 0x00) == 0x456);
+}
+
+int main(void)
+{
+    _g_dac = sim_mcp47feb_add(DAC_ADDR);
+    sim_set_isr(isr);
+
+    RUN(test_write_background);
+    RUN(test_read);
+    RUN(test_order_and_full);
+    RUN(test_nack);
+    RUN(test_nack_during_eewa);
+    RUN(test_blocking_waits_for_job);
+    RUN(test_abort);
+    RUN(test_stuck_sda);
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,280 @@
+/*
+ * File:   test_usart.c
+ * Author: Matt
+ *
+ * The buffered EUSART1 console and EUSART2 data channel against the
+ * EUSART model: printf returns while the TX ring drains under TXIF,
+ * input keeps arriving into the RX ring meanwhile, and the CPU is free
+ * for I2C work while a long message goes out.
+ */
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "usart.h"
+#include "util.h"
+#include "i2c.h"
+#include "i2c_queue.h"
+#include "mcp47febxx.h"
+
+#include "check.h"
+
+#define BYTE_US(baud)   (10000000UL / (baud))
+
+static sim_mcp47feb_t *_g_dac;
+static uint32_t _g_idle_calls;
+
+/* util.c's wdt_getch() serves the data channel through this */
+void cmd_idle(void)
+{
+    _g_idle_calls++;
+}
+
+static void isr(void)
+{
+    usart1_isr();
+    usart2_isr();
+
+    if (PIE1bits.SSPIE && PIR1bits.SSPIF)
+    {
+        PIR1bits.SSPIF = 0;
+        i2c_queue_isr();
+    }
+}
+
+static void setup(void)
+{
+    sim_reset();
+
+    usart1_open(USART_CONT_RX | USART_IOR, (((_XTAL_FREQ / UART_BAUD) / 64) - 1));
+    i2c_init(100);
+    i2c_queue_init();
+
+    INTCONbits.PEIE = 1;
+    INTCONbits.GIE = 1;
+
+    CHECK(usart1_set_baud(UART_BAUD));
+}
+
+static void fill(char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = 'A' + (i % 26);
+    buf[len] = 0;
+}
+
+static bool baud_near(uint32_t actual, uint32_t want)
+{
+    uint32_t err = (actual > want) ? actual - want : want - actual;
+    return err * 100 <= want * USART_MAX_BAUD_ERROR;
+}
+
+/* A line that fits the ring costs the CPU next to nothing */
+static void test_printf_background(void)
+{
+    char text[101];
+    uint64_t start;
+
+    setup();
+    fill(text, 100);
+
+    start = sim_us();
+    printf("%s", text);
+    CHECK(sim_us() - start < 2000);
+    CHECK(sim_usart_output_len(SIM_UART1) <= 1);
+
+    sim_delay_us(100 * BYTE_US(UART_BAUD) + 2000);
+    CHECK_STR(sim_usart_output(SIM_UART1), text);
+}
+
+/* Past the ring, printf waits only for the overflow to fit */
+static void test_printf_full_ring(void)
+{
+    static char text[601];
+    uint64_t elapsed;
+    uint64_t start;
+
+    setup();
+    fill(text, 600);
+
+    start = sim_us();
+    printf("%s", text);
+    elapsed = sim_us() - start;
+
+    /* The ring holds UART_TX_BUF_SIZE - 1, TXREG and the shifter one each */
+    CHECK(elapsed > (600 - UART_TX_BUF_SIZE - 2) * BYTE_US(UART_BAUD));
+    CHECK(elapsed < (600 - UART_TX_BUF_SIZE + 4) * BYTE_US(UART_BAUD));
+
+    usart1_flush();
+    CHECK_STR(sim_usart_output(SIM_UART1), text);
+}
+
+/* Typing ahead during a long reply: nothing overruns, nothing is lost */
+static void test_rx_during_output(void)
+{
+    char text[201];
+    char input[51];
+    char got[51];
+    uint8_t i;
+
+    setup();
+    fill(text, 200);
+    strcpy(input, "dump;set 100 200;show;speed 4;addr 61;mode machine");
+    CHECK(strlen(input) == 50);
+
+    printf("%s", text);
+    sim_usart_send(SIM_UART1, input, 50);
+
+    sim_delay_us(200 * BYTE_US(UART_BAUD) + 5000);
+    CHECK_STR(sim_usart_output(SIM_UART1), text);
+    CHECK(sim_usart_overruns(SIM_UART1) == 0);
+
+    for (i = 0; i < 50; i++)
+        got[i] = wdt_getch();
+    got[50] = 0;
+
+    CHECK_STR(got, input);
+    CHECK(!usart1_data_ready());
+}
+
+/* A full RX ring drops the newest bytes, the EUSART itself never overruns */
+static void test_rx_ring_full(void)
+{
+    char input[81];
+    uint8_t i;
+    bool ok = true;
+
+    setup();
+    fill(input, 80);
+
+    sim_usart_send(SIM_UART1, input, 80);
+    sim_delay_us(80 * BYTE_US(UART_BAUD) + 2000);
+    CHECK(sim_usart_overruns(SIM_UART1) == 0);
+
+    for (i = 0; i < UART_RX_BUF_SIZE - 1; i++)
+        ok &= usart1_data_ready() && usart1_get() == input[i];
+
+    CHECK(ok);
+    CHECK(!usart1_data_ready());
+}
+
+static void test_getch_idles(void)
+{
+    setup();
+    _g_idle_calls = 0;
+
+    sim_usart_send(SIM_UART1, "x", 1);
+    CHECK(wdt_getch() == 'x');
+    CHECK(_g_idle_calls > 0);
+}
+
+/* The old rate finishes what's queued before the divider changes */
+static void test_set_baud_flushes(void)
+{
+    setup();
+
+    printf("hello");
+    CHECK(usart1_set_baud(115200));
+    CHECK_STR(sim_usart_output(SIM_UART1), "hello");
+
+    CHECK(baud_near(usart1_get_baud(), 115200));
+    CHECK(baud_near(sim_usart_baud(SIM_UART1), 115200));
+    CHECK(!usart1_set_baud(5000000));
+
+    printf("world");
+    usart1_flush();
+    CHECK_STR(sim_usart_output(SIM_UART1), "helloworld");
+}
+
+static void test_autobaud(void)
+{
+    setup();
+
+    sim_usart_host_baud(SIM_UART1, 57600);
+    sim_usart_send(SIM_UART1, "U", 1);
+
+    CHECK(usart1_autobaud(100));
+    CHECK(baud_near(usart1_get_baud(), 57600));
+
+    /* The measuring 'U' is not input */
+    sim_delay_us(1000);
+    CHECK(!usart1_data_ready());
+
+    sim_usart_send(SIM_UART1, "ok", 2);
+    CHECK(wdt_getch() == 'o');
+    CHECK(wdt_getch() == 'k');
+}
+
+static void test_usart2(void)
+{
+    setup();
+
+    CHECK(usart2_open(UART2_BAUD));
+    CHECK(usart2_is_open());
+    CHECK(baud_near(usart2_get_baud(), UART2_BAUD));
+
+    sim_usart_send(SIM_UART2, "abc", 3);
+    sim_delay_us(3 * BYTE_US(UART2_BAUD) + 100);
+
+    CHECK(usart2_data_ready() && usart2_get() == 'a');
+    CHECK(usart2_data_ready() && usart2_get() == 'b');
+    CHECK(usart2_data_ready() && usart2_get() == 'c');
+    CHECK(!usart2_data_ready());
+
+    usart2_put('x');
+    usart2_put('y');
+    usart2_put('z');
+    usart2_close();
+
+    CHECK_STR(sim_usart_output(SIM_UART2), "xyz");
+    CHECK(!usart2_is_open());
+    CHECK(sim_usart_output_len(SIM_UART1) == 0);
+}
+
+/* A bus transfer right after a long message doesn't wait for the UART */
+static void test_i2c_while_draining(void)
+{
+    char text[201];
+    uint64_t start;
+    uint16_t value = 0;
+
+    setup();
+    fill(text, 200);
+
+    printf("%s", text);
+
+    start = sim_us();
+    CHECK(i2c_write16(MCP47FEBXX_A0_SLAVE_ADDR, MCP47FEBXX_VOLATILE_DAC0 | MCP47FEBXX_CMD_WRITE, 0x0345));
+    CHECK(i2c_read16(MCP47FEBXX_A0_SLAVE_ADDR, MCP47FEBXX_VOLATILE_DAC0 | MCP47FEBXX_CMD_READ, &value));
+    CHECK(sim_us() - start < 2000);
+
+    CHECK(value == 0x345);
+    CHECK(sim_mcp47feb_get(_g_dac, 0x00) == 0x345);
+    CHECK(sim_usart_output_len(SIM_UART1) < 10);
+
+    usart1_flush();
+    CHECK_STR(sim_usart_output(SIM_UART1), text);
+}
+
+int main(void)
+{
+    _g_dac = sim_mcp47feb_add(MCP47FEBXX_A0_SLAVE_ADDR);
+    sim_set_isr(isr);
+
+    RUN(test_printf_background);
+    RUN(test_printf_full_ring);
+    RUN(test_rx_during_output);
+    RUN(test_rx_ring_full);
+    RUN(test_getch_idles);
+    RUN(test_set_baud_flushes);
+    RUN(test_autobaud);
+    RUN(test_usart2);
+    RUN(test_i2c_while_draining);
+
+    return CHECK_RESULT();
+}
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "i2c.h"
 
@@ -14,50 +15,317 @@
 #include "util.h"
 #endif /* _I2C_XFER_MANY_TO_UART_ */
 
-#define I2C_NUMCLOCKS_TIMEOUT 100
-
-//#define i2c_wait_for(x) while (x)
-
-#define i2c_wait_for(x)                             \
-    do {                                            \
-        uint8_t waits = I2C_NUMCLOCKS_TIMEOUT;      \
-        uint8_t cleared = 0;                        \
-        do {                                        \
-            uint8_t timeout = _g_waitPeriod;        \
-            do {                                    \
-                if (!(x)) {                         \
-                    cleared = 1;                    \
-                    break;                          \
-                }                                   \
-                __delay_us(1);                      \
-            } while (--timeout);                    \
-            if (cleared)                            \
-                break;                              \
-        } while (--waits);                          \
-        if (!cleared)                               \
-            goto fail;                              \
-        } while (0);
+#ifdef _I2C_QUEUE_
+#include "i2c_queue.h"
+#endif /* _I2C_QUEUE_ */
+
+/*
+ * Timeouts per operation, sized for Standard-mode (the slowest rate) with
+ * plenty of room for clock stretching. A START/STOP/ACK is one SCL period,
+ * a byte is nine.
+ */
+#define I2C_TIMEOUT_COND_US     200
+#define I2C_TIMEOUT_BYTE_US     1000
+#define I2C_TIMEOUT_IDLE_US     1000
+
+/* Deadline timer runs at Fosc/32 */
+#define I2C_TICKS(us) ((uint16_t)(((uint32_t)(us) * (_XTAL_FREQ / 32000UL)) / 1000UL))
+
+#define I2C_SEN     0x01
+#define I2C_RSEN    0x02
+#define I2C_PEN     0x04
+#define I2C_RCEN    0x08
+#define I2C_ACKEN   0x10
+#define I2C_BF      0x01
+#define I2C_RW      0x04
+
+/* Waits until (reg & mask) == until, or bails out to fail: */
+#define i2c_wait_for(reg, mask, until, us) \
+    do { if (!i2c_wait(&(reg), (mask), (until), I2C_TICKS(us))) goto fail; } while (0)
 
 #ifdef __PIC12__
-#define i2c_wait_for_idle() i2c_wait_for((SSP1CON2 & 0x1F) | (SSP1STATbits.R_nW))
+#define i2c_wait_for_idle() \
+    { i2c_wait_for(SSP1CON2, 0x1F, 0, I2C_TIMEOUT_IDLE_US); i2c_wait_for(SSP1STAT, I2C_RW, 0, I2C_TIMEOUT_IDLE_US); }
 #else
-#define i2c_wait_for_idle() i2c_wait_for((SSPCON2 & 0x1F) | (SSPSTATbits.R_W))
+#define i2c_wait_for_idle() \
+    { i2c_wait_for(SSPCON2, 0x1F, 0, I2C_TIMEOUT_IDLE_US); i2c_wait_for(SSPSTAT, I2C_RW, 0, I2C_TIMEOUT_IDLE_US); }
 #endif
 
-#define i2c_put_start_and_wait() { SSPCON2bits.SEN = 1; i2c_wait_for(SSPCON2bits.SEN); }
-#define i2c_put_stop_and_wait() { SSPCON2bits.PEN = 1; i2c_wait_for(SSPCON2bits.PEN); }
+#define i2c_put_start_and_wait() { SSPCON2bits.SEN = 1; i2c_wait_for(SSPCON2, I2C_SEN, 0, I2C_TIMEOUT_COND_US); }
+#define i2c_put_stop_and_wait() { SSPCON2bits.PEN = 1; i2c_wait_for(SSPCON2, I2C_PEN, 0, I2C_TIMEOUT_COND_US); }
+#define i2c_put_restart_and_wait() { SSPCON2bits.RSEN = 1; i2c_wait_for(SSPCON2, I2C_RSEN, 0, I2C_TIMEOUT_COND_US); }
+
+#if defined(__PIC16__) || defined(__PIC12__)
+/* Timer1, 1:8 prescale. Not latched, so re-read if the high byte moved */
+#define i2c_timer_init() { T1CON = 0x31; }
+static uint16_t i2c_timer_read(void)
+{
+    uint8_t hi;
+    uint8_t lo;
+
+    do {
+        hi = TMR1H;
+        lo = TMR1L;
+    } while (hi != TMR1H);
+
+    return ((uint16_t)hi << 8) | lo;
+}
+#else
+/* Timer0, 16 bit, 1:8 prescale. Reading TMR0L latches TMR0H */
+#ifdef __18F26K42
+#define i2c_timer_init() { T0CON1 = 0x43; T0CON0 = 0x90; }
+#else
+#define i2c_timer_init() { T0CON = 0x82; }
+#endif
+static uint16_t i2c_timer_read(void)
+{
+    uint8_t lo = TMR0L;
+    return ((uint16_t)TMR0H << 8) | lo;
+}
+#endif
 #define i2c_ack_was_received() (!SSPCON2bits.ACKSTAT)
 
+/*
+ * A START, STOP or byte out that finds SDA held low loses arbitration:
+ * the MSSP sets BCLIF and clears the bit as if it had gone out.
+ */
+#if defined(_I2C_DMA_)
+#define i2c_collided() (false)
+#define i2c_collision_clear()
+#elif defined(__18F26K22) || defined(__PIC12__)
+#define i2c_collided() (PIR2bits.BCL1IF)
+#define i2c_collision_clear() { PIR2bits.BCL1IF = 0; }
+#else
+#define i2c_collided() (PIR2bits.BCLIF)
+#define i2c_collision_clear() { PIR2bits.BCLIF = 0; }
+#endif
+
+#ifdef _I2C_BRUTEFORCE_RESET_
+
+#define I2C_RESET_HALF_US   5
+
+#if defined(_18F2550)
+
+#define BL_SCL  LATBbits.LATB1
+#define BL_SDA  LATBbits.LATB0
+
+#define BP_SDA  PORTBbits.RB0
+
+#define BT_SCL  TRISBbits.TRISB1
+#define BT_SDA  TRISBbits.TRISB0
+
+#elif defined(__18F26K22) || defined(__18F2520) || defined(__18F26K42)
+
+#define BL_SCL  LATCbits.LATC3
+#define BL_SDA  LATCbits.LATC4
+
+#define BP_SDA  PORTCbits.RC4
+
+#define BT_SCL  TRISCbits.TRISC3
+#define BT_SDA  TRISCbits.TRISC4
+
+#elif defined(__16F876A) || defined(__16F876)
+
+/* No LAT on these. TRIS is the only thing toggled after the latch is cleared */
+#define BL_SCL  PORTCbits.RC3
+#define BL_SDA  PORTCbits.RC4
+
+#define BP_SDA  PORTCbits.RC4
+
+#define BT_SCL  TRISCbits.TRISC3
+#define BT_SDA  TRISCbits.TRISC4
+
+#else
+#error Unknown device
+#endif
+
+#endif /* _I2C_BRUTEFORCE_RESET_ */
+
+#ifdef _I2C_DMA_
+
+#define I2C1TX_IRQ          0x18    /* Vector table numbers, DMA triggers */
+#define I2C1RX_IRQ          0x17
+#define I2C1CLK_CLKREF      0x04
+#define CLKR_SRC_FOSC       0x00
+#define CLKR_EN_50          0x90    /* Enabled, 50% duty cycle */
+#define I2C1_MODE_HOST7     0x04    /* 7 bit host, address from I2C1ADB1 */
+#define I2C1_MMA            0x20    /* I2C1STAT0: host active */
+#define I2C1_ERR_FLAGS      0x70    /* I2C1ERR: BTOIF, BCLIF, NACKIF */
+#define PPS_SCL1            0x21
+#define PPS_SDA1            0x22
+#define PPS_RC3             0x13
+#define PPS_RC4             0x14
+
+/* Same pins as the MSSP parts, SCL on RC3 and SDA on RC4, open drain */
+#define i2c1_pins() { \
+    I2C1SCLPPS = PPS_RC3; I2C1SDAPPS = PPS_RC4; \
+    RC3PPS = PPS_SCL1; RC4PPS = PPS_SDA1; \
+    ODCONCbits.ODCC3 = 1; ODCONCbits.ODCC4 = 1; \
+    TRISCbits.TRISC3 = 0; TRISCbits.TRISC4 = 0; }
+
+#if defined(_I2C_XFER_MANY_TO_UART_) || defined(_I2C_DS2482_SPECIAL_)
+#error Not implemented for the I2C1 module
+#endif
+
+#endif /* _I2C_DMA_ */
+
+#ifdef _I2C_QUEUE_
+/* Hold off the interrupt driven engine while a blocking transfer owns the bus */
+#define i2c_begin() { i2c_queue_lock(); _g_timed_out = false; }
+#define i2c_end() i2c_queue_unlock()
+#else
+#define i2c_begin() { _g_timed_out = false; }
+#define i2c_end()
+#endif /* _I2C_QUEUE_ */
+
 #if defined (_I2C_XFER_) || defined(_I2C_XFER_BYTE_) || defined(_I2C_XFER_MANY_) \
   || defined(_I2C_XFER_X16_) || defined(_I2C_DS2482_SPECIAL_)
 
-static uint8_t _g_waitPeriod;
+static bool _g_timed_out;
+#ifdef _I2C_BRUTEFORCE_RESET_
+static uint16_t _g_recoveries;
+#endif /* _I2C_BRUTEFORCE_RESET_ */
+
+/*
+ * Shared, deliberately not inlined, poll loop. Reacts within a few
+ * instruction cycles and times out against the free running timer, so
+ * the timeout does not depend on loop overhead or clock speed. A bus
+ * collision counts as a timeout: both mean a bus to be clocked free.
+ */
+static bool i2c_wait(volatile uint8_t *reg, uint8_t mask, uint8_t until, uint16_t ticks)
+{
+    uint16_t start = i2c_timer_read();
+
+    do {
+        if ((*reg & mask) == until)
+            break;
+    } while ((uint16_t)(i2c_timer_read() - start) < ticks);
+
+    if ((*reg & mask) == until && !i2c_collided())
+        return true;
+
+    i2c_collision_clear();
+    _g_timed_out = true;
+    return false;
+}
+
+void i2c_deadline_start(i2c_deadline_t *deadline, uint16_t ms)
+{
+    deadline->last = i2c_timer_read();
+    deadline->ticks = 0;
+    deadline->ms = ms;
+}
+
+/*
+ * True once the deadline's milliseconds have gone by. Elapsed time is
+ * taken off at every call, so any length works as long as the caller
+ * checks more often than the timer wraps (about 40ms).
+ */
+bool i2c_deadline_passed(i2c_deadline_t *deadline)
+{
+    uint16_t now = i2c_timer_read();
+    uint16_t elapsed = now - deadline->last;
+
+    deadline->last = now;
+    deadline->ticks += elapsed % I2C_TICKS(1000);
+    elapsed /= I2C_TICKS(1000);
+
+    if (deadline->ticks >= I2C_TICKS(1000))
+    {
+        deadline->ticks -= I2C_TICKS(1000);
+        elapsed++;
+    }
+
+    if (elapsed >= deadline->ms)
+        deadline->ms = 0;
+    else
+        deadline->ms -= elapsed;
+
+    return !deadline->ms;
+}
+
+/*
+ * Called on the failure path of a transfer. After a timeout or a bus
+ * collision (as opposed to a NACK) the bus is clocked free and, if attempt
+ * is given, the caller may retry once.
+ */
+static bool i2c_recover(uint8_t *attempt)
+{
+    if (!_g_timed_out)
+        return false;
+
+    _g_timed_out = false;
+
+#ifdef _I2C_BRUTEFORCE_RESET_
+    i2c_bruteforce_reset();
+    _g_recoveries++;
+
+    if (attempt && !(*attempt)++)
+        return true;
+#endif /* _I2C_BRUTEFORCE_RESET_ */
+
+    return false;
+}
+
+#ifdef _I2C_BRUTEFORCE_RESET_
+uint16_t i2c_recoveries(void)
+{
+    return _g_recoveries;
+}
+#endif /* _I2C_BRUTEFORCE_RESET_ */
+
+#ifdef _I2C_DMA_
+/*
+ * Module clock is CLKREF, Fosc / 2^div. With FME set SCL runs at a
+ * quarter of it. Round the divider up so the bus never runs faster
+ * than asked: 96kHz, 384kHz and 768kHz for the 100/400/1000 steps.
+ */
+static uint8_t i2c_clkref_div(uint16_t freq_khz)
+{
+    uint8_t div = 0;
+
+    while (div < 7 && (_XTAL_FREQ >> div) > freq_khz * 4000UL)
+        div++;
+
+    return div;
+}
+#else
+/* Round the divider up so the bus never runs faster than asked */
+#define i2c_sspadd(freq_khz) \
+    ((uint8_t)((((_XTAL_FREQ / 4) + ((freq_khz) * 1000UL) - 1) / ((freq_khz) * 1000UL)) - 1))
+#endif /* _I2C_DMA_ */
+
+/* The SCL rate i2c_init(freq_khz) really gives, in whole kHz */
+uint16_t i2c_get_khz(uint16_t freq_khz)
+{
+#ifdef _I2C_DMA_
+    return (uint16_t)((_XTAL_FREQ >> i2c_clkref_div(freq_khz)) / 4000UL);
+#else
+    return (uint16_t)((_XTAL_FREQ / 4000UL) / (i2c_sspadd(freq_khz) + 1));
+#endif /* _I2C_DMA_ */
+}
 
 void i2c_init(uint16_t freq_khz)
 {
     if (freq_khz < I2C_MIN_FREQ)
         return;
 
+#ifdef _I2C_DMA_
+    I2C1CON0bits.EN = 0;
+
+    CLKRCLK = CLKR_SRC_FOSC;
+    CLKRCON = CLKR_EN_50 | i2c_clkref_div(freq_khz);
+    I2C1CLK = I2C1CLK_CLKREF;
+
+    i2c1_pins();
+
+    I2C1CON0 = I2C1_MODE_HOST7;
+    I2C1CON1 = 0;
+    I2C1CON1bits.ACKCNT = 1;         /* NACK the last byte of a read */
+    I2C1CON2 = 0;
+    I2C1CON2bits.FME = 1;
+    I2C1CON0bits.EN = 1;
+#else
 #if defined(__PIC16__) || defined(__PIC12__)
     SSPCON = 0x28;                   /* I2C enabled, Master mode */
     SSPCON2 = 0x00;
@@ -65,11 +333,16 @@ void i2c_init(uint16_t freq_khz)
     SSPCON1 = 0x28;                  /* I2C enabled, Master mode */
     SSPCON2 = 0x00;
 #endif
-    
-    SSPADD = (((_XTAL_FREQ / (freq_khz * 1000)) / 4) - 1);
-    SSPSTAT = 0b11000000;            /* Slew rate disabled */
 
-    _g_waitPeriod = (uint8_t)(1000 / freq_khz);
+    SSPADD = i2c_sspadd(freq_khz);
+
+    if (freq_khz > 100 && freq_khz <= 400)
+        SSPSTAT = 0b01000000;        /* Slew rate control enabled for Fast-mode */
+    else
+        SSPSTAT = 0b11000000;        /* Slew rate disabled */
+#endif /* _I2C_DMA_ */
+
+    i2c_timer_init();
 }
 
 #ifdef _I2C_BRUTEFORCE_RESET_
@@ -78,66 +351,59 @@ void i2c_bruteforce_reset(void)
 {
     uint8_t i;
     
-#if defined(__PIC16__) || defined(__PIC12__)
+#if defined(_I2C_DMA_)
+    /* Module off and the pins handed back to LAT/TRIS */
+    I2C1CON0bits.EN = 0;
+    RC3PPS = 0;
+    RC4PPS = 0;
+#elif defined(__PIC16__) || defined(__PIC12__)
     SSPCON = 0x08;                   /* I2C disabled, Master mode */
 #else
     SSPCON1 = 0x08;                  /* I2C disabled, Master mode */
 #endif
     
-#if defined(_18F2550)
-    
-#define BB_SCL  PORTBbits.RB1
-#define BB_SDA  PORTBbits.RB0
-
-#define BT_SCL  TRISBbits.TRISB1
-#define BT_SDA  TRISBbits.TRISB0
+    /* Open-drain emulation: output latch low, TRIS releases (1) or pulls low (0) */
+    BL_SCL = 0;
+    BL_SDA = 0;
+    BT_SCL = 1;
+    BT_SDA = 1;
+    __delay_us(I2C_RESET_HALF_US);
 
-#else
-#error Unknown device
-#endif
-    
-    // Set both pins to output
-    BT_SCL = 0;
-    BT_SDA = 0;
-    
-    // Start condition
-    BB_SDA = 0;
-    __delay_us(20);
-    BB_SCL = 0;
-    __delay_us(20);
-    BB_SDA = 1;
-    __delay_us(20);
-    BB_SCL = 1;
-    
-    // 16 clocks
-    for (i = 0; i < 16; i++)
+    /* Clock out whatever a stuck slave still wants to send, up to one byte + ACK */
+    for (i = 0; i < 9 && !BP_SDA; i++)
     {
-        __delay_us(20);
-        BB_SCL = 0;
-        __delay_us(20);
-        BB_SCL = 1;
+        BT_SCL = 0;
+        __delay_us(I2C_RESET_HALF_US);
+        BT_SCL = 1;
+        __delay_us(I2C_RESET_HALF_US);
     }
     
-    // Start of stop condition
-    __delay_us(20);
-    BB_SCL = 0;
-    delay_10ms(10);
-    BB_SDA = 0;
-    __delay_us(20);
-    BB_SCL = 1;
-    __delay_us(20);
-    // End of stop
-    BB_SDA = 1;
-    
-    // Both pins back to input
-    BT_SDA = 1;
+    // Stop condition
+    BT_SCL = 0;
+    __delay_us(I2C_RESET_HALF_US);
+    BT_SDA = 0;
+    __delay_us(I2C_RESET_HALF_US);
     BT_SCL = 1;
+    __delay_us(I2C_RESET_HALF_US);
+    BT_SDA = 1;
+    __delay_us(I2C_RESET_HALF_US);
     
-    __delay_ms(1);
+#if defined(_I2C_DMA_)
+    i2c1_pins();
+    I2C1CON0bits.EN = 1;
+#elif defined(__PIC16__) || defined(__PIC12__)
+    SSPCON = 0x28;                   /* I2C enabled, Master mode */
+    SSPCON2 = 0x00;
+#else
+    SSPCON1 = 0x28;                  /* I2C enabled, Master mode */
+    SSPCON2 = 0x00;
+#endif
 }
 
 #endif /* _I2C_BRUTEFORCE_RESET_ */
 
+#ifndef _I2C_DMA_
+
 static bool i2c_byte_out(uint8_t data_out)
 {
     SSPBUF = data_out;
@@ -153,7 +419,7 @@ static bool i2c_byte_out(uint8_t data_out)
         goto fail;
     }
 
-    i2c_wait_for(SSPSTATbits.BF);    /* Wait until write cycle is complete */
+    i2c_wait_for(SSPSTAT, I2C_BF, 0, I2C_TIMEOUT_BYTE_US);    /* Wait until write cycle is complete */
 
     i2c_wait_for_idle();
     return true;
@@ -166,13 +432,13 @@ static bool i2c_byte_in(bool ack, uint8_t *data)
 {
     SSPCON2bits.RCEN = 1;            /* Enable master for 1 byte reception */
 
-    i2c_wait_for(!SSPSTATbits.BF);
-    i2c_wait_for(SSPCON2bits.RCEN);  /* Check that receive sequence is over */
+    i2c_wait_for(SSPSTAT, I2C_BF, I2C_BF, I2C_TIMEOUT_BYTE_US);
+    i2c_wait_for(SSPCON2, I2C_RCEN, 0, I2C_TIMEOUT_COND_US);  /* Check that receive sequence is over */
 
     SSPCON2bits.ACKDT = ack ? 0 : 1; /* Send ACK when 0 and NACK when 1 */
     SSPCON2bits.ACKEN = 1;
 
-    i2c_wait_for(SSPCON2bits.ACKEN); /* Wait till finished */
+    i2c_wait_for(SSPCON2, I2C_ACKEN, 0, I2C_TIMEOUT_COND_US); /* Wait till finished */
 
     *data = (SSPBUF);                 /* Return with read byte */
     return true;
@@ -186,6 +452,10 @@ fail:
 
 bool i2c_write(uint8_t addr, uint8_t reg, uint8_t data)
 {
+    uint8_t attempt = 0;
+
+retry:
+    i2c_begin();
     i2c_wait_for_idle();
     i2c_put_start_and_wait();
     i2c_byte_out(addr << 1);
@@ -213,14 +483,24 @@ bool i2c_write(uint8_t addr, uint8_t reg, uint8_t data)
     }
 
     i2c_put_stop_and_wait();
+    i2c_end();
     return true;
     
 fail:
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
     return false;
 }
 
 bool i2c_read(uint8_t addr, uint8_t reg, uint8_t *ret)
 {
+    uint8_t attempt = 0;
+
+retry:
+    i2c_begin();
     i2c_wait_for_idle();
     i2c_put_start_and_wait();
     i2c_byte_out(addr << 1);
@@ -252,9 +532,15 @@ bool i2c_read(uint8_t addr, uint8_t reg, uint8_t *ret)
         goto fail;
     
     i2c_put_stop_and_wait();
+    i2c_end();
     return true;
     
 fail:
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
     return false;
 }
 
@@ -264,6 +550,10 @@ fail:
 
 bool i2c_write_byte(uint8_t addr, uint8_t data)
 {
+    uint8_t attempt = 0;
+
+retry:
+    i2c_begin();
     i2c_wait_for_idle();
     i2c_put_start_and_wait();
     i2c_byte_out(addr << 1);
@@ -283,14 +573,24 @@ bool i2c_write_byte(uint8_t addr, uint8_t data)
     }
 
     i2c_put_stop_and_wait();
+    i2c_end();
     return true;
     
 fail:
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
     return false;
 }
 
 bool i2c_read_byte(uint8_t addr, uint8_t *ret)
 {
+    uint8_t attempt = 0;
+
+retry:
+    i2c_begin();
     i2c_wait_for_idle();
     i2c_put_start_and_wait();
 
@@ -306,9 +606,15 @@ bool i2c_read_byte(uint8_t addr, uint8_t *ret)
         goto fail;
     
     i2c_put_stop_and_wait();
+    i2c_end();
     return true;
     
 fail:
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
     return false;
 }
 
@@ -319,7 +625,10 @@ fail:
 bool i2c_write_buf(uint8_t addr, uint8_t reg, uint8_t *data, uint8_t len)
 {
     uint8_t i;
+    uint8_t attempt = 0;
 
+retry:
+    i2c_begin();
     i2c_wait_for_idle();
     i2c_put_start_and_wait();
     i2c_byte_out(addr << 1);
@@ -350,14 +659,29 @@ bool i2c_write_buf(uint8_t addr, uint8_t reg, uint8_t *data, uint8_t len)
     }
 
     i2c_put_stop_and_wait();
+    i2c_end();
     return true;
     
 fail:
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
     return false;
 }
 
 bool i2c_read_buf(uint8_t addr, uint8_t offset, uint8_t *ret, uint8_t len)
 {
+    uint8_t attempt = 0;
+    uint8_t *p;
+    uint8_t n;
+
+retry:
+    p = ret;
+    n = len;
+
+    i2c_begin();
     i2c_wait_for_idle();
     i2c_put_start_and_wait();
     i2c_byte_out(addr << 1);
@@ -381,26 +705,107 @@ bool i2c_read_buf(uint8_t addr, uint8_t offset, uint8_t *ret, uint8_t len)
 
     if (!i2c_ack_was_received())
     {
-        i2c_put_start_and_wait(); /* Reset I2C bus */
-        goto fail;                /* Error */
+        i2c_put_stop_and_wait(); /* Reset I2C bus */
+        goto fail;               /* Error */
     }
 
-    while (len > 1)
+    while (n > 1)
     {
-        if (!i2c_byte_in(true, ret))
+        if (!i2c_byte_in(true, p))
             goto fail;
         
-        ret++;
-        len--;
+        p++;
+        n--;
     }
 
-    if (!i2c_byte_in(false, ret))
+    if (!i2c_byte_in(false, p))
         goto fail;
     
     i2c_put_stop_and_wait();
+    i2c_end();
     return true;
     
 fail:
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
+    return false;
+}
+
+/*
+ * Reads a list of 16 bit registers in a single bus transaction. Each register
+ * gets its own command byte and read phase, chained with repeated STARTs:
+ *
+ * S addr+W reg0 Sr addr+R d0h d0l Sr addr+W reg1 Sr addr+R d1h d1l ... P
+ */
+bool i2c_read16_many(uint8_t addr, const uint8_t *regs, uint16_t *ret, uint8_t count)
+{
+    uint8_t attempt = 0;
+    const uint8_t *r;
+    uint16_t *p;
+    uint8_t n;
+
+retry:
+    r = regs;
+    p = ret;
+    n = count;
+
+    i2c_begin();
+    i2c_wait_for_idle();
+    i2c_put_start_and_wait();
+
+    while (n--)
+    {
+        i2c_byte_out(addr << 1);
+
+        if (!i2c_ack_was_received())
+        {
+            i2c_put_stop_and_wait(); /* Reset I2C bus */
+            goto fail;               /* Error */
+        }
+
+        i2c_byte_out(*r);
+
+        if (!i2c_ack_was_received())
+        {
+            i2c_put_stop_and_wait(); /* Reset I2C bus */
+            goto fail;               /* Error */
+        }
+
+        i2c_put_restart_and_wait();
+        i2c_byte_out((addr << 1) | 0x01);
+
+        if (!i2c_ack_was_received())
+        {
+            i2c_put_stop_and_wait(); /* Reset I2C bus */
+            goto fail;               /* Error */
+        }
+
+        if (!i2c_byte_in(true, ((uint8_t *)p + 1)))
+            goto fail;
+
+        if (!i2c_byte_in(false, ((uint8_t *)p)))
+            goto fail;
+
+        if (n)
+            i2c_put_restart_and_wait();
+
+        r++;
+        p++;
+    }
+
+    i2c_put_stop_and_wait();
+    i2c_end();
+    return true;
+    
+fail:
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
     return false;
 }
 
@@ -412,6 +817,7 @@ bool i2c_read_to_uart(uint8_t addr, uint8_t offset, uint8_t len)
 {
     uint8_t ret;
     
+    i2c_begin();
     i2c_wait_for_idle();
     i2c_put_start_and_wait();
     i2c_byte_out(addr << 1);
@@ -435,8 +841,8 @@ bool i2c_read_to_uart(uint8_t addr, uint8_t offset, uint8_t len)
 
     if (!i2c_ack_was_received())
     {
-        i2c_put_start_and_wait(); /* Reset I2C bus */
-        goto fail;                /* Error */
+        i2c_put_stop_and_wait(); /* Reset I2C bus */
+        goto fail;               /* Error */
     }
 
     while (len > 1)
@@ -454,9 +860,12 @@ bool i2c_read_to_uart(uint8_t addr, uint8_t offset, uint8_t len)
     uart_put(ret);
     
     i2c_put_stop_and_wait();
+    i2c_end();
     return true;
     
 fail:
+    i2c_end();
+    i2c_recover(NULL);
     return false;
 }
 
@@ -466,6 +875,10 @@ fail:
 
 bool i2c_write16(uint8_t addr, uint8_t reg, uint16_t data)
 {
+    uint8_t attempt = 0;
+
+retry:
+    i2c_begin();
     i2c_wait_for_idle();
     i2c_put_start_and_wait();
     i2c_byte_out(addr << 1);
@@ -501,14 +914,24 @@ bool i2c_write16(uint8_t addr, uint8_t reg, uint16_t data)
     }
 
     i2c_put_stop_and_wait();
+    i2c_end();
     return true;
     
 fail:
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
     return false;
 }
 
 bool i2c_read16(uint8_t addr, uint8_t offset, uint16_t *ret)
 {
+    uint8_t attempt = 0;
+
+retry:
+    i2c_begin();
     i2c_wait_for_idle();
     i2c_put_start_and_wait();
     i2c_byte_out(addr << 1);
@@ -532,8 +955,8 @@ bool i2c_read16(uint8_t addr, uint8_t offset, uint16_t *ret)
 
     if (!i2c_ack_was_received())
     {
-        i2c_put_start_and_wait(); /* Reset I2C bus */
-        goto fail;                /* Error */
+        i2c_put_stop_and_wait(); /* Reset I2C bus */
+        goto fail;               /* Error */
     }
     if (!i2c_byte_in(true, ((uint8_t *)ret + 1)))
         goto fail;
@@ -542,9 +965,15 @@ bool i2c_read16(uint8_t addr, uint8_t offset, uint16_t *ret)
         goto fail;
 
     i2c_put_stop_and_wait();
+    i2c_end();
     return true;
     
 fail:
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
     return false;
 }
 
@@ -556,6 +985,7 @@ bool i2c_await_flag(uint8_t addr, uint8_t mask, uint8_t *ret, uint8_t attempts)
 {
     uint8_t status;
 
+    i2c_begin();
     i2c_wait_for_idle();
     i2c_put_start_and_wait();
 
@@ -580,13 +1010,346 @@ bool i2c_await_flag(uint8_t addr, uint8_t mask, uint8_t *ret, uint8_t attempts)
         goto fail;
     
     i2c_put_stop_and_wait();
+    i2c_end();
 
     *ret = status;
     return !(status & mask);
     
 fail:
+    i2c_end();
+    i2c_recover(NULL);
     return false;
 }
 
 #endif /* _I2C_DS2482_SPECIAL_ */
+
+#else /* _I2C_DMA_ */
+
+/*
+ * K42 I2C1 module. The host state machine sequences a whole phase from
+ * the byte counter (address, I2C1CNT data bytes with ACK/NACK, then a
+ * STOP or SCL held for a repeated START) while DMA2 moves the data
+ * between memory and I2C1TXB/I2C1RXB. The CPU sets up each phase and
+ * waits for it to end, never for a single byte.
+ */
+
+/* Phase deadline: one byte timeout per byte, capped to fit the timer */
+#define I2C1_MAX_TIMED_BYTES    (0xFFFFU / I2C_TICKS(I2C_TIMEOUT_BYTE_US) - 1)
+
+static void i2c1_dma(uint8_t *data, uint8_t len, bool rx)
+{
+    DMA2CON0 = 0;
+
+    if (rx)
+    {
+        /* I2C1RXB -> data, one byte per I2C1RXIF, stops when full */
+        DMA2CON1bits.DMODE = 1;
+        DMA2CON1bits.DSTP = 1;
+        DMA2CON1bits.SMR = 0;
+        DMA2CON1bits.SMODE = 0;
+        DMA2CON1bits.SSTP = 0;
+        DMA2SSA = (__uint24)&I2C1RXB;
+        DMA2SSZ = 1;
+        DMA2DSA = (uint16_t)data;
+        DMA2DSZ = len;
+        DMA2SIRQ = I2C1RX_IRQ;
+    }
+    else
+    {
+        /* data -> I2C1TXB, one byte per I2C1TXIF, stops when drained */
+        DMA2CON1bits.DMODE = 0;
+        DMA2CON1bits.DSTP = 0;
+        DMA2CON1bits.SMR = 0;
+        DMA2CON1bits.SMODE = 1;
+        DMA2CON1bits.SSTP = 1;
+        DMA2SSA = (__uint24)data;
+        DMA2SSZ = len;
+        DMA2DSA = (uint16_t)&I2C1TXB;
+        DMA2DSZ = 1;
+        DMA2SIRQ = I2C1TX_IRQ;
+    }
+
+    DMA2AIRQ = 0;
+    DMA2CON0bits.EN = 1;
+    DMA2CON0bits.SIRQEN = 1;
+}
+
+/*
+ * Starts (or restarts, after a held phase) one phase and waits until the
+ * counter has drained and DMA2 has let go of the last byte. A NACK makes
+ * the module send the STOP by itself.
+ */
+static bool i2c1_run(uint8_t addr_rw, uint8_t count, bool hold)
+{
+    uint16_t ticks;
+    uint16_t start;
+
+    if (count > I2C1_MAX_TIMED_BYTES)
+        ticks = 0xFFFF;
+    else
+        ticks = I2C_TICKS(I2C_TIMEOUT_BYTE_US) * (count + 1);
+
+    I2C1ADB1 = addr_rw;
+    I2C1CNT = count;
+    I2C1CON0bits.RSEN = hold;
+    I2C1CON0bits.S = 1;
+
+    start = i2c_timer_read();
+
+    do {
+        if (I2C1ERR & I2C1_ERR_FLAGS)
+            return false;
+
+        if ((hold ? (I2C1CON0bits.MDR && !I2C1CNT) : I2C1PIRbits.PCIF) && !DMA2CON0bits.SIRQEN)
+            return true;
+    } while ((uint16_t)(i2c_timer_read() - start) < ticks);
+
+    _g_timed_out = true;
+    return false;
+}
+
+/* addr+W, first, then len bytes of data. first goes out of I2C1TXB, DMA2 feeds the rest */
+static bool i2c1_write_phase(uint8_t addr, uint8_t first, uint8_t *data, uint8_t len, bool hold)
+{
+    I2C1TXB = first;
+
+    if (len)
+        i2c1_dma(data, len, false);
+
+    return i2c1_run(addr << 1, len + 1, hold);
+}
+
+static bool i2c1_read_phase(uint8_t addr, uint8_t *data, uint8_t len, bool hold)
+{
+    i2c1_dma(data, len, true);
+    return i2c1_run((addr << 1) | 0x01, len, hold);
+}
+
+static bool i2c1_start(void)
+{
+    i2c_wait_for(I2C1STAT0, I2C1_MMA, 0, I2C_TIMEOUT_IDLE_US);
+
+    DMA2CON0 = 0;
+    I2C1STAT1bits.CLRBF = 1;
+    I2C1PIR = 0;
+    I2C1ERR &= ~I2C1_ERR_FLAGS;
+    return true;
+
+fail:
+    return false;
+}
+
+/* After a NACK the module finishes with a STOP itself. If it doesn't, reset it */
+static void i2c1_abort(void)
+{
+    DMA2CON0 = 0;
+
+    if (!i2c_wait(&I2C1STAT0, I2C1_MMA, 0, I2C_TICKS(I2C_TIMEOUT_COND_US)))
+    {
+        I2C1CON0bits.EN = 0;
+        I2C1CON0bits.EN = 1;
+    }
+}
+
+/*
+ * S addr+W cmd wdata[0..wlen-1], then if rlen, Sr addr+R rdata[0..rlen-1],
+ * then P. The shape of every MSSP transfer below, as one setup per phase.
+ */
+static bool i2c1_xfer(uint8_t addr, uint8_t cmd, uint8_t *wdata, uint8_t wlen, uint8_t *rdata, uint8_t rlen)
+{
+    uint8_t attempt = 0;
+
+retry:
+    i2c_begin();
+
+    if (!i2c1_start())
+        goto fail;
+
+    if (!i2c1_write_phase(addr, cmd, wdata, wlen, rlen != 0))
+        goto fail;
+
+    if (rlen && !i2c1_read_phase(addr, rdata, rlen, false))
+        goto fail;
+
+    i2c_end();
+    return true;
+
+fail:
+    i2c1_abort();
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
+    return false;
+}
+
+#ifdef _I2C_XFER_
+
+bool i2c_write(uint8_t addr, uint8_t reg, uint8_t data)
+{
+    return i2c1_xfer(addr, reg, &data, 1, NULL, 0);
+}
+
+bool i2c_read(uint8_t addr, uint8_t reg, uint8_t *ret)
+{
+    return i2c1_xfer(addr, reg, NULL, 0, ret, 1);
+}
+
+#endif /* _I2C_XFER_ */
+
+#ifdef _I2C_XFER_BYTE_
+
+bool i2c_write_byte(uint8_t addr, uint8_t data)
+{
+    return i2c1_xfer(addr, data, NULL, 0, NULL, 0);
+}
+
+bool i2c_read_byte(uint8_t addr, uint8_t *ret)
+{
+    uint8_t attempt = 0;
+
+retry:
+    i2c_begin();
+
+    if (!i2c1_start())
+        goto fail;
+
+    if (!i2c1_read_phase(addr, ret, 1, false))
+        goto fail;
+
+    i2c_end();
+    return true;
+
+fail:
+    i2c1_abort();
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
+    return false;
+}
+
+#endif /* _I2C_XFER_BYTE_ */
+
+#ifdef _I2C_XFER_MANY_
+
+bool i2c_write_buf(uint8_t addr, uint8_t reg, uint8_t *data, uint8_t len)
+{
+    return i2c1_xfer(addr, reg, data, len, NULL, 0);
+}
+
+bool i2c_read_buf(uint8_t addr, uint8_t offset, uint8_t *ret, uint8_t len)
+{
+    return i2c1_xfer(addr, offset, NULL, 0, ret, len);
+}
+
+/*
+ * Same bus sequence as the MSSP version. The MCP47FEB has no register
+ * auto-increment, so each register is still a write and a read phase,
+ * but they are chained with the counter holding SCL in between, and the
+ * CPU only turns the byte order around at the end.
+ */
+bool i2c_read16_many(uint8_t addr, const uint8_t *regs, uint16_t *ret, uint8_t count)
+{
+    uint8_t attempt = 0;
+    uint8_t i;
+    uint8_t *p;
+
+retry:
+    i2c_begin();
+
+    if (!i2c1_start())
+        goto fail;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!i2c1_write_phase(addr, regs[i], NULL, 0, true))
+            goto fail;
+
+        if (!i2c1_read_phase(addr, (uint8_t *)&ret[i], 2, i + 1 < count))
+            goto fail;
+    }
+
+    i2c_end();
+
+    /* Big endian on the wire */
+    for (i = 0; i < count; i++)
+    {
+        p = (uint8_t *)&ret[i];
+        ret[i] = ((uint16_t)p[0] << 8) | p[1];
+    }
+
+    return true;
+
+fail:
+    i2c1_abort();
+    i2c_end();
+
+    if (i2c_recover(&attempt))
+        goto retry;
+
+    return false;
+}
+
+#endif /* _I2C_XFER_MANY_ */
+
+#ifdef _I2C_XFER_X16_
+
+bool i2c_write16(uint8_t addr, uint8_t reg, uint16_t data)
+{
+    uint8_t buf[2];
+
+    buf[0] = (uint8_t)(data >> 8);
+    buf[1] = (uint8_t)data;
+
+    return i2c1_xfer(addr, reg, buf, 2, NULL, 0);
+}
+
+bool i2c_read16(uint8_t addr, uint8_t offset, uint16_t *ret)
+{
+    uint8_t buf[2];
+
+    if (!i2c1_xfer(addr, offset, NULL, 0, buf, 2))
+        return false;
+
+    *ret = ((uint16_t)buf[0] << 8) | buf[1];
+    return true;
+}
+
+#endif /* _I2C_XFER_X16_ */
+
+#endif /* _I2C_DMA_ */
+
+#ifdef _I2C_XFER_X16_
+
+/*
+ * Polls a 16 bit register until every bit in mask reads back clear, e.g. to
+ * wait out a device's EEPROM write cycle. NACKs are treated as busy since
+ * some devices stop responding while they program.
+ */
+bool i2c_await_clear16(uint8_t addr, uint8_t reg, uint16_t mask, uint16_t timeout_ms)
+{
+    uint16_t value;
+    i2c_deadline_t deadline;
+    bool last;
+
+    i2c_deadline_start(&deadline, timeout_ms);
+
+    do {
+        /* Sample once more after the deadline, it may pass during the delay */
+        last = i2c_deadline_passed(&deadline);
+
+        if (i2c_read16(addr, reg, &value) && !(value & mask))
+            return true;
+
+        __delay_us(100);
+    } while (!last);
+
+    return false;
+}
+
+#endif /* _I2C_XFER_X16_ */
+
 #endif /* Entire Feature */
\ No newline at end of file
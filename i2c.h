@@ -13,7 +13,14 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#if _XTAL_FREQ == 18432000
+/* K42: standalone I2C1 module with a byte counter, data moved by DMA2 */
+#ifdef __18F26K42
+#define _I2C_DMA_
+#endif
+
+#if defined(_I2C_DMA_)
+#define I2C_MIN_FREQ 96             /* Slowest CLKREF divider, see i2c_init() */
+#elif _XTAL_FREQ == 18432000
 #define I2C_MIN_FREQ 18
 #elif _XTAL_FREQ == 16000000
 #define I2C_MIN_FREQ 16
@@ -27,10 +34,21 @@
 #error Cannot determine minimum I2C frequency
 #endif
 
+/* Millisecond timeout on the I2C deadline timer, see i2c_deadline_passed() */
+typedef struct {
+    uint16_t last;          /* Timer at the previous check */
+    uint16_t ticks;         /* Part of a millisecond carried over */
+    uint16_t ms;            /* Whole milliseconds left */
+} i2c_deadline_t;
+
 void i2c_init(uint16_t freq_khz);
+uint16_t i2c_get_khz(uint16_t freq_khz);
+void i2c_deadline_start(i2c_deadline_t *deadline, uint16_t ms);
+bool i2c_deadline_passed(i2c_deadline_t *deadline);
 
 #ifdef _I2C_BRUTEFORCE_RESET_
 void i2c_bruteforce_reset(void);
+uint16_t i2c_recoveries(void);
 #endif /* _I2C_BRUTEFORCE_RESET_ */
 
 #ifdef _I2C_XFER_
@@ -46,6 +64,7 @@ bool i2c_read_byte(uint8_t addr, uint8_t *ret);
 #ifdef _I2C_XFER_MANY_
 bool i2c_read_buf(uint8_t addr, uint8_t offset, uint8_t *ret, uint8_t len);
 bool i2c_write_buf(uint8_t addr, uint8_t reg, uint8_t *data, uint8_t len);
+bool i2c_read16_many(uint8_t addr, const uint8_t *regs, uint16_t *ret, uint8_t count);
 #endif /* I2C_XFER_MANY */
 
 #ifdef _I2C_XFER_MANY_TO_UART_
@@ -55,6 +74,7 @@ bool i2c_read_to_uart(uint8_t addr, uint8_t offset, uint8_t len);
 #ifdef _I2C_XFER_X16_
 bool i2c_read16(uint8_t addr, uint8_t reg, uint16_t *ret);
 bool i2c_write16(uint8_t addr, uint8_t reg, uint16_t data);
+bool i2c_await_clear16(uint8_t addr, uint8_t reg, uint16_t mask, uint16_t timeout_ms);
 #endif /* _I2C_XFER_X16_ */
 
 #ifdef _I2C_DS2482_SPECIAL_
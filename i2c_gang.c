@@ -0,0 +1,253 @@
+/*
+* File:   i2c_gang.c
+* Author: Matt
+*
+* Bit-banged I2C master driving one shared SCL and up to eight SDA
+* lanes on a single port. Every lane sees the same clock, so identical
+* devices (same slave address) can be programmed in parallel.
+*
+* Lines are driven open-drain: LAT is held at 0 and the TRIS bit
+* releases (1) or pulls low (0).
+*/
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "i2c_gang.h"
+
+#ifdef _I2C_GANG_
+
+#define gang_delay() __delay_us(I2C_GANG_HALF_PERIOD_US)
+#define gang_scl_low() (I2C_GANG_SCL_TRIS = 0)
+#define gang_scl_high() (I2C_GANG_SCL_TRIS = 1)
+
+static uint8_t _g_lanes;    /* Lanes in use */
+static uint8_t _g_live;     /* Lanes that have ACKed everything so far */
+
+void i2c_gang_init(uint8_t lanes)
+{
+    /* Release everything we may have driven before */
+    I2C_GANG_SDA_TRIS |= _g_lanes | lanes;
+    I2C_GANG_SDA_LAT &= ~lanes;
+
+    I2C_GANG_SCL_TRIS = 1;
+    I2C_GANG_SCL_LAT = 0;
+
+    _g_lanes = lanes;
+}
+
+uint8_t i2c_gang_lanes(void)
+{
+    return _g_lanes;
+}
+
+/* release: lanes to let float high. Lanes that dropped out always float */
+static void gang_sda(uint8_t release)
+{
+    I2C_GANG_SDA_TRIS = (I2C_GANG_SDA_TRIS & ~_g_lanes) | ((release | ~_g_live) & _g_lanes);
+}
+
+static void gang_clock(void)
+{
+    gang_delay();
+    gang_scl_high();
+    gang_delay();
+    gang_scl_low();
+}
+
+static void gang_start(void)
+{
+    _g_live = _g_lanes;
+
+    gang_sda(0xFF);
+    gang_scl_high();
+    gang_delay();
+    gang_sda(0x00);
+    gang_delay();
+    gang_scl_low();
+}
+
+static void gang_restart(void)
+{
+    gang_sda(0xFF);
+    gang_delay();
+    gang_scl_high();
+    gang_delay();
+    gang_sda(0x00);
+    gang_delay();
+    gang_scl_low();
+}
+
+static void gang_stop(void)
+{
+    uint8_t live = _g_live;
+
+    /* Every lane gets the STOP, including the ones that NACKed */
+    _g_live = _g_lanes;
+
+    gang_sda(0x00);
+    gang_delay();
+    gang_scl_high();
+    gang_delay();
+    gang_sda(0xFF);
+    gang_delay();
+
+    _g_live = live;
+}
+
+/* bits[0] is the MSB. Each entry is the mask of lanes sending a 1 */
+static void gang_out(const uint8_t *bits)
+{
+    uint8_t i;
+
+    for (i = 0; i < 8; i++)
+    {
+        gang_sda(bits[i]);
+        gang_clock();
+    }
+
+    /* ACK slot. Lanes that NACK drop out of the transaction */
+    gang_sda(0xFF);
+    gang_delay();
+    gang_scl_high();
+    gang_delay();
+    _g_live &= ~I2C_GANG_SDA_PORT;
+    gang_scl_low();
+}
+
+static void gang_out_byte(uint8_t data)
+{
+    uint8_t bits[8];
+    uint8_t i;
+
+    for (i = 0; i < 8; i++)
+        bits[i] = (data & (0x80 >> i)) ? 0xFF : 0x00;
+
+    gang_out(bits);
+}
+
+/* Per lane data: bit-transpose one byte of every lane's word */
+static void gang_out_lanes(const uint16_t *data, bool high)
+{
+    uint8_t bits[8];
+    uint8_t i;
+    uint8_t lane;
+    uint8_t byte;
+
+    for (i = 0; i < 8; i++)
+        bits[i] = 0;
+
+    for (lane = 0; lane < I2C_GANG_LANES; lane++)
+    {
+        byte = high ? (uint8_t)(data[lane] >> 8) : (uint8_t)data[lane];
+
+        for (i = 0; i < 8; i++)
+        {
+            if (byte & (0x80 >> i))
+                bits[i] |= (1 << lane);
+        }
+    }
+
+    gang_out(bits);
+}
+
+static void gang_in(uint8_t *bytes, bool ack)
+{
+    uint8_t i;
+    uint8_t lane;
+    uint8_t sample;
+
+    gang_sda(0xFF);
+
+    for (i = 0; i < 8; i++)
+    {
+        gang_delay();
+        gang_scl_high();
+        gang_delay();
+        sample = I2C_GANG_SDA_PORT;
+        gang_scl_low();
+
+        for (lane = 0; lane < I2C_GANG_LANES; lane++)
+        {
+            bytes[lane] <<= 1;
+            if (sample & (1 << lane))
+                bytes[lane] |= 0x01;
+        }
+    }
+
+    gang_sda(ack ? 0x00 : 0xFF); /* Send ACK when true and NACK when false */
+    gang_clock();
+    gang_sda(0xFF);
+}
+
+uint8_t i2c_gang_write(uint8_t addr, uint8_t reg, uint8_t data)
+{
+    gang_start();
+    gang_out_byte(addr << 1);
+    gang_out_byte(reg);
+    gang_out_byte(data);
+    gang_stop();
+
+    return _g_live;
+}
+
+uint8_t i2c_gang_write_byte(uint8_t addr, uint8_t data)
+{
+    gang_start();
+    gang_out_byte(addr << 1);
+    gang_out_byte(data);
+    gang_stop();
+
+    return _g_live;
+}
+
+uint8_t i2c_gang_write16(uint8_t addr, uint8_t reg, uint16_t data)
+{
+    gang_start();
+    gang_out_byte(addr << 1);
+    gang_out_byte(reg);
+    gang_out_byte((uint8_t)(data >> 8));
+    gang_out_byte((uint8_t)data);
+    gang_stop();
+
+    return _g_live;
+}
+
+/* data[] holds one word per lane, I2C_GANG_LANES entries */
+uint8_t i2c_gang_write16_lanes(uint8_t addr, uint8_t reg, const uint16_t *data)
+{
+    gang_start();
+    gang_out_byte(addr << 1);
+    gang_out_byte(reg);
+    gang_out_lanes(data, true);
+    gang_out_lanes(data, false);
+    gang_stop();
+
+    return _g_live;
+}
+
+/* ret[] receives one word per lane, I2C_GANG_LANES entries */
+uint8_t i2c_gang_read16(uint8_t addr, uint8_t reg, uint16_t *ret)
+{
+    uint8_t hi[I2C_GANG_LANES];
+    uint8_t lo[I2C_GANG_LANES];
+    uint8_t lane;
+
+    gang_start();
+    gang_out_byte(addr << 1);
+    gang_out_byte(reg);
+    gang_restart();
+    gang_out_byte((addr << 1) | 0x01);
+    gang_in(hi, true);
+    gang_in(lo, false);
+    gang_stop();
+
+    for (lane = 0; lane < I2C_GANG_LANES; lane++)
+        ret[lane] = ((uint16_t)hi[lane] << 8) | lo[lane];
+
+    return _g_live;
+}
+
+#endif /* _I2C_GANG_ */
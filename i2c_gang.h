@@ -0,0 +1,35 @@
+/*
+* File:   i2c_gang.h
+* Author: Matt
+*
+* Bit-banged I2C master driving one shared SCL and up to eight SDA
+* lanes on a single port. Every lane sees the same clock, so identical
+* devices (same slave address) can be programmed in parallel.
+*
+* Each lane needs its own SDA pull-up. Functions return a mask of the
+* lanes that acknowledged every byte of the transaction.
+*/
+
+#ifndef __I2C_GANG_H__
+#define __I2C_GANG_H__
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef _I2C_GANG_
+
+#define I2C_GANG_LANES          8
+
+void i2c_gang_init(uint8_t lanes);
+uint8_t i2c_gang_lanes(void);
+uint8_t i2c_gang_write(uint8_t addr, uint8_t reg, uint8_t data);
+uint8_t i2c_gang_write_byte(uint8_t addr, uint8_t data);
+uint8_t i2c_gang_write16(uint8_t addr, uint8_t reg, uint16_t data);
+uint8_t i2c_gang_write16_lanes(uint8_t addr, uint8_t reg, const uint16_t *data);
+uint8_t i2c_gang_read16(uint8_t addr, uint8_t reg, uint16_t *ret);
+
+#endif /* _I2C_GANG_ */
+
+#endif /* __I2C_GANG_H__ */
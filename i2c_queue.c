@@ -0,0 +1,321 @@
+/*
+* File:   i2c_queue.c
+* Author: Matt
+*
+* Interrupt driven (SSPIF) I2C transaction engine. Jobs are queued
+* and clocked out in the background by i2c_queue_isr().
+*/
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "i2c_queue.h"
+
+#ifdef _I2C_QUEUE_
+
+#define I2C_STATE_IDLE          0x00
+#define I2C_STATE_START         0x01
+#define I2C_STATE_ADDR_W        0x02
+#define I2C_STATE_TX_DATA       0x03
+#define I2C_STATE_RESTART       0x04
+#define I2C_STATE_ADDR_R        0x05
+#define I2C_STATE_RX_BYTE       0x06
+#define I2C_STATE_RX_ACK        0x07
+#define I2C_STATE_STOP          0x08
+
+#define I2C_QUEUE_MASK          (I2C_QUEUE_LEN - 1)
+
+#if (I2C_QUEUE_LEN & I2C_QUEUE_MASK)
+#error I2C_QUEUE_LEN must be a power of two
+#endif
+
+#define i2c_queue_irq_off() (PIE1bits.SSPIE = 0)
+#define i2c_queue_irq_on() (PIE1bits.SSPIE = 1)
+
+/*
+ * Jobs are also submitted from other interrupt sources (the wave timer),
+ * so main line changes to the ring hold off every interrupt, not just
+ * SSPIF. Inside the ISR GIE is already clear and stays so.
+ */
+#define i2c_queue_enter(gie) { gie = INTCONbits.GIE; INTCONbits.GIE = 0; }
+#define i2c_queue_leave(gie) (INTCONbits.GIE = gie)
+
+static i2c_job_t *_g_queue[I2C_QUEUE_LEN];
+static volatile uint8_t _g_head;
+static volatile uint8_t _g_tail;
+static i2c_job_t * volatile _g_current;
+static volatile uint8_t _g_state;
+static volatile uint8_t _g_result;
+static volatile bool _g_locked;
+static uint8_t _g_index;
+
+static void i2c_queue_kick(void);
+
+void i2c_queue_init(void)
+{
+    i2c_queue_irq_off();
+    PIR1bits.SSPIF = 0;
+
+    _g_head = 0;
+    _g_tail = 0;
+    _g_current = NULL;
+    _g_state = I2C_STATE_IDLE;
+    _g_locked = false;
+}
+
+/* Called with SSPIE masked, or from the ISR itself */
+static void i2c_queue_kick(void)
+{
+    i2c_job_t *job;
+
+    if (_g_current || _g_locked || _g_head == _g_tail)
+        return;
+
+    job = _g_queue[_g_tail];
+    _g_tail = (_g_tail + 1) & I2C_QUEUE_MASK;
+
+    _g_current = job;
+    _g_result = I2C_JOB_DONE;
+    _g_index = 0;
+    job->status = I2C_JOB_BUSY;
+
+    PIR1bits.SSPIF = 0;
+    _g_state = I2C_STATE_START;
+    SSPCON2bits.SEN = 1;
+    i2c_queue_irq_on();
+}
+
+static void i2c_queue_complete(void)
+{
+    i2c_job_t *job = _g_current;
+
+    _g_current = NULL;
+    _g_state = I2C_STATE_IDLE;
+    i2c_queue_irq_off();
+
+    job->status = _g_result;
+
+    if (job->callback)
+        job->callback(job);
+
+    i2c_queue_kick();
+}
+
+void i2c_queue_isr(void)
+{
+    i2c_job_t *job = _g_current;
+
+    if (!job)
+    {
+        i2c_queue_irq_off();
+        return;
+    }
+
+    switch (_g_state)
+    {
+        case I2C_STATE_START:
+            _g_state = I2C_STATE_ADDR_W;
+            SSPBUF = job->addr << 1;
+            break;
+
+        case I2C_STATE_ADDR_W:
+            if (SSPCON2bits.ACKSTAT)
+                goto nack;
+            _g_state = I2C_STATE_TX_DATA;
+            SSPBUF = job->reg;
+            break;
+
+        case I2C_STATE_TX_DATA:
+            if (SSPCON2bits.ACKSTAT)
+                goto nack;
+
+            if (job->flags & I2C_JOB_READ)
+            {
+                _g_state = I2C_STATE_RESTART;
+                SSPCON2bits.RSEN = 1;
+            }
+            else if (_g_index < job->len)
+            {
+                SSPBUF = job->data[_g_index++];
+            }
+            else
+            {
+                _g_state = I2C_STATE_STOP;
+                SSPCON2bits.PEN = 1;
+            }
+            break;
+
+        case I2C_STATE_RESTART:
+            _g_state = I2C_STATE_ADDR_R;
+            SSPBUF = (job->addr << 1) | 0x01;
+            break;
+
+        case I2C_STATE_ADDR_R:
+            if (SSPCON2bits.ACKSTAT)
+                goto nack;
+            _g_state = I2C_STATE_RX_BYTE;
+            SSPCON2bits.RCEN = 1;
+            break;
+
+        case I2C_STATE_RX_BYTE:
+            job->data[_g_index++] = SSPBUF;
+            _g_state = I2C_STATE_RX_ACK;
+            SSPCON2bits.ACKDT = (_g_index < job->len) ? 0 : 1; /* NACK the last byte */
+            SSPCON2bits.ACKEN = 1;
+            break;
+
+        case I2C_STATE_RX_ACK:
+            if (_g_index < job->len)
+            {
+                _g_state = I2C_STATE_RX_BYTE;
+                SSPCON2bits.RCEN = 1;
+            }
+            else
+            {
+                _g_state = I2C_STATE_STOP;
+                SSPCON2bits.PEN = 1;
+            }
+            break;
+
+        case I2C_STATE_STOP:
+            i2c_queue_complete();
+            break;
+
+        default:
+            i2c_queue_irq_off();
+            break;
+    }
+
+    return;
+
+nack:
+    _g_result = I2C_JOB_FAILED;
+    _g_state = I2C_STATE_STOP;
+    SSPCON2bits.PEN = 1;     /* Reset I2C bus */
+}
+
+bool i2c_queue_submit(i2c_job_t *job)
+{
+    uint8_t next;
+    bool ret = false;
+    bool gie;
+
+    if ((job->flags & I2C_JOB_READ) && !job->len)
+        return false;
+
+    i2c_queue_enter(gie);
+    i2c_queue_irq_off();
+
+    next = (_g_head + 1) & I2C_QUEUE_MASK;
+
+    if (next != _g_tail)
+    {
+        job->status = I2C_JOB_QUEUED;
+        _g_queue[_g_head] = job;
+        _g_head = next;
+        ret = true;
+    }
+
+    if (_g_current)
+        i2c_queue_irq_on();
+    else
+        i2c_queue_kick();
+
+    i2c_queue_leave(gie);
+    return ret;
+}
+
+bool i2c_queue_busy(void)
+{
+    return _g_current || _g_head != _g_tail;
+}
+
+bool i2c_queue_wait(i2c_job_t *job)
+{
+    uint16_t timeout = I2C_QUEUE_TIMEOUT_MS * 100;
+
+    while (i2c_job_pending(job))
+    {
+        if (!--timeout)
+        {
+            i2c_queue_abort();
+            return false;
+        }
+        __delay_us(10);
+    }
+
+    return job->status == I2C_JOB_DONE;
+}
+
+bool i2c_queue_flush(void)
+{
+    uint16_t timeout = I2C_QUEUE_TIMEOUT_MS * 100;
+
+    while (_g_current || (!_g_locked && _g_head != _g_tail))
+    {
+        if (!--timeout)
+        {
+            i2c_queue_abort();
+            return false;
+        }
+        __delay_us(10);
+    }
+
+    return true;
+}
+
+void i2c_queue_abort(void)
+{
+    bool gie;
+
+    i2c_queue_enter(gie);
+    i2c_queue_irq_off();
+
+    if (_g_current)
+    {
+        _g_current->status = I2C_JOB_FAILED;
+        _g_current = NULL;
+        SSPCON2bits.PEN = 1; /* Reset I2C bus */
+    }
+
+    while (_g_tail != _g_head)
+    {
+        _g_queue[_g_tail]->status = I2C_JOB_FAILED;
+        _g_tail = (_g_tail + 1) & I2C_QUEUE_MASK;
+    }
+
+    _g_state = I2C_STATE_IDLE;
+    i2c_queue_leave(gie);
+}
+
+/*
+ * The blocking transfers in i2c.c share the MSSP with this engine. They
+ * take the lock for the duration of a transfer: the in-flight job is
+ * allowed to finish and anything submitted meanwhile waits in the queue.
+ */
+void i2c_queue_lock(void)
+{
+    _g_locked = true;
+    i2c_queue_flush();
+}
+
+void i2c_queue_unlock(void)
+{
+    bool gie;
+
+    i2c_queue_enter(gie);
+    i2c_queue_irq_off();
+    _g_locked = false;
+
+    if (_g_current)
+        i2c_queue_irq_on();
+    else
+        i2c_queue_kick();
+
+    i2c_queue_leave(gie);
+}
+
+#endif /* _I2C_QUEUE_ */
@@ -0,0 +1,62 @@
+/*
+* File:   i2c_queue.h
+* Author: Matt
+*
+* Interrupt driven (SSPIF) I2C transaction engine. Jobs are queued
+* and clocked out in the background by i2c_queue_isr().
+*/
+
+#ifndef __I2C_QUEUE_H__
+#define __I2C_QUEUE_H__
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef _I2C_QUEUE_
+
+#define I2C_JOB_WRITE           0x00
+#define I2C_JOB_READ            0x01
+
+#define I2C_JOB_IDLE            0x00
+#define I2C_JOB_QUEUED          0x01
+#define I2C_JOB_BUSY            0x02
+#define I2C_JOB_DONE            0x03
+#define I2C_JOB_FAILED          0x04
+
+typedef struct i2c_job i2c_job_t;
+typedef void (*i2c_job_cb_t)(i2c_job_t *job);
+
+/*
+ * Transaction descriptor. Storage is owned by the caller and must stay
+ * valid until status reaches I2C_JOB_DONE or I2C_JOB_FAILED.
+ *
+ * Write: START, addr+W, reg, data[0..len-1], STOP
+ * Read:  START, addr+W, reg, RESTART, addr+R, data[0..len-1], STOP
+ */
+struct i2c_job {
+    uint8_t addr;
+    uint8_t reg;
+    uint8_t *data;
+    uint8_t len;
+    uint8_t flags;
+    volatile uint8_t status;
+    i2c_job_cb_t callback;      /* Optional. Called from ISR context */
+};
+
+void i2c_queue_init(void);
+void i2c_queue_isr(void);
+bool i2c_queue_submit(i2c_job_t *job);
+bool i2c_queue_busy(void);
+bool i2c_queue_wait(i2c_job_t *job);
+bool i2c_queue_flush(void);
+void i2c_queue_abort(void);
+void i2c_queue_lock(void);
+void i2c_queue_unlock(void);
+
+#define i2c_job_pending(job) ((job)->status == I2C_JOB_QUEUED || (job)->status == I2C_JOB_BUSY)
+
+#endif /* _I2C_QUEUE_ */
+
+#endif /* __I2C_QUEUE_H__ */
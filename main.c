@@ -16,6 +16,9 @@
 #include "util.h"
 #include "usart.h"
 #include "i2c.h"
+#include "i2c_queue.h"
+#include "adc.h"
+#include "wave.h"
 
 #ifdef __18F26K22
 #ifdef _4X_PLL_
@@ -66,18 +69,86 @@
 #pragma config EBTRB = OFF
 #endif
 
+#ifdef __18F26K42
+#pragma config FEXTOSC = HS
+#ifdef _4X_PLL_
+#pragma config RSTOSC = EXTOSC_4PLL
+#else
+#pragma config RSTOSC = EXTOSC
+#endif
+#pragma config CLKOUTEN = OFF
+#pragma config CSWEN = ON
+#pragma config FCMEN = OFF
+#pragma config MCLRE = EXTMCLR
+#pragma config PWRTS = PWRT_OFF
+#pragma config MVECEN = OFF // Legacy vectors, same ISR as the other parts
+#pragma config BOREN = OFF
+#pragma config PPS1WAY = OFF
+#pragma config STVREN = ON
+#pragma config DEBUG = OFF
+#pragma config XINST = OFF
+#pragma config WDTCPS = WDTCPS_14
+#pragma config WDTE = ON
+#pragma config LVP = OFF
+#pragma config CP = OFF
+#endif
+
+#ifdef _USART1_BUFFERED_
+#define UART_FLAGS  (USART_CONT_RX | USART_IOR)
+#else
+#define UART_FLAGS  USART_CONT_RX
+#endif
+
 sys_config_t _g_cfg;
 
+#ifdef __PIC18__
+void interrupt high_priority isr_high(void)
+#else
+void interrupt isr(void)
+#endif
+{
+#ifdef _USART1_BUFFERED_
+    usart1_isr();
+#endif /* _USART1_BUFFERED_ */
+
+#ifdef _USART2_
+    usart2_isr();
+#endif /* _USART2_ */
+
+#ifdef _ADC_
+    adc_isr();
+#endif /* _ADC_ */
+
+#ifdef _WAVE_
+    wave_isr();
+#endif /* _WAVE_ */
+
+#ifdef _I2C_QUEUE_
+    if (PIE1bits.SSPIE && PIR1bits.SSPIF)
+    {
+        PIR1bits.SSPIF = 0;
+        i2c_queue_isr();
+    }
+#endif /* _I2C_QUEUE_ */
+}
+
 int main(void)
 {
     sys_config_t *config = &_g_cfg;
 
     /* Disable Interrupts */
+#ifdef __18F26K42
+    INTCON0bits.GIEH = 0;
+    INTCON0bits.GIEL = 0;
+
+    INTCON0bits.IPEN = 1;
+#else
     INTCONbits.GIE_GIEH = 0;
     INTCONbits.PEIE_GIEL = 0;
 
     INTCON2bits.RBIP = 0;
     RCONbits.IPEN = 1;
+#endif /* __18F26K42 */
 
     /* A/D pins all digital */
 #ifdef __PIC18_K__
@@ -91,7 +162,12 @@ int main(void)
     ADCON1bits.PCFG3 = 1;
 #endif /* __PIC18_K__ */
 
-#ifdef __PIC18_K__
+#if defined(__18F26K42)
+    IOCBPbits.IOCBP4 = 1;
+    IOCBNbits.IOCBN4 = 1;
+    IOCBPbits.IOCBP5 = 1;
+    IOCBNbits.IOCBN5 = 1;
+#elif defined(__PIC18_K__)
     IOCBbits.IOCB4 = 1;
     IOCBbits.IOCB5 = 1;
 #endif
@@ -102,15 +178,48 @@ int main(void)
     PORTAbits.RA3 = 0;
     PORTAbits.RA5 = 0;
 
+#ifdef __18F26K42
+    dma_arbiter_init();
+#endif /* __18F26K42 */
+
 #ifdef _4X_PLL_
-    usart1_open(USART_CONT_RX, (((_XTAL_FREQ / UART_BAUD) / 64) - 1));
+    usart1_open(UART_FLAGS, (((_XTAL_FREQ / UART_BAUD) / 64) - 1));
 #else
-    usart1_open(USART_CONT_RX | USART_BRGH, (((_XTAL_FREQ / UART_BAUD) / 16) - 1));
+    usart1_open(UART_FLAGS | USART_BRGH, (((_XTAL_FREQ / UART_BAUD) / 16) - 1));
 #endif
     
-    i2c_init(100);
+    i2c_init(I2C_SPEED_100K * 100);
+#ifdef _I2C_QUEUE_
+    i2c_queue_init();
+#endif /* _I2C_QUEUE_ */
+#ifdef _ADC_
+    adc_init();
+#endif /* _ADC_ */
+
+    /* Enable Interrupts */
+#ifdef __18F26K42
+    INTCON0bits.GIEL = 1;
+    INTCON0bits.GIEH = 1;
+#else
+    INTCONbits.PEIE_GIEL = 1;
+    INTCONbits.GIE_GIEH = 1;
+#endif /* __18F26K42 */
+
     load_configuration(config);
 
+#ifdef _USART_BRG16_
+    if (config->uart_autobaud && usart1_autobaud(UART_AUTOBAUD_MS))
+        printf("\r\nAuto-baud: %lu\r\n", usart1_get_baud());
+    else
+#endif /* _USART_BRG16_ */
+    if (!usart1_set_baud(config->uart_baud))
+        usart1_set_baud(UART_BAUD);
+
+#ifdef _USART2_
+    if (config->data_baud)
+        usart2_open(config->data_baud);
+#endif /* _USART2_ */
+
     for (;;)
     {
         cmd_prompt(config);
@@ -15,10 +15,29 @@
 
 #define MCP47FEBXX_VOLATILE_DAC0            (0x00 << 3)
 #define MCP47FEBXX_VOLATILE_DAC1            (0x01 << 3)
+#define MCP47FEBXX_VOLATILE_VREF            (0x08 << 3)
+#define MCP47FEBXX_VOLATILE_POWERDOWN       (0x09 << 3)
+#define MCP47FEBXX_GAIN_STATUS              (0x0A << 3)
 #define MCP47FEBXX_NONVOLATILE_DAC0         (0x10 << 3)
 #define MCP47FEBXX_NONVOLATILE_DAC1         (0x11 << 3)
+#define MCP47FEBXX_NONVOLATILE_VREF         (0x18 << 3)
+#define MCP47FEBXX_NONVOLATILE_POWERDOWN    (0x19 << 3)
 #define MCP47FEBXX_GAINCTRL_SLAVEADDR       (0x1A << 3)
 
+/* Gain / status register bits */
+#define MCP47FEBXX_STATUS_EEWA              0x0040
+#define MCP47FEBXX_STATUS_POR               0x0080
+#define MCP47FEBXX_GAIN_G0                  0x0100
+#define MCP47FEBXX_GAIN_G1                  0x0200
+
+#define MCP47FEBXX_MAX_CODE                 4095
+
+/* Registers 10h to 1Fh are EEPROM backed */
+#define MCP47FEBXX_IS_NONVOLATILE(reg)      ((reg) & 0x80)
+
+/* EEPROM write cycle is 10ms max. Leave some margin */
+#define MCP47FEBXX_NV_TIMEOUT_MS            25
+
 #define MCP47FEBXX_A0_SLAVE_ADDR            0x60
 
 #endif /* __MCP47FEBXX_H__ */
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define __PROJECT_H__
 
 #define _USART1_
+#define _USART1_BUFFERED_
 #define _12_288_CLK_
 
 #if defined(__18F26K22) || defined(__18F26K42)
@@ -10,9 +11,27 @@
 #define __PIC18_K__
 #define _4X_PLL_
 #define _HELP_
+#define _I2C_GANG_
+#define _BINARY_PROTO_
+#define _ADC_
 
 #endif
 
+/* The background I2C engine runs the MSSP. The K42's I2C1 module isn't one */
+#ifdef __18F26K22
+#define _I2C_QUEUE_
+#endif
+
+/* DAC waveforms are clocked out as background I2C jobs (Timer1 / CCP5) */
+#ifdef _I2C_QUEUE_
+#define _WAVE_
+#endif
+
+/* Second EUSART as a host data channel. Shares RB6/RB7 with gang lanes 6/7 */
+#ifdef __18F26K22
+#define _USART2_
+#endif
+
 #ifdef _12_288_CLK_
 #ifdef _4X_PLL_
 #define _XTAL_FREQ      49152000
@@ -24,14 +43,50 @@
 #include <xc.h>
 #include <stdint.h>
 
-#define CONFIG_MAGIC        0x4646
+#define CONFIG_MAGIC        0x464C
 
 #define _I2C_XFER_
 #define _I2C_XFER_BYTE_
 #define _I2C_XFER_X16_
+#define _I2C_XFER_MANY_
+#define _I2C_BRUTEFORCE_RESET_
+
+#define I2C_SPEED_ENTRIES       4
+#define I2C_FALLBACK_ERRORS     3
+
+/* Gang programmer: SDA lanes on PORTB, shared SCL on RC2 */
+#define I2C_GANG_SDA_PORT       PORTB
+#define I2C_GANG_SDA_LAT        LATB
+#define I2C_GANG_SDA_TRIS       TRISB
+#define I2C_GANG_SCL_LAT        LATCbits.LATC2
+#define I2C_GANG_SCL_TRIS       TRISCbits.TRISC2
+#define I2C_GANG_HALF_PERIOD_US 5
+
+#define I2C_QUEUE_LEN           4   /* Power of two */
+#define I2C_QUEUE_TIMEOUT_MS    50
 
 #define UART_BAUD            9600
+#define UART_AUTOBAUD_MS     3000
+
+/* Ring buffer sizes, powers of two */
+#ifdef __PIC18_K__
+#define UART_RX_BUF_SIZE        64
+#define UART_TX_BUF_SIZE        256
+#else
+#define UART_RX_BUF_SIZE        16
+#define UART_TX_BUF_SIZE        32
+#endif
+
+#define UART2_BAUD              460800
+#define UART2_RX_BUF_SIZE       128
+#define UART2_TX_BUF_SIZE       128
+#define UART2_GANG_LANES        0xC0    /* Gang lanes lost to TX2/RX2 */
 
 #define MAX_DESC                16
 
+/* DAC outputs fed back to the ADC for autocal. ANx on RAx */
+#define ADC_CH_OFFSET           0   /* DAC0 */
+#define ADC_CH_GAIN             1   /* DAC1 */
+#define ADC_VREF_MV             5000
+
 #endif /* __PROJECT_H__ */
\ No newline at end of file
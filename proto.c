@@ -0,0 +1,173 @@
+/*
+* File:   proto.c
+* Author: Matt
+*
+* Binary framed command protocol: framing and CRC. Opcode handling
+* lives with the rest of the commands in cmd.c.
+*/
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "proto.h"
+#include "usart.h"
+#include "util.h"
+
+#ifdef _BINARY_PROTO_
+
+/* CRC-16/CCITT, one nibble at a time */
+static const uint16_t _g_crc_table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+};
+
+uint16_t proto_crc16(uint16_t crc, const uint8_t *data, uint8_t len)
+{
+    uint8_t c;
+
+    while (len--)
+    {
+        c = *data++;
+        crc = (crc << 4) ^ _g_crc_table[(uint8_t)(crc >> 12) ^ (c >> 4)];
+        crc = (crc << 4) ^ _g_crc_table[(uint8_t)(crc >> 12) ^ (c & 0x0F)];
+    }
+
+    return crc;
+}
+
+uint8_t proto_rx_size(uint8_t port)
+{
+#ifdef _USART2_
+    if (port == PROTO_PORT_DATA)
+        return UART2_RX_BUF_SIZE;
+#endif /* _USART2_ */
+
+    return UART_RX_BUF_SIZE;
+}
+
+static bool proto_ready(uint8_t port)
+{
+#ifdef _USART2_
+    if (port == PROTO_PORT_DATA)
+        return usart2_data_ready();
+#endif /* _USART2_ */
+
+    return usart1_data_ready();
+}
+
+static uint8_t proto_get(uint8_t port)
+{
+#ifdef _USART2_
+    if (port == PROTO_PORT_DATA)
+        return (uint8_t)usart2_get();
+#endif /* _USART2_ */
+
+    return (uint8_t)usart1_get();
+}
+
+static void proto_put(uint8_t port, uint8_t c)
+{
+#ifdef _USART2_
+    if (port == PROTO_PORT_DATA)
+    {
+        while (usart2_busy());
+        usart2_put((char)c);
+        return;
+    }
+#endif /* _USART2_ */
+
+    while (usart1_busy());
+    usart1_put((char)c);
+}
+
+/* Next byte of a frame. Gives up if the host stalls mid-frame */
+static bool proto_getch(uint8_t port, uint8_t *c)
+{
+    uint16_t timeout = PROTO_BYTE_TIMEOUT_MS * 10;
+
+    while (!proto_ready(port))
+    {
+        if (!--timeout)
+            return false;
+
+        CLRWDT();
+        __delay_us(100);
+    }
+
+    *c = proto_get(port);
+    return true;
+}
+
+/*
+ * Bytes outside a frame are discarded while hunting for SOF, which is
+ * also how the parser resynchronises. The console blocks until a frame
+ * starts; the data channel gives up once its input runs dry.
+ *
+ * Doesn't use wdt_getch(): that calls back into cmd_idle(), which is
+ * what serves the data channel.
+ */
+uint8_t proto_recv(uint8_t port, proto_frame_t *frame)
+{
+    uint8_t *p = &frame->len;
+    uint8_t crc[2];
+    uint8_t c;
+    uint8_t i;
+
+    do {
+        if (port == PROTO_PORT_CONSOLE)
+        {
+            clear_usart_oerr();
+
+            while (!proto_ready(port))
+                CLRWDT();
+        }
+
+        if (!proto_getch(port, &c))
+            return PROTO_RX_DROP;
+    } while (c != PROTO_SOF);
+
+    /* len, seq, op are laid out ahead of payload */
+    for (i = 0; i < 3; i++)
+    {
+        if (!proto_getch(port, &p[i]))
+            return PROTO_RX_DROP;
+    }
+
+    if (frame->len > PROTO_MAX_PAYLOAD)
+        return PROTO_RX_DROP;
+
+    for (i = 0; i < frame->len; i++)
+    {
+        if (!proto_getch(port, &frame->payload[i]))
+            return PROTO_RX_DROP;
+    }
+
+    if (!proto_getch(port, &crc[0]) || !proto_getch(port, &crc[1]))
+        return PROTO_RX_DROP;
+
+    if (proto_crc16(0xFFFF, p, frame->len + 3) != (((uint16_t)crc[0] << 8) | crc[1]))
+        return PROTO_RX_CRC;
+
+    return PROTO_RX_FRAME;
+}
+
+void proto_send(uint8_t port, const proto_frame_t *frame)
+{
+    const uint8_t *p = &frame->len;
+    uint16_t crc;
+    uint8_t i;
+
+    crc = proto_crc16(0xFFFF, p, frame->len + 3);
+
+    proto_put(port, PROTO_SOF);
+
+    for (i = 0; i < frame->len + 3; i++)
+        proto_put(port, p[i]);
+
+    proto_put(port, (uint8_t)(crc >> 8));
+    proto_put(port, (uint8_t)crc);
+}
+
+#endif /* _BINARY_PROTO_ */
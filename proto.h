@@ -0,0 +1,84 @@
+/*
+* File:   proto.h
+* Author: Matt
+*
+* Binary framed command protocol for host automation. Runs on the
+* console UART next to the text CLI and is entered by sending
+* PROTO_MAGIC_COUNT SYN (16h) characters at the start of a line.
+*
+* Frame, both directions:
+*
+*   SOF len seq op payload[len] crc_hi crc_lo
+*
+* The CRC is CRC-16/CCITT (poly 1021h, init FFFFh) over len, seq, op
+* and payload. A reply echoes seq and op and carries a status byte as
+* payload[0]. Requests are handled in order, so the host may pipeline
+* as many as fit in the receive buffer (PROTO_OP_INFO reports its size)
+* and match replies by seq.
+*
+* On the 26K22 the same frames are also served on USART2 whenever the
+* console sits at its prompt, without any switch sequence.
+*/
+
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef _BINARY_PROTO_
+
+#define PROTO_VERSION           1
+
+#define PROTO_SOF               0xA5
+#define PROTO_MAGIC             0x16
+#define PROTO_MAGIC_COUNT       2
+#define PROTO_MAX_PAYLOAD       24
+#define PROTO_BYTE_TIMEOUT_MS   20
+
+#define PROTO_PORT_CONSOLE      0   /* USART1, after the SYN switch */
+#define PROTO_PORT_DATA         1   /* USART2 data channel, always framed */
+
+/* Opcodes. reg is the register address (00h to 1Fh), not a command byte */
+#define PROTO_OP_INFO           0x00    /* -> version, rx buffer size, max payload */
+#define PROTO_OP_READ           0x01    /* reg -> hi lo */
+#define PROTO_OP_WRITE          0x02    /* reg hi lo. NV registers wait for EEPROM */
+#define PROTO_OP_SET            0x03    /* nv offset_hi offset_lo gain_hi gain_lo */
+#define PROTO_OP_ADDR           0x04    /* addr, or mux channel addr. Selects the target */
+#define PROTO_OP_PGMADDR        0x05    /* addr. Reprograms the target's address */
+#define PROTO_OP_DUMP           0x06    /* [all] -> hi lo per register, dump order */
+#define PROTO_OP_SAVE           0x07
+#define PROTO_OP_DEFAULT        0x08
+#define PROTO_OP_IDENT          0x09    /* -> station desc, NUL padded to MAX_DESC */
+#define PROTO_OP_EXIT           0x0F    /* Back to the text CLI */
+
+/* Reply status, payload[0] */
+#define PROTO_OK                0x00
+#define PROTO_ERR_FAILED        0x01
+#define PROTO_ERR_OPCODE        0x02
+#define PROTO_ERR_LENGTH        0x03
+#define PROTO_ERR_CRC           0x04
+#define PROTO_ERR_RANGE         0x05
+
+/* proto_recv() results */
+#define PROTO_RX_FRAME          0
+#define PROTO_RX_CRC            1
+#define PROTO_RX_DROP           2   /* Timeout or bad length, nothing to answer */
+
+typedef struct {
+    uint8_t len;
+    uint8_t seq;
+    uint8_t op;
+    uint8_t payload[PROTO_MAX_PAYLOAD];
+} proto_frame_t;
+
+uint16_t proto_crc16(uint16_t crc, const uint8_t *data, uint8_t len);
+uint8_t proto_rx_size(uint8_t port);
+uint8_t proto_recv(uint8_t port, proto_frame_t *frame);
+void proto_send(uint8_t port, const proto_frame_t *frame);
+
+#endif /* _BINARY_PROTO_ */
+
+#endif /* __PROTO_H__ */
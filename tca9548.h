@@ -0,0 +1,19 @@
+/*
+ * File:   tca9548.h
+ * Author: Matt
+ *
+ * TCA9548A/PCA9548A 8 channel I2C switch. Its control register is the
+ * only register: one enable bit per downstream channel, written as a
+ * single byte with no command.
+ */
+
+#ifndef __TCA9548_H__
+#define __TCA9548_H__
+
+#define TCA9548_CHANNELS                    8
+#define TCA9548_BASE_ADDR                   0x70    /* A2..A0 = 0 */
+
+#define TCA9548_NONE                        0x00
+#define TCA9548_CHANNEL(ch)                 (1 << (ch))
+
+#endif /* __TCA9548_H__ */
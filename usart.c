@@ -13,9 +13,285 @@
 #include "usart.h"
 #include "i2c.h"
 
-#ifdef _USART1_
+/*
+ * Divider for the requested rate. EUSART parts run the 16 bit generator
+ * with BRGH set (Fosc / 4 per count), the rest use the 8 bit one
+ * (Fosc / 16 per count). Fails if the rate error would be too large.
+ */
+static bool usart_baud_div(uint32_t baud, uint32_t *div)
+{
+    uint32_t actual;
+    uint32_t err;
+
+    if (!baud)
+        return false;
+
+#ifdef _USART_BRG16_
+    *div = ((_XTAL_FREQ / 4) + (baud / 2)) / baud;
+    if (*div < 1 || *div > 65536UL)
+        return false;
+    actual = (_XTAL_FREQ / 4) / *div;
+#else
+    *div = ((_XTAL_FREQ / 16) + (baud / 2)) / baud;
+    if (*div < 1 || *div > 256)
+        return false;
+    actual = (_XTAL_FREQ / 16) / *div;
+#endif /* _USART_BRG16_ */
+
+    err = (actual > baud) ? (actual - baud) : (baud - actual);
+    return (err * 100) <= (baud * USART_MAX_BAUD_ERROR);
+}
+
+bool usart_baud_ok(uint32_t baud)
+{
+    uint32_t div;
+    return usart_baud_div(baud, &div);
+}
+
+#if defined(_USART1_) && defined(_USART_DMA_)
+
+/*
+ * K42 UART1. TX leaves the ring through DMA1, triggered by U1TXIF, one
+ * contiguous chunk per transfer: the CPU only sees an interrupt when a
+ * chunk completes, not per byte. RX is interrupt driven into a ring so
+ * DMA2 stays free for the I2C module.
+ */
+
+#ifndef _USART1_BUFFERED_
+#error The K42 UART backend is always buffered
+#endif
+
+#define RX_MASK (UART_RX_BUF_SIZE - 1)
+#define TX_MASK (UART_TX_BUF_SIZE - 1)
+
+#if (UART_RX_BUF_SIZE & RX_MASK) || (UART_TX_BUF_SIZE & TX_MASK) || UART_TX_BUF_SIZE > 256
+#error UART buffer sizes must be powers of two, 256 max
+#endif
+
+#define U1TX_IRQ            0x1C    /* Vector table number, DMA trigger */
+#define PPS_U1TX            0x13
+#define PPS_RC7             0x17
+
+static volatile char _g_rx_buf[UART_RX_BUF_SIZE];
+static volatile uint8_t _g_rx_head;
+static volatile uint8_t _g_rx_tail;
+static volatile char _g_tx_buf[UART_TX_BUF_SIZE];
+static volatile uint8_t _g_tx_head;
+static volatile uint8_t _g_tx_tail;
+static volatile uint8_t _g_tx_chunk;    /* Bytes handed to DMA1 */
+
+/*
+ * Same flags and divider as the EUSART version: without USART_BRGH the
+ * divider is for Fosc / 64, which the UART (BRGS = 0, Fosc / 16) gets by
+ * scaling it by four.
+ */
+void usart1_open(uint8_t flags, uint16_t brg)
+{
+    U1CON1bits.ON = 0;
+
+    _g_rx_head = _g_rx_tail = 0;
+    _g_tx_head = _g_tx_tail = 0;
+    _g_tx_chunk = 0;
+
+    if (!(flags & USART_BRGH))
+        brg = ((brg + 1) << 2) - 1;
+
+    U1CON0 = 0;                 /* Async 8 bit, BRGS = 0 */
+    U1BRGH = (uint8_t)(brg >> 8);
+    U1BRGL = (uint8_t)brg;
+
+    RC6PPS = PPS_U1TX;
+    U1RXPPS = PPS_RC7;
+    TRISCbits.TRISC6 = 0; // TX
+    TRISCbits.TRISC7 = 1; // RX
+
+    U1CON0bits.TXEN = 1;
+    if (flags & USART_CONT_RX)
+        U1CON0bits.RXEN = 1;
+    U1CON1bits.ON = 1;
+
+    /* DMA1: ring chunk -> U1TXB, one byte per U1TXIF, stops at the end */
+    DMA1CON0 = 0;
+    DMA1CON1bits.DMODE = 0;
+    DMA1CON1bits.DSTP = 0;
+    DMA1CON1bits.SMR = 0;
+    DMA1CON1bits.SMODE = 1;
+    DMA1CON1bits.SSTP = 1;
+    DMA1DSA = (uint16_t)&U1TXB;
+    DMA1DSZ = 1;
+    DMA1SIRQ = U1TX_IRQ;
+    DMA1AIRQ = 0;
+    PIR2bits.DMA1SCNTIF = 0;
+    PIE2bits.DMA1SCNTIE = 1;
+    DMA1CON0bits.EN = 1;
+
+    PIR3bits.U1RXIF = 0;
+    PIE3bits.U1RXIE = (flags & USART_IOR) ? 1 : 0;
+}
+
+bool usart1_set_baud(uint32_t baud)
+{
+    uint32_t div;
+
+    if (!usart_baud_div(baud, &div))
+        return false;
+
+    usart1_flush();
+
+    div--;
+
+    U1CON0bits.BRGS = 1;
+    U1BRGH = (uint8_t)(div >> 8);
+    U1BRGL = (uint8_t)div;
+
+    return true;
+}
+
+uint32_t usart1_get_baud(void)
+{
+    uint32_t n = ((uint16_t)U1BRGH << 8) | U1BRGL;
+    return (U1CON0bits.BRGS ? (_XTAL_FREQ / 4) : (_XTAL_FREQ / 16)) / (n + 1);
+}
+
+/* As the EUSART version: measures a 'U' and discards it */
+bool usart1_autobaud(uint16_t timeout_ms)
+{
+    bool rxie = PIE3bits.U1RXIE;
+    bool ok = false;
+
+    PIE3bits.U1RXIE = 0;
+
+    U1CON0bits.BRGS = 1;
+    U1UIRbits.ABDIF = 0;
+    U1ERRIRbits.ABDOVF = 0;
+    U1CON0bits.ABDEN = 1;
+
+    while (timeout_ms--)
+    {
+        if (U1UIRbits.ABDIF)
+        {
+            ok = !U1ERRIRbits.ABDOVF;
+            break;
+        }
+
+        CLRWDT();
+        __delay_ms(1);
+    }
+
+    U1CON0bits.ABDEN = 0;
+    U1UIRbits.ABDIF = 0;
+    U1ERRIRbits.ABDOVF = 0;
+    (void)U1RXB;
+
+    PIE3bits.U1RXIE = rxie;
+    return ok;
+}
+
+/* Hands the next contiguous run of the ring to DMA1. SCNTIE masked */
+static void usart1_tx_kick(void)
+{
+    if (_g_tx_chunk || _g_tx_head == _g_tx_tail)
+        return;
+
+    if (_g_tx_head > _g_tx_tail)
+        _g_tx_chunk = _g_tx_head - _g_tx_tail;
+    else
+        _g_tx_chunk = (uint8_t)(UART_TX_BUF_SIZE - _g_tx_tail);
+
+    DMA1SSA = (__uint24)&_g_tx_buf[_g_tx_tail];
+    DMA1SSZ = _g_tx_chunk;
+    DMA1CON0bits.SIRQEN = 1;
+}
 
-void usart1_open(uint8_t flags, uint8_t brg)
+void usart1_isr(void)
+{
+    uint8_t next;
+    char c;
+
+    if (PIE3bits.U1RXIE && PIR3bits.U1RXIF)
+    {
+        if (U1ERRIRbits.RXFOIF)
+            U1ERRIRbits.RXFOIF = 0;
+
+        c = U1RXB;
+        next = (_g_rx_head + 1) & RX_MASK;
+
+        if (next != _g_rx_tail)  /* Drop on overflow */
+        {
+            _g_rx_buf[_g_rx_head] = c;
+            _g_rx_head = next;
+        }
+    }
+
+    /* Chunk done. SSTP has already cleared SIRQEN */
+    if (PIE2bits.DMA1SCNTIE && PIR2bits.DMA1SCNTIF)
+    {
+        PIR2bits.DMA1SCNTIF = 0;
+        _g_tx_tail = (_g_tx_tail + _g_tx_chunk) & TX_MASK;
+        _g_tx_chunk = 0;
+        usart1_tx_kick();
+    }
+}
+
+/* True while the TX ring is full */
+bool usart1_busy(void)
+{
+    return ((_g_tx_head + 1) & TX_MASK) == _g_tx_tail;
+}
+
+void usart1_put(char c)
+{
+    _g_tx_buf[_g_tx_head] = c;
+
+    PIE2bits.DMA1SCNTIE = 0;
+    _g_tx_head = (_g_tx_head + 1) & TX_MASK;
+    usart1_tx_kick();
+    PIE2bits.DMA1SCNTIE = 1;
+}
+
+bool usart1_data_ready(void)
+{
+    return _g_rx_head != _g_rx_tail;
+}
+
+char usart1_get(void)
+{
+    char data;
+    data = _g_rx_buf[_g_rx_tail];
+    _g_rx_tail = (_g_rx_tail + 1) & RX_MASK;
+    return data;
+}
+
+/* Waits until everything queued has left the shift register */
+void usart1_flush(void)
+{
+    while (_g_tx_head != _g_tx_tail || !U1ERRIRbits.TXMTIF)
+        CLRWDT();
+}
+
+#endif /* _USART1_ && _USART_DMA_ */
+
+#if defined(_USART1_) && !defined(_USART_DMA_)
+
+#ifdef _USART1_BUFFERED_
+
+#define RX_MASK (UART_RX_BUF_SIZE - 1)
+#define TX_MASK (UART_TX_BUF_SIZE - 1)
+
+#if (UART_RX_BUF_SIZE & RX_MASK) || (UART_TX_BUF_SIZE & TX_MASK) || UART_TX_BUF_SIZE > 256
+#error UART buffer sizes must be powers of two, 256 max
+#endif
+
+static volatile char _g_rx_buf[UART_RX_BUF_SIZE];
+static volatile uint8_t _g_rx_head;
+static volatile uint8_t _g_rx_tail;
+static volatile char _g_tx_buf[UART_TX_BUF_SIZE];
+static volatile uint8_t _g_tx_head;
+static volatile uint8_t _g_tx_tail;
+
+#endif /* _USART1_BUFFERED_ */
+
+void usart1_open(uint8_t flags, uint16_t brg)
 {
     if (flags & USART_SYNC)
         TXSTAbits.SYNC = 1;
@@ -49,7 +325,10 @@ void usart1_open(uint8_t flags, uint8_t brg)
     else
         PIE1bits.TXIE = 0;
 
-    SPBRG = brg;
+#ifdef _USART_BRG16_
+    BAUDCONbits.BRG16 = 0;
+#endif /* _USART_BRG16_ */
+    SPBRG = (uint8_t)brg;
 
     TXSTAbits.TXEN = 1;
     RCSTAbits.SPEN = 1;
@@ -64,6 +343,166 @@ void usart1_open(uint8_t flags, uint8_t brg)
 #endif
 }
 
+/* Waits for pending output, then reprograms the baud rate generator */
+bool usart1_set_baud(uint32_t baud)
+{
+    uint32_t div;
+
+    if (!usart_baud_div(baud, &div))
+        return false;
+
+#ifdef _USART1_BUFFERED_
+    usart1_flush();
+#else
+    while (!TXSTAbits.TRMT);
+#endif /* _USART1_BUFFERED_ */
+
+    div--;
+
+#ifdef _USART_BRG16_
+    BAUDCONbits.BRG16 = 1;
+    SPBRGH = (uint8_t)(div >> 8);
+#endif /* _USART_BRG16_ */
+    TXSTAbits.BRGH = 1;
+    SPBRG = (uint8_t)div;
+
+    return true;
+}
+
+uint32_t usart1_get_baud(void)
+{
+    uint32_t n = SPBRG;
+
+#ifdef _USART_BRG16_
+    if (BAUDCONbits.BRG16)
+    {
+        n |= (uint16_t)SPBRGH << 8;
+        return (TXSTAbits.BRGH ? (_XTAL_FREQ / 4) : (_XTAL_FREQ / 16)) / (n + 1);
+    }
+#endif /* _USART_BRG16_ */
+
+    return (TXSTAbits.BRGH ? (_XTAL_FREQ / 16) : (_XTAL_FREQ / 64)) / (n + 1);
+}
+
+#ifdef _USART_BRG16_
+
+/*
+ * Measures the rate from a 'U' (55h) sent by the host. The measuring
+ * character is discarded. Returns false on timeout or counter overflow,
+ * leaving the generator for the caller to reprogram.
+ */
+bool usart1_autobaud(uint16_t timeout_ms)
+{
+    bool rcie = PIE1bits.RCIE;
+    bool ok = false;
+
+    PIE1bits.RCIE = 0;
+
+    BAUDCONbits.BRG16 = 1;
+    TXSTAbits.BRGH = 1;
+    BAUDCONbits.ABDOVF = 0;
+    BAUDCONbits.ABDEN = 1;
+
+    while (timeout_ms--)
+    {
+        if (!BAUDCONbits.ABDEN)
+        {
+            ok = !BAUDCONbits.ABDOVF;
+            break;
+        }
+
+        CLRWDT();
+        __delay_ms(1);
+    }
+
+    BAUDCONbits.ABDEN = 0;
+    BAUDCONbits.ABDOVF = 0;
+    (void)RCREG;
+
+    PIE1bits.RCIE = rcie;
+    return ok;
+}
+
+#endif /* _USART_BRG16_ */
+
+#ifdef _USART1_BUFFERED_
+
+/*
+ * RCIF/TXIF service. RX bytes go into a ring drained by usart1_get(),
+ * TX bytes queued by usart1_put() are fed to TXREG as it empties.
+ */
+void usart1_isr(void)
+{
+    uint8_t next;
+    char c;
+
+    if (PIE1bits.RCIE && PIR1bits.RCIF)
+    {
+        if (RCSTAbits.OERR)
+        {
+            RCSTAbits.CREN = 0;
+            RCSTAbits.CREN = 1;
+        }
+
+        c = RCREG;
+        next = (_g_rx_head + 1) & RX_MASK;
+
+        if (next != _g_rx_tail)  /* Drop on overflow */
+        {
+            _g_rx_buf[_g_rx_head] = c;
+            _g_rx_head = next;
+        }
+    }
+
+    if (PIE1bits.TXIE && PIR1bits.TXIF)
+    {
+        if (_g_tx_head != _g_tx_tail)
+        {
+            TXREG = _g_tx_buf[_g_tx_tail];
+            _g_tx_tail = (_g_tx_tail + 1) & TX_MASK;
+        }
+        else
+        {
+            PIE1bits.TXIE = 0;
+        }
+    }
+}
+
+/* True while the TX ring is full */
+bool usart1_busy(void)
+{
+    return ((_g_tx_head + 1) & TX_MASK) == _g_tx_tail;
+}
+
+void usart1_put(char c)
+{
+    _g_tx_buf[_g_tx_head] = c;
+    _g_tx_head = (_g_tx_head + 1) & TX_MASK;
+    PIE1bits.TXIE = 1;
+}
+
+bool usart1_data_ready(void)
+{
+    return _g_rx_head != _g_rx_tail;
+}
+
+char usart1_get(void)
+{
+    char data;
+    data = _g_rx_buf[_g_rx_tail];
+    _g_rx_tail = (_g_rx_tail + 1) & RX_MASK;
+    return data;
+}
+
+/* Waits until everything queued has left the shift register */
+void usart1_flush(void)
+{
+    while (_g_tx_head != _g_tx_tail || !TXSTAbits.TRMT)
+        CLRWDT();
+}
+
+#else
+
 bool usart1_busy(void)
 {
     if (!TXSTAbits.TRMT)
@@ -90,4 +529,154 @@ char usart1_get(void)
     return data;
 }
 
-#endif /* _USART1_ */
\ No newline at end of file
+#endif /* _USART1_BUFFERED_ */
+
+#endif /* _USART1_ && !_USART_DMA_ */
+
+#ifdef _USART2_
+
+/*
+ * Second EUSART (26K22), used as the host data channel. Always 8N1,
+ * interrupt driven, 16 bit baud generator. TX2/RX2 are RB6/RB7.
+ */
+
+#define RX2_MASK (UART2_RX_BUF_SIZE - 1)
+#define TX2_MASK (UART2_TX_BUF_SIZE - 1)
+
+#if (UART2_RX_BUF_SIZE & RX2_MASK) || (UART2_TX_BUF_SIZE & TX2_MASK) || UART2_TX_BUF_SIZE > 256
+#error UART2 buffer sizes must be powers of two, 256 max
+#endif
+
+static volatile char _g_rx2_buf[UART2_RX_BUF_SIZE];
+static volatile uint8_t _g_rx2_head;
+static volatile uint8_t _g_rx2_tail;
+static volatile char _g_tx2_buf[UART2_TX_BUF_SIZE];
+static volatile uint8_t _g_tx2_head;
+static volatile uint8_t _g_tx2_tail;
+
+bool usart2_open(uint32_t baud)
+{
+    uint32_t div;
+
+    if (!usart_baud_div(baud, &div))
+        return false;
+
+    usart2_close();
+
+    _g_rx2_head = _g_rx2_tail = 0;
+    _g_tx2_head = _g_tx2_tail = 0;
+
+    div--;
+
+    TXSTA2 = 0;
+    RCSTA2 = 0;
+    BAUDCON2bits.BRG16 = 1;
+    TXSTA2bits.BRGH = 1;
+    SPBRGH2 = (uint8_t)(div >> 8);
+    SPBRG2 = (uint8_t)div;
+
+    TRISBbits.TRISB6 = 0; // TX2
+    TRISBbits.TRISB7 = 1; // RX2
+
+    RCSTA2bits.CREN = 1;
+    TXSTA2bits.TXEN = 1;
+    RCSTA2bits.SPEN = 1;
+
+    PIR3bits.RC2IF = 0;
+    PIE3bits.RC2IE = 1;
+
+    return true;
+}
+
+void usart2_close(void)
+{
+    if (RCSTA2bits.SPEN)
+        usart2_flush();
+
+    PIE3bits.RC2IE = 0;
+    PIE3bits.TX2IE = 0;
+    RCSTA2bits.SPEN = 0;
+    TXSTA2bits.TXEN = 0;
+}
+
+bool usart2_is_open(void)
+{
+    return RCSTA2bits.SPEN;
+}
+
+uint32_t usart2_get_baud(void)
+{
+    uint32_t n = ((uint16_t)SPBRGH2 << 8) | SPBRG2;
+    return (_XTAL_FREQ / 4) / (n + 1);
+}
+
+void usart2_isr(void)
+{
+    uint8_t next;
+    char c;
+
+    if (PIE3bits.RC2IE && PIR3bits.RC2IF)
+    {
+        if (RCSTA2bits.OERR)
+        {
+            RCSTA2bits.CREN = 0;
+            RCSTA2bits.CREN = 1;
+        }
+
+        c = RCREG2;
+        next = (_g_rx2_head + 1) & RX2_MASK;
+
+        if (next != _g_rx2_tail)  /* Drop on overflow */
+        {
+            _g_rx2_buf[_g_rx2_head] = c;
+            _g_rx2_head = next;
+        }
+    }
+
+    if (PIE3bits.TX2IE && PIR3bits.TX2IF)
+    {
+        if (_g_tx2_head != _g_tx2_tail)
+        {
+            TXREG2 = _g_tx2_buf[_g_tx2_tail];
+            _g_tx2_tail = (_g_tx2_tail + 1) & TX2_MASK;
+        }
+        else
+        {
+            PIE3bits.TX2IE = 0;
+        }
+    }
+}
+
+/* True while the TX ring is full */
+bool usart2_busy(void)
+{
+    return ((_g_tx2_head + 1) & TX2_MASK) == _g_tx2_tail;
+}
+
+void usart2_put(char c)
+{
+    _g_tx2_buf[_g_tx2_head] = c;
+    _g_tx2_head = (_g_tx2_head + 1) & TX2_MASK;
+    PIE3bits.TX2IE = 1;
+}
+
+bool usart2_data_ready(void)
+{
+    return _g_rx2_head != _g_rx2_tail;
+}
+
+char usart2_get(void)
+{
+    char data;
+    data = _g_rx2_buf[_g_rx2_tail];
+    _g_rx2_tail = (_g_rx2_tail + 1) & RX2_MASK;
+    return data;
+}
+
+void usart2_flush(void)
+{
+    while (_g_tx2_head != _g_tx2_tail || !TXSTA2bits.TRMT)
+        CLRWDT();
+}
+
+#endif /* _USART2_ */
\ No newline at end of file
@@ -21,14 +21,55 @@
 #define USART_IOR          0x20
 #define USART_IOT          0x40
 
+/* Largest acceptable baud rate error, percent */
+#define USART_MAX_BAUD_ERROR    2
+
+/* EUSART parts: 16 bit baud generator and auto-baud detect */
+#if defined(__18F26K22) || defined(__18F2520) || defined(__18F2550)
+#define _USART_BRG16_
+#endif
+
+/* K42 UART module: 16 bit generator, auto-baud, TX fed by DMA1 */
+#ifdef __18F26K42
+#define _USART_BRG16_
+#define _USART_DMA_
+#endif
+
+bool usart_baud_ok(uint32_t baud);
+
 #ifdef _USART1_
 
-void usart1_open(uint8_t flags, uint8_t brg);
+void usart1_open(uint8_t flags, uint16_t brg);
+bool usart1_set_baud(uint32_t baud);
+uint32_t usart1_get_baud(void);
+#ifdef _USART_BRG16_
+bool usart1_autobaud(uint16_t timeout_ms);
+#endif /* _USART_BRG16_ */
 bool usart1_busy(void);
 void usart1_put(char c);
 bool usart1_data_ready(void);
 char usart1_get(void);
 
+#ifdef _USART1_BUFFERED_
+void usart1_isr(void);
+void usart1_flush(void);
+#endif /* _USART1_BUFFERED_ */
+
 #endif /* _USART1_ */
 
+#ifdef _USART2_
+
+bool usart2_open(uint32_t baud);
+void usart2_close(void);
+bool usart2_is_open(void);
+uint32_t usart2_get_baud(void);
+void usart2_isr(void);
+bool usart2_busy(void);
+void usart2_put(char c);
+bool usart2_data_ready(void);
+char usart2_get(void);
+void usart2_flush(void);
+
+#endif /* _USART2_ */
+
 #endif /* __USART_H__ */
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <xc.h>
 
@@ -22,27 +23,70 @@
 #include "usart.h"
 #endif
 
+/* Binary protocol sessions own the UART. Keeps printf out of the frames */
+static bool _g_mute;
+
+void console_mute(bool mute)
+{
+    _g_mute = mute;
+}
+
 void reset(void)
 {
+#ifdef _USART1_BUFFERED_
+    usart1_flush();
+#endif /* _USART1_BUFFERED_ */
     asm("reset");
     while (1);
 }
 
 void putch(char byte)
 {
+    if (_g_mute)
+        return;
+
     while (usart1_busy());
     usart1_put(byte);
 }
 
 void clear_usart_oerr(void)
 {
+#ifdef _USART_DMA_
+    if (U1ERRIRbits.RXFOIF)
+        U1ERRIRbits.RXFOIF = 0;
+#else
     if (RCSTAbits.OERR)
     {
         /* Hack to clear overrun errors */
         RCSTAbits.CREN = 0;
         RCSTAbits.CREN = 1;
     }
+#endif /* _USART_DMA_ */
+}
+
+#ifdef __18F26K42
+/*
+ * DMA only moves data once the system arbiter priorities are locked.
+ * DMA2 first, then interrupts, DMA1 (console TX), then the main line.
+ */
+void dma_arbiter_init(void)
+{
+    bool gie = INTCON0bits.GIE;
+
+    INTCON0bits.GIE = 0;
+
+    DMA2PR = 0;
+    ISRPR = 1;
+    DMA1PR = 2;
+    MAINPR = 3;
+
+    PRLOCK = 0x55;
+    PRLOCK = 0xAA;
+    PRLOCKbits.PRLOCKED = 1;
+
+    INTCON0bits.GIE = gie;
 }
+#endif /* __18F26K42 */
 
 void delay_10ms(uint8_t delay)
 {
@@ -59,7 +103,12 @@ char wdt_getch(void)
     clear_usart_oerr();
 
     while (!usart1_data_ready())
+    {
         CLRWDT();
+#ifdef _USART2_
+        cmd_idle();
+#endif /* _USART2_ */
+    }
 
     return usart1_get();
 }
@@ -70,6 +119,26 @@ void eeprom_write_data(uint8_t addr, uint8_t *bytes, uint8_t len)
 
     for (i = 0; i < len; i++)
     {
+#ifdef __18F26K42
+        while (NVMCON1bits.WR);
+
+        NVMCON1bits.REG = 0;    /* Data EEPROM */
+        NVMADRH = 0;
+        NVMADRL = addr + i;
+        NVMDAT = *bytes;
+
+        INTCON0bits.GIE = 0;
+
+        NVMCON1bits.WREN = 1;
+
+        NVMCON2 = 0x55;
+        NVMCON2 = 0xAA;
+
+        NVMCON1bits.WR = 1;
+        NVMCON1bits.WREN = 0;
+
+        INTCON0bits.GIE = 1;
+#else
         while (EECON1bits.WR);
 
         EECON1bits.EEPGD = 0;
@@ -90,6 +159,7 @@ void eeprom_write_data(uint8_t addr, uint8_t *bytes, uint8_t len)
         EECON1bits.WR = 1;
 
         INTCONbits.GIE = 1;
+#endif /* __18F26K42 */
 
         bytes++;
     }
@@ -101,6 +171,13 @@ void eeprom_read_data(uint8_t addr, uint8_t *bytes, uint8_t len)
 
     for (i = 0; i < len; i++)
     {
+#ifdef __18F26K42
+        NVMCON1bits.REG = 0;
+        NVMADRH = 0;
+        NVMADRL = addr + i;
+        NVMCON1bits.RD = 1;
+        *bytes = NVMDAT;
+#else
         EEADR = addr + i;
         EECON1bits.EEPGD = 0;
 #ifdef __PIC18__
@@ -108,6 +185,7 @@ void eeprom_read_data(uint8_t addr, uint8_t *bytes, uint8_t len)
 #endif
         EECON1bits.RD = 1;
         *bytes = EEDATA;
+#endif /* __18F26K42 */
         bytes++;
     }
 }
\ No newline at end of file
@@ -15,6 +15,10 @@ void format_fixedpoint(char *buf, int16_t value, uint8_t type);
 void eeprom_read_data(uint8_t addr, uint8_t *bytes, uint8_t len);
 void eeprom_write_data(uint8_t addr, uint8_t *bytes, uint8_t len);
 char wdt_getch(void);
+void console_mute(bool mute);
+#ifdef __18F26K42
+void dma_arbiter_init(void);
+#endif
 
 #define I_1DP               0
 #define U_1DP               1
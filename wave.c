@@ -0,0 +1,334 @@
+/*
+ * File:   wave.c
+ * Author: Matt
+ *
+ * Timer driven waveform generator on the DAC channels.
+ *
+ * Timer1 free runs and CCP5 compares against it. Every match moves the
+ * compare point on by one period, so the update rate never drifts with
+ * interrupt latency. An update computes the next point of each active
+ * channel and hands one I2C job to the background engine; with both
+ * channels active it's a single continuous write of DAC0 and DAC1.
+ *
+ * An update is dropped, and counted as missed, if the previous one is
+ * still on the bus. The latency from the compare match to the handler
+ * and the bus time of each update are measured off Timer1 too.
+ */
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "wave.h"
+#include "i2c_queue.h"
+#include "mcp47febxx.h"
+
+#ifdef _WAVE_
+
+/* Timer1 at Fosc / 4 with a 1:8 prescale */
+#define WAVE_TICK_HZ            (_XTAL_FREQ / 32UL)
+#define WAVE_TICKS_TO_US(t)     ((uint16_t)(((uint32_t)(t) * 1000UL) / (WAVE_TICK_HZ / 1000UL)))
+
+#define WAVE_HALF               (WAVE_POINTS / 2)
+#define WAVE_QUARTER            (WAVE_POINTS / 4)
+
+typedef struct {
+    bool active;
+    uint8_t shape;
+    uint16_t amp;
+    uint16_t offset;
+} wave_chan_t;
+
+/* sin() over a quarter period, 0 to 32767 */
+static const uint16_t _g_sine[WAVE_QUARTER + 1] = {
+        0,   804,  1608,  2410,  3212,  4011,  4808,  5602,
+     6393,  7179,  7962,  8739,  9512, 10278, 11039, 11793,
+    12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+    18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+    23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+    27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+    32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+    32767,
+};
+
+static wave_chan_t _g_chan[WAVE_CHANNELS];
+static volatile bool _g_running;
+static uint8_t _g_addr;
+static uint16_t _g_rate;
+static uint8_t _g_index;                /* Point in the period, wraps at WAVE_POINTS */
+
+static uint16_t _g_period;              /* Compare step, in ticks */
+static uint8_t _g_post;                 /* Compare matches per update, for slow rates */
+static uint8_t _g_post_count;
+static uint16_t _g_due;                 /* Tick of the pending compare match */
+
+static i2c_job_t _g_job;
+static uint8_t _g_data[5];
+static uint16_t _g_submitted;
+
+static volatile uint32_t _g_updates;
+static volatile uint16_t _g_missed;
+static volatile uint16_t _g_failed;
+static volatile uint16_t _g_late_min;
+static volatile uint16_t _g_late_max;
+static volatile uint16_t _g_xfer_max;
+
+/* Reading TMR1L latches TMR1H in 16 bit mode */
+static uint16_t wave_timer_read(void)
+{
+    uint8_t lo = TMR1L;
+    return ((uint16_t)TMR1H << 8) | lo;
+}
+
+/* Unsigned 0 to 65535 for point i of a period */
+static uint16_t wave_point(uint8_t shape, uint8_t i)
+{
+    uint16_t s;
+
+    switch (shape)
+    {
+        case WAVE_RAMP:
+            return (uint16_t)i << 8 | i;
+
+        case WAVE_TRIANGLE:
+            if (i >= WAVE_HALF)
+                i = (WAVE_POINTS - 1) - i;
+            return (uint16_t)i << 9 | (uint16_t)i << 2;
+
+        case WAVE_SQUARE:
+            return (i < WAVE_HALF) ? 0xFFFF : 0;
+
+        default:
+            break;
+    }
+
+    if ((i & (WAVE_HALF - 1)) < WAVE_QUARTER)
+        s = _g_sine[i & (WAVE_QUARTER - 1)];
+    else
+        s = _g_sine[WAVE_QUARTER - (i & (WAVE_QUARTER - 1))];
+
+    return (i < WAVE_HALF) ? 32768U + s : 32768U - s;
+}
+
+static uint16_t wave_code(wave_chan_t *chan, uint8_t i)
+{
+    return chan->offset + (uint16_t)(((uint32_t)chan->amp * wave_point(chan->shape, i)) >> 16);
+}
+
+/* Called from ISR context by the queue */
+static void wave_job_done(i2c_job_t *job)
+{
+    uint16_t took = wave_timer_read() - _g_submitted;
+
+    if (job->status != I2C_JOB_DONE)
+        _g_failed++;
+
+    if (took > _g_xfer_max)
+        _g_xfer_max = took;
+}
+
+/* One job for whichever channels are active, DAC0 first */
+static bool wave_update(void)
+{
+    uint16_t code;
+    uint8_t *p = _g_data;
+    uint8_t ch;
+
+    _g_job.len = 0;
+
+    for (ch = 0; ch < WAVE_CHANNELS; ch++)
+    {
+        if (!_g_chan[ch].active)
+            continue;
+
+        code = wave_code(&_g_chan[ch], _g_index);
+
+        if (_g_job.len)
+        {
+            /* Continuous write: the next command byte rides in the data */
+            *p++ = MCP47FEBXX_VOLATILE_DAC1 | MCP47FEBXX_CMD_WRITE;
+            _g_job.len++;
+        }
+        else
+        {
+            _g_job.reg = (ch ? MCP47FEBXX_VOLATILE_DAC1 : MCP47FEBXX_VOLATILE_DAC0) | MCP47FEBXX_CMD_WRITE;
+        }
+
+        *p++ = (uint8_t)(code >> 8);
+        *p++ = (uint8_t)code;
+        _g_job.len += 2;
+    }
+
+    _g_submitted = wave_timer_read();
+    return i2c_queue_submit(&_g_job);
+}
+
+void wave_isr(void)
+{
+    uint16_t now;
+    uint16_t late;
+    bool overrun;
+
+    if (!(PIE4bits.CCP5IE && PIR4bits.CCP5IF))
+        return;
+
+    PIR4bits.CCP5IF = 0;
+
+    now = wave_timer_read();
+    late = now - _g_due;
+    overrun = (late >= _g_period);
+
+    /* Overran a whole period: the next match is already behind the timer */
+    if (overrun)
+    {
+        _g_due = now;
+        _g_post_count = 0;
+        _g_missed++;
+    }
+
+    _g_due += _g_period;
+    CCPR5H = (uint8_t)(_g_due >> 8);
+    CCPR5L = (uint8_t)_g_due;
+
+    if (overrun || ++_g_post_count < _g_post)
+        return;
+
+    _g_post_count = 0;
+
+    if (late < _g_late_min)
+        _g_late_min = late;
+
+    if (late > _g_late_max)
+        _g_late_max = late;
+
+    if (i2c_job_pending(&_g_job) || !wave_update())
+        _g_missed++;
+    else
+        _g_updates++;
+
+    _g_index++;
+}
+
+/*
+ * Starts, or retunes, channel ch at rate updates per second, so the
+ * wave's frequency is rate / WAVE_POINTS. The rate is shared: the other
+ * channel keeps its shape but follows the new rate, and is dropped if
+ * it was running on another address. Codes are offset to offset + amp.
+ */
+bool wave_start(uint8_t addr, uint8_t ch, uint8_t shape, uint16_t rate, uint16_t amp, uint16_t offset)
+{
+    uint32_t ticks;
+
+    if (ch >= WAVE_CHANNELS || shape > WAVE_SQUARE
+            || rate < WAVE_MIN_RATE || rate > WAVE_MAX_RATE
+            || (uint32_t)offset + amp > MCP47FEBXX_MAX_CODE)
+        return false;
+
+    if (_g_running && addr != _g_addr)
+        wave_stop();
+
+    PIE4bits.CCP5IE = 0;
+
+    if (i2c_job_pending(&_g_job))
+        i2c_queue_wait(&_g_job);
+
+    if (!_g_running)
+    {
+        _g_chan[0].active = false;
+        _g_chan[1].active = false;
+        _g_index = 0;
+    }
+
+    _g_chan[ch].active = true;
+    _g_chan[ch].shape = shape;
+    _g_chan[ch].amp = amp;
+    _g_chan[ch].offset = offset;
+
+    _g_addr = addr;
+    _g_rate = rate;
+
+    /* Below ~24Hz the period overflows the compare, so split it */
+    ticks = WAVE_TICK_HZ / rate;
+    _g_post = (uint8_t)(ticks / 0x10000UL + 1);
+    _g_period = (uint16_t)(ticks / _g_post);
+    _g_post_count = 0;
+
+    _g_job.addr = addr;
+    _g_job.data = _g_data;
+    _g_job.flags = I2C_JOB_WRITE;
+    _g_job.callback = wave_job_done;
+
+    _g_updates = 0;
+    _g_missed = 0;
+    _g_failed = 0;
+    _g_late_min = 0xFFFF;
+    _g_late_max = 0;
+    _g_xfer_max = 0;
+
+    T1CON = 0x33;                       /* Fosc / 4, 1:8, 16 bit reads, on */
+    CCPTMRS1 &= ~0x0C;                  /* CCP5 on Timer1 */
+    CCP5CON = 0x0A;                     /* Compare, interrupt only */
+
+    _g_due = wave_timer_read() + _g_period;
+    CCPR5H = (uint8_t)(_g_due >> 8);
+    CCPR5L = (uint8_t)_g_due;
+
+    _g_running = true;
+
+    PIR4bits.CCP5IF = 0;
+    PIE4bits.CCP5IE = 1;
+
+    return true;
+}
+
+/* Stops both channels. The outputs hold their last codes */
+void wave_stop(void)
+{
+    if (!_g_running)
+        return;
+
+    PIE4bits.CCP5IE = 0;
+    CCP5CON = 0;
+    T1CONbits.TMR1ON = 0;
+
+    _g_running = false;
+
+    if (i2c_job_pending(&_g_job))
+        i2c_queue_wait(&_g_job);
+}
+
+bool wave_running(void)
+{
+    return _g_running;
+}
+
+uint8_t wave_addr(void)
+{
+    return _g_addr;
+}
+
+/*
+ * Counters since the last wave_start(). The highest sustainable rate is
+ * about 1s / xfer_max_us, less the handler's own time.
+ */
+void wave_stats(wave_stats_t *stats)
+{
+    bool on = PIE4bits.CCP5IE;
+
+    PIE4bits.CCP5IE = 0;
+
+    stats->rate = _g_rate;
+    stats->updates = _g_updates;
+    stats->missed = _g_missed;
+    stats->failed = _g_failed;
+    stats->late_min_us = (_g_late_min == 0xFFFF) ? 0 : WAVE_TICKS_TO_US(_g_late_min);
+    stats->late_max_us = WAVE_TICKS_TO_US(_g_late_max);
+    stats->xfer_max_us = WAVE_TICKS_TO_US(_g_xfer_max);
+
+    PIE4bits.CCP5IE = on;
+}
+
+#endif /* _WAVE_ */
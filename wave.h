@@ -0,0 +1,50 @@
+/*
+ * File:   wave.h
+ * Author: Matt
+ *
+ * Timer driven waveform generator. Each update is one background I2C
+ * job writing one or both DAC channels, so the CPU stays free for the
+ * CLI while a wave runs.
+ */
+
+#ifndef __WAVE_H__
+#define __WAVE_H__
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef _WAVE_
+
+#define WAVE_CHANNELS           2
+
+#define WAVE_RAMP               0
+#define WAVE_TRIANGLE           1
+#define WAVE_SINE               2
+#define WAVE_SQUARE             3
+
+#define WAVE_POINTS             256     /* Updates per period */
+#define WAVE_MIN_RATE           1       /* Updates per second */
+#define WAVE_MAX_RATE           10000
+
+typedef struct {
+    uint16_t rate;
+    uint32_t updates;           /* Jobs submitted */
+    uint16_t missed;            /* Updates dropped: bus still busy, or too late */
+    uint16_t failed;            /* Jobs the bus didn't complete */
+    uint16_t late_min_us;       /* Interrupt latency range, jitter is the spread */
+    uint16_t late_max_us;
+    uint16_t xfer_max_us;       /* Longest update, submit to completion */
+} wave_stats_t;
+
+bool wave_start(uint8_t addr, uint8_t ch, uint8_t shape, uint16_t rate, uint16_t amp, uint16_t offset);
+void wave_stop(void);
+bool wave_running(void);
+uint8_t wave_addr(void);
+void wave_isr(void);
+void wave_stats(wave_stats_t *stats);
+
+#endif /* _WAVE_ */
+
+#endif /* __WAVE_H__ */